@@ -0,0 +1,533 @@
+/*=========================================================================
+
+Program:   Atamai Image Registration and Segmentation
+Module:    AIRSBenchmarks.cxx
+
+   This software is distributed WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+=========================================================================*/
+
+// This is the benchmark suite, for tracking the performance of
+// vtkImageRegistration between releases.  A synthetic phantom is
+// registered to a copy of itself that has been moved by a known
+// transformation, for every combination of metric, interpolator, and
+// transform type, with 1, 2, 4, ... up to the maximum number of threads,
+// and with both the thread pool and vtkSMPTools (if available).  For
+// each run, the number of evaluations, the evaluations per second, the
+// time to converge, the final cost, and the error in the recovered
+// transformation are written as CSV or JSON.  The phantoms and the
+// motions are deterministic, so results can be compared between builds.
+//
+// Usage: AIRSBenchmarks [options]
+//   --size <n>            phantom size in voxels along each axis (32)
+//   --threads <n>         maximum number of threads (all cores)
+//   --phantom <mr|ct>     phantom intensities (mr)
+//   --metric <name>       only run this metric (can be repeated)
+//   --interpolator <name> only run this interpolator (can be repeated)
+//   --transform <name>    only run this transform type (can be repeated)
+//   --format <csv|json>   output format (csv)
+//   -o <file>             output file (stdout)
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+#include <vtkMatrix4x4.h>
+#include <vtkTransform.h>
+#include <vtkTimerLog.h>
+#include <vtkMultiThreader.h>
+#include <vtkThreadedImageAlgorithm.h>
+#include <vtkVersion.h>
+
+#include <vtkImageRegistration.h>
+#include <vtkWorkerThreadPool.h>
+
+#include "BenchmarkPhantom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <vector>
+#include <string>
+
+#if VTK_MAJOR_VERSION >= 7
+#define BENCHMARK_SMP
+#include <vtkSMPTools.h>
+#endif
+
+namespace {
+
+const char *MetricNames[] = {
+  "SquaredDifference",
+  "CrossCorrelation",
+  "NormalizedCrossCorrelation",
+  "NeighborhoodCorrelation",
+  "CorrelationRatio",
+  "MutualInformation",
+  "NormalizedMutualInformation",
+  NULL
+};
+
+const char *InterpolatorNames[] = {
+  "Nearest",
+  "Linear",
+  "Cubic",
+  "BSpline",
+  "Sinc",
+  "ASinc",
+  "Label",
+  NULL
+};
+
+const char *TransformNames[] = {
+  "Translation",
+  "Rigid",
+  "Similarity",
+  "ScaleSourceAxes",
+  "ScaleTargetAxes",
+  "Affine",
+  NULL
+};
+
+const char *ModeNames[] = {
+  "MT",
+  "SMP",
+  NULL
+};
+
+enum { ThreadPoolMode, SMPMode };
+
+enum { CSVFormat, JSONFormat };
+
+struct BenchmarkOptions
+{
+  int Size;
+  int Threads;
+  int Phantom;
+  int Format;
+  const char *Output;
+  std::vector<int> Metrics;
+  std::vector<int> Interpolators;
+  std::vector<int> Transforms;
+};
+
+struct BenchmarkResult
+{
+  int Evaluations;
+  double Seconds;
+  double EvaluationsPerSecond;
+  double FinalCost;
+  double Error;
+};
+
+//----------------------------------------------------------------------------
+// Find a name in a NULL-terminated list, or return -1.
+int FindName(const char *names[], const char *name)
+{
+  for (int i = 0; names[i] != NULL; i++)
+    {
+    if (strcmp(names[i], name) == 0)
+      {
+      return i;
+      }
+    }
+  return -1;
+}
+
+//----------------------------------------------------------------------------
+// Use every item if none were chosen on the command line.
+void UseAllIfEmpty(std::vector<int> *items, const char *names[])
+{
+  if (items->empty())
+    {
+    for (int i = 0; names[i] != NULL; i++)
+      {
+      items->push_back(i);
+      }
+    }
+}
+
+//----------------------------------------------------------------------------
+// Build the motion of the phantom for the given transform type, about
+// the image center.  Each transform type gets a motion that it can fully
+// recover, so that the error measures the accuracy of the registration.
+void BuildMotion(vtkTransform *motion, int transformType)
+{
+  motion->Identity();
+  motion->PostMultiply();
+  if (transformType != vtkImageRegistration::Translation)
+    {
+    motion->RotateWXYZ(8.0, 0.2, 0.3, 1.0);
+    }
+  if (transformType == vtkImageRegistration::Similarity)
+    {
+    motion->Scale(1.04, 1.04, 1.04);
+    }
+  else if (transformType == vtkImageRegistration::ScaleSourceAxes ||
+           transformType == vtkImageRegistration::ScaleTargetAxes ||
+           transformType == vtkImageRegistration::Affine)
+    {
+    motion->Scale(1.05, 0.96, 1.02);
+    }
+  motion->Translate(2.5, -1.5, 1.0);
+}
+
+//----------------------------------------------------------------------------
+// Compute the largest displacement between two transforms at the corners
+// of the image, to measure how well the motion was recovered.
+double TransformError(
+  vtkMatrix4x4 *matrix1, vtkMatrix4x4 *matrix2, vtkImageData *image)
+{
+  double bounds[6];
+  image->GetBounds(bounds);
+
+  double maxerr = 0.0;
+  for (int i = 0; i < 8; i++)
+    {
+    double p[4], q1[4], q2[4];
+    p[0] = bounds[0 + (i & 1)];
+    p[1] = bounds[2 + ((i >> 1) & 1)];
+    p[2] = bounds[4 + ((i >> 2) & 1)];
+    p[3] = 1.0;
+    matrix1->MultiplyPoint(p, q1);
+    matrix2->MultiplyPoint(p, q2);
+    double d = sqrt((q1[0] - q2[0])*(q1[0] - q2[0]) +
+                    (q1[1] - q2[1])*(q1[1] - q2[1]) +
+                    (q1[2] - q2[2])*(q1[2] - q2[2]));
+    maxerr = (d > maxerr ? d : maxerr);
+    }
+
+  return maxerr;
+}
+
+//----------------------------------------------------------------------------
+// Run a two-level registration until the finest level converges.  The
+// number of threads and the threading mode must be set before the
+// registration is created, since the metric uses the global defaults.
+BenchmarkResult RunRegistration(
+  vtkImageData *source, vtkImageData *target, vtkMatrix4x4 *expected,
+  int metricType, int interpolatorType, int transformType, int threads)
+{
+  vtkSmartPointer<vtkImageRegistration> registration =
+    vtkSmartPointer<vtkImageRegistration>::New();
+
+  registration->GetThreadPool()->SetNumberOfThreads(threads);
+  registration->SetSourceImage(source);
+  registration->SetTargetImage(target);
+  registration->SetMetricType(metricType);
+  registration->SetOptimizerTypeToPowell();
+  registration->SetInterpolatorType(interpolatorType);
+  registration->SetTransformType(transformType);
+  registration->SetInitializerTypeToCentered();
+  registration->SetCostTolerance(1e-4);
+  registration->SetTransformTolerance(0.1);
+  registration->SetMaximumNumberOfIterations(500);
+  registration->SetMaximumNumberOfEvaluations(5000);
+  registration->SetNumberOfLevels(2);
+
+  double startTime = vtkTimerLog::GetUniversalTime();
+  registration->InitializePyramid(NULL);
+  while (registration->IteratePyramid()) { }
+  double elapsed = vtkTimerLog::GetUniversalTime() - startTime;
+
+  BenchmarkResult result;
+  result.Evaluations = 0;
+  for (int level = 0; level < 2; level++)
+    {
+    result.Evaluations += registration->GetLevelNumberOfEvaluations(level);
+    }
+  result.Seconds = elapsed;
+  result.EvaluationsPerSecond =
+    (elapsed > 0 ? result.Evaluations/elapsed : 0.0);
+  result.FinalCost = registration->GetCostValue();
+  result.Error = TransformError(
+    registration->GetTransform()->GetMatrix(), expected, source);
+
+  return result;
+}
+
+//----------------------------------------------------------------------------
+// Set the number of threads and the threading mode for new metrics.
+void SetThreading(int mode, int threads)
+{
+  vtkMultiThreader::SetGlobalDefaultNumberOfThreads(threads);
+#ifdef BENCHMARK_SMP
+  vtkThreadedImageAlgorithm::SetGlobalDefaultEnableSMP(mode == SMPMode);
+  if (mode == SMPMode)
+    {
+    vtkSMPTools::Initialize(threads);
+    }
+#else
+  (void)mode;
+#endif
+}
+
+//----------------------------------------------------------------------------
+void PrintUsage(FILE *f, const char *cmd)
+{
+  fprintf(f,
+    "Usage: %s [--size n] [--threads n] [--phantom mr|ct]\n"
+    "         [--metric name] [--interpolator name] [--transform name]\n"
+    "         [--format csv|json] [-o file]\n", cmd);
+}
+
+//----------------------------------------------------------------------------
+// Read the command-line options, and return zero on failure.
+int ReadOptions(int argc, char *argv[], BenchmarkOptions *options)
+{
+  options->Size = 32;
+  options->Threads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  options->Phantom = BenchmarkMRPhantom;
+  options->Format = CSVFormat;
+  options->Output = NULL;
+
+  for (int argi = 1; argi < argc; argi++)
+    {
+    const char *arg = argv[argi];
+    const char *val = (argi + 1 < argc ? argv[argi + 1] : NULL);
+    int idx = -1;
+
+    if (val == NULL)
+      {
+      fprintf(stderr, "Option %s needs a value.\n", arg);
+      return 0;
+      }
+    else if (strcmp(arg, "--size") == 0)
+      {
+      options->Size = atoi(val);
+      }
+    else if (strcmp(arg, "--threads") == 0)
+      {
+      options->Threads = atoi(val);
+      }
+    else if (strcmp(arg, "--phantom") == 0)
+      {
+      if (strcmp(val, "mr") == 0)
+        {
+        options->Phantom = BenchmarkMRPhantom;
+        }
+      else if (strcmp(val, "ct") == 0)
+        {
+        options->Phantom = BenchmarkCTPhantom;
+        }
+      else
+        {
+        fprintf(stderr, "Unknown phantom %s.\n", val);
+        return 0;
+        }
+      }
+    else if (strcmp(arg, "--metric") == 0)
+      {
+      if ((idx = FindName(MetricNames, val)) < 0)
+        {
+        fprintf(stderr, "Unknown metric %s.\n", val);
+        return 0;
+        }
+      options->Metrics.push_back(idx);
+      }
+    else if (strcmp(arg, "--interpolator") == 0)
+      {
+      if ((idx = FindName(InterpolatorNames, val)) < 0)
+        {
+        fprintf(stderr, "Unknown interpolator %s.\n", val);
+        return 0;
+        }
+      options->Interpolators.push_back(idx);
+      }
+    else if (strcmp(arg, "--transform") == 0)
+      {
+      if ((idx = FindName(TransformNames, val)) < 0)
+        {
+        fprintf(stderr, "Unknown transform %s.\n", val);
+        return 0;
+        }
+      options->Transforms.push_back(idx);
+      }
+    else if (strcmp(arg, "--format") == 0)
+      {
+      if (strcmp(val, "csv") == 0)
+        {
+        options->Format = CSVFormat;
+        }
+      else if (strcmp(val, "json") == 0)
+        {
+        options->Format = JSONFormat;
+        }
+      else
+        {
+        fprintf(stderr, "Unknown format %s.\n", val);
+        return 0;
+        }
+      }
+    else if (strcmp(arg, "-o") == 0)
+      {
+      options->Output = val;
+      }
+    else
+      {
+      fprintf(stderr, "Unknown option %s.\n", arg);
+      return 0;
+      }
+    argi++;
+    }
+
+  if (options->Size < 16 || options->Threads < 1)
+    {
+    fprintf(stderr, "The size must be at least 16, and the number of "
+            "threads must be at least 1.\n");
+    return 0;
+    }
+
+  UseAllIfEmpty(&options->Metrics, MetricNames);
+  UseAllIfEmpty(&options->Interpolators, InterpolatorNames);
+  UseAllIfEmpty(&options->Transforms, TransformNames);
+
+  return 1;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char *argv[])
+{
+  BenchmarkOptions options;
+  if (!ReadOptions(argc, argv, &options))
+    {
+    PrintUsage(stderr, argv[0]);
+    return 1;
+    }
+
+  FILE *f = stdout;
+  if (options.Output)
+    {
+    f = fopen(options.Output, "w");
+    if (!f)
+      {
+      fprintf(stderr, "Unable to open output file %s\n", options.Output);
+      return 1;
+      }
+    }
+
+  // the thread counts are powers of two, plus the maximum
+  std::vector<int> threadCounts;
+  for (int t = 1; t < options.Threads; t *= 2)
+    {
+    threadCounts.push_back(t);
+    }
+  threadCounts.push_back(options.Threads);
+
+  int numberOfModes = 1;
+#ifdef BENCHMARK_SMP
+  numberOfModes = 2;
+#endif
+
+  int n = options.Size;
+  int size[3] = { n, n, n };
+  double spacing[3] = { 1.0, 1.0, 1.0 };
+  const char *phantomName =
+    (options.Phantom == BenchmarkCTPhantom ? "ct" : "mr");
+
+  vtkSmartPointer<vtkImageData> source =
+    vtkSmartPointer<vtkImageData>::New();
+  MakeBenchmarkPhantom(source, size, spacing, NULL, options.Phantom);
+
+  if (options.Format == CSVFormat)
+    {
+    fprintf(f, "phantom,size,metric,interpolator,transform,mode,threads,"
+            "evaluations,seconds,evaluations_per_second,cost,error\n");
+    }
+  else
+    {
+    fprintf(f, "[\n");
+    }
+
+  int count = 0;
+  for (size_t t = 0; t < options.Transforms.size(); t++)
+    {
+    int transformType = options.Transforms[t];
+
+    // the motion is about the image center, but the registration uses
+    // the image origin, so the expected result must be adjusted
+    double c = 0.5*(n - 1);
+    vtkSmartPointer<vtkTransform> motion =
+      vtkSmartPointer<vtkTransform>::New();
+    BuildMotion(motion, transformType);
+    vtkSmartPointer<vtkTransform> expected =
+      vtkSmartPointer<vtkTransform>::New();
+    expected->PostMultiply();
+    expected->Translate(-c, -c, -c);
+    expected->Concatenate(motion->GetMatrix());
+    expected->Translate(c, c, c);
+
+    vtkSmartPointer<vtkImageData> target =
+      vtkSmartPointer<vtkImageData>::New();
+    MakeBenchmarkPhantom(
+      target, size, spacing, motion->GetMatrix(), options.Phantom);
+
+    for (size_t m = 0; m < options.Metrics.size(); m++)
+      {
+      for (size_t i = 0; i < options.Interpolators.size(); i++)
+        {
+        for (int mode = 0; mode < numberOfModes; mode++)
+          {
+          for (size_t k = 0; k < threadCounts.size(); k++)
+            {
+            int threads = threadCounts[k];
+            SetThreading(mode, threads);
+
+            BenchmarkResult result = RunRegistration(
+              source, target, expected->GetMatrix(), options.Metrics[m],
+              options.Interpolators[i], transformType, threads);
+
+            const char *metricName = MetricNames[options.Metrics[m]];
+            const char *interpolatorName =
+              InterpolatorNames[options.Interpolators[i]];
+            const char *transformName = TransformNames[transformType];
+
+            if (options.Format == CSVFormat)
+              {
+              fprintf(f, "%s,%d,%s,%s,%s,%s,%d,%d,%.6g,%.6g,%.8g,%.6g\n",
+                      phantomName, n, metricName, interpolatorName,
+                      transformName, ModeNames[mode], threads,
+                      result.Evaluations, result.Seconds,
+                      result.EvaluationsPerSecond, result.FinalCost,
+                      result.Error);
+              }
+            else
+              {
+              fprintf(f, "%s  {\"phantom\": \"%s\", \"size\": %d, "
+                      "\"metric\": \"%s\", \"interpolator\": \"%s\", "
+                      "\"transform\": \"%s\", \"mode\": \"%s\", "
+                      "\"threads\": %d, \"evaluations\": %d, "
+                      "\"seconds\": %.6g, \"evaluations_per_second\": %.6g, "
+                      "\"cost\": %.8g, \"error\": %.6g}",
+                      (count > 0 ? ",\n" : ""), phantomName, n,
+                      metricName, interpolatorName, transformName,
+                      ModeNames[mode], threads, result.Evaluations,
+                      result.Seconds, result.EvaluationsPerSecond,
+                      result.FinalCost, result.Error);
+              }
+            fflush(f);
+            count++;
+
+            fprintf(stderr, "%s %s %s %s %d: %.3f s\n", metricName,
+                    interpolatorName, transformName, ModeNames[mode],
+                    threads, result.Seconds);
+            }
+          }
+        }
+      }
+    }
+
+  if (options.Format == JSONFormat)
+    {
+    fprintf(f, "\n]\n");
+    }
+
+  if (f != stdout)
+    {
+    fclose(f);
+    }
+
+  return 0;
+}
@@ -0,0 +1,208 @@
+/*=========================================================================
+
+Program:   Atamai Image Registration and Segmentation
+Module:    BenchmarkInitializers.cxx
+
+   This software is distributed WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+=========================================================================*/
+
+// This benchmark compares the initializers of vtkImageRegistration.  A
+// synthetic phantom is registered to a copy of itself that has been moved,
+// with a three-level pyramid, and for each initializer the time that it
+// took, the number of evaluations for the coarsest level and for all of
+// the levels, the total time, and the error in the recovered
+// transformation are reported.  The first motion is a pure translation,
+// as for a same-modality follow-up scan, and the second adds a rotation.
+//
+// Usage: BenchmarkInitializers [size [threads]]
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+#include <vtkMatrix4x4.h>
+#include <vtkTransform.h>
+#include <vtkTimerLog.h>
+#include <vtkMultiThreader.h>
+
+#include <vtkImageRegistration.h>
+#include <vtkWorkerThreadPool.h>
+
+#include "BenchmarkPhantom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+namespace {
+
+const char *InitializerNames[] = {
+  "Centered",
+  "Moments",
+  "PhaseCorr",
+  "GridSearch",
+  NULL
+};
+
+const int InitializerTypes[] = {
+  vtkImageRegistration::Centered,
+  vtkImageRegistration::Moments,
+  vtkImageRegistration::PhaseCorrelation,
+  vtkImageRegistration::GridSearch
+};
+
+struct BenchmarkResult
+{
+  double InitSeconds;
+  int CoarseEvaluations;
+  int Evaluations;
+  double Seconds;
+  double Error;
+};
+
+//----------------------------------------------------------------------------
+// Compute the largest displacement between two transforms at the corners
+// of the image, to measure how well the motion was recovered.
+double TransformError(
+  vtkMatrix4x4 *matrix1, vtkMatrix4x4 *matrix2, vtkImageData *image)
+{
+  double bounds[6];
+  image->GetBounds(bounds);
+
+  double maxerr = 0.0;
+  for (int i = 0; i < 8; i++)
+    {
+    double p[4], q1[4], q2[4];
+    p[0] = bounds[0 + (i & 1)];
+    p[1] = bounds[2 + ((i >> 1) & 1)];
+    p[2] = bounds[4 + ((i >> 2) & 1)];
+    p[3] = 1.0;
+    matrix1->MultiplyPoint(p, q1);
+    matrix2->MultiplyPoint(p, q2);
+    double d = sqrt((q1[0] - q2[0])*(q1[0] - q2[0]) +
+                    (q1[1] - q2[1])*(q1[1] - q2[1]) +
+                    (q1[2] - q2[2])*(q1[2] - q2[2]));
+    maxerr = (d > maxerr ? d : maxerr);
+    }
+
+  return maxerr;
+}
+
+//----------------------------------------------------------------------------
+// Run a multi-resolution registration until the finest level converges.
+BenchmarkResult RunRegistration(
+  vtkImageData *source, vtkImageData *target, vtkMatrix4x4 *expected,
+  int initializerType, int threads)
+{
+  vtkSmartPointer<vtkImageRegistration> registration =
+    vtkSmartPointer<vtkImageRegistration>::New();
+
+  registration->GetThreadPool()->SetNumberOfThreads(threads);
+  registration->SetSourceImage(source);
+  registration->SetTargetImage(target);
+  registration->SetMetricTypeToNormalizedMutualInformation();
+  registration->SetOptimizerTypeToPowell();
+  registration->SetInterpolatorTypeToLinear();
+  registration->SetTransformTypeToRigid();
+  registration->SetInitializerType(initializerType);
+  registration->SetCostTolerance(1e-4);
+  registration->SetTransformTolerance(0.1);
+  registration->SetMaximumNumberOfIterations(500);
+  registration->SetNumberOfLevels(3);
+  registration->SetFusedEvaluation(true);
+
+  double startTime = vtkTimerLog::GetUniversalTime();
+  registration->InitializePyramid(NULL);
+  double initTime = vtkTimerLog::GetUniversalTime() - startTime;
+  while (registration->IteratePyramid()) { }
+  double elapsed = vtkTimerLog::GetUniversalTime() - startTime;
+
+  BenchmarkResult result;
+  result.InitSeconds = initTime;
+  result.CoarseEvaluations = registration->GetLevelNumberOfEvaluations(0);
+  result.Evaluations = 0;
+  for (int level = 0; level < 3; level++)
+    {
+    result.Evaluations += registration->GetLevelNumberOfEvaluations(level);
+    }
+  result.Seconds = elapsed;
+  result.Error = TransformError(
+    registration->GetTransform()->GetMatrix(), expected, source);
+
+  return result;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char *argv[])
+{
+  int n = 64;
+  int threads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  if (argc > 1)
+    {
+    n = atoi(argv[1]);
+    }
+  if (argc > 2)
+    {
+    threads = atoi(argv[2]);
+    }
+  if (n < 16 || threads < 1)
+    {
+    fprintf(stderr, "Usage: %s [size [threads]]\n", argv[0]);
+    return 1;
+    }
+
+  int size[3] = { n, n, n };
+  double spacing[3] = { 1.0, 1.0, 1.0 };
+
+  vtkSmartPointer<vtkImageData> source =
+    vtkSmartPointer<vtkImageData>::New();
+  MakeBenchmarkPhantom(source, size, spacing, NULL);
+
+  printf("Phantom size %dx%dx%d, %d threads\n", n, n, n, threads);
+
+  for (int m = 0; m < 2; m++)
+    {
+    // the target is the source moved about the image center
+    vtkSmartPointer<vtkTransform> motion =
+      vtkSmartPointer<vtkTransform>::New();
+    motion->PostMultiply();
+    if (m == 1)
+      {
+      motion->RotateWXYZ(25.0, 0.2, 0.3, 1.0);
+      }
+    motion->Translate(0.2*n, -0.15*n, 0.1*n);
+
+    // the expected result is the motion, but about the image origin
+    double c = 0.5*(n - 1);
+    vtkSmartPointer<vtkTransform> expected =
+      vtkSmartPointer<vtkTransform>::New();
+    expected->PostMultiply();
+    expected->Translate(-c, -c, -c);
+    expected->Concatenate(motion->GetMatrix());
+    expected->Translate(c, c, c);
+
+    vtkSmartPointer<vtkImageData> target =
+      vtkSmartPointer<vtkImageData>::New();
+    MakeBenchmarkPhantom(target, size, spacing, motion->GetMatrix());
+
+    printf("\n%s\n", (m == 0 ? "Translation" : "Rotation and translation"));
+    printf("%-12s %10s %10s %10s %10s %10s\n", "initializer",
+           "init secs", "coarse", "evals", "seconds", "error");
+
+    for (int t = 0; InitializerNames[t] != NULL; t++)
+      {
+      BenchmarkResult result = RunRegistration(
+        source, target, expected->GetMatrix(), InitializerTypes[t],
+        threads);
+
+      printf("%-12s %10.3f %10d %10d %10.3f %10.4f\n",
+             InitializerNames[t], result.InitSeconds,
+             result.CoarseEvaluations, result.Evaluations,
+             result.Seconds, result.Error);
+      }
+    }
+
+  return 0;
+}
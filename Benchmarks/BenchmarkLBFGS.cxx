@@ -0,0 +1,205 @@
+/*=========================================================================
+
+Program:   Atamai Image Registration and Segmentation
+Module:    BenchmarkLBFGS.cxx
+
+   This software is distributed WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+=========================================================================*/
+
+// This benchmark compares the Powell optimizer with the LBFGS optimizer,
+// which uses finite-difference gradients that are evaluated concurrently.
+// A synthetic phantom is registered to a copy of itself that has been
+// moved by an affine transformation, and for each optimizer the number
+// of evaluations, the time to convergence, the final cost, and the error
+// in the recovered transformation are reported.
+//
+// Usage: BenchmarkLBFGS [size [threads]]
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+#include <vtkMatrix4x4.h>
+#include <vtkTransform.h>
+#include <vtkTimerLog.h>
+#include <vtkMultiThreader.h>
+
+#include <vtkImageRegistration.h>
+#include <vtkWorkerThreadPool.h>
+
+#include "BenchmarkPhantom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+namespace {
+
+const char *TransformNames[] = {
+  "Rigid",
+  "Similarity",
+  "Affine",
+  NULL
+};
+
+const int TransformTypes[] = {
+  vtkImageRegistration::Rigid,
+  vtkImageRegistration::Similarity,
+  vtkImageRegistration::Affine
+};
+
+struct BenchmarkResult
+{
+  int Evaluations;
+  double Seconds;
+  double FinalCost;
+  double Error;
+};
+
+//----------------------------------------------------------------------------
+// Compute the largest displacement between two transforms at the corners
+// of the image, to measure how well the motion was recovered.
+double TransformError(
+  vtkMatrix4x4 *matrix1, vtkMatrix4x4 *matrix2, vtkImageData *image)
+{
+  double bounds[6];
+  image->GetBounds(bounds);
+
+  double maxerr = 0.0;
+  for (int i = 0; i < 8; i++)
+    {
+    double p[4], q1[4], q2[4];
+    p[0] = bounds[0 + (i & 1)];
+    p[1] = bounds[2 + ((i >> 1) & 1)];
+    p[2] = bounds[4 + ((i >> 2) & 1)];
+    p[3] = 1.0;
+    matrix1->MultiplyPoint(p, q1);
+    matrix2->MultiplyPoint(p, q2);
+    double d = sqrt((q1[0] - q2[0])*(q1[0] - q2[0]) +
+                    (q1[1] - q2[1])*(q1[1] - q2[1]) +
+                    (q1[2] - q2[2])*(q1[2] - q2[2]));
+    maxerr = (d > maxerr ? d : maxerr);
+    }
+
+  return maxerr;
+}
+
+//----------------------------------------------------------------------------
+// Run the registration until it converges.
+BenchmarkResult RunRegistration(
+  vtkImageData *source, vtkImageData *target, vtkMatrix4x4 *expected,
+  int transformType, int optimizerType, int threads)
+{
+  vtkSmartPointer<vtkImageRegistration> registration =
+    vtkSmartPointer<vtkImageRegistration>::New();
+
+  registration->GetThreadPool()->SetNumberOfThreads(threads);
+  registration->SetSourceImage(source);
+  registration->SetTargetImage(target);
+  registration->SetMetricTypeToNormalizedMutualInformation();
+  registration->SetOptimizerType(optimizerType);
+  registration->SetInterpolatorTypeToLinear();
+  registration->SetTransformType(transformType);
+  registration->SetInitializerTypeToCentered();
+  registration->SetCostTolerance(1e-4);
+  registration->SetTransformTolerance(0.1);
+  registration->SetMaximumNumberOfIterations(500);
+  registration->SetMaximumNumberOfEvaluations(20000);
+  registration->SetFusedEvaluation(true);
+
+  double startTime = vtkTimerLog::GetUniversalTime();
+  registration->Initialize(NULL);
+  while (registration->Iterate()) { }
+  double elapsed = vtkTimerLog::GetUniversalTime() - startTime;
+
+  BenchmarkResult result;
+  result.Evaluations = registration->GetNumberOfEvaluations();
+  result.Seconds = elapsed;
+  result.FinalCost = registration->GetCostValue();
+  result.Error = TransformError(
+    registration->GetTransform()->GetMatrix(), expected, source);
+
+  return result;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char *argv[])
+{
+  int n = 64;
+  int threads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  if (argc > 1)
+    {
+    n = atoi(argv[1]);
+    }
+  if (argc > 2)
+    {
+    threads = atoi(argv[2]);
+    }
+  if (n < 8 || threads < 1)
+    {
+    fprintf(stderr, "Usage: %s [size [threads]]\n", argv[0]);
+    return 1;
+    }
+
+  int size[3] = { n, n, n };
+  double spacing[3] = { 1.0, 1.0, 1.0 };
+
+  // the target is the source moved by an affine transformation (about
+  // the image center), as for inter-subject registration
+  vtkSmartPointer<vtkTransform> motion =
+    vtkSmartPointer<vtkTransform>::New();
+  motion->PostMultiply();
+  motion->RotateWXYZ(6.0, 0.2, 0.3, 1.0);
+  motion->Scale(1.06, 0.95, 1.03);
+  motion->RotateWXYZ(-20.0, 1.0, 0.0, 0.0);
+  motion->Translate(3.0, -2.0, 1.5);
+
+  // the registration maps source points to target points, so the
+  // expected result is the motion, but about the image origin
+  double c = 0.5*(n - 1);
+  vtkSmartPointer<vtkTransform> expected =
+    vtkSmartPointer<vtkTransform>::New();
+  expected->PostMultiply();
+  expected->Translate(-c, -c, -c);
+  expected->Concatenate(motion->GetMatrix());
+  expected->Translate(c, c, c);
+
+  vtkSmartPointer<vtkImageData> source =
+    vtkSmartPointer<vtkImageData>::New();
+  MakeBenchmarkPhantom(source, size, spacing, NULL);
+
+  vtkSmartPointer<vtkImageData> target =
+    vtkSmartPointer<vtkImageData>::New();
+  MakeBenchmarkPhantom(target, size, spacing, motion->GetMatrix());
+
+  printf("Phantom size %dx%dx%d, %d threads\n", n, n, n, threads);
+  printf("%-12s %-8s %8s %10s %8s %12s %10s\n", "transform",
+         "optimizer", "evals", "seconds", "speedup", "cost", "error");
+
+  for (int t = 0; TransformNames[t] != NULL; t++)
+    {
+    BenchmarkResult powell = RunRegistration(
+      source, target, expected->GetMatrix(), TransformTypes[t],
+      vtkImageRegistration::Powell, threads);
+    BenchmarkResult lbfgs = RunRegistration(
+      source, target, expected->GetMatrix(), TransformTypes[t],
+      vtkImageRegistration::LBFGS, threads);
+
+    double speedup = 0.0;
+    if (lbfgs.Seconds > 0)
+      {
+      speedup = powell.Seconds/lbfgs.Seconds;
+      }
+
+    printf("%-12s %-8s %8d %10.3f %8s %12.6g %10.4f\n",
+           TransformNames[t], "Powell", powell.Evaluations,
+           powell.Seconds, "", powell.FinalCost, powell.Error);
+    printf("%-12s %-8s %8d %10.3f %7.2fx %12.6g %10.4f\n",
+           TransformNames[t], "LBFGS", lbfgs.Evaluations,
+           lbfgs.Seconds, speedup, lbfgs.FinalCost, lbfgs.Error);
+    }
+
+  return 0;
+}
@@ -0,0 +1,263 @@
+/*=========================================================================
+
+Program:   Atamai Image Registration and Segmentation
+Module:    BenchmarkNUMA.cxx
+
+   This software is distributed WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+=========================================================================*/
+
+// This benchmark measures what NUMAPlacement gains on machines with more
+// than one NUMA node, e.g. dual-socket servers.  First, the pinned threads
+// of a vtkWorkerThreadPool each read their own slab of a large buffer,
+// once when the whole buffer was first touched by the main thread (so
+// that it is all on one node, and the threads on the other sockets read
+// across the interconnect) and once when each slab was first touched by
+// the thread that reads it.  The ratio of the read bandwidths is the gain
+// for the memory-bound parts of the metric.  Second, a registration is
+// run with NUMAPlacement off and on, with and without FusedEvaluation,
+// where without fusion only the accumulators of the metric are placed.
+// On a machine with a single node, both ratios should be close to one.
+//
+// Usage: BenchmarkNUMA [size [threads]]
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+#include <vtkMatrix4x4.h>
+#include <vtkTransform.h>
+#include <vtkTimerLog.h>
+#include <vtkMultiThreader.h>
+
+#include <vtkImageRegistration.h>
+#include <vtkWorkerThreadPool.h>
+
+#include "BenchmarkPhantom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace {
+
+//----------------------------------------------------------------------------
+// A buffer that is split evenly between the threads of the pool.
+struct BandwidthData
+{
+  double *Buffer;
+  size_t Size;
+  double Sums[VTK_MAX_THREADS];
+};
+
+//----------------------------------------------------------------------------
+// Write this thread's slab of the buffer, which is the first touch if the
+// buffer was just allocated.
+void TouchSlab(void *arg, int threadId, int numberOfThreads)
+{
+  BandwidthData *data = static_cast<BandwidthData *>(arg);
+  size_t begin = data->Size*threadId/numberOfThreads;
+  size_t end = data->Size*(threadId + 1)/numberOfThreads;
+  for (size_t i = begin; i < end; i++)
+    {
+    data->Buffer[i] = static_cast<double>(i & 0xff);
+    }
+}
+
+//----------------------------------------------------------------------------
+// Read this thread's slab of the buffer.
+void ReadSlab(void *arg, int threadId, int numberOfThreads)
+{
+  BandwidthData *data = static_cast<BandwidthData *>(arg);
+  size_t begin = data->Size*threadId/numberOfThreads;
+  size_t end = data->Size*(threadId + 1)/numberOfThreads;
+  double sum = 0.0;
+  for (size_t i = begin; i < end; i++)
+    {
+    sum += data->Buffer[i];
+    }
+  data->Sums[threadId] += sum;
+}
+
+//----------------------------------------------------------------------------
+// Measure the read bandwidth in GB/s, after the buffer has been touched
+// either by the main thread or by the pool threads.
+double RunBandwidth(
+  vtkWorkerThreadPool *pool, size_t size, bool placed, int repeats)
+{
+  BandwidthData data;
+  data.Buffer = new double[size];
+  data.Size = size;
+  for (int i = 0; i < VTK_MAX_THREADS; i++)
+    {
+    data.Sums[i] = 0.0;
+    }
+
+  if (placed)
+    {
+    pool->Execute(TouchSlab, &data);
+    }
+  else
+    {
+    TouchSlab(&data, 0, 1);
+    }
+
+  // one read before timing, to start the threads
+  pool->Execute(ReadSlab, &data);
+
+  double startTime = vtkTimerLog::GetUniversalTime();
+  for (int r = 0; r < repeats; r++)
+    {
+    pool->Execute(ReadSlab, &data);
+    }
+  double elapsed = vtkTimerLog::GetUniversalTime() - startTime;
+
+  delete [] data.Buffer;
+
+  double bytes = static_cast<double>(size)*sizeof(double)*repeats;
+  return (elapsed > 0 ? bytes/elapsed*1e-9 : 0.0);
+}
+
+//----------------------------------------------------------------------------
+// Run a registration until it converges, and return the seconds that it
+// took and the number of evaluations.
+double RunRegistration(
+  vtkImageData *source, vtkImageData *target, bool fused, bool numa,
+  int threads, int *evaluations)
+{
+  vtkSmartPointer<vtkImageRegistration> registration =
+    vtkSmartPointer<vtkImageRegistration>::New();
+
+  registration->GetThreadPool()->SetNumberOfThreads(threads);
+  registration->SetSourceImage(source);
+  registration->SetTargetImage(target);
+  registration->SetMetricTypeToNormalizedMutualInformation();
+  registration->SetOptimizerTypeToPowell();
+  registration->SetInterpolatorTypeToLinear();
+  registration->SetTransformTypeToRigid();
+  registration->SetInitializerTypeToCentered();
+  registration->SetFusedEvaluation(fused);
+  registration->SetNUMAPlacement(numa);
+  registration->SetCostTolerance(1e-4);
+  registration->SetTransformTolerance(0.01);
+  registration->SetMaximumNumberOfIterations(200);
+
+  // the time includes the placement of the images
+  double startTime = vtkTimerLog::GetUniversalTime();
+  registration->Initialize(NULL);
+  while (registration->Iterate()) { }
+  double elapsed = vtkTimerLog::GetUniversalTime() - startTime;
+
+  *evaluations = registration->GetNumberOfEvaluations();
+
+  return elapsed;
+}
+
+//----------------------------------------------------------------------------
+// Count the NUMA nodes, or return zero if this is not known.
+int CountNodes()
+{
+  int nodes = 0;
+#ifdef __linux__
+  for (;;)
+    {
+    char path[64];
+    sprintf(path, "/sys/devices/system/node/node%d/cpulist", nodes);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+      {
+      break;
+      }
+    fclose(fp);
+    nodes++;
+    }
+#endif
+  return nodes;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char *argv[])
+{
+  int n = 192;
+  int threads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  if (argc > 1)
+    {
+    n = atoi(argv[1]);
+    }
+  if (argc > 2)
+    {
+    threads = atoi(argv[2]);
+    }
+  if (n < 16 || threads < 1 || threads > VTK_MAX_THREADS)
+    {
+    fprintf(stderr, "Usage: %s [size [threads]]\n", argv[0]);
+    return 1;
+    }
+
+  int nodes = CountNodes();
+  if (nodes > 0)
+    {
+    printf("%d NUMA nodes, %d threads\n", nodes, threads);
+    }
+  else
+    {
+    printf("Unknown number of NUMA nodes, %d threads\n", threads);
+    }
+
+  // the bandwidth of the pinned threads, for a buffer that is much
+  // larger than the caches
+  vtkSmartPointer<vtkWorkerThreadPool> pool =
+    vtkSmartPointer<vtkWorkerThreadPool>::New();
+  pool->SetNumberOfThreads(threads);
+  pool->PinThreadsOn();
+
+  size_t size = static_cast<size_t>(n)*n*n;
+  double mainRate = RunBandwidth(pool, size, false, 20);
+  double placedRate = RunBandwidth(pool, size, true, 20);
+
+  printf("\nRead bandwidth for %.0f MB, in GB/s\n",
+         size*sizeof(double)/1048576.0);
+  printf("%14s %14s %8s\n", "main touched", "slab touched", "speedup");
+  printf("%14.2f %14.2f %7.2fx\n", mainRate, placedRate,
+         (mainRate > 0 ? placedRate/mainRate : 0.0));
+
+  // a registration of a phantom with a moved copy of itself
+  int imageSize[3] = { n, n, n };
+  double spacing[3] = { 1.0, 1.0, 1.0 };
+
+  vtkSmartPointer<vtkTransform> motion =
+    vtkSmartPointer<vtkTransform>::New();
+  motion->PostMultiply();
+  motion->RotateWXYZ(5.0, 0.2, 0.3, 1.0);
+  motion->Translate(2.5, -1.5, 1.0);
+
+  vtkSmartPointer<vtkImageData> source =
+    vtkSmartPointer<vtkImageData>::New();
+  MakeBenchmarkPhantom(source, imageSize, spacing, NULL);
+  vtkSmartPointer<vtkImageData> target =
+    vtkSmartPointer<vtkImageData>::New();
+  MakeBenchmarkPhantom(target, imageSize, spacing, motion->GetMatrix());
+
+  printf("\nRegistration of %dx%dx%d phantom\n", n, n, n);
+  printf("%-8s %10s %10s %10s %10s %8s\n", "fused", "off s", "off ev/s",
+         "numa s", "numa ev/s", "speedup");
+
+  for (int fused = 0; fused < 2; fused++)
+    {
+    int offEvaluations = 0;
+    int numaEvaluations = 0;
+    double offSeconds = RunRegistration(
+      source, target, (fused != 0), false, threads, &offEvaluations);
+    double numaSeconds = RunRegistration(
+      source, target, (fused != 0), true, threads, &numaEvaluations);
+
+    double offRate = (offSeconds > 0 ? offEvaluations/offSeconds : 0.0);
+    double numaRate = (numaSeconds > 0 ? numaEvaluations/numaSeconds : 0.0);
+
+    printf("%-8s %10.3f %10.1f %10.3f %10.1f %7.2fx\n",
+           (fused ? "On" : "Off"), offSeconds, offRate,
+           numaSeconds, numaRate, (offRate > 0 ? numaRate/offRate : 0.0));
+    }
+
+  return 0;
+}
@@ -0,0 +1,160 @@
+/*=========================================================================
+
+Program:   Atamai Image Registration and Segmentation
+Module:    BenchmarkPhantom.h
+
+   This software is distributed WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+=========================================================================*/
+
+// This header provides a synthetic phantom for the benchmarks, so that
+// they can be run without any image files.  The phantom is a body-like
+// ellipsoid that contains several smaller ellipsoids of different
+// intensities.  A transformed copy of the phantom can be generated by
+// providing a matrix, which allows the registration to be benchmarked
+// with a known misalignment.  The default phantom has MR-like intensities
+// on a zero background, and the CT phantom is a head with a bony skull,
+// soft tissue, ventricles, and an air-filled sinus, in Hounsfield units.
+
+#ifndef BenchmarkPhantom_h
+#define BenchmarkPhantom_h
+
+#include <vtkImageData.h>
+#include <vtkMatrix4x4.h>
+#include <vtkVersion.h>
+
+#include <math.h>
+
+namespace {
+
+// The phantom types
+enum { BenchmarkMRPhantom, BenchmarkCTPhantom };
+
+// The ellipsoids that make up the phantom: center, radii (both as a
+// fraction of the field of view), and the intensity
+const double BenchmarkPhantomEllipsoids[][7] = {
+  {  0.00,  0.00,  0.00,   0.45, 0.35, 0.45,   100.0 },
+  { -0.15,  0.00,  0.00,   0.10, 0.12, 0.20,   300.0 },
+  {  0.15,  0.05,  0.05,   0.08, 0.08, 0.15,   600.0 },
+  {  0.00, -0.15, -0.10,   0.05, 0.05, 0.05,  1000.0 },
+  {  0.05,  0.18,  0.12,   0.12, 0.04, 0.06,   450.0 },
+};
+
+const int BenchmarkPhantomNumberOfEllipsoids =
+  sizeof(BenchmarkPhantomEllipsoids)/sizeof(BenchmarkPhantomEllipsoids[0]);
+
+// The ellipsoids for the CT head phantom, which has an air background
+const double BenchmarkCTPhantomEllipsoids[][7] = {
+  {  0.00,  0.00,  0.00,   0.40, 0.46, 0.42,  1200.0 },
+  {  0.00,  0.00,  0.02,   0.36, 0.42, 0.38,    40.0 },
+  { -0.06,  0.02,  0.04,   0.04, 0.12, 0.06,     5.0 },
+  {  0.06,  0.02,  0.04,   0.04, 0.12, 0.06,     5.0 },
+  {  0.00,  0.38, -0.20,   0.08, 0.05, 0.06, -1000.0 },
+  {  0.12, -0.15,  0.10,   0.05, 0.05, 0.05,    70.0 },
+};
+
+const int BenchmarkCTPhantomNumberOfEllipsoids =
+  sizeof(BenchmarkCTPhantomEllipsoids)/
+  sizeof(BenchmarkCTPhantomEllipsoids[0]);
+
+//----------------------------------------------------------------------------
+// Evaluate the phantom at point "p", given relative to the image center
+// and as a fraction of the field of view.  The phantom intensity falls off
+// linearly across a narrow band at each edge, to avoid aliasing.
+double BenchmarkPhantomValue(const double p[3], double edge, int type)
+{
+  const double (*ellipsoids)[7] = BenchmarkPhantomEllipsoids;
+  int n = BenchmarkPhantomNumberOfEllipsoids;
+  double value = 0.0;
+  if (type == BenchmarkCTPhantom)
+    {
+    ellipsoids = BenchmarkCTPhantomEllipsoids;
+    n = BenchmarkCTPhantomNumberOfEllipsoids;
+    value = -1000.0;
+    }
+
+  for (int i = 0; i < n; i++)
+    {
+    const double *e = ellipsoids[i];
+    double x = (p[0] - e[0])/e[3];
+    double y = (p[1] - e[1])/e[4];
+    double z = (p[2] - e[2])/e[5];
+    double r = sqrt(x*x + y*y + z*z);
+    double w = e[3];
+    w = (w < e[4] ? w : e[4]);
+    w = (w < e[5] ? w : e[5]);
+    double f = (1.0 - r)*w/edge + 0.5;
+    f = (f > 0.0 ? f : 0.0);
+    f = (f < 1.0 ? f : 1.0);
+    // each ellipsoid replaces the intensity of the ones before it
+    value += f*(e[6] - value);
+    }
+
+  return value;
+}
+
+//----------------------------------------------------------------------------
+// Generate the phantom.  If a matrix is given, then the phantom is moved
+// by this matrix (in data coordinates, around the image center).
+void MakeBenchmarkPhantom(
+  vtkImageData *image, const int size[3], const double spacing[3],
+  vtkMatrix4x4 *matrix, int type = BenchmarkMRPhantom)
+{
+  image->SetDimensions(size[0], size[1], size[2]);
+  image->SetSpacing(spacing[0], spacing[1], spacing[2]);
+  image->SetOrigin(0.0, 0.0, 0.0);
+#if VTK_MAJOR_VERSION >= 6
+  image->AllocateScalars(VTK_SHORT, 1);
+#else
+  image->SetScalarTypeToShort();
+  image->SetNumberOfScalarComponents(1);
+  image->AllocateScalars();
+#endif
+
+  double fov[3];
+  double center[3];
+  for (int j = 0; j < 3; j++)
+    {
+    fov[j] = (size[j] > 1 ? (size[j] - 1)*spacing[j] : 1.0);
+    center[j] = 0.5*(size[j] - 1)*spacing[j];
+    }
+  double edge = spacing[0]/fov[0];
+
+  // the phantom is moved by the matrix, so sample with its inverse
+  double inverse[16];
+  vtkMatrix4x4::Identity(inverse);
+  if (matrix)
+    {
+    vtkMatrix4x4::Invert(*matrix->Element, inverse);
+    }
+
+  short *ptr = static_cast<short *>(image->GetScalarPointer());
+  for (int k = 0; k < size[2]; k++)
+    {
+    for (int j = 0; j < size[1]; j++)
+      {
+      for (int i = 0; i < size[0]; i++)
+        {
+        double x[3];
+        x[0] = i*spacing[0] - center[0];
+        x[1] = j*spacing[1] - center[1];
+        x[2] = k*spacing[2] - center[2];
+
+        double p[3];
+        for (int l = 0; l < 3; l++)
+          {
+          const double *row = inverse + 4*l;
+          p[l] = (row[0]*x[0] + row[1]*x[1] + row[2]*x[2] + row[3])/fov[l];
+          }
+
+        double v = BenchmarkPhantomValue(p, edge, type);
+        *ptr++ = static_cast<short>(floor(v + 0.5));
+        }
+      }
+    }
+}
+
+} // end anonymous namespace
+
+#endif /* BenchmarkPhantom_h */
@@ -0,0 +1,324 @@
+/*=========================================================================
+
+Program:   Atamai Image Registration and Segmentation
+Module:    BenchmarkPrecision.cxx
+
+   This software is distributed WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+=========================================================================*/
+
+// This benchmark is the accuracy report for the single-precision mode of
+// vtkImageRegistration.  A synthetic phantom, stored as double, is
+// registered to a copy of itself that has been moved, once with the
+// default precision and once with single precision.  For each metric and
+// interpolator, the time for each precision, the difference between the
+// two final transforms, and the error of each with respect to the known
+// motion are reported.  The differences are the largest displacements at
+// the corners of the image, in voxels.  Then the phantoms are given a
+// large constant offset, like the pedestal of raw scanner data, and the
+// normalized cross correlation is checked for the loss of precision that
+// comes from cancellation in its single-precision sums: the difference
+// between the single and double costs should stay small as the offset
+// grows, and so should the registration errors.
+//
+// Usage: BenchmarkPrecision [size [threads]]
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+#include <vtkImageCast.h>
+#include <vtkImageShiftScale.h>
+#include <vtkMatrix4x4.h>
+#include <vtkTransform.h>
+#include <vtkTimerLog.h>
+#include <vtkMultiThreader.h>
+
+#include <vtkImageRegistration.h>
+#include <vtkImageCrossCorrelation.h>
+#include <vtkWorkerThreadPool.h>
+
+#include "BenchmarkPhantom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+namespace {
+
+const char *MetricNames[] = {
+  "SquaredDifference",
+  "NormalizedCrossCorrelation",
+  "NormalizedMutualInformation",
+  NULL
+};
+
+const int MetricTypes[] = {
+  vtkImageRegistration::SquaredDifference,
+  vtkImageRegistration::NormalizedCrossCorrelation,
+  vtkImageRegistration::NormalizedMutualInformation
+};
+
+const char *InterpolatorNames[] = {
+  "Linear",
+  "BSpline",
+  NULL
+};
+
+const int InterpolatorTypes[] = {
+  vtkImageRegistration::Linear,
+  vtkImageRegistration::BSpline
+};
+
+struct BenchmarkResult
+{
+  double Seconds;
+  double Error;
+};
+
+//----------------------------------------------------------------------------
+// Compute the largest displacement between two transforms at the corners
+// of the image, to measure how well the motion was recovered.
+double TransformError(
+  vtkMatrix4x4 *matrix1, vtkMatrix4x4 *matrix2, vtkImageData *image)
+{
+  double bounds[6];
+  image->GetBounds(bounds);
+
+  double maxerr = 0.0;
+  for (int i = 0; i < 8; i++)
+    {
+    double p[4], q1[4], q2[4];
+    p[0] = bounds[0 + (i & 1)];
+    p[1] = bounds[2 + ((i >> 1) & 1)];
+    p[2] = bounds[4 + ((i >> 2) & 1)];
+    p[3] = 1.0;
+    matrix1->MultiplyPoint(p, q1);
+    matrix2->MultiplyPoint(p, q2);
+    double d = sqrt((q1[0] - q2[0])*(q1[0] - q2[0]) +
+                    (q1[1] - q2[1])*(q1[1] - q2[1]) +
+                    (q1[2] - q2[2])*(q1[2] - q2[2]));
+    maxerr = (d > maxerr ? d : maxerr);
+    }
+
+  return maxerr;
+}
+
+//----------------------------------------------------------------------------
+// Run a rigid registration until it converges, and store the result.
+BenchmarkResult RunRegistration(
+  vtkImageData *source, vtkImageData *target, vtkMatrix4x4 *expected,
+  int metricType, int interpolatorType, int precision, int threads,
+  vtkMatrix4x4 *result)
+{
+  vtkSmartPointer<vtkImageRegistration> registration =
+    vtkSmartPointer<vtkImageRegistration>::New();
+
+  registration->GetThreadPool()->SetNumberOfThreads(threads);
+  registration->SetSourceImage(source);
+  registration->SetTargetImage(target);
+  registration->SetMetricType(metricType);
+  registration->SetOptimizerTypeToPowell();
+  registration->SetInterpolatorType(interpolatorType);
+  registration->SetTransformTypeToRigid();
+  registration->SetInitializerTypeToCentered();
+  registration->SetPrecision(precision);
+  registration->SetCostTolerance(1e-4);
+  registration->SetTransformTolerance(0.01);
+  registration->SetMaximumNumberOfIterations(500);
+
+  double startTime = vtkTimerLog::GetUniversalTime();
+  registration->Initialize(NULL);
+  while (registration->Iterate()) { }
+  double elapsed = vtkTimerLog::GetUniversalTime() - startTime;
+
+  result->DeepCopy(registration->GetTransform()->GetMatrix());
+
+  BenchmarkResult r;
+  r.Seconds = elapsed;
+  r.Error = TransformError(result, expected, source);
+
+  return r;
+}
+
+//----------------------------------------------------------------------------
+// Add a constant offset to an image, and store the result as double.
+void OffsetImage(vtkImageData *image, double offset, vtkImageData *output)
+{
+  vtkSmartPointer<vtkImageShiftScale> shift =
+    vtkSmartPointer<vtkImageShiftScale>::New();
+#if VTK_MAJOR_VERSION >= 6
+  shift->SetInputData(image);
+#else
+  shift->SetInput(image);
+#endif
+  shift->SetShift(offset);
+  shift->SetScale(1.0);
+  shift->SetOutputScalarTypeToDouble();
+  shift->Update();
+  output->DeepCopy(shift->GetOutput());
+}
+
+//----------------------------------------------------------------------------
+// Compute the normalized cross correlation of two images in single and in
+// double precision, and return the difference between the two costs.
+double CostDifference(vtkImageData *source, vtkImageData *target)
+{
+  double costs[2];
+  for (int i = 0; i < 2; i++)
+    {
+    vtkSmartPointer<vtkImageCrossCorrelation> metric =
+      vtkSmartPointer<vtkImageCrossCorrelation>::New();
+    metric->SetMetricToNormalizedCrossCorrelation();
+    metric->SetSinglePrecision(i != 0);
+#if VTK_MAJOR_VERSION >= 6
+    metric->SetInputData(0, source);
+    metric->SetInputData(1, target);
+#else
+    metric->SetInput(0, source);
+    metric->SetInput(1, target);
+#endif
+    metric->Update();
+    costs[i] = metric->GetCost();
+    }
+
+  return fabs(costs[1] - costs[0]);
+}
+
+} // end anonymous namespace
+
+int main(int argc, char *argv[])
+{
+  int n = 64;
+  int threads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  if (argc > 1)
+    {
+    n = atoi(argv[1]);
+    }
+  if (argc > 2)
+    {
+    threads = atoi(argv[2]);
+    }
+  if (n < 16 || threads < 1)
+    {
+    fprintf(stderr, "Usage: %s [size [threads]]\n", argv[0]);
+    return 1;
+    }
+
+  int size[3] = { n, n, n };
+  double spacing[3] = { 1.0, 1.0, 1.0 };
+
+  vtkSmartPointer<vtkTransform> motion =
+    vtkSmartPointer<vtkTransform>::New();
+  motion->PostMultiply();
+  motion->RotateWXYZ(5.0, 0.2, 0.3, 1.0);
+  motion->Translate(2.5, -1.5, 1.0);
+
+  // the expected result is the motion, but about the image origin
+  double c = 0.5*(n - 1);
+  vtkSmartPointer<vtkTransform> expected =
+    vtkSmartPointer<vtkTransform>::New();
+  expected->PostMultiply();
+  expected->Translate(-c, -c, -c);
+  expected->Concatenate(motion->GetMatrix());
+  expected->Translate(c, c, c);
+
+  // use double images, so that the default precision is double
+  vtkSmartPointer<vtkImageData> phantom =
+    vtkSmartPointer<vtkImageData>::New();
+  MakeBenchmarkPhantom(phantom, size, spacing, NULL);
+  vtkSmartPointer<vtkImageCast> sourceCast =
+    vtkSmartPointer<vtkImageCast>::New();
+#if VTK_MAJOR_VERSION >= 6
+  sourceCast->SetInputData(phantom);
+#else
+  sourceCast->SetInput(phantom);
+#endif
+  sourceCast->SetOutputScalarTypeToDouble();
+  sourceCast->Update();
+  vtkImageData *source = sourceCast->GetOutput();
+
+  vtkSmartPointer<vtkImageData> movedPhantom =
+    vtkSmartPointer<vtkImageData>::New();
+  MakeBenchmarkPhantom(movedPhantom, size, spacing, motion->GetMatrix());
+  vtkSmartPointer<vtkImageCast> targetCast =
+    vtkSmartPointer<vtkImageCast>::New();
+#if VTK_MAJOR_VERSION >= 6
+  targetCast->SetInputData(movedPhantom);
+#else
+  targetCast->SetInput(movedPhantom);
+#endif
+  targetCast->SetOutputScalarTypeToDouble();
+  targetCast->Update();
+  vtkImageData *target = targetCast->GetOutput();
+
+  vtkSmartPointer<vtkMatrix4x4> defaultMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  vtkSmartPointer<vtkMatrix4x4> singleMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+
+  printf("Phantom size %dx%dx%d (double), %d threads\n", n, n, n, threads);
+  printf("%-28s %-8s %10s %10s %8s %10s %10s %10s\n", "metric", "interp",
+         "double s", "single s", "speedup", "difference", "double err",
+         "single err");
+
+  for (int m = 0; MetricNames[m] != NULL; m++)
+    {
+    for (int i = 0; InterpolatorNames[i] != NULL; i++)
+      {
+      BenchmarkResult d = RunRegistration(
+        source, target, expected->GetMatrix(), MetricTypes[m],
+        InterpolatorTypes[i], vtkImageRegistration::DefaultPrecision,
+        threads, defaultMatrix);
+      BenchmarkResult s = RunRegistration(
+        source, target, expected->GetMatrix(), MetricTypes[m],
+        InterpolatorTypes[i], vtkImageRegistration::SinglePrecision,
+        threads, singleMatrix);
+
+      double difference = TransformError(defaultMatrix, singleMatrix, source);
+
+      printf("%-28s %-8s %10.3f %10.3f %7.2fx %10.4f %10.4f %10.4f\n",
+             MetricNames[m], InterpolatorNames[i], d.Seconds, s.Seconds,
+             (s.Seconds > 0 ? d.Seconds/s.Seconds : 0.0), difference,
+             d.Error, s.Error);
+      }
+    }
+
+  // the same phantoms, with offsets that are large compared to the
+  // contrast, which is what makes the float sums cancel
+  static const double offsets[] = { 0.0, 1e3, 1e4, 1e5, 1e6 };
+
+  printf("\nNormalizedCrossCorrelation, Linear, with an offset\n");
+  printf("%10s %12s %10s %10s %10s\n", "offset", "cost diff",
+         "difference", "double err", "single err");
+
+  for (size_t k = 0; k < sizeof(offsets)/sizeof(double); k++)
+    {
+    vtkSmartPointer<vtkImageData> offsetSource =
+      vtkSmartPointer<vtkImageData>::New();
+    OffsetImage(source, offsets[k], offsetSource);
+    vtkSmartPointer<vtkImageData> offsetTarget =
+      vtkSmartPointer<vtkImageData>::New();
+    OffsetImage(target, offsets[k], offsetTarget);
+
+    double costDifference = CostDifference(offsetSource, offsetTarget);
+
+    BenchmarkResult d = RunRegistration(
+      offsetSource, offsetTarget, expected->GetMatrix(),
+      vtkImageRegistration::NormalizedCrossCorrelation,
+      vtkImageRegistration::Linear, vtkImageRegistration::DefaultPrecision,
+      threads, defaultMatrix);
+    BenchmarkResult s = RunRegistration(
+      offsetSource, offsetTarget, expected->GetMatrix(),
+      vtkImageRegistration::NormalizedCrossCorrelation,
+      vtkImageRegistration::Linear, vtkImageRegistration::SinglePrecision,
+      threads, singleMatrix);
+
+    double difference = TransformError(defaultMatrix, singleMatrix, source);
+
+    printf("%10.0f %12.3g %10.4f %10.4f %10.4f\n", offsets[k],
+           costDifference, difference, d.Error, s.Error);
+    }
+
+  return 0;
+}
@@ -0,0 +1,168 @@
+/*=========================================================================
+
+Program:   Atamai Image Registration and Segmentation
+Module:    BenchmarkThreadPool.cxx
+
+   This software is distributed WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+=========================================================================*/
+
+// This benchmark measures the number of metric evaluations per second
+// when the metric is multithreaded with vtkMultiThreader, which creates
+// new threads for every evaluation, versus with vtkWorkerThreadPool,
+// which reuses its threads, and versus vtkSMPTools if it is available.
+// It is run at each of the image sizes of a four-level pyramid, since
+// the thread overhead matters most for the small, coarse levels.
+//
+// Usage: BenchmarkThreadPool [size [evaluations [threads]]]
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+#include <vtkTransform.h>
+#include <vtkTimerLog.h>
+#include <vtkMultiThreader.h>
+#include <vtkVersion.h>
+
+#include <vtkImageMutualInformation.h>
+#include <vtkImageSquaredDifference.h>
+#include <vtkWorkerThreadPool.h>
+
+#include "BenchmarkPhantom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if VTK_MAJOR_VERSION >= 7
+#define BENCHMARK_SMP
+#endif
+
+namespace {
+
+enum { MultiThreaderMode, ThreadPoolMode, SMPMode };
+
+//----------------------------------------------------------------------------
+// Evaluate the metric repeatedly, and return the evaluations per second.
+double RunMetric(
+  vtkImageSimilarityMetric *metric, vtkImageData *source,
+  vtkImageData *target, vtkWorkerThreadPool *pool, int mode,
+  int threads, int evaluations)
+{
+#if VTK_MAJOR_VERSION >= 6
+  metric->SetInputData(0, source);
+  metric->SetInputData(1, target);
+#else
+  metric->SetInput(0, source);
+  metric->SetInput(1, target);
+#endif
+  metric->SetNumberOfThreads(threads);
+  metric->SetThreadPool(mode == ThreadPoolMode ? pool : NULL);
+#ifdef BENCHMARK_SMP
+  metric->SetEnableSMP(mode == SMPMode);
+#endif
+
+  // do one evaluation before timing, to start the threads
+  metric->Update();
+
+  double startTime = vtkTimerLog::GetUniversalTime();
+  for (int i = 0; i < evaluations; i++)
+    {
+    metric->Modified();
+    metric->Update();
+    }
+  double elapsed = vtkTimerLog::GetUniversalTime() - startTime;
+
+  return (elapsed > 0 ? evaluations/elapsed : 0.0);
+}
+
+} // end anonymous namespace
+
+int main(int argc, char *argv[])
+{
+  int n = 128;
+  int evaluations = 500;
+  int threads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  if (argc > 1)
+    {
+    n = atoi(argv[1]);
+    }
+  if (argc > 2)
+    {
+    evaluations = atoi(argv[2]);
+    }
+  if (argc > 3)
+    {
+    threads = atoi(argv[3]);
+    }
+  if (n < 8 || evaluations < 1 || threads < 1)
+    {
+    fprintf(stderr, "Usage: %s [size [evaluations [threads]]]\n", argv[0]);
+    return 1;
+    }
+
+  vtkSmartPointer<vtkTransform> motion =
+    vtkSmartPointer<vtkTransform>::New();
+  motion->Translate(3.0, -2.0, 1.5);
+  motion->RotateWXYZ(5.0, 0.2, 0.3, 1.0);
+
+  vtkSmartPointer<vtkWorkerThreadPool> pool =
+    vtkSmartPointer<vtkWorkerThreadPool>::New();
+
+  vtkSmartPointer<vtkImageSquaredDifference> sd =
+    vtkSmartPointer<vtkImageSquaredDifference>::New();
+  vtkSmartPointer<vtkImageMutualInformation> mi =
+    vtkSmartPointer<vtkImageMutualInformation>::New();
+  double range[2] = { 0.0, 1000.0 };
+  mi->SetInputRange(0, range);
+  mi->SetInputRange(1, range);
+  vtkImageSimilarityMetric *metrics[2] = { sd, mi };
+  const char *metricNames[2] = { "SquaredDifference", "MutualInformation" };
+
+  printf("Using %d threads, %d evaluations per run\n", threads, evaluations);
+  printf("%-18s %6s %14s %14s %14s %8s\n", "metric", "size",
+         "threader ev/s", "pool ev/s", "smp ev/s", "speedup");
+
+  // the sizes of the levels of a four-level pyramid, coarsest first
+  for (int level = 3; level >= 0; level--)
+    {
+    int m = (n >> level);
+    if (m < 2)
+      {
+      continue;
+      }
+
+    int size[3] = { m, m, m };
+    double spacing[3];
+    spacing[0] = spacing[1] = spacing[2] = static_cast<double>(n)/m;
+
+    vtkSmartPointer<vtkImageData> source =
+      vtkSmartPointer<vtkImageData>::New();
+    MakeBenchmarkPhantom(source, size, spacing, NULL);
+
+    vtkSmartPointer<vtkImageData> target =
+      vtkSmartPointer<vtkImageData>::New();
+    MakeBenchmarkPhantom(target, size, spacing, motion->GetMatrix());
+
+    for (int k = 0; k < 2; k++)
+      {
+      vtkImageSimilarityMetric *metric = metrics[k];
+
+      double threaderRate = RunMetric(metric, source, target, pool,
+        MultiThreaderMode, threads, evaluations);
+      double poolRate = RunMetric(metric, source, target, pool,
+        ThreadPoolMode, threads, evaluations);
+      double smpRate = 0.0;
+#ifdef BENCHMARK_SMP
+      smpRate = RunMetric(metric, source, target, pool,
+        SMPMode, threads, evaluations);
+#endif
+
+      printf("%-18s %6d %14.1f %14.1f %14.1f %7.2fx\n",
+             metricNames[k], m, threaderRate, poolRate, smpRate,
+             (threaderRate > 0 ? poolRate/threaderRate : 0.0));
+      }
+    }
+
+  return 0;
+}
@@ -27,8 +27,6 @@ Module:    RigidImageRegistration.cxx
 #include <vtkSmartPointer.h>
 
 #include <vtkImageReslice.h>
-#include <vtkImageResize.h>
-#include <vtkImageSincInterpolator.h>
 #include <vtkImageData.h>
 #include <vtkPointData.h>
 #include <vtkMatrix4x4.h>
@@ -476,32 +474,6 @@ int main (int argc, char *argv[])
     minSpacing = sourceSpacing[2];
     }
 
-  // blur source image with Blackman-windowed sinc
-  vtkSmartPointer<vtkImageSincInterpolator> sourceBlurKernel =
-    vtkSmartPointer<vtkImageSincInterpolator>::New();
-  sourceBlurKernel->SetWindowFunctionToBlackman();
-
-  // reduce the source resolution
-  vtkSmartPointer<vtkImageResize> sourceBlur =
-    vtkSmartPointer<vtkImageResize>::New();
-  sourceBlur->SET_INPUT_DATA(sourceImage);
-  sourceBlur->SetResizeMethodToOutputSpacing();
-  sourceBlur->SetInterpolator(sourceBlurKernel);
-  sourceBlur->InterpolateOn();
-
-  // blur target with Blackman-windowed sinc
-  vtkSmartPointer<vtkImageSincInterpolator> targetBlurKernel =
-    vtkSmartPointer<vtkImageSincInterpolator>::New();
-  targetBlurKernel->SetWindowFunctionToBlackman();
-
-  // keep target at full resolution
-  vtkSmartPointer<vtkImageResize> targetBlur =
-    vtkSmartPointer<vtkImageResize>::New();
-  targetBlur->SET_INPUT_DATA(targetImage);
-  targetBlur->SetResizeMethodToOutputSpacing();
-  targetBlur->SetInterpolator(targetBlurKernel);
-  targetBlur->InterpolateOn();
-
   // get the initial transformation
   vtkSmartPointer<vtkMatrix4x4> matrix =
     vtkSmartPointer<vtkMatrix4x4>::New();
@@ -512,8 +484,8 @@ int main (int argc, char *argv[])
   // set up the registration
   vtkSmartPointer<vtkImageRegistration> registration =
     vtkSmartPointer<vtkImageRegistration>::New();
-  registration->SetTargetImageInputConnection(targetBlur->GetOutputPort());
-  registration->SetSourceImageInputConnection(sourceBlur->GetOutputPort());
+  registration->SetTargetImage(targetImage);
+  registration->SetSourceImage(sourceImage);
   registration->SetInitializerTypeToCentered();
   //registration->SetTransformDimensionalityTo2D();
   registration->SetTransformTypeToRigid();
@@ -529,6 +501,26 @@ int main (int argc, char *argv[])
   registration->SetTransformTolerance(transformTolerance);
   registration->SetMaximumNumberOfIterations(500);
 
+  // the registration starts at low-resolution, with two stages for
+  // each resolution: first without interpolation, and then with
+  // interpolation
+  int numberOfLevels = 0;
+  for (double f = initialBlurFactor; f > 0.9; f /= 2.0)
+    {
+    numberOfLevels += 2;
+    }
+  registration->SetNumberOfLevels(numberOfLevels);
+  double blurFactor = initialBlurFactor;
+  for (int level = 0; level < numberOfLevels; level += 2)
+    {
+    registration->SetLevelShrinkFactor(level, blurFactor);
+    registration->SetLevelInterpolatorType(
+      level, vtkImageRegistration::Nearest);
+    registration->SetLevelTransformTolerance(level, minSpacing*blurFactor);
+    registration->SetLevelShrinkFactor(level + 1, blurFactor);
+    blurFactor /= 2.0;
+    }
+
   // -------------------------------------------------------
   // make a timer
   vtkSmartPointer<vtkTimerLog> timer =
@@ -539,108 +531,32 @@ int main (int argc, char *argv[])
   // -------------------------------------------------------
   // do the registration
 
-  // the registration starts at low-resolution
-  double blurFactor = initialBlurFactor;
-  // two stages for each resolution:
-  // first without interpolation, and then with interpolation
-  int stage = 0;
-  // will be set to "true" when registration is initialized
-  bool initialized = false;
+  registration->InitializePyramid(matrix);
 
-  for (;;)
+  int level = 0;
+  bool running = true;
+  while (running)
     {
-    if (stage == 0)
-      {
-      registration->SetInterpolatorTypeToNearest();
-      registration->SetTransformTolerance(minSpacing*blurFactor);
-      }
-    else
-      {
-      registration->SetInterpolatorType(interpolatorType);
-      registration->SetTransformTolerance(transformTolerance*blurFactor);
-      }
-    if (blurFactor < 1.1)
-      {
-      // full resolution: no blurring or resampling
-      sourceBlur->SetInterpolator(0);
-      sourceBlur->InterpolateOff();
-      sourceBlur->SetOutputSpacing(sourceSpacing);
-      sourceBlur->Update();
-
-      targetBlur->SetInterpolator(0);
-      sourceBlur->InterpolateOff();
-      targetBlur->SetOutputSpacing(targetSpacing);
-      targetBlur->Update();
-      }
-    else
-      {
-      // reduced resolution: set the blurring
-      double spacing[3];
-      for (int j = 0; j < 3; j++)
-        {
-        spacing[j] = blurFactor*minSpacing;
-        if (spacing[j] < sourceSpacing[j])
-          {
-          spacing[j] = sourceSpacing[j];
-          }
-        }
-
-      sourceBlurKernel->SetBlurFactors(
-        spacing[0]/sourceSpacing[0],
-        spacing[1]/sourceSpacing[1],
-        spacing[2]/sourceSpacing[2]);
-
-      sourceBlur->SetOutputSpacing(spacing);
-      sourceBlur->Update();
-
-      targetBlurKernel->SetBlurFactors(
-        blurFactor*minSpacing/targetSpacing[0],
-        blurFactor*minSpacing/targetSpacing[1],
-        blurFactor*minSpacing/targetSpacing[2]);
-
-      targetBlur->Update();
-      }
+    // will iterate until the final level converges or fails
+    running = (registration->IteratePyramid() != 0);
 
-    if (initialized)
+    vtkMatrix4x4::Multiply4x4(
+      targetMatrix,registration->GetTransform()->GetMatrix(),sourceMatrix);
+    sourceMatrix->Modified();
+    if (display)
       {
-      // re-initialize with the matrix from the previous step
-      registration->SetInitializerTypeToNone();
-      matrix->DeepCopy(registration->GetTransform()->GetMatrix());
+      interactor->Render();
       }
 
-    registration->Initialize(matrix);
-
-    initialized = true;
-
-    while (registration->Iterate())
-      {
-      // registration->UpdateRegistration();
-      // will iterate until convergence or failure
-      vtkMatrix4x4::Multiply4x4(
-        targetMatrix,registration->GetTransform()->GetMatrix(),sourceMatrix);
-      sourceMatrix->Modified();
-      if (display)
-        {
-        interactor->Render();
-        }
-      }
-
-    double newTime = timer->GetUniversalTime();
-    cout << "blur " << blurFactor << " stage " << stage << " took "
-         << (newTime - lastTime) << "s and "
-         << registration->GetNumberOfEvaluations() << " evaluations" << endl;
-    lastTime = newTime;
-
-    // prepare for next iteration
-    if (stage == 1)
+    for (; level < registration->GetCurrentLevel(); level++)
       {
-      blurFactor /= 2.0;
-      if (blurFactor < 0.9)
-        {
-        break;
-        }
+      cout << "blur " << registration->GetLevelShrinkFactor(level)
+           << " stage " << (level % 2) << " took "
+           << registration->GetLevelElapsedTime(level) << "s and "
+           << registration->GetLevelNumberOfEvaluations(level)
+           << " evaluations" << endl;
+      lastTime = timer->GetUniversalTime();
       }
-    stage = (stage + 1) % 2;
     }
 
   cout << "registration took " << (lastTime - startTime) << "s" << endl;
@@ -0,0 +1,386 @@
+/*=========================================================================
+
+  Program:   Visualization Toolkit
+  Module:    vtkCalcCentroid.cxx
+  Thanks:    Thanks to Yves who developed this class.
+
+Copyright (c) 1993-2000 Ken Martin, Will Schroeder, Bill Lorensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+ * Neither name of Ken Martin, Will Schroeder, or Bill Lorensen nor the names
+   of any contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+ * Modified source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=========================================================================*/
+#include "vtkCalcCentroid.h"
+#include "vtkWorkerThreadPool.h"
+
+#include <vtkObjectFactory.h>
+#include <vtkImageData.h>
+#include <vtkImageStencilData.h>
+#include <vtkMath.h>
+#include <vtkTemplateAliasMacro.h>
+
+#include <vector>
+
+vtkStandardNewMacro(vtkCalcCentroid);
+
+vtkCxxSetObjectMacro(vtkCalcCentroid, Input, vtkImageData);
+vtkCxxSetObjectMacro(vtkCalcCentroid, Stencil, vtkImageStencilData);
+vtkCxxSetObjectMacro(vtkCalcCentroid, ThreadPool, vtkWorkerThreadPool);
+
+//--------------------------------------------------------------------------
+// Constructs with initial 0 values.
+vtkCalcCentroid::vtkCalcCentroid()
+{
+  this->Input = NULL;
+  this->Stencil = NULL;
+  this->ThreadPool = NULL;
+  this->IntensityRange[0] = 0.0;
+  this->IntensityRange[1] = VTK_DOUBLE_MAX;
+  for (int i = 0; i < 3; i++)
+    {
+    this->Centroid[i] = 0.0;
+    this->PrincipalMoments[i] = 0.0;
+    }
+  for (int i = 0; i < 9; i++)
+    {
+    this->CovarianceMatrix[i] = 0.0;
+    this->PrincipalAxes[i] = (i % 4 == 0 ? 1.0 : 0.0);
+    }
+}
+
+//--------------------------------------------------------------------------
+vtkCalcCentroid::~vtkCalcCentroid()
+{
+  this->SetInput(NULL);
+  this->SetStencil(NULL);
+  this->SetThreadPool(NULL);
+}
+
+//--------------------------------------------------------------------------
+namespace {
+
+// The number of sums: weight, three first moments, six second moments
+const int vtkCalcCentroidNumberOfSums = 10;
+
+struct vtkCalcCentroidThreadData
+{
+  vtkImageData *Input;
+  vtkImageStencilData *Stencil;
+  double IntensityRange[2];
+  double Center[3];
+  std::vector<double> Sums;
+};
+
+//--------------------------------------------------------------------------
+// Gather the sums for a share of the rows of the image.  The coordinates
+// are relative to the image center, to reduce roundoff error.
+template <class T>
+void vtkCalcCentroidExecute(
+  vtkCalcCentroidThreadData *data, const T *inPtr,
+  int threadId, int numberOfThreads)
+{
+  vtkImageData *input = data->Input;
+  vtkImageStencilData *stencil = data->Stencil;
+  double origin[3];
+  double spacing[3];
+  int extent[6];
+  vtkIdType inc[3];
+  input->GetOrigin(origin);
+  input->GetSpacing(spacing);
+  input->GetExtent(extent);
+  input->GetIncrements(inc);
+
+  double low = data->IntensityRange[0];
+  double high = data->IntensityRange[1] - low;
+  const double *center = data->Center;
+
+  vtkIdType ny = extent[3] - extent[2] + 1;
+  vtkIdType nz = extent[5] - extent[4] + 1;
+  vtkIdType rowBegin = ny*nz*threadId/numberOfThreads;
+  vtkIdType rowEnd = ny*nz*(threadId + 1)/numberOfThreads;
+
+  double s[vtkCalcCentroidNumberOfSums];
+  for (int i = 0; i < vtkCalcCentroidNumberOfSums; i++)
+    {
+    s[i] = 0.0;
+    }
+
+  for (vtkIdType row = rowBegin; row < rowEnd; row++)
+    {
+    int idY = extent[2] + static_cast<int>(row % ny);
+    int idZ = extent[4] + static_cast<int>(row / ny);
+    double y = origin[1] + idY*spacing[1] - center[1];
+    double z = origin[2] + idZ*spacing[2] - center[2];
+
+    // the sums along the row, which are later multiplied by y and z
+    double sw = 0.0;
+    double swx = 0.0;
+    double swxx = 0.0;
+
+    int iter = 0;
+    int r1 = extent[0];
+    int r2 = extent[1];
+    while (stencil ?
+           stencil->GetNextExtent(
+             r1, r2, extent[0], extent[1], idY, idZ, iter) :
+           (iter++ == 0))
+      {
+      const T *ptr = inPtr + (r1 - extent[0])*inc[0] +
+        (idY - extent[2])*inc[1] + (idZ - extent[4])*inc[2];
+      for (int idX = r1; idX <= r2; idX++)
+        {
+        double w = *ptr - low;
+        ptr += inc[0];
+        if (w > 0)
+          {
+          w = (w < high ? w : high);
+          double x = origin[0] + idX*spacing[0] - center[0];
+          sw += w;
+          swx += w*x;
+          swxx += w*x*x;
+          }
+        }
+      }
+
+    s[0] += sw;
+    s[1] += swx;
+    s[2] += sw*y;
+    s[3] += sw*z;
+    s[4] += swxx;
+    s[5] += swx*y;
+    s[6] += swx*z;
+    s[7] += sw*y*y;
+    s[8] += sw*y*z;
+    s[9] += sw*z*z;
+    }
+
+  double *sums = &data->Sums[vtkCalcCentroidNumberOfSums*threadId];
+  for (int i = 0; i < vtkCalcCentroidNumberOfSums; i++)
+    {
+    sums[i] = s[i];
+    }
+}
+
+//--------------------------------------------------------------------------
+void vtkCalcCentroidThreadFunction(
+  void *arg, int threadId, int numberOfThreads)
+{
+  vtkCalcCentroidThreadData *data =
+    static_cast<vtkCalcCentroidThreadData *>(arg);
+  vtkImageData *input = data->Input;
+  void *inPtr = input->GetScalarPointer();
+
+  switch (input->GetScalarType())
+    {
+    vtkTemplateAliasMacro(
+      vtkCalcCentroidExecute(
+        data, static_cast<const VTK_TT *>(inPtr),
+        threadId, numberOfThreads));
+    default:
+      break;
+    }
+}
+
+} // end anonymous namespace
+
+//--------------------------------------------------------------------------
+int vtkCalcCentroid::ComputeMoments()
+{
+  // make sure input is available
+  if (!this->Input || !this->Input->GetScalarPointer())
+    {
+    vtkErrorMacro("ComputeMoments: No input...can't execute!");
+    return 0;
+    }
+
+  double bounds[6];
+  this->Input->GetBounds(bounds);
+
+  vtkCalcCentroidThreadData data;
+  data.Input = this->Input;
+  data.Stencil = this->Stencil;
+  data.IntensityRange[0] = this->IntensityRange[0];
+  data.IntensityRange[1] = this->IntensityRange[1];
+  data.Center[0] = 0.5*(bounds[0] + bounds[1]);
+  data.Center[1] = 0.5*(bounds[2] + bounds[3]);
+  data.Center[2] = 0.5*(bounds[4] + bounds[5]);
+
+  int numberOfThreads = 1;
+  if (this->ThreadPool)
+    {
+    numberOfThreads = this->ThreadPool->GetNumberOfThreads();
+    }
+  data.Sums.assign(vtkCalcCentroidNumberOfSums*numberOfThreads, 0.0);
+
+  if (this->ThreadPool)
+    {
+    this->ThreadPool->Execute(vtkCalcCentroidThreadFunction, &data);
+    }
+  else
+    {
+    vtkCalcCentroidThreadFunction(&data, 0, 1);
+    }
+
+  double s[vtkCalcCentroidNumberOfSums];
+  for (int i = 0; i < vtkCalcCentroidNumberOfSums; i++)
+    {
+    s[i] = 0.0;
+    for (int j = 0; j < numberOfThreads; j++)
+      {
+      s[i] += data.Sums[vtkCalcCentroidNumberOfSums*j + i];
+      }
+    }
+
+  this->ComputeTime.Modified();
+
+  double w = s[0];
+  if (w <= 0)
+    {
+    for (int i = 0; i < 3; i++)
+      {
+      this->Centroid[i] = data.Center[i];
+      this->PrincipalMoments[i] = 0.0;
+      }
+    for (int i = 0; i < 9; i++)
+      {
+      this->CovarianceMatrix[i] = 0.0;
+      this->PrincipalAxes[i] = (i % 4 == 0 ? 1.0 : 0.0);
+      }
+    return 0;
+    }
+
+  double m[3];
+  m[0] = s[1]/w;
+  m[1] = s[2]/w;
+  m[2] = s[3]/w;
+
+  // the second moments, in the order xx, xy, xz, yy, yz, zz
+  static const int row[6] = { 0, 0, 0, 1, 1, 2 };
+  static const int col[6] = { 0, 1, 2, 1, 2, 2 };
+  double *covar = this->CovarianceMatrix;
+  for (int k = 0; k < 6; k++)
+    {
+    double c = s[4 + k]/w - m[row[k]]*m[col[k]];
+    covar[3*row[k] + col[k]] = c;
+    covar[3*col[k] + row[k]] = c;
+    }
+
+  for (int i = 0; i < 3; i++)
+    {
+    this->Centroid[i] = data.Center[i] + m[i];
+    }
+
+  // the eigenvectors are the columns of v, sorted by eigenvalue
+  double a[3][3];
+  double v[3][3];
+  double *aptr[3] = { a[0], a[1], a[2] };
+  double *vptr[3] = { v[0], v[1], v[2] };
+  for (int i = 0; i < 3; i++)
+    {
+    for (int j = 0; j < 3; j++)
+      {
+      a[i][j] = covar[3*i + j];
+      }
+    }
+  vtkMath::Jacobi(aptr, this->PrincipalMoments, vptr);
+  for (int i = 0; i < 3; i++)
+    {
+    for (int j = 0; j < 3; j++)
+      {
+      this->PrincipalAxes[3*i + j] = v[j][i];
+      }
+    }
+
+  return 1;
+}
+
+//--------------------------------------------------------------------------
+void vtkCalcCentroid::UpdateMoments()
+{
+  vtkMTimeType mtime = this->GetMTime();
+  if (this->Input && this->Input->GetMTime() > mtime)
+    {
+    mtime = this->Input->GetMTime();
+    }
+  if (this->Stencil && this->Stencil->GetMTime() > mtime)
+    {
+    mtime = this->Stencil->GetMTime();
+    }
+  if (mtime > this->ComputeTime.GetMTime())
+    {
+    this->ComputeMoments();
+    }
+}
+
+//--------------------------------------------------------------------------
+double *vtkCalcCentroid::GetCentroid()
+{
+  this->UpdateMoments();
+  return this->Centroid;
+}
+
+//--------------------------------------------------------------------------
+double *vtkCalcCentroid::GetCovarianceMatrix()
+{
+  this->UpdateMoments();
+  return this->CovarianceMatrix;
+}
+
+//--------------------------------------------------------------------------
+double *vtkCalcCentroid::GetPrincipalAxes()
+{
+  this->UpdateMoments();
+  return this->PrincipalAxes;
+}
+
+//--------------------------------------------------------------------------
+double *vtkCalcCentroid::GetPrincipalMoments()
+{
+  this->UpdateMoments();
+  return this->PrincipalMoments;
+}
+
+//--------------------------------------------------------------------------
+void vtkCalcCentroid::PrintSelf(ostream& os, vtkIndent indent)
+{
+  double *mat = this->CovarianceMatrix;
+  this->Superclass::PrintSelf(os,indent);
+
+  os << indent << "Input: " << this->Input << "\n";
+  os << indent << "Stencil: " << this->Stencil << "\n";
+  os << indent << "ThreadPool: " << this->ThreadPool << "\n";
+  os << indent << "IntensityRange: " << this->IntensityRange[0] << " "
+     << this->IntensityRange[1] << "\n";
+  os << indent << "Centroid: [" << this->Centroid[0] << "," <<
+    this->Centroid[1] << "," << this->Centroid[2] << "]\n";
+  os << indent << "Covariance Matrix:\n"
+     << indent << "[" << mat[0] << "," << mat[1] << "," << mat[2] << "]\n"
+     << indent << "[" << mat[3] << "," << mat[4] << "," << mat[5] << "]\n"
+     << indent << "[" << mat[6] << "," << mat[7] << "," << mat[8] << "]\n";
+}
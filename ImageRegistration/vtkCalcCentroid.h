@@ -0,0 +1,137 @@
+/*=========================================================================
+
+  Program:   Visualization Toolkit
+  Module:    vtkCalcCentroid.h
+  Thanks:    Thanks to Yves who developed this class.
+
+Copyright (c) 1993-2000 Ken Martin, Will Schroeder, Bill Lorensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+ * Neither name of Ken Martin, Will Schroeder, or Bill Lorensen nor the names
+   of any contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+ * Modified source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=========================================================================*/
+// .NAME vtkCalcCentroid - compute the centroid and principal axes of an image
+// .SECTION Description
+// vtkCalcCentroid computes the intensity-weighted centre of gravity of
+// vtkImageData, and the covariance matrix of the intensity about the
+// centroid, both in world coordinates.  All of the moments are gathered
+// in a single pass over the image, and the pass can be split between the
+// threads of a vtkWorkerThreadPool.  The principal axes are the
+// eigenvectors of the covariance matrix.  Only the first component of
+// the image is used.
+
+#ifndef vtkCalcCentroid_h
+#define vtkCalcCentroid_h
+
+#include "vtkObject.h"
+
+class vtkImageData;
+class vtkImageStencilData;
+class vtkWorkerThreadPool;
+
+class VTK_EXPORT vtkCalcCentroid : public vtkObject
+{
+public:
+  vtkTypeMacro(vtkCalcCentroid, vtkObject);
+  static vtkCalcCentroid *New();
+
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  // Description:
+  // Set the image to compute the moments for.
+  void SetInput(vtkImageData *input);
+  vtkGetObjectMacro(Input, vtkImageData);
+
+  // Description:
+  // Set a stencil to limit the computation to a region of the image.
+  void SetStencil(vtkImageStencilData *stencil);
+  vtkGetObjectMacro(Stencil, vtkImageStencilData);
+
+  // Description:
+  // Set the range of intensities that are used as weights.  The weight
+  // of each voxel is its intensity minus the minimum of the range, and
+  // is clamped to the size of the range.  Voxels at or below the minimum
+  // are ignored.  The default range is [0, VTK_DOUBLE_MAX].
+  vtkSetVector2Macro(IntensityRange, double);
+  vtkGetVector2Macro(IntensityRange, double);
+
+  // Description:
+  // Set a thread pool to use for the computation.  If no thread pool is
+  // set, then the computation is done in the calling thread.
+  void SetThreadPool(vtkWorkerThreadPool *pool);
+  vtkGetObjectMacro(ThreadPool, vtkWorkerThreadPool);
+
+  // Description:
+  // Compute the moments.  This is called automatically by the methods
+  // below if the input or the settings have changed.  The return value
+  // is zero if the image has no voxels with a positive weight.
+  int ComputeMoments();
+
+  // Description:
+  // Get the centroid, in world coordinates.
+  double *GetCentroid();
+
+  // Description:
+  // Get the covariance matrix, as nine values in row-major order.
+  double *GetCovarianceMatrix();
+
+  // Description:
+  // Get the principal axes, as the rows of a 3x3 matrix in row-major
+  // order, sorted from largest to smallest variance.  The axes are unit
+  // vectors but their signs are arbitrary.
+  double *GetPrincipalAxes();
+
+  // Description:
+  // Get the variance along each of the principal axes.
+  double *GetPrincipalMoments();
+
+protected:
+  vtkCalcCentroid();
+  ~vtkCalcCentroid();
+
+  // Description:
+  // Compute the moments if anything has changed since the last time.
+  void UpdateMoments();
+
+  double Centroid[3];
+  double CovarianceMatrix[9];
+  double PrincipalAxes[9];
+  double PrincipalMoments[3];
+  double IntensityRange[2];
+  vtkImageData *Input;
+  vtkImageStencilData *Stencil;
+  vtkWorkerThreadPool *ThreadPool;
+  vtkTimeStamp ComputeTime;
+
+private:
+  vtkCalcCentroid(const vtkCalcCentroid&); // Not implemented.
+  void operator=(const vtkCalcCentroid&); // Not implemented.
+};
+
+#endif
@@ -20,6 +20,9 @@ vtkFunctionMinimizer::vtkFunctionMinimizer()
   this->Function = NULL;
   this->FunctionArg = NULL;
   this->FunctionArgDelete = NULL;
+  this->BatchFunction = NULL;
+  this->LineSearchFunction = NULL;
+  this->MinimumConcurrentBatch = 1;
 
   this->NumberOfParameters = 0;
   this->ParameterNames = NULL;
@@ -46,6 +49,8 @@ vtkFunctionMinimizer::~vtkFunctionMinimizer()
   this->FunctionArg = NULL;
   this->FunctionArgDelete = NULL;
   this->Function = NULL;
+  this->BatchFunction = NULL;
+  this->LineSearchFunction = NULL;
 
   if (this->ParameterNames)
     {
@@ -119,6 +124,8 @@ void vtkFunctionMinimizer::PrintSelf(ostream& os, vtkIndent indent)
   os << indent << "FunctionEvaluations: " << this->GetFunctionEvaluations()
      << "\n";
   os << indent << "Iterations: " << this->GetIterations() << "\n";
+  os << indent << "MinimumConcurrentBatch: "
+     << this->MinimumConcurrentBatch << "\n";
   os << indent << "MaxIterations: " << this->GetMaxIterations() << "\n";
   os << indent << "Tolerance: " << this->GetTolerance() << "\n";
   os << indent << "ParameterTolerance: " << this->GetParameterTolerance() << "\n";
@@ -151,6 +158,38 @@ void vtkFunctionMinimizer::SetFunctionArgDelete(void (*f)(void *))
     }
 }
 
+//----------------------------------------------------------------------------
+void vtkFunctionMinimizer::SetBatchFunction(
+  void (*f)(void *, const double *, int, double *))
+{
+  if (f != this->BatchFunction)
+    {
+    this->BatchFunction = f;
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkFunctionMinimizer::SetLineSearchFunction(
+  void (*f)(void *, const double *, const double *))
+{
+  if (f != this->LineSearchFunction)
+    {
+    this->LineSearchFunction = f;
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkFunctionMinimizer::StartLineSearch(
+  const double *p0, const double *v)
+{
+  if (this->LineSearchFunction)
+    {
+    this->LineSearchFunction(this->FunctionArg, p0, v);
+    }
+}
+
 //----------------------------------------------------------------------------
 double vtkFunctionMinimizer::GetParameterValue(const char *name)
 {
@@ -324,6 +363,50 @@ void vtkFunctionMinimizer::EvaluateFunction()
     }
 }
 
+//----------------------------------------------------------------------------
+void vtkFunctionMinimizer::EvaluateBatch(
+  const double *params, int count, double *costs)
+{
+  if (count <= 0)
+    {
+    return;
+    }
+
+  if (this->AbortFlag)
+    {
+    for (int k = 0; k < count; k++)
+      {
+      costs[k] = this->FunctionValue;
+      }
+    return;
+    }
+
+  if (this->BatchFunction)
+    {
+    this->BatchFunction(this->FunctionArg, params, count, costs);
+    this->FunctionEvaluations += count;
+    return;
+    }
+
+  // evaluate the points one at a time, and then restore the current point
+  int n = this->NumberOfParameters;
+  double *p = this->ParameterValues;
+  double *psave = new double[n];
+  double ysave = this->FunctionValue;
+  for (int i = 0; i < n; i++) { psave[i] = p[i]; }
+
+  for (int k = 0; k < count; k++)
+    {
+    for (int i = 0; i < n; i++) { p[i] = params[k*n + i]; }
+    this->EvaluateFunction();
+    costs[k] = this->FunctionValue;
+    }
+
+  for (int i = 0; i < n; i++) { p[i] = psave[i]; }
+  this->FunctionValue = ysave;
+  delete [] psave;
+}
+
 //----------------------------------------------------------------------------
 int vtkFunctionMinimizer::Iterate()
 {
@@ -370,7 +453,7 @@ void vtkFunctionMinimizer::Minimize()
   for (; this->Iterations < this->MaxIterations; this->Iterations++)
     {
     int stillgood = this->Step();
-    if (!stillgood)
+    if (!stillgood || this->AbortFlag)
       {
       break;
       }
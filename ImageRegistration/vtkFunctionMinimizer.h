@@ -41,6 +41,43 @@ public:
   // Set a function to call when a void* argument is being discarded.
   void SetFunctionArgDelete(void (*f)(void *));
 
+  // Description:
+  // Specify a function that evaluates several points at once, so that
+  // the points can be evaluated concurrently.  It is called with the same
+  // argument as the function given to SetFunction(), with "count"
+  // parameter vectors packed one after the other into "params", and it
+  // must store the "count" results into "costs".  It must not change the
+  // current parameter values or the current function value.  Minimizers
+  // use this for points that they can choose before any of them have been
+  // evaluated.  If no batch function is set, the points are evaluated one
+  // at a time by calling the function.
+  void SetBatchFunction(
+    void (*f)(void *arg, const double *params, int count, double *costs));
+
+  // Description:
+  // Set the smallest batch that the batch function evaluates concurrently.
+  // Smaller batches are evaluated one point at a time, so a minimizer that
+  // would evaluate extra points in order to make a batch should only do
+  // so if the batch is at least this large.  The default is 1, meaning
+  // that every batch is evaluated concurrently.  If no batch function is
+  // set, then the Get method returns VTK_INT_MAX.
+  vtkSetMacro(MinimumConcurrentBatch, int);
+  int GetMinimumConcurrentBatch() {
+    return (this->BatchFunction ? this->MinimumConcurrentBatch :
+                                  VTK_INT_MAX); }
+
+  // Description:
+  // Specify a function to call when a line search begins.  It is called
+  // with the same argument as the function given to SetFunction(), with
+  // the start point "p0" and the direction "v" of the line, so that the
+  // function can prepare for evaluations at points p0 + t*v.  Points that
+  // are not on the line may still be evaluated during the search.  When
+  // the line searches are finished, it is called with NULL for "p0" and
+  // "v".  Only minimizers that do line searches along fixed directions,
+  // such as vtkPowellMinimizer, call this function.
+  void SetLineSearchFunction(
+    void (*f)(void *arg, const double *p0, const double *v));
+
   // Description:
   // Set the initial value for the specified parameter.  Calling
   // this function for any parameter will reset the Iterations
@@ -140,10 +177,21 @@ public:
   // minimization code, but it is provided here as a public method.
   void EvaluateFunction();
 
+  // Description:
+  // Evaluate the function at several points, with the parameter vectors
+  // packed one after the other in "params".  The current parameter values
+  // and function value are not changed.  This is usually called internally
+  // by the minimization code, but it is provided here as a public method.
+  void EvaluateBatch(const double *params, int count, double *costs);
+
 protected:
   vtkFunctionMinimizer();
   ~vtkFunctionMinimizer();
 
+  // Description:
+  // Call the line search function, if one was set.
+  void StartLineSearch(const double *p0, const double *v);
+
   // Description:
   // Ask subclass to begin a new minimization.
   virtual void Start() = 0;
@@ -154,7 +202,10 @@ protected:
 
   void (*Function)(void *);
   void (*FunctionArgDelete)(void *);
+  void (*BatchFunction)(void *, const double *, int, double *);
+  void (*LineSearchFunction)(void *, const double *, const double *);
   void *FunctionArg;
+  int MinimumConcurrentBatch;
 
   int NumberOfParameters;
   char **ParameterNames;
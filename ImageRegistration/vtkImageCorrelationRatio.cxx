@@ -47,6 +47,13 @@ class vtkImageCorrelationRatioTLS
 {
 };
 
+//----------------------------------------------------------------------------
+// The partial sums that persist between executions.
+class vtkImageCorrelationRatioArena
+  : public vtkImageSimilarityMetricArena<double>
+{
+};
+
 //----------------------------------------------------------------------------
 // Constructor sets default values
 vtkImageCorrelationRatio::vtkImageCorrelationRatio()
@@ -55,12 +62,24 @@ vtkImageCorrelationRatio::vtkImageCorrelationRatio()
   this->BinOrigin = 0.0;
   this->BinSpacing = 1.0;
 
-  this->ThreadData = 0;
+  this->ThreadData = new vtkImageCorrelationRatioTLS;
+  this->Arena = new vtkImageCorrelationRatioArena;
+
+  this->SupportsSampleList = true;
 }
 
 //----------------------------------------------------------------------------
 vtkImageCorrelationRatio::~vtkImageCorrelationRatio()
 {
+  delete this->ThreadData;
+  delete this->Arena;
+}
+
+//----------------------------------------------------------------------------
+vtkTypeUInt64 vtkImageCorrelationRatio::GetNumberOfAllocations()
+{
+  return (this->Superclass::GetNumberOfAllocations() +
+          this->Arena->GetNumberOfAllocations());
 }
 
 //----------------------------------------------------------------------------
@@ -186,6 +205,71 @@ void vtkImageCorrelationRatioExecuteInt(
     }
 }
 
+//----------------------------------------------------------------------------
+// Accumulate the partial sums when the target is interpolated directly,
+// see vtkImageSimilarityMetricFusedExecute().
+class vtkImageCorrelationRatioFunctor
+{
+public:
+  vtkImageCorrelationRatioFunctor(
+    double *outPtr, int numBins, double binOrigin, double binSpacing)
+    : OutPtr(outPtr), MaxBin(numBins - 1),
+      Shift(-binOrigin), Scale(1.0/binSpacing) {}
+
+  void operator()(double x, double y)
+  {
+    x += this->Shift;
+    x *= this->Scale;
+
+    x = (x > 0.0 ? x : 0.0);
+    x = (x < this->MaxBin ? x : this->MaxBin);
+
+    int xi = static_cast<int>(x + 0.5);
+    double *outPtr1 = this->OutPtr + 3*xi;
+    outPtr1[0]++;
+    outPtr1[1] += y;
+    outPtr1[2] += y*y;
+  }
+
+private:
+  double *OutPtr;
+  double MaxBin;
+  double Shift;
+  double Scale;
+};
+
+//----------------------------------------------------------------------------
+// Same as above, but with integer binning for integer source images.
+class vtkImageCorrelationRatioIntFunctor
+{
+public:
+  vtkImageCorrelationRatioIntFunctor(
+    double *outPtr, int numBins, int binOrigin, int binSpacing)
+    : OutPtr(outPtr), MaxBin(numBins - 1),
+      BinOrigin(binOrigin), BinSpacing(binSpacing) {}
+
+  void operator()(double x, double y)
+  {
+    int xi = static_cast<int>(x);
+
+    xi -= this->BinOrigin;
+    xi /= this->BinSpacing;
+    xi = (xi > 0 ? xi : 0);
+    xi = (xi < this->MaxBin ? xi : this->MaxBin);
+
+    double *outPtr1 = this->OutPtr + 3*xi;
+    outPtr1[0]++;
+    outPtr1[1] += y;
+    outPtr1[2] += y*y;
+  }
+
+private:
+  double *OutPtr;
+  int MaxBin;
+  int BinOrigin;
+  int BinSpacing;
+};
+
 } // end anonymous namespace
 
 
@@ -231,14 +315,19 @@ int vtkImageCorrelationRatio::RequestData(
     this->BinSpacing = (l + this->NumberOfBins)/this->NumberOfBins;
     }
 
-  // create the thread-local object
-  vtkImageCorrelationRatioTLS tlocal;
-  tlocal.Initialize(this);
-  this->ThreadData = &tlocal;
+  // the partial sums are kept between executions, unless their size changes
+  this->Arena->SetBufferSize(3*this->NumberOfBins);
+
+  // reset the thread-local objects, which are kept between executions
+  if (this->ThreadData->Initialize(this))
+    {
+    this->NumberOfAllocations++;
+    }
 
   this->Superclass::RequestData(request, inputVector, outputVector);
 
-  this->ThreadData = 0;
+  // the partial sums were cleared by ReduceRequestData()
+  this->Arena->ReleaseAll();
 
   return 1;
 }
@@ -330,13 +419,10 @@ void vtkImageCorrelationRatio::PieceRequestData(
 
   if (outPtr == 0)
     {
-    // initialize the partial sums to zero
-    vtkIdType outCount = 3*this->NumberOfBins;
-    threadLocal->Data = new double[outCount];
+    // get cleared partial sums from the arena
+    threadLocal->Data = this->Arena->Acquire(
+      this->GetAccumulatorSlot(pieceId));
     outPtr = threadLocal->Data;
-
-    double *outPtr1 = outPtr;
-    do { *outPtr1++ = 0; } while (--outCount > 0);
     }
 
   vtkInformation *inInfo0 = inputVector[0]->GetInformationObject(0);
@@ -349,7 +435,6 @@ void vtkImageCorrelationRatio::PieceRequestData(
 
   int *ext = const_cast<int *>(extent);
   void *inPtr0 = inData0->GetScalarPointerForExtent(ext);
-  void *inPtr1 = inData1->GetScalarPointerForExtent(ext);
 
   vtkImageStencilData *stencil = this->GetStencil();
 
@@ -357,6 +442,70 @@ void vtkImageCorrelationRatio::PieceRequestData(
   double binSpacing = this->BinSpacing;
   int numBins = this->NumberOfBins;
 
+  if (this->Interpolator)
+    {
+    // interpolate the target directly, instead of using a resampled target
+    vtkAlgorithm *progress = ((pieceId == 0) ? this : NULL);
+    vtkImageSimilarityMetricSampleList *samples = this->GetSampleList();
+    vtkIdType range[2] = { 0, 0 };
+    if (samples)
+      {
+      this->GetSampleRange(pieceId, range);
+      }
+
+    if (inData0->GetScalarType() != VTK_FLOAT &&
+        inData0->GetScalarType() != VTK_DOUBLE)
+      {
+      vtkImageCorrelationRatioIntFunctor functor(
+        outPtr, numBins,
+        static_cast<int>(binOrigin), static_cast<int>(binSpacing));
+
+      if (samples)
+        {
+        vtkImageSimilarityMetricSampleExecute(
+          samples, range, this->Interpolator, this->IndexMatrix, functor);
+        return;
+        }
+
+      switch (inData0->GetScalarType())
+        {
+        vtkTemplateAliasMacro(
+          vtkImageSimilarityMetricFusedExecute(
+            progress, inData0, static_cast<VTK_TT *>(inPtr0), stencil,
+            this->Interpolator, this->IndexMatrix, extent, functor,
+            this->GetLine(), this->GetLineStep()));
+        default:
+          vtkErrorMacro(<< "Execute: Unknown ScalarType");
+        }
+      }
+    else
+      {
+      vtkImageCorrelationRatioFunctor functor(
+        outPtr, numBins, binOrigin, binSpacing);
+
+      if (samples)
+        {
+        vtkImageSimilarityMetricSampleExecute(
+          samples, range, this->Interpolator, this->IndexMatrix, functor);
+        return;
+        }
+
+      switch (inData0->GetScalarType())
+        {
+        vtkTemplateAliasMacro(
+          vtkImageSimilarityMetricFusedExecute(
+            progress, inData0, static_cast<VTK_TT *>(inPtr0), stencil,
+            this->Interpolator, this->IndexMatrix, extent, functor,
+            this->GetLine(), this->GetLineStep()));
+        default:
+          vtkErrorMacro(<< "Execute: Unknown ScalarType");
+        }
+      }
+    return;
+    }
+
+  void *inPtr1 = inData1->GetScalarPointerForExtent(ext);
+
   if (inData0->GetScalarType() != VTK_FLOAT &&
       inData0->GetScalarType() != VTK_DOUBLE)
     {
@@ -413,10 +562,14 @@ void vtkImageCorrelationRatio::ReduceRequestData(
       {
       if (iter->Data)
         {
+        // read the sums, and clear them for the next execution
         double *outPtr1 = iter->Data + 3*ix;
         ni += outPtr1[0];
         yi += outPtr1[1];
         yyi += outPtr1[2];
+        outPtr1[0] = 0;
+        outPtr1[1] = 0;
+        outPtr1[2] = 0;
         }
       }
 
@@ -446,14 +599,6 @@ void vtkImageCorrelationRatio::ReduceRequestData(
     correlationRatio = 1.0 - viSum/v;
     }
 
-  for (vtkImageCorrelationRatioTLS::iterator
-       iter = this->ThreadData->begin();
-       iter != this->ThreadData->end(); ++iter)
-    {
-    // delete the temporary memory
-    delete [] iter->Data;
-    }
-
   // output values
   this->SetValue(correlationRatio);
   this->SetCost(-correlationRatio);
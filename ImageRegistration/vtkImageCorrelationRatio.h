@@ -38,6 +38,7 @@
 #include "vtkImageSimilarityMetric.h"
 
 class vtkImageCorrelationRatioTLS;
+class vtkImageCorrelationRatioArena;
 
 class VTK_EXPORT vtkImageCorrelationRatio : public vtkImageSimilarityMetric
 {
@@ -53,6 +54,13 @@ public:
   void SetDataRange(const double range[2]) {
     this->SetInputRange(0, range); }
 
+  // Description:
+  // Get the number of times that memory for the partial sums has been
+  // allocated.  The per-thread sums are kept between executions, so this
+  // will only increase if the number of bins or the number of threads
+  // changes.
+  vtkTypeUInt64 GetNumberOfAllocations();
+
 protected:
   vtkImageCorrelationRatio();
   ~vtkImageCorrelationRatio();
@@ -75,6 +83,7 @@ protected:
   double BinSpacing;
 
   vtkImageCorrelationRatioTLS *ThreadData;
+  vtkImageCorrelationRatioArena *Arena;
 
 private:
   vtkImageCorrelationRatio(const vtkImageCorrelationRatio&);  // Not implemented.
@@ -63,12 +63,15 @@ vtkImageCrossCorrelation::vtkImageCrossCorrelation()
   this->CrossCorrelation = 0.0;
   this->NormalizedCrossCorrelation = 0.0;
 
-  this->ThreadData = 0;
+  this->ThreadData = new vtkImageCrossCorrelationTLS;
+
+  this->SupportsSampleList = true;
 }
 
 //----------------------------------------------------------------------------
 vtkImageCrossCorrelation::~vtkImageCrossCorrelation()
 {
+  delete this->ThreadData;
 }
 
 //----------------------------------------------------------------------------
@@ -88,7 +91,11 @@ void vtkImageCrossCorrelation::PrintSelf(ostream& os, vtkIndent indent)
 namespace {
 
 //----------------------------------------------------------------------------
-template<class T1, class T2>
+// The arithmetic for each span is done with type F (float or double), and
+// the spans are summed in double precision.  The sums for each span are
+// taken about the first voxel of the span, so that images with a large
+// offset do not lose the variance to cancellation in the float sums.
+template<class F, class T1, class T2>
 void vtkImageCrossCorrelationExecute(
   vtkImageCrossCorrelation *self,
   vtkImageData *inData0, vtkImageData *inData1, vtkImageStencilData *stencil,
@@ -120,33 +127,58 @@ void vtkImageCrossCorrelationExecute(
       T1 *inPtrEnd = inIter.EndSpan();
       inPtr1 = inIter1.BeginSpan();
 
+      F xs = 0;
+      F ys = 0;
+      F xxs = 0;
+      F yys = 0;
+      F xys = 0;
+      double a = 0.0;
+      double b = 0.0;
+      double n = 0.0;
+
+      if (inPtr != inPtrEnd)
+        {
+        a = static_cast<double>(static_cast<F>(*inPtr));
+        b = static_cast<double>(static_cast<F>(*inPtr1));
+        }
+      F xa = static_cast<F>(a);
+      F yb = static_cast<F>(b);
+
       // iterate over all voxels in the span
       while (inPtr != inPtrEnd)
         {
-        double x = *inPtr;
-        double y = *inPtr1;
+        F x = static_cast<F>(*inPtr) - xa;
+        F y = static_cast<F>(*inPtr1) - yb;
 
-        xSum += x;
-        ySum += y;
-        xxSum += x*x;
-        yySum += y*y;
-        xySum += x*y;
-        count++;
+        xs += x;
+        ys += y;
+        xxs += x*x;
+        yys += y*y;
+        xys += x*y;
+        n++;
 
         inPtr += pixelInc;
         inPtr1 += pixelInc1;
         }
+
+      // convert the sums about (a, b) into sums about zero
+      xSum += xs + n*a;
+      ySum += ys + n*b;
+      xxSum += xxs + 2.0*a*xs + n*a*a;
+      yySum += yys + 2.0*b*ys + n*b*b;
+      xySum += xys + a*ys + b*xs + n*a*b;
+      count += n;
       }
     inIter.NextSpan();
     inIter1.NextSpan();
     }
 
-  output[0] = xSum;
-  output[1] = ySum;
-  output[2] = xxSum;
-  output[3] = yySum;
-  output[4] = xySum;
-  output[5] = count;
+  output[0] += xSum;
+  output[1] += ySum;
+  output[2] += xxSum;
+  output[3] += yySum;
+  output[4] += xySum;
+  output[5] += count;
 }
 
 //----------------------------------------------------------------------------
@@ -157,10 +189,24 @@ void vtkImageCrossCorrelationExecute1(
   vtkImageStencilData *stencil, T1 *inPtr, void *inPtr1,
   const int extent[6], double output[6], vtkIdType pieceId)
 {
+  if (self->GetSinglePrecision())
+    {
+    switch (inData1->GetScalarType())
+      {
+      vtkTemplateAliasMacro(
+        vtkImageCrossCorrelationExecute<float>(
+          self, inData0, inData1, stencil,
+          inPtr, static_cast<VTK_TT *>(inPtr1), extent, output, pieceId));
+      default:
+        vtkErrorWithObjectMacro(self, "Execute: Unknown input ScalarType");
+      }
+    return;
+    }
+
   switch (inData1->GetScalarType())
     {
     vtkTemplateAliasMacro(
-      vtkImageCrossCorrelationExecute(
+      vtkImageCrossCorrelationExecute<double>(
         self, inData0, inData1, stencil,
         inPtr, static_cast<VTK_TT *>(inPtr1), extent, output, pieceId));
     default:
@@ -168,6 +214,119 @@ void vtkImageCrossCorrelationExecute1(
     }
 }
 
+//----------------------------------------------------------------------------
+// Accumulate the sums when the target is interpolated directly,
+// see vtkImageSimilarityMetricFusedExecute().  As for the spans of
+// vtkImageCrossCorrelationExecute(), the arithmetic is done with type F
+// for each block of voxels, about the first voxel of the block, and the
+// blocks are summed in double.
+template<class F>
+class vtkImageCrossCorrelationFunctor
+{
+public:
+  vtkImageCrossCorrelationFunctor()
+    : A(0.0), B(0.0), XA(0), YB(0), Xs(0), Ys(0), XXs(0), YYs(0), XYs(0),
+      BlockCount(0)
+  {
+    Data[0] = Data[1] = Data[2] = Data[3] = Data[4] = Data[5] = 0.0;
+  }
+
+  void operator()(double x, double y)
+  {
+    if (this->BlockCount == 0)
+      {
+      this->XA = static_cast<F>(x);
+      this->YB = static_cast<F>(y);
+      this->A = static_cast<double>(this->XA);
+      this->B = static_cast<double>(this->YB);
+      }
+
+    F u = static_cast<F>(x) - this->XA;
+    F v = static_cast<F>(y) - this->YB;
+    this->Xs += u;
+    this->Ys += v;
+    this->XXs += u*u;
+    this->YYs += v*v;
+    this->XYs += u*v;
+
+    if (++this->BlockCount == BlockSize)
+      {
+      this->Flush();
+      }
+  }
+
+  // Add the current block to the sums, must be called at the end
+  void Flush()
+  {
+    double a = this->A;
+    double b = this->B;
+    double n = this->BlockCount;
+    this->Data[0] += this->Xs + n*a;
+    this->Data[1] += this->Ys + n*b;
+    this->Data[2] += this->XXs + 2.0*a*this->Xs + n*a*a;
+    this->Data[3] += this->YYs + 2.0*b*this->Ys + n*b*b;
+    this->Data[4] += this->XYs + a*this->Ys + b*this->Xs + n*a*b;
+    this->Data[5] += n;
+    this->Xs = this->Ys = this->XXs = this->YYs = this->XYs = 0;
+    this->BlockCount = 0;
+  }
+
+  double Data[6];
+
+private:
+  enum { BlockSize = 256 };
+
+  double A;
+  double B;
+  F XA;
+  F YB;
+  F Xs;
+  F Ys;
+  F XXs;
+  F YYs;
+  F XYs;
+  int BlockCount;
+};
+
+//----------------------------------------------------------------------------
+// Interpolate the target at the source voxels of the extent, or at the
+// given range of the sample list, with arithmetic of type F.
+template<class F>
+void vtkImageCrossCorrelationFused(
+  vtkImageCrossCorrelation *self, vtkImageData *inData0, void *inPtr0,
+  vtkImageStencilData *stencil, vtkImageSimilarityMetricSampleList *samples,
+  const vtkIdType range[2], vtkAbstractImageInterpolator *interpolator,
+  const double matrix[16], const vtkImageSimilarityMetricLine *line,
+  double step, const int extent[6], vtkAlgorithm *progress,
+  double output[6])
+{
+  vtkImageCrossCorrelationFunctor<F> functor;
+
+  if (samples)
+    {
+    vtkImageSimilarityMetricSampleExecute(
+      samples, range, interpolator, matrix, functor);
+    }
+  else
+    {
+    switch (inData0->GetScalarType())
+      {
+      vtkTemplateAliasMacro(
+        vtkImageSimilarityMetricFusedExecute(
+          progress, inData0, static_cast<VTK_TT *>(inPtr0), stencil,
+          interpolator, matrix, extent, functor, line, step));
+      default:
+        vtkErrorWithObjectMacro(self, "Execute: Unknown ScalarType");
+      }
+    }
+
+  functor.Flush();
+  for (int i = 0; i < 6; i++)
+    {
+    output[i] += functor.Data[i];
+    }
+}
+
 } // end anonymous namespace
 
 //----------------------------------------------------------------------------
@@ -176,15 +335,14 @@ int vtkImageCrossCorrelation::RequestData(
   vtkInformationVector** inputVector,
   vtkInformationVector* outputVector)
 {
-  // create the thread-local object
-  vtkImageCrossCorrelationTLS tlocal;
-  tlocal.Initialize(this);
-  this->ThreadData = &tlocal;
+  // reset the thread-local objects, which are kept between executions
+  if (this->ThreadData->Initialize(this))
+    {
+    this->NumberOfAllocations++;
+    }
 
   this->Superclass::RequestData(request, inputVector, outputVector);
 
-  this->ThreadData = 0;
-
   return 1;
 }
 
@@ -214,10 +372,39 @@ void vtkImageCrossCorrelation::PieceRequestData(
 
   int *ext = const_cast<int *>(extent);
   void *inPtr0 = inData0->GetScalarPointerForExtent(ext);
-  void *inPtr1 = inData1->GetScalarPointerForExtent(ext);
 
   vtkImageStencilData *stencil = this->GetStencil();
 
+  if (this->Interpolator)
+    {
+    // interpolate the target directly, instead of using a resampled target
+    vtkAlgorithm *progress = ((pieceId == 0) ? this : NULL);
+    vtkImageSimilarityMetricSampleList *samples = this->GetSampleList();
+    vtkIdType range[2] = { 0, 0 };
+    if (samples)
+      {
+      this->GetSampleRange(pieceId, range);
+      }
+
+    if (this->GetSinglePrecision())
+      {
+      vtkImageCrossCorrelationFused<float>(
+        this, inData0, inPtr0, stencil, samples, range,
+        this->Interpolator, this->IndexMatrix, this->GetLine(),
+        this->GetLineStep(), extent, progress, outPtr);
+      }
+    else
+      {
+      vtkImageCrossCorrelationFused<double>(
+        this, inData0, inPtr0, stencil, samples, range,
+        this->Interpolator, this->IndexMatrix, this->GetLine(),
+        this->GetLineStep(), extent, progress, outPtr);
+      }
+    return;
+    }
+
+  void *inPtr1 = inData1->GetScalarPointerForExtent(ext);
+
   switch (inData0->GetScalarType())
     {
     vtkTemplateAliasMacro(
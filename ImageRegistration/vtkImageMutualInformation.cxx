@@ -34,13 +34,17 @@
 vtkStandardNewMacro(vtkImageMutualInformation);
 
 //----------------------------------------------------------------------------
-// Data needed for each thread.
+// Data needed for each thread.  The joint histogram is accumulated with
+// 32-bit counts, which are flushed into the 64-bit Overflow histogram
+// before the number of Pending counts can exceed the 32-bit limit.
 class vtkImageMutualInformationThreadData
 {
 public:
-  vtkImageMutualInformationThreadData() : Data(0) {}
+  vtkImageMutualInformationThreadData() : Data(0), Overflow(0), Pending(0) {}
 
-  vtkIdType *Data;
+  vtkTypeUInt32 *Data;
+  vtkIdType *Overflow;
+  vtkTypeUInt64 Pending;
 };
 
 class vtkImageMutualInformationTLS
@@ -48,6 +52,23 @@ class vtkImageMutualInformationTLS
 {
 };
 
+//----------------------------------------------------------------------------
+// The buffers that persist between executions.
+class vtkImageMutualInformationArena
+{
+public:
+  vtkImageMutualInformationArena() : SIMD(0), Lanes(1) {}
+
+  int SIMD;
+  int Lanes;
+  vtkImageSimilarityMetricArena<vtkTypeUInt32> Counts;
+  vtkImageSimilarityMetricArena<vtkIdType> Overflow;
+  vtkImageSimilarityMetricArena<vtkIdType> Reduce;
+};
+
+// The maximum number of counts before a flush is needed.
+static const vtkTypeUInt64 vtkImageMutualInformationMaxPending = 0xFFFFFFFFu;
+
 //----------------------------------------------------------------------------
 // Constructor sets default values
 vtkImageMutualInformation::vtkImageMutualInformation()
@@ -64,11 +85,15 @@ vtkImageMutualInformation::vtkImageMutualInformation()
   this->OutputScalarType = VTK_FLOAT;
 
   this->Metric = 0;
+  this->UseSIMD = 1;
 
   this->MutualInformation = 0.0;
   this->NormalizedMutualInformation = 0.0;
 
-  this->ThreadData = 0;
+  this->ThreadData = new vtkImageMutualInformationTLS;
+  this->Arena = new vtkImageMutualInformationArena;
+
+  this->SupportsSampleList = true;
 
   this->SetNumberOfOutputPorts(1);
 }
@@ -76,6 +101,17 @@ vtkImageMutualInformation::vtkImageMutualInformation()
 //----------------------------------------------------------------------------
 vtkImageMutualInformation::~vtkImageMutualInformation()
 {
+  delete this->ThreadData;
+  delete this->Arena;
+}
+
+//----------------------------------------------------------------------------
+vtkTypeUInt64 vtkImageMutualInformation::GetNumberOfAllocations()
+{
+  return (this->Superclass::GetNumberOfAllocations() +
+          this->Arena->Counts.GetNumberOfAllocations() +
+          this->Arena->Overflow.GetNumberOfAllocations() +
+          this->Arena->Reduce.GetNumberOfAllocations());
 }
 
 //----------------------------------------------------------------------------
@@ -94,6 +130,7 @@ void vtkImageMutualInformation::PrintSelf(ostream& os, vtkIndent indent)
   os << indent << "NormalizedMutualInformation: "
      << this->NormalizedMutualInformation << "\n";
 
+  os << indent << "UseSIMD: " << (this->UseSIMD ? "On\n" : "Off\n");
   os << indent << "Metric: "
      << (this->Metric == NMI ? "NormalizedMutualInformation\n" :
                                "MutualInformation\n");
@@ -143,14 +180,386 @@ int vtkImageMutualInformation::RequestInformation(
 // anonymous namespace for internal functions
 namespace {
 
+//----------------------------------------------------------------------------
+// Vectorized binning.  The scale, clamp, and round of each voxel pair is
+// done with SIMD instructions in double precision, using exactly the same
+// operations as the scalar loop so that the bin indices are bit-identical.
+// The increments are scattered over several sub-histograms (one per lane)
+// to avoid a dependency between consecutive increments to the same bin,
+// and the sub-histograms are summed in ReduceRequestData().
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VTK_MI_SIMD_X86
+#include <immintrin.h>
+#define VTK_MI_TARGET_AVX2 __attribute__((target("avx2")))
+#define VTK_MI_TARGET_SSE41 __attribute__((target("sse4.1")))
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define VTK_MI_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+#include <string.h>
+
+// The instruction set that will be used for binning
+enum { SIMDNone, SIMDSSE41, SIMDAVX2, SIMDNEON };
+
+// The number of sub-histograms used by the vectorized kernels
+const int vtkImageMutualInformationLanes = 4;
+
+//----------------------------------------------------------------------------
+// Check the processor for the best supported instruction set.
+int vtkImageMutualInformationDetectSIMD()
+{
+#if defined(VTK_MI_SIMD_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    {
+    return SIMDAVX2;
+    }
+  if (__builtin_cpu_supports("sse4.1"))
+    {
+    return SIMDSSE41;
+    }
+#elif defined(VTK_MI_SIMD_NEON)
+  return SIMDNEON;
+#endif
+  return SIMDNone;
+}
+
+int vtkImageMutualInformationGetSIMD()
+{
+  static int level = vtkImageMutualInformationDetectSIMD();
+  return level;
+}
+
+//----------------------------------------------------------------------------
+// The binning parameters, in the form used by the kernels.
+struct vtkImageMutualInformationBinning
+{
+  double XShift;
+  double YShift;
+  double XScale;
+  double YScale;
+  double XMax;
+  double YMax;
+  int OutIncY;
+  vtkIdType LaneInc;
+};
+
+//----------------------------------------------------------------------------
+// Bin the voxels of a span with scalar code, using only the first lane.
+// This is the reference that the vectorized kernels must match.
+template<class T1, class T2>
+inline void vtkImageMutualInformationBinScalar(
+  const T1 *inPtr, const T2 *inPtr1, int n,
+  const vtkImageMutualInformationBinning& b, vtkTypeUInt32 *outPtr)
+{
+  for (int i = 0; i < n; i++)
+    {
+    double x = inPtr[i];
+    double y = inPtr1[i];
+
+    x += b.XShift;
+    x *= b.XScale;
+
+    y += b.YShift;
+    y *= b.YScale;
+
+    x = (x > 0.0 ? x : 0.0);
+    x = (x < b.XMax ? x : b.XMax);
+
+    y = (y > 0.0 ? y : 0.0);
+    y = (y < b.YMax ? y : b.YMax);
+
+    int xi = static_cast<int>(x + 0.5);
+    int yi = static_cast<int>(y + 0.5);
+
+    outPtr[yi*b.OutIncY + xi]++;
+    }
+}
+
+//----------------------------------------------------------------------------
+// Increment one bin in each of the lanes.
+inline void vtkImageMutualInformationScatter(
+  const int idx[4], vtkIdType laneInc, vtkTypeUInt32 *outPtr)
+{
+  outPtr[idx[0]]++;
+  outPtr[laneInc + idx[1]]++;
+  outPtr[2*laneInc + idx[2]]++;
+  outPtr[3*laneInc + idx[3]]++;
+}
+
+#if defined(VTK_MI_SIMD_X86)
+//----------------------------------------------------------------------------
+// Load four values and convert them to double (AVX2).
+template<class T> __m256d vtkImageMutualInformationLoad4(const T *p);
+
+template<> VTK_MI_TARGET_AVX2 inline
+__m256d vtkImageMutualInformationLoad4(const unsigned char *p)
+{
+  int v;
+  memcpy(&v, p, 4);
+  return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)));
+}
+
+template<> VTK_MI_TARGET_AVX2 inline
+__m256d vtkImageMutualInformationLoad4(const short *p)
+{
+  __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+  return _mm256_cvtepi32_pd(_mm_cvtepi16_epi32(v));
+}
+
+template<> VTK_MI_TARGET_AVX2 inline
+__m256d vtkImageMutualInformationLoad4(const unsigned short *p)
+{
+  __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+  return _mm256_cvtepi32_pd(_mm_cvtepu16_epi32(v));
+}
+
+template<> VTK_MI_TARGET_AVX2 inline
+__m256d vtkImageMutualInformationLoad4(const float *p)
+{
+  return _mm256_cvtps_pd(_mm_loadu_ps(p));
+}
+
+//----------------------------------------------------------------------------
+// Load two values and convert them to double (SSE4.1).
+template<class T> __m128d vtkImageMutualInformationLoad2(const T *p);
+
+template<> VTK_MI_TARGET_SSE41 inline
+__m128d vtkImageMutualInformationLoad2(const unsigned char *p)
+{
+  unsigned short v;
+  memcpy(&v, p, 2);
+  return _mm_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)));
+}
+
+template<> VTK_MI_TARGET_SSE41 inline
+__m128d vtkImageMutualInformationLoad2(const short *p)
+{
+  int v;
+  memcpy(&v, p, 4);
+  return _mm_cvtepi32_pd(_mm_cvtepi16_epi32(_mm_cvtsi32_si128(v)));
+}
+
+template<> VTK_MI_TARGET_SSE41 inline
+__m128d vtkImageMutualInformationLoad2(const unsigned short *p)
+{
+  int v;
+  memcpy(&v, p, 4);
+  return _mm_cvtepi32_pd(_mm_cvtepu16_epi32(_mm_cvtsi32_si128(v)));
+}
+
+template<> VTK_MI_TARGET_SSE41 inline
+__m128d vtkImageMutualInformationLoad2(const float *p)
+{
+  __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+  return _mm_cvtps_pd(_mm_castsi128_ps(v));
+}
+
+//----------------------------------------------------------------------------
+// Note that max(x, 0) gives 0 if x is NaN, just like the scalar code.
+template<class T1, class T2>
+VTK_MI_TARGET_AVX2 int vtkImageMutualInformationBinAVX2(
+  const T1 *inPtr, const T2 *inPtr1, int n,
+  const vtkImageMutualInformationBinning& b, vtkTypeUInt32 *outPtr)
+{
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d half = _mm256_set1_pd(0.5);
+  const __m256d xshift = _mm256_set1_pd(b.XShift);
+  const __m256d yshift = _mm256_set1_pd(b.YShift);
+  const __m256d xscale = _mm256_set1_pd(b.XScale);
+  const __m256d yscale = _mm256_set1_pd(b.YScale);
+  const __m256d xmax = _mm256_set1_pd(b.XMax);
+  const __m256d ymax = _mm256_set1_pd(b.YMax);
+  const __m128i incY = _mm_set1_epi32(b.OutIncY);
+
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+    __m256d x = vtkImageMutualInformationLoad4(inPtr + i);
+    __m256d y = vtkImageMutualInformationLoad4(inPtr1 + i);
+
+    x = _mm256_mul_pd(_mm256_add_pd(x, xshift), xscale);
+    y = _mm256_mul_pd(_mm256_add_pd(y, yshift), yscale);
+
+    x = _mm256_min_pd(_mm256_max_pd(x, zero), xmax);
+    y = _mm256_min_pd(_mm256_max_pd(y, zero), ymax);
+
+    __m128i xi = _mm256_cvttpd_epi32(_mm256_add_pd(x, half));
+    __m128i yi = _mm256_cvttpd_epi32(_mm256_add_pd(y, half));
+
+    int idx[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(idx),
+      _mm_add_epi32(_mm_mullo_epi32(yi, incY), xi));
+    vtkImageMutualInformationScatter(idx, b.LaneInc, outPtr);
+    }
+
+  return i;
+}
+
+//----------------------------------------------------------------------------
+template<class T1, class T2>
+VTK_MI_TARGET_SSE41 int vtkImageMutualInformationBinSSE41(
+  const T1 *inPtr, const T2 *inPtr1, int n,
+  const vtkImageMutualInformationBinning& b, vtkTypeUInt32 *outPtr)
+{
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d half = _mm_set1_pd(0.5);
+  const __m128d xshift = _mm_set1_pd(b.XShift);
+  const __m128d yshift = _mm_set1_pd(b.YShift);
+  const __m128d xscale = _mm_set1_pd(b.XScale);
+  const __m128d yscale = _mm_set1_pd(b.YScale);
+  const __m128d xmax = _mm_set1_pd(b.XMax);
+  const __m128d ymax = _mm_set1_pd(b.YMax);
+  const __m128i incY = _mm_set1_epi32(b.OutIncY);
+
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+    __m128d x0 = vtkImageMutualInformationLoad2(inPtr + i);
+    __m128d x1 = vtkImageMutualInformationLoad2(inPtr + i + 2);
+    __m128d y0 = vtkImageMutualInformationLoad2(inPtr1 + i);
+    __m128d y1 = vtkImageMutualInformationLoad2(inPtr1 + i + 2);
+
+    x0 = _mm_mul_pd(_mm_add_pd(x0, xshift), xscale);
+    x1 = _mm_mul_pd(_mm_add_pd(x1, xshift), xscale);
+    y0 = _mm_mul_pd(_mm_add_pd(y0, yshift), yscale);
+    y1 = _mm_mul_pd(_mm_add_pd(y1, yshift), yscale);
+
+    x0 = _mm_min_pd(_mm_max_pd(x0, zero), xmax);
+    x1 = _mm_min_pd(_mm_max_pd(x1, zero), xmax);
+    y0 = _mm_min_pd(_mm_max_pd(y0, zero), ymax);
+    y1 = _mm_min_pd(_mm_max_pd(y1, zero), ymax);
+
+    __m128i xi = _mm_unpacklo_epi64(
+      _mm_cvttpd_epi32(_mm_add_pd(x0, half)),
+      _mm_cvttpd_epi32(_mm_add_pd(x1, half)));
+    __m128i yi = _mm_unpacklo_epi64(
+      _mm_cvttpd_epi32(_mm_add_pd(y0, half)),
+      _mm_cvttpd_epi32(_mm_add_pd(y1, half)));
+
+    int idx[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(idx),
+      _mm_add_epi32(_mm_mullo_epi32(yi, incY), xi));
+    vtkImageMutualInformationScatter(idx, b.LaneInc, outPtr);
+    }
+
+  return i;
+}
+#endif
+
+#if defined(VTK_MI_SIMD_NEON)
+//----------------------------------------------------------------------------
+// The NEON maxnm/minnm instructions give the non-NaN operand, so that
+// NaN values are clamped to zero just like the scalar code.
+template<class T1, class T2>
+int vtkImageMutualInformationBinNEON(
+  const T1 *inPtr, const T2 *inPtr1, int n,
+  const vtkImageMutualInformationBinning& b, vtkTypeUInt32 *outPtr)
+{
+  const float64x2_t zero = vdupq_n_f64(0.0);
+  const float64x2_t half = vdupq_n_f64(0.5);
+  const float64x2_t xshift = vdupq_n_f64(b.XShift);
+  const float64x2_t yshift = vdupq_n_f64(b.YShift);
+  const float64x2_t xscale = vdupq_n_f64(b.XScale);
+  const float64x2_t yscale = vdupq_n_f64(b.YScale);
+  const float64x2_t xmax = vdupq_n_f64(b.XMax);
+  const float64x2_t ymax = vdupq_n_f64(b.YMax);
+
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+    int idx[4];
+    for (int j = 0; j < 4; j += 2)
+      {
+      double xv[2] = { static_cast<double>(inPtr[i + j]),
+                       static_cast<double>(inPtr[i + j + 1]) };
+      double yv[2] = { static_cast<double>(inPtr1[i + j]),
+                       static_cast<double>(inPtr1[i + j + 1]) };
+      float64x2_t x = vld1q_f64(xv);
+      float64x2_t y = vld1q_f64(yv);
+
+      x = vmulq_f64(vaddq_f64(x, xshift), xscale);
+      y = vmulq_f64(vaddq_f64(y, yshift), yscale);
+
+      x = vminnmq_f64(vmaxnmq_f64(x, zero), xmax);
+      y = vminnmq_f64(vmaxnmq_f64(y, zero), ymax);
+
+      int64x2_t xi = vcvtq_s64_f64(vaddq_f64(x, half));
+      int64x2_t yi = vcvtq_s64_f64(vaddq_f64(y, half));
+
+      idx[j] = static_cast<int>(
+        vgetq_lane_s64(yi, 0)*b.OutIncY + vgetq_lane_s64(xi, 0));
+      idx[j + 1] = static_cast<int>(
+        vgetq_lane_s64(yi, 1)*b.OutIncY + vgetq_lane_s64(xi, 1));
+      }
+    vtkImageMutualInformationScatter(idx, b.LaneInc, outPtr);
+    }
+
+  return i;
+}
+#endif
+
+//----------------------------------------------------------------------------
+// The types for which vectorized kernels are provided.
+template<class T> struct vtkImageMutualInformationSIMDType
+  { enum { Supported = 0 }; };
+template<> struct vtkImageMutualInformationSIMDType<unsigned char>
+  { enum { Supported = 1 }; };
+template<> struct vtkImageMutualInformationSIMDType<short>
+  { enum { Supported = 1 }; };
+template<> struct vtkImageMutualInformationSIMDType<unsigned short>
+  { enum { Supported = 1 }; };
+template<> struct vtkImageMutualInformationSIMDType<float>
+  { enum { Supported = 1 }; };
+
+//----------------------------------------------------------------------------
+// Bin a span of contiguous voxels with the given instruction set, and
+// return the number of voxels that were binned (the remainder of the span
+// must be binned with scalar code).
+template<class T1, class T2, bool Supported>
+struct vtkImageMutualInformationSIMDKernel
+{
+  static int Bin(int, const T1 *, const T2 *, int,
+                 const vtkImageMutualInformationBinning&, vtkTypeUInt32 *)
+    {
+    return 0;
+    }
+};
+
+template<class T1, class T2>
+struct vtkImageMutualInformationSIMDKernel<T1, T2, true>
+{
+  static int Bin(int simd, const T1 *inPtr, const T2 *inPtr1, int n,
+                 const vtkImageMutualInformationBinning& b,
+                 vtkTypeUInt32 *outPtr)
+    {
+    switch (simd)
+      {
+#if defined(VTK_MI_SIMD_X86)
+      case SIMDAVX2:
+        return vtkImageMutualInformationBinAVX2(inPtr, inPtr1, n, b, outPtr);
+      case SIMDSSE41:
+        return vtkImageMutualInformationBinSSE41(inPtr, inPtr1, n, b, outPtr);
+#elif defined(VTK_MI_SIMD_NEON)
+      case SIMDNEON:
+        return vtkImageMutualInformationBinNEON(inPtr, inPtr1, n, b, outPtr);
+#endif
+      default:
+        break;
+      }
+    return 0;
+    }
+};
+
 //----------------------------------------------------------------------------
 template<class T1, class T2>
 void vtkImageMutualInformationExecute(
   vtkImageMutualInformation *self,
   vtkImageData *inData0, vtkImageData *inData1, vtkImageStencilData *stencil,
-  T1 *inPtr, T2 *inPtr1, const int extent[6], vtkIdType *outPtr,
+  T1 *inPtr, T2 *inPtr1, const int extent[6], vtkTypeUInt32 *outPtr,
   const int numBins[2], const double binOrigin[2], const double binSpacing[2],
-  vtkIdType pieceId)
+  int simd, int lanes, vtkIdType pieceId)
 {
   int *ext = const_cast<int *>(extent);
   vtkImageStencilIterator<T1>
@@ -169,7 +578,22 @@ void vtkImageMutualInformationExecute(
   double yshift = -binOrigin[1];
   double xscale = 1.0/binSpacing[0];
   double yscale = 1.0/binSpacing[1];
-  int outIncY = numBins[1];
+  int outIncY = numBins[0];
+
+  // the vectorized kernels need contiguous voxels
+  vtkImageMutualInformationBinning binning;
+  binning.XShift = xshift;
+  binning.YShift = yshift;
+  binning.XScale = xscale;
+  binning.YScale = yscale;
+  binning.XMax = xmax;
+  binning.YMax = ymax;
+  binning.OutIncY = outIncY;
+  binning.LaneInc = (lanes > 1 ? static_cast<vtkIdType>(outIncY)*numBins[1] : 0);
+  if (pixelInc != 1 || pixelInc1 != 1)
+    {
+    simd = SIMDNone;
+    }
 
   // iterate over all spans in the stencil
   while (!inIter.IsAtEnd())
@@ -180,6 +604,18 @@ void vtkImageMutualInformationExecute(
       T1 *inPtrEnd = inIter.EndSpan();
       inPtr1 = inIter1.BeginSpan();
 
+      if (simd != SIMDNone)
+        {
+        int n = static_cast<int>(inPtrEnd - inPtr);
+        int m = vtkImageMutualInformationSIMDKernel<T1, T2,
+          (vtkImageMutualInformationSIMDType<T1>::Supported &&
+           vtkImageMutualInformationSIMDType<T2>::Supported)>::Bin(
+             simd, inPtr, inPtr1, n, binning, outPtr);
+        vtkImageMutualInformationBinScalar(
+          inPtr + m, inPtr1 + m, n - m, binning, outPtr);
+        inPtr = inPtrEnd;
+        }
+
       // iterate over all voxels in the span
       while (inPtr != inPtrEnd)
         {
@@ -201,7 +637,7 @@ void vtkImageMutualInformationExecute(
         int xi = static_cast<int>(x + 0.5);
         int yi = static_cast<int>(y + 0.5);
 
-        vtkIdType *outPtr1 = outPtr + yi*outIncY + xi;
+        vtkTypeUInt32 *outPtr1 = outPtr + yi*outIncY + xi;
 
         (*outPtr1)++;
 
@@ -219,7 +655,7 @@ void vtkImageMutualInformationExecutePreScaled(
   vtkImageMutualInformation *self,
   vtkImageData *inData0, vtkImageData *inData1, vtkImageStencilData *stencil,
   unsigned char *inPtr, unsigned char *inPtr1, const int extent[6],
-  vtkIdType *outPtr, const int numBins[2], vtkIdType pieceId)
+  vtkTypeUInt32 *outPtr, const int numBins[2], vtkIdType pieceId)
 {
   int *ext = const_cast<int *>(extent);
   vtkImageStencilIterator<unsigned char>
@@ -232,7 +668,7 @@ void vtkImageMutualInformationExecutePreScaled(
 
   int xmax = numBins[0] - 1;
   int ymax = numBins[1] - 1;
-  int outIncY = numBins[1];
+  int outIncY = numBins[0];
 
   // iterate over all spans in the stencil
   while (!inIter.IsAtEnd())
@@ -252,7 +688,7 @@ void vtkImageMutualInformationExecutePreScaled(
         x = (x < xmax ? x : xmax);
         y = (y < ymax ? y : ymax);
 
-        vtkIdType *outPtr1 = outPtr + y*outIncY + x;
+        vtkTypeUInt32 *outPtr1 = outPtr + y*outIncY + x;
 
         (*outPtr1)++;
 
@@ -265,6 +701,57 @@ void vtkImageMutualInformationExecutePreScaled(
     }
 }
 
+//----------------------------------------------------------------------------
+// Accumulate the joint histogram when the target is interpolated directly,
+// see vtkImageSimilarityMetricFusedExecute().
+class vtkImageMutualInformationFunctor
+{
+public:
+  vtkImageMutualInformationFunctor(
+    vtkTypeUInt32 *outPtr, const int numBins[2],
+    const double binOrigin[2], const double binSpacing[2])
+  {
+    this->OutPtr = outPtr;
+    this->OutIncY = numBins[0];
+    this->XMax = numBins[0] - 1;
+    this->YMax = numBins[1] - 1;
+    this->XShift = -binOrigin[0];
+    this->YShift = -binOrigin[1];
+    this->XScale = 1.0/binSpacing[0];
+    this->YScale = 1.0/binSpacing[1];
+  }
+
+  void operator()(double x, double y)
+  {
+    x += this->XShift;
+    x *= this->XScale;
+
+    y += this->YShift;
+    y *= this->YScale;
+
+    x = (x > 0.0 ? x : 0.0);
+    x = (x < this->XMax ? x : this->XMax);
+
+    y = (y > 0.0 ? y : 0.0);
+    y = (y < this->YMax ? y : this->YMax);
+
+    int xi = static_cast<int>(x + 0.5);
+    int yi = static_cast<int>(y + 0.5);
+
+    this->OutPtr[yi*this->OutIncY + xi]++;
+  }
+
+private:
+  vtkTypeUInt32 *OutPtr;
+  vtkIdType OutIncY;
+  double XMax;
+  double YMax;
+  double XShift;
+  double YShift;
+  double XScale;
+  double YScale;
+};
+
 //----------------------------------------------------------------------------
 // copy one row of the joint histogram to the output, with conversion
 // but without type range checking
@@ -282,6 +769,33 @@ void vtkImageMutualInformationCopyRow(
   while (--n);
 }
 
+//----------------------------------------------------------------------------
+// add the 32-bit counts to the 64-bit histogram, and clear the counts
+void vtkImageMutualInformationFlush(
+  vtkImageMutualInformationThreadData *threadLocal,
+  vtkImageSimilarityMetricArena<vtkIdType> *overflowArena,
+  vtkIdType n, int lanes, int slot)
+{
+  if (threadLocal->Overflow == 0)
+    {
+    threadLocal->Overflow = overflowArena->Acquire(slot);
+    }
+
+  vtkTypeUInt32 *counts = threadLocal->Data;
+  vtkIdType *totals = threadLocal->Overflow;
+  for (int lane = 0; lane < lanes; lane++)
+    {
+    for (vtkIdType i = 0; i < n; i++)
+      {
+      totals[i] += counts[i];
+      counts[i] = 0;
+      }
+    counts += n;
+    }
+
+  threadLocal->Pending = 0;
+}
+
 } // end anonymous namespace
 
 //----------------------------------------------------------------------------
@@ -305,14 +819,38 @@ int vtkImageMutualInformation::RequestData(
       }
     }
 
-  // create the thread-local object
-  vtkImageMutualInformationTLS tlocal;
-  tlocal.Initialize(this);
-  this->ThreadData = &tlocal;
+  // the vectorized kernels use one sub-histogram per lane, but only if
+  // the sub-histograms are small enough to stay in the cache
+  vtkIdType outCount = this->NumberOfBins[0];
+  outCount *= this->NumberOfBins[1];
+  this->Arena->SIMD = SIMDNone;
+  this->Arena->Lanes = 1;
+  if (this->UseSIMD)
+    {
+    this->Arena->SIMD = vtkImageMutualInformationGetSIMD();
+    if (this->Arena->SIMD != SIMDNone && outCount <= 128*128)
+      {
+      this->Arena->Lanes = vtkImageMutualInformationLanes;
+      }
+    }
+
+  // the histograms are kept between executions, unless their size changes
+  this->Arena->Counts.SetBufferSize(outCount*this->Arena->Lanes);
+  this->Arena->Overflow.SetBufferSize(outCount);
+  this->Arena->Reduce.SetBufferSize(2*this->NumberOfBins[0]);
+
+  // reset the thread-local objects, which are kept between executions
+  if (this->ThreadData->Initialize(this))
+    {
+    this->NumberOfAllocations++;
+    }
 
   this->Superclass::RequestData(request, inputVector, outputVector);
 
-  this->ThreadData = 0;
+  // the histograms were cleared by ReduceRequestData()
+  this->Arena->Counts.ReleaseAll();
+  this->Arena->Overflow.ReleaseAll();
+  this->Arena->Reduce.ReleaseAll();
 
   return 1;
 }
@@ -331,9 +869,9 @@ template<class T1>
 void vtkImageMutualInformationExecute1(
   vtkImageMutualInformation *self,
   vtkImageData *inData0, vtkImageData *inData1, vtkImageStencilData *stencil,
-  T1 *inPtr, void *inPtr1, int extent[6],
-  vtkIdType *outPtr, int numBins[2], double binOrigin[2], double binSpacing[2],
-  vtkIdType pieceId)
+  T1 *inPtr, void *inPtr1, const int extent[6], vtkTypeUInt32 *outPtr,
+  const int numBins[2], const double binOrigin[2], const double binSpacing[2],
+  int simd, int lanes, vtkIdType pieceId)
 {
   switch (inData1->GetScalarType())
     {
@@ -341,19 +879,81 @@ void vtkImageMutualInformationExecute1(
       vtkImageMutualInformationExecute(
         self, inData0, inData1, stencil,
         inPtr, static_cast<VTK_TT *>(inPtr1), extent,
-        outPtr, numBins, binOrigin, binSpacing, pieceId));
+        outPtr, numBins, binOrigin, binSpacing, simd, lanes, pieceId));
     default:
       vtkErrorWithObjectMacro(self, "Execute: Unknown input ScalarType");
     }
 }
 
+//----------------------------------------------------------------------------
+// Accumulate the joint histogram over the given extent.
+void vtkImageMutualInformationExecutePiece(
+  vtkImageMutualInformation *self,
+  vtkImageData *inData0, vtkImageData *inData1, vtkImageStencilData *stencil,
+  vtkAbstractImageInterpolator *interpolator, const double indexMatrix[16],
+  const vtkImageSimilarityMetricLine *line, double step,
+  const int extent[6], vtkTypeUInt32 *outPtr, const int numBins[2],
+  const double binOrigin[2], const double binSpacing[2],
+  int simd, int lanes, vtkIdType pieceId)
+{
+  int *ext = const_cast<int *>(extent);
+  void *inPtr0 = inData0->GetScalarPointerForExtent(ext);
+
+  int maxX = numBins[0] - 1;
+  int maxY = numBins[1] - 1;
+
+  if (interpolator)
+    {
+    // interpolate the target directly, instead of using a resampled target
+    vtkImageMutualInformationFunctor functor(
+      outPtr, numBins, binOrigin, binSpacing);
+    vtkAlgorithm *progress = ((pieceId == 0) ? self : NULL);
+
+    switch (inData0->GetScalarType())
+      {
+      vtkTemplateAliasMacro(
+        vtkImageSimilarityMetricFusedExecute(
+          progress, inData0, static_cast<VTK_TT *>(inPtr0), stencil,
+          interpolator, indexMatrix, extent, functor, line, step));
+      default:
+        vtkErrorWithObjectMacro(self, "Execute: Unknown ScalarType");
+      }
+    return;
+    }
+
+  void *inPtr1 = inData1->GetScalarPointerForExtent(ext);
+
+  if (vtkMath::Floor(binOrigin[0] + 0.5) == 0 &&
+      vtkMath::Floor(binOrigin[1] + 0.5) == 0 &&
+      vtkMath::Floor(binOrigin[0] + binSpacing[0]*maxX + 0.5) == maxX &&
+      vtkMath::Floor(binOrigin[1] + binSpacing[1]*maxY + 0.5) == maxY &&
+      inData0->GetScalarType() == VTK_UNSIGNED_CHAR &&
+      inData1->GetScalarType() == VTK_UNSIGNED_CHAR)
+    {
+    vtkImageMutualInformationExecutePreScaled(
+      self, inData0, inData1, stencil,
+      static_cast<unsigned char *>(inPtr0),
+      static_cast<unsigned char *>(inPtr1),
+      extent, outPtr, numBins, pieceId);
+    }
+  else switch (inData0->GetScalarType())
+    {
+    vtkTemplateAliasMacro(
+      vtkImageMutualInformationExecute1(
+        self, inData0, inData1, stencil,
+        static_cast<VTK_TT *>(inPtr0), inPtr1,
+        extent, outPtr, numBins, binOrigin, binSpacing,
+        simd, lanes, pieceId));
+    default:
+      vtkErrorWithObjectMacro(self, "Execute: Unknown ScalarType");
+    }
+}
+
 } // end anonymous namespace
 
 //----------------------------------------------------------------------------
 // This method is passed a input and output region, and executes the filter
 // algorithm to fill the output from the input.
-// It just executes a switch statement to call the correct function for
-// the regions data types.
 void vtkImageMutualInformation::PieceRequestData(
   vtkInformation *vtkNotUsed(request),
   vtkInformationVector **inputVector,
@@ -363,20 +963,13 @@ void vtkImageMutualInformation::PieceRequestData(
   vtkImageMutualInformationThreadData *threadLocal =
     &this->ThreadData->Local(pieceId);
 
-  vtkIdType *outPtr = threadLocal->Data;
+  // the arena slot, if each thread is to keep its own buffers
+  int slot = this->GetAccumulatorSlot(pieceId);
 
-  if (outPtr == 0)
+  if (threadLocal->Data == 0)
     {
-    // initialize the joint histogram to zero
-    vtkIdType outIncY = this->NumberOfBins[0];
-    vtkIdType outCount = outIncY;
-    outCount *= this->NumberOfBins[1];
-
-    threadLocal->Data = new vtkIdType[outCount];
-    outPtr = threadLocal->Data;
-
-    vtkIdType *outPtr1 = outPtr;
-    do { *outPtr1++ = 0; } while (--outCount > 0);
+    // get a cleared joint histogram from the arena
+    threadLocal->Data = this->Arena->Counts.Acquire(slot);
     }
 
   vtkInformation *inInfo0 = inputVector[0]->GetInformationObject(0);
@@ -388,9 +981,14 @@ void vtkImageMutualInformation::PieceRequestData(
     inInfo1->Get(vtkDataObject::DATA_OBJECT()));
 
   // make sure execute extent is not beyond the extent of any input
+  // (if the target is interpolated directly, only the first input matters)
   int inExt0[6], inExt1[6];
   inData0->GetExtent(inExt0);
   inData1->GetExtent(inExt1);
+  if (this->Interpolator)
+    {
+    inData0->GetExtent(inExt1);
+    }
 
   int extent[6];
   for (int i = 0; i < 6; i += 2)
@@ -408,40 +1006,86 @@ void vtkImageMutualInformation::PieceRequestData(
       }
     }
 
-  void *inPtr0 = inData0->GetScalarPointerForExtent(extent);
-  void *inPtr1 = inData1->GetScalarPointerForExtent(extent);
-
   vtkImageStencilData *stencil = this->GetStencil();
+  vtkIdType outCount = this->NumberOfBins[0];
+  outCount *= this->NumberOfBins[1];
 
-  double *binOrigin = this->BinOrigin;
-  double *binSpacing = this->BinSpacing;
-  int *numBins = this->NumberOfBins;
-  int maxX = numBins[0] - 1;
-  int maxY = numBins[1] - 1;
+  vtkImageSimilarityMetricSampleList *samples = this->GetSampleList();
+  if (samples)
+    {
+    // go through the samples in chunks that are small enough that the
+    // 32-bit counts cannot overflow
+    vtkIdType range[2];
+    this->GetSampleRange(pieceId, range);
+    vtkIdType chunkRange[2];
+    for (chunkRange[0] = range[0]; chunkRange[0] < range[1];
+         chunkRange[0] = chunkRange[1])
+      {
+      vtkTypeUInt64 chunkSize = range[1] - chunkRange[0];
+      if (chunkSize > vtkImageMutualInformationMaxPending)
+        {
+        chunkSize = vtkImageMutualInformationMaxPending;
+        }
+      chunkRange[1] = chunkRange[0] + static_cast<vtkIdType>(chunkSize);
 
-  if (vtkMath::Floor(binOrigin[0] + 0.5) == 0 &&
-      vtkMath::Floor(binOrigin[1] + 0.5) == 0 &&
-      vtkMath::Floor(binOrigin[0] + binSpacing[0]*maxX + 0.5) == maxX &&
-      vtkMath::Floor(binOrigin[1] + binSpacing[1]*maxY + 0.5) == maxY &&
-      inData0->GetScalarType() == VTK_UNSIGNED_CHAR &&
-      inData1->GetScalarType() == VTK_UNSIGNED_CHAR)
+      if (threadLocal->Pending + chunkSize >
+          vtkImageMutualInformationMaxPending)
+        {
+        vtkImageMutualInformationFlush(
+          threadLocal, &this->Arena->Overflow, outCount, this->Arena->Lanes,
+          slot);
+        }
+      threadLocal->Pending += chunkSize;
+
+      vtkImageMutualInformationFunctor functor(
+        threadLocal->Data, this->NumberOfBins,
+        this->BinOrigin, this->BinSpacing);
+      vtkImageSimilarityMetricSampleExecute(
+        samples, chunkRange, this->Interpolator, this->IndexMatrix, functor);
+      }
+    return;
+    }
+
+  // go through the extent in chunks of slices, where each chunk is small
+  // enough that the 32-bit counts cannot overflow
+  vtkTypeUInt64 sliceSize = extent[1] - extent[0] + 1;
+  sliceSize *= extent[3] - extent[2] + 1;
+  vtkTypeUInt64 maxSlices = vtkImageMutualInformationMaxPending/sliceSize;
+  int chunkSlices = extent[5] - extent[4] + 1;
+  if (maxSlices < static_cast<vtkTypeUInt64>(chunkSlices))
     {
-    vtkImageMutualInformationExecutePreScaled(
-      this, inData0, inData1, stencil,
-      static_cast<unsigned char *>(inPtr0),
-      static_cast<unsigned char *>(inPtr1),
-      extent, outPtr, numBins, pieceId);
+    chunkSlices = (maxSlices > 1 ? static_cast<int>(maxSlices) : 1);
     }
-  else switch (inData0->GetScalarType())
+
+  int chunkExt[6];
+  chunkExt[0] = extent[0];
+  chunkExt[1] = extent[1];
+  chunkExt[2] = extent[2];
+  chunkExt[3] = extent[3];
+  for (int zIdx = extent[4]; zIdx <= extent[5]; zIdx += chunkSlices)
     {
-    vtkTemplateAliasMacro(
-      vtkImageMutualInformationExecute1(
-        this, inData0, inData1, stencil,
-        static_cast<VTK_TT *>(inPtr0), inPtr1,
-        extent, outPtr, numBins, binOrigin, binSpacing,
-        pieceId));
-    default:
-      vtkErrorMacro(<< "Execute: Unknown ScalarType");
+    chunkExt[4] = zIdx;
+    chunkExt[5] = extent[5];
+    if (extent[5] - zIdx >= chunkSlices)
+      {
+      chunkExt[5] = zIdx + chunkSlices - 1;
+      }
+
+    vtkTypeUInt64 chunkSize = sliceSize*(chunkExt[5] - chunkExt[4] + 1);
+    if (threadLocal->Pending + chunkSize > vtkImageMutualInformationMaxPending)
+      {
+      vtkImageMutualInformationFlush(
+        threadLocal, &this->Arena->Overflow, outCount, this->Arena->Lanes,
+        slot);
+      }
+    threadLocal->Pending += chunkSize;
+
+    vtkImageMutualInformationExecutePiece(
+      this, inData0, inData1, stencil, this->Interpolator, this->IndexMatrix,
+      this->GetLine(), this->GetLineStep(), chunkExt, threadLocal->Data,
+      this->NumberOfBins,
+      this->BinOrigin, this->BinSpacing,
+      this->Arena->SIMD, this->Arena->Lanes, pieceId);
     }
 }
 
@@ -472,16 +1116,14 @@ void vtkImageMutualInformation::ReduceRequestData(
   double yEntropy = 0;
   double xyEntropy = 0;
 
-  // allocate space to accumulate results
-  vtkIdType *xyHist = new vtkIdType[2*nx + ny];
-  vtkIdType *xHist = xyHist + nx;
+  // the number of sub-histograms per thread
+  int lanes = this->Arena->Lanes;
+  vtkIdType laneInc = static_cast<vtkIdType>(nx)*ny;
 
-  // clear xHist to zero
+  // get the (already cleared) space to accumulate results
+  vtkIdType *xyHist = this->Arena->Reduce.Acquire();
+  vtkIdType *xHist = xyHist + nx;
   int ix;
-  for (ix = 0; ix < nx; ++ix)
-    {
-    xHist[ix] = 0;
-    }
 
   // piece together the joint histogram results from each thread
   for (int iy = 0; iy < ny; ++iy)
@@ -500,7 +1142,8 @@ void vtkImageMutualInformation::ReduceRequestData(
       xyHist[ix] = 0;
       }
 
-    // add the contribution from thread j
+    // add the contribution from thread j, and clear the thread's
+    // histogram while it is in cache so it is ready for the next execution
     vtkIdType a = 0;
     for (vtkImageMutualInformationTLS::iterator
          iter = this->ThreadData->begin();
@@ -508,11 +1151,29 @@ void vtkImageMutualInformation::ReduceRequestData(
       {
       if (iter->Data)
         {
-        vtkIdType *outPtr2 = iter->Data + static_cast<vtkIdType>(nx)*iy;
+        vtkTypeUInt32 *outPtr2 = iter->Data + static_cast<vtkIdType>(nx)*iy;
+
+        // sum the sub-histograms that were used by the vectorized kernels
+        for (int lane = 0; lane < lanes; lane++)
+          {
+          for (ix = 0; ix < nx; ++ix)
+            {
+            vtkIdType c = outPtr2[ix];
+            outPtr2[ix] = 0;
+            xyHist[ix] += c;
+            a += c;
+            }
+          outPtr2 += laneInc;
+          }
+        }
+      if (iter->Overflow)
+        {
+        vtkIdType *outPtr2 = iter->Overflow + static_cast<vtkIdType>(nx)*iy;
 
         for (ix = 0; ix < nx; ++ix)
           {
-          vtkIdType c = *outPtr2++;
+          vtkIdType c = outPtr2[ix];
+          outPtr2[ix] = 0;
           xyHist[ix] += c;
           a += c;
           }
@@ -566,18 +1227,10 @@ void vtkImageMutualInformation::ReduceRequestData(
       {
       xEntropy += db*log(db);
       }
+    xyHist[ix] = 0;
+    xHist[ix] = 0;
     }
 
-  for (vtkImageMutualInformationTLS::iterator
-       iter = this->ThreadData->begin();
-       iter != this->ThreadData->end(); ++iter)
-    {
-    // delete the temporary memory
-    delete [] iter->Data;
-    }
-
-  delete [] xyHist;
-
   // minimum possible values
   double mutualInformation = 0.0;
   double normalizedMutualInformation = 1.0;
@@ -46,6 +46,7 @@
 #include "vtkImageSimilarityMetric.h"
 
 class vtkImageMutualInformationTLS;
+class vtkImageMutualInformationArena;
 
 class VTK_EXPORT vtkImageMutualInformation : public vtkImageSimilarityMetric
 {
@@ -57,9 +58,9 @@ public:
 
   // Description:
   // Set the type for the output.  The joint histogram will always be
-  // computed using vtkIdType, but since vtkIdType is not directly
-  // supported as an image data type, it will be converted to the requested
-  // type for use as the output of the filter.  The default type is float.
+  // computed using integer counts, but it will be converted to the
+  // requested type for use as the output of the filter.  The default
+  // type is float.
   vtkSetMacro(OutputScalarType, int);
   vtkGetMacro(OutputScalarType, int);
   void SetOutputScalarTypeToFloat() {
@@ -124,6 +125,21 @@ public:
   vtkSetMacro(Metric, int);
   vtkGetMacro(Metric, int);
 
+  // Description:
+  // Use SIMD instructions (AVX2, SSE4.1, or NEON) to bin the voxels, if
+  // the processor supports them.  The joint histogram is identical to the
+  // one computed without SIMD.  Only unsigned char, short, unsigned short,
+  // and float inputs are vectorized.  The default is On.
+  vtkSetMacro(UseSIMD, int);
+  vtkBooleanMacro(UseSIMD, int);
+  vtkGetMacro(UseSIMD, int);
+
+  // Description:
+  // Get the number of times that histogram memory has been allocated.
+  // The per-thread histograms are kept between executions, so this will
+  // only increase if the number of bins or the number of threads changes.
+  vtkTypeUInt64 GetNumberOfAllocations();
+
 protected:
   vtkImageMutualInformation();
   ~vtkImageMutualInformation();
@@ -152,11 +168,13 @@ protected:
   int OutputScalarType;
 
   int Metric;
+  int UseSIMD;
 
   double MutualInformation;
   double NormalizedMutualInformation;
 
   vtkImageMutualInformationTLS *ThreadData;
+  vtkImageMutualInformationArena *Arena;
 
 private:
   vtkImageMutualInformation(const vtkImageMutualInformation&);  // Not implemented.
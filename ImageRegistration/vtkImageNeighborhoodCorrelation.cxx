@@ -58,11 +58,14 @@ vtkImageNeighborhoodCorrelation::vtkImageNeighborhoodCorrelation()
   this->NeighborhoodRadius[0] = 7;
   this->NeighborhoodRadius[1] = 7;
   this->NeighborhoodRadius[2] = 7;
+
+  this->ThreadData = new vtkImageNeighborhoodCorrelationTLS;
 }
 
 //----------------------------------------------------------------------------
 vtkImageNeighborhoodCorrelation::~vtkImageNeighborhoodCorrelation()
 {
+  delete this->ThreadData;
 }
 
 //----------------------------------------------------------------------------
@@ -881,15 +884,14 @@ int vtkImageNeighborhoodCorrelation::RequestData(
   vtkInformationVector** inputVector,
   vtkInformationVector* outputVector)
 {
-  // create the thread-local object
-  vtkImageNeighborhoodCorrelationTLS tlocal;
-  tlocal.Initialize(this);
-  this->ThreadData = &tlocal;
+  // reset the thread-local objects, which are kept between executions
+  if (this->ThreadData->Initialize(this))
+    {
+    this->NumberOfAllocations++;
+    }
 
   this->Superclass::RequestData(request, inputVector, outputVector);
 
-  this->ThreadData = 0;
-
   return 1;
 }
 //----------------------------------------------------------------------------
@@ -911,7 +913,10 @@ void vtkImageNeighborhoodCorrelation::PieceRequestData(
   vtkImageData *inData1 = vtkImageData::SafeDownCast(
     inInfo1->Get(vtkDataObject::DATA_OBJECT()));
 
-  if (inData0->GetScalarType() != inData1->GetScalarType())
+  // if the target is interpolated directly, its type does not matter
+  vtkAbstractImageInterpolator *interpolator = this->Interpolator;
+
+  if (inData0->GetScalarType() != inData1->GetScalarType() && !interpolator)
     {
     if (pieceId == 0)
       {
@@ -930,6 +935,10 @@ void vtkImageNeighborhoodCorrelation::PieceRequestData(
   int inExt0[6], inExt1[6];
   inData0->GetExtent(inExt0);
   inData1->GetExtent(inExt1);
+  if (interpolator)
+    {
+    inData0->GetExtent(inExt1);
+    }
 
   int extent[6];
   for (int i = 0; i < 6; i += 2)
@@ -946,20 +955,56 @@ void vtkImageNeighborhoodCorrelation::PieceRequestData(
     extent[j] = ((extent[j] < inExt1[j]) ? extent[j] : inExt1[j]);
     }
 
+  int scalarType = inData0->GetScalarType();
+
   void *inPtr0 = inData0->GetScalarPointerForExtent(extent);
-  void *inPtr1 = inData1->GetScalarPointerForExtent(extent);
+  void *inPtr1 = 0;
 
   vtkIdType inInc1[3], inInc2[3];
   inData0->GetIncrements(inInc1);
-  inData1->GetIncrements(inInc2);
 
   vtkImageStencilData *stencil = this->GetStencil();
 
+  // for interpolating the target directly
+  char *resampleBuffer = 0;
+  vtkImageStencilData *resampleStencil = 0;
+
+  if (interpolator)
+    {
+    // the neighborhood sums need contiguous target voxels, so interpolate
+    // the target over the padded extent of this piece into a buffer that
+    // has the same type as the source, and make a stencil that excludes
+    // voxels that are outside the bounds of the target
+    inInc2[0] = 1;
+    inInc2[1] = inInc2[0]*(extent[1] - extent[0] + 1);
+    inInc2[2] = inInc2[1]*(extent[3] - extent[2] + 1);
+    vtkIdType bufferSize = inInc2[2]*(extent[5] - extent[4] + 1);
+
+    resampleBuffer = new char[bufferSize*inData0->GetScalarSize()];
+    resampleStencil = vtkImageStencilData::New();
+
+    switch (scalarType)
+      {
+      vtkTemplateAliasMacro(
+        vtkImageSimilarityMetricFusedResample(
+          stencil, interpolator, this->IndexMatrix, extent,
+          reinterpret_cast<VTK_TT *>(resampleBuffer), resampleStencil));
+      default:
+        vtkErrorMacro(<< "Execute: Unknown ScalarType");
+      }
+
+    inPtr1 = resampleBuffer;
+    stencil = resampleStencil;
+    }
+  else
+    {
+    inPtr1 = inData1->GetScalarPointerForExtent(extent);
+    inData1->GetIncrements(inInc2);
+    }
+
   // only used for tracking progress
   vtkAlgorithm *progress = (pieceId == 0 ? this : 0);
 
-  int scalarType = inData0->GetScalarType();
-
   if (scalarType == VTK_FLOAT || scalarType == VTK_DOUBLE)
     {
     // use a floating-point type for computing sums
@@ -1002,6 +1047,12 @@ void vtkImageNeighborhoodCorrelation::PieceRequestData(
         vtkErrorMacro(<< "Execute: Unknown ScalarType");
       }
     }
+
+  if (interpolator)
+    {
+    delete [] resampleBuffer;
+    resampleStencil->Delete();
+    }
 }
 
 //----------------------------------------------------------------------------
@@ -35,16 +35,27 @@
 #include <vtkStreamingDemandDrivenPipeline.h>
 #include <vtkImageHistogramStatistics.h>
 #include <vtkImageBSplineCoefficients.h>
+#include <vtkImageInterpolator.h>
 #include <vtkImageBSplineInterpolator.h>
 #include <vtkImageSincInterpolator.h>
+#include <vtkImageResize.h>
+#include <vtkImageFFT.h>
+#include <vtkImageRFFT.h>
+#include <vtkSmartPointer.h>
+#include <vtkMinimalStandardRandomSequence.h>
+#include <vtkMultiThreader.h>
+#include <vtkTemplateAliasMacro.h>
 #include <vtkVersion.h>
 
 // Interpolator header files
 #include "vtkLabelInterpolator.h"
+#include "vtkCalcCentroid.h"
+#include "vtkImageRegistrationTarget.h"
 
 // Optimizer header files
 #include "vtkNelderMeadMinimizer.h"
 #include "vtkPowellMinimizer.h"
+#include "vtkLBFGSMinimizer.h"
 
 // Image metric header files
 #include "vtkImageSquaredDifference.h"
@@ -53,8 +64,16 @@
 #include "vtkImageCrossCorrelation.h"
 #include "vtkImageNeighborhoodCorrelation.h"
 
+// Threading header files
+#include "vtkWorkerThreadPool.h"
+
 // C header files
 #include <math.h>
+#include <string.h>
+
+// C++ header files
+#include <vector>
+#include <algorithm>
 
 // A macro to assist VTK 5 backwards compatibility
 #if VTK_MAJOR_VERSION >= 6
@@ -65,18 +84,68 @@
 #define SET_STENCIL_DATA SetStencil
 #endif
 
+// Check whether vtkThreadedImageAlgorithm has EnableSMP
+#if VTK_MAJOR_VERSION > 7 || (VTK_MAJOR_VERSION == 7 && VTK_MINOR_VERSION >= 0)
+#define USE_SMP_THREADED_IMAGE_ALGORITHM
+#endif
+
+// A metric, and a reslice pipeline if fusion is off, that can be used
+// from a worker thread while other probes are used from other threads
+struct vtkImageRegistrationProbe
+{
+  vtkSmartPointer<vtkImageSimilarityMetric> Metric;
+  vtkSmartPointer<vtkImageReslice> Reslice;
+  vtkSmartPointer<vtkMatrixToLinearTransform> Transform;
+};
+
+// A copy of an image that was placed by the threads of the pool, and the
+// image that it was copied from, so that later levels that use the same
+// image can use the same copy.  The original is only compared, and it is
+// not referenced, since it might be deleted while the copy is kept.
+struct vtkImageRegistrationPlacedImage
+{
+  vtkImageRegistrationPlacedImage() : Original(NULL), NumberOfThreads(0) {}
+
+  // check whether this is a current copy of the image, that was placed
+  // for the given number of threads
+  bool IsCopyOf(vtkImageData *image, int numberOfThreads)
+    {
+    return (this->Copy && this->Original == image &&
+            this->NumberOfThreads == numberOfThreads &&
+            image->GetMTime() < this->CopyTime.GetMTime());
+    }
+
+  void Release()
+    {
+    this->Copy = NULL;
+    this->Original = NULL;
+    this->NumberOfThreads = 0;
+    }
+
+  vtkSmartPointer<vtkImageData> Copy;
+  vtkImageData *Original;
+  vtkTimeStamp CopyTime;
+  int NumberOfThreads;
+};
+
 // A helper class for the optimizer
 struct vtkImageRegistrationInfo
 {
-  vtkTransform *Transform;
+  vtkMatrixToLinearTransform *Transform;
   vtkFunctionMinimizer *Optimizer;
   vtkImageSimilarityMetric *Metric;
+  vtkImageReslice *Reslice;
   vtkMatrix4x4 *InitialMatrix;
 
   vtkDoubleArray *MetricValues;
   vtkDoubleArray *CostValues;
   vtkDoubleArray *ParameterValues;
 
+  // the profile of the current evaluation, and when the last one ended
+  vtkDoubleArray *ProfileValues;
+  double Profile[7];
+  double ProfileTime;
+
   int TransformDimensionality;
   int TransformType;
   int OptimizerType;
@@ -85,6 +154,86 @@ struct vtkImageRegistrationInfo
   double Center[3];
 
   int NumberOfEvaluations;
+
+  // the line that the optimizer is searching along, with the matrix at
+  // the start of the line and the change in the matrix per unit step,
+  // and whether the metric has to be given the line again
+  bool LineActive;
+  bool LineChanged;
+  double LineOrigin[12];
+  double LineDirection[12];
+  double LineMatrix[16];
+  double LineDelta[16];
+
+  // the best cost so far and its parameters, the best cost is also used
+  // as the ceiling for early abandonment
+  bool EarlyAbandon;
+  double BestCost;
+  double BestParameters[12];
+
+  // the time at which the optimizer must stop, or zero for no limit
+  double Deadline;
+
+  // independent pipelines for evaluating several points concurrently
+  std::vector<vtkImageRegistrationProbe> Probes;
+  vtkWorkerThreadPool *ThreadPool;
+  int ConcurrentBatchSize;
+
+  // scratch space for batches, kept so that it is not allocated for every
+  // batch, and a count of the times that it or the trace had to grow
+  std::vector<double> BatchMatrices;
+  std::vector<double> BatchSteps;
+  std::vector<double> BatchValues;
+  std::vector<double> BatchProfile;
+  vtkTypeUInt64 NumberOfAllocations;
+
+  // the copies of the images that were placed by the pool threads, and
+  // the PinThreads setting of the pool from before it was pinned for
+  // placement, or -1 if the pool was not pinned for placement
+  vtkImageRegistrationPlacedImage PlacedSourceImage;
+  vtkImageRegistrationPlacedImage PlacedTargetImage;
+  int SavedPinThreads;
+};
+
+// A helper class for multi-resolution registration
+struct vtkImageRegistrationPyramid
+{
+  // the settings for each level, zero or -1 means "use default"
+  std::vector<double> ShrinkFactors;
+  std::vector<int> MaximumNumberOfEvaluations;
+  std::vector<int> InterpolatorTypes;
+  std::vector<double> TransformTolerances;
+  std::vector<double> SamplingFractions;
+
+  // the cached images for each level, and how they were built
+  std::vector<vtkSmartPointer<vtkImageData> > SourceImages;
+  std::vector<vtkSmartPointer<vtkImageData> > TargetImages;
+  std::vector<vtkSmartPointer<vtkImageStencilData> > SourceStencils;
+  std::vector<double> BuiltShrinkFactors;
+  std::vector<int> BuiltInterpolate;
+  vtkImageData *BuiltSourceImage;
+  vtkImageData *BuiltTargetImage;
+  vtkImageStencilData *BuiltSourceStencil;
+  vtkTimeStamp BuildTime;
+
+  // shallow copies of the images of the prepared target, indexed by
+  // level + 1 so that the original target image is first
+  std::vector<vtkSmartPointer<vtkImageData> > PreparedImages;
+  std::vector<vtkSmartPointer<vtkImageData> > PreparedQuantizedImages;
+  std::vector<vtkSmartPointer<vtkImageData> > PreparedCoefficients;
+
+  // the results for each level
+  std::vector<double> ElapsedTimes;
+  std::vector<int> NumberOfEvaluations;
+
+  // the sampling fractions set to fit the time budget (zero for none),
+  // the fractions that were used, and the time left when each level began
+  std::vector<double> BudgetSamplingFractions;
+  std::vector<double> UsedSamplingFractions;
+  std::vector<double> TimeBudgets;
+
+  int CurrentLevel;
+  double StartTime;
 };
 
 //----------------------------------------------------------------------------
@@ -107,13 +256,34 @@ vtkImageRegistration* vtkImageRegistration::New()
 vtkImageRegistration::vtkImageRegistration()
 {
   this->OptimizerType = vtkImageRegistration::Powell;
+  this->ProbeMemoryLimit = 512.0;
   this->MetricType = vtkImageRegistration::MutualInformation;
   this->InterpolatorType = vtkImageRegistration::Linear;
   this->TransformType = vtkImageRegistration::Rigid;
   this->InitializerType = vtkImageRegistration::None;
+  this->InitializerAngleStep = 90.0;
+  this->InitializerTranslationStep = 0.0;
+  this->InitializerNumberOfSeeds = 4;
+  this->InitializerMaximumNumberOfEvaluations = 0;
+  this->InitializerMaximumTime = 0.0;
   this->TransformDimensionality = 3;
-
-  this->Transform = vtkTransform::New();
+  this->FusedEvaluation = false;
+  this->IncrementalLineSearch = false;
+  this->EarlyAbandon = false;
+  this->UseSampleList = false;
+  this->BalancedSplit = false;
+  this->NUMAPlacement = false;
+  this->TimeBudget = 0.0;
+  this->StoppedByTimeBudget = false;
+  this->Precision = vtkImageRegistration::DefaultPrecision;
+  this->SamplingFraction = 1.0;
+  this->SamplingStrategy = vtkImageRegistration::StratifiedSampling;
+
+  // the transform's matrix is modified in place by the optimizer
+  this->Transform = vtkMatrixToLinearTransform::New();
+  vtkMatrix4x4 *transformMatrix = vtkMatrix4x4::New();
+  this->Transform->SetInput(transformMatrix);
+  transformMatrix->Delete();
   this->Metric = NULL;
   this->Optimizer = NULL;
   this->Interpolator = NULL;
@@ -122,15 +292,36 @@ vtkImageRegistration::vtkImageRegistration()
   this->RegistrationInfo->Transform = NULL;
   this->RegistrationInfo->Optimizer = NULL;
   this->RegistrationInfo->Metric = NULL;
+  this->RegistrationInfo->Reslice = NULL;
   this->RegistrationInfo->InitialMatrix = NULL;
   this->RegistrationInfo->MetricValues = NULL;
   this->RegistrationInfo->CostValues = NULL;
   this->RegistrationInfo->ParameterValues = NULL;
+  this->RegistrationInfo->ProfileValues = NULL;
+  this->RegistrationInfo->ProfileTime = 0.0;
   this->RegistrationInfo->TransformDimensionality = 0;
   this->RegistrationInfo->TransformType = 0;
   this->RegistrationInfo->OptimizerType = 0;
   this->RegistrationInfo->MetricType = 0;
   this->RegistrationInfo->NumberOfEvaluations = 0;
+  this->RegistrationInfo->LineActive = false;
+  this->RegistrationInfo->LineChanged = false;
+  this->RegistrationInfo->EarlyAbandon = false;
+  this->RegistrationInfo->BestCost = VTK_DOUBLE_MAX;
+  this->RegistrationInfo->Deadline = 0.0;
+  this->RegistrationInfo->ThreadPool = NULL;
+  this->RegistrationInfo->ConcurrentBatchSize = VTK_INT_MAX;
+  this->RegistrationInfo->NumberOfAllocations = 0;
+  this->RegistrationInfo->SavedPinThreads = -1;
+
+  this->Pyramid = new vtkImageRegistrationPyramid;
+  this->Pyramid->BuiltSourceImage = NULL;
+  this->Pyramid->BuiltTargetImage = NULL;
+  this->Pyramid->BuiltSourceStencil = NULL;
+  this->Pyramid->CurrentLevel = -1;
+  this->Pyramid->StartTime = 0.0;
+  this->NumberOfLevels = 0;
+  this->SetNumberOfLevels(1);
 
   this->JointHistogramSize[0] = 64;
   this->JointHistogramSize[1] = 64;
@@ -144,6 +335,9 @@ vtkImageRegistration::vtkImageRegistration()
   this->ImageBSpline = vtkImageBSplineCoefficients::New();
   this->TargetImageTypecast = vtkImageShiftScale::New();
   this->SourceImageTypecast = vtkImageShiftScale::New();
+  this->SamplingStencil = vtkImageStencilData::New();
+  this->ThreadPool = vtkWorkerThreadPool::New();
+  this->PreparedTarget = NULL;
 
   this->MetricValue = 0.0;
   this->CostValue = 0.0;
@@ -152,6 +346,10 @@ vtkImageRegistration::vtkImageRegistration()
   this->MetricValues = vtkDoubleArray::New();
   this->CostValues = vtkDoubleArray::New();
   this->ParameterValues = vtkDoubleArray::New();
+  this->CollectProfile = false;
+  this->ProfileValues = vtkDoubleArray::New();
+  this->InitializerCostValues = vtkDoubleArray::New();
+  this->InitializerParameterValues = vtkDoubleArray::New();
 
   this->CostTolerance = 1e-4;
   this->TransformTolerance = 1e-1;
@@ -195,11 +393,33 @@ vtkImageRegistration::~vtkImageRegistration()
     {
     this->ParameterValues->Delete();
     }
+  if (this->ProfileValues)
+    {
+    this->ProfileValues->Delete();
+    }
+  if (this->InitializerCostValues)
+    {
+    this->InitializerCostValues->Delete();
+    }
+  if (this->InitializerParameterValues)
+    {
+    this->InitializerParameterValues->Delete();
+    }
 
   if (this->RegistrationInfo)
     {
+    // the pool might still be used by whoever else holds a reference
+    if (this->RegistrationInfo->SavedPinThreads >= 0 && this->ThreadPool)
+      {
+      this->ThreadPool->SetPinThreads(
+        this->RegistrationInfo->SavedPinThreads);
+      }
     delete this->RegistrationInfo;
     }
+  if (this->Pyramid)
+    {
+    delete this->Pyramid;
+    }
 
   if (this->InitialTransformMatrix)
     {
@@ -221,6 +441,18 @@ vtkImageRegistration::~vtkImageRegistration()
     {
     this->ImageBSpline->Delete();
     }
+  if (this->SamplingStencil)
+    {
+    this->SamplingStencil->Delete();
+    }
+  if (this->ThreadPool)
+    {
+    this->ThreadPool->Delete();
+    }
+  if (this->PreparedTarget)
+    {
+    this->PreparedTarget->UnRegister(this);
+    }
 }
 
 //----------------------------------------------------------------------------
@@ -229,12 +461,57 @@ void vtkImageRegistration::PrintSelf(ostream& os, vtkIndent indent)
   this->Superclass::PrintSelf(os,indent);
 
   os << indent << "OptimizerType: " << this->OptimizerType << "\n";
+  os << indent << "ProbeMemoryLimit: " << this->ProbeMemoryLimit << "\n";
   os << indent << "MetricType: " << this->MetricType << "\n";
   os << indent << "InterpolatorType: " << this->InterpolatorType << "\n";
   os << indent << "TransformType: " << this->TransformType << "\n";
   os << indent << "TransformDimensionality: "
      << this->TransformDimensionality << "\n";
   os << indent << "InitializerType: " << this->InitializerType << "\n";
+  os << indent << "InitializerAngleStep: "
+     << this->InitializerAngleStep << "\n";
+  os << indent << "InitializerTranslationStep: "
+     << this->InitializerTranslationStep << "\n";
+  os << indent << "InitializerNumberOfSeeds: "
+     << this->InitializerNumberOfSeeds << "\n";
+  os << indent << "InitializerMaximumNumberOfEvaluations: "
+     << this->InitializerMaximumNumberOfEvaluations << "\n";
+  os << indent << "InitializerMaximumTime: "
+     << this->InitializerMaximumTime << "\n";
+  os << indent << "FusedEvaluation: "
+     << (this->FusedEvaluation ? "On\n" : "Off\n");
+  os << indent << "IncrementalLineSearch: "
+     << (this->IncrementalLineSearch ? "On\n" : "Off\n");
+  os << indent << "EarlyAbandon: "
+     << (this->EarlyAbandon ? "On\n" : "Off\n");
+  os << indent << "UseSampleList: "
+     << (this->UseSampleList ? "On\n" : "Off\n");
+  os << indent << "BalancedSplit: "
+     << (this->BalancedSplit ? "On\n" : "Off\n");
+  os << indent << "NUMAPlacement: "
+     << (this->NUMAPlacement ? "On\n" : "Off\n");
+  os << indent << "TimeBudget: " << this->TimeBudget << "\n";
+  os << indent << "StoppedByTimeBudget: "
+     << (this->StoppedByTimeBudget ? "On\n" : "Off\n");
+  os << indent << "Precision: "
+     << (this->Precision == vtkImageRegistration::SinglePrecision ?
+         "Single\n" : "Default\n");
+  os << indent << "SamplingFraction: " << this->SamplingFraction << "\n";
+  os << indent << "SamplingStrategy: " << this->SamplingStrategy << "\n";
+  os << indent << "ThreadPool: " << this->ThreadPool << "\n";
+  os << indent << "PreparedTarget: " << this->PreparedTarget << "\n";
+  os << indent << "NumberOfLevels: " << this->NumberOfLevels << "\n";
+  for (int level = 0; level < this->NumberOfLevels; level++)
+    {
+    os << indent << "Level " << level << ": "
+       << "ShrinkFactor " << this->GetLevelShrinkFactor(level)
+       << ", MaximumNumberOfEvaluations "
+       << this->GetLevelMaximumNumberOfEvaluations(level)
+       << ", InterpolatorType " << this->GetLevelInterpolatorType(level)
+       << ", TransformTolerance " << this->GetLevelTransformTolerance(level)
+       << ", SamplingFraction " << this->GetLevelSamplingFraction(level)
+       << "\n";
+    }
   os << indent << "CostTolerance: " << this->CostTolerance << "\n";
   os << indent << "TransformTolerance: " << this->TransformTolerance << "\n";
   os << indent << "MaximumNumberOfIterations: "
@@ -254,6 +531,13 @@ void vtkImageRegistration::PrintSelf(ostream& os, vtkIndent indent)
   os << indent << "MetricValues: " << this->MetricValues << "\n";
   os << indent << "CostValues: " << this->CostValues << "\n";
   os << indent << "ParameterValues: " << this->ParameterValues << "\n";
+  os << indent << "CollectProfile: "
+     << (this->CollectProfile ? "On\n" : "Off\n");
+  os << indent << "ProfileValues: " << this->ProfileValues << "\n";
+  os << indent << "InitializerCostValues: "
+     << this->InitializerCostValues << "\n";
+  os << indent << "InitializerParameterValues: "
+     << this->InitializerParameterValues << "\n";
   os << indent << "NumberOfEvaluations: "
      << this->RegistrationInfo->NumberOfEvaluations << "\n";
 }
@@ -335,12 +619,236 @@ vtkImageStencilData* vtkImageRegistration::GetSourceImageStencil()
     this->GetExecutive()->GetInputData(2, 0));
 }
 
+//----------------------------------------------------------------------------
+void vtkImageRegistration::SetNumberOfLevels(int n)
+{
+  n = (n > 1 ? n : 1);
+  if (n != this->NumberOfLevels)
+    {
+    vtkImageRegistrationPyramid *pyramid = this->Pyramid;
+    this->NumberOfLevels = n;
+    pyramid->ShrinkFactors.assign(n, 0.0);
+    pyramid->MaximumNumberOfEvaluations.assign(n, 0);
+    pyramid->InterpolatorTypes.assign(n, -1);
+    pyramid->TransformTolerances.assign(n, 0.0);
+    pyramid->SamplingFractions.assign(n, 0.0);
+    pyramid->ElapsedTimes.assign(n, 0.0);
+    pyramid->NumberOfEvaluations.assign(n, 0);
+    pyramid->CurrentLevel = -1;
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistration::SetLevelShrinkFactor(int level, double factor)
+{
+  if (level < 0 || level >= this->NumberOfLevels)
+    {
+    vtkErrorMacro("SetLevelShrinkFactor: level " << level
+                  << " is out of range");
+    return;
+    }
+  this->Pyramid->ShrinkFactors[level] = factor;
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+double vtkImageRegistration::GetLevelShrinkFactor(int level)
+{
+  if (level < 0 || level >= this->NumberOfLevels)
+    {
+    return 1.0;
+    }
+  double factor = this->Pyramid->ShrinkFactors[level];
+  if (factor <= 0.0)
+    {
+    factor = ldexp(1.0, this->NumberOfLevels - 1 - level);
+    }
+  return factor;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistration::SetLevelMaximumNumberOfEvaluations(
+  int level, int n)
+{
+  if (level < 0 || level >= this->NumberOfLevels)
+    {
+    vtkErrorMacro("SetLevelMaximumNumberOfEvaluations: level " << level
+                  << " is out of range");
+    return;
+    }
+  this->Pyramid->MaximumNumberOfEvaluations[level] = n;
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+int vtkImageRegistration::GetLevelMaximumNumberOfEvaluations(int level)
+{
+  if (level < 0 || level >= this->NumberOfLevels ||
+      this->Pyramid->MaximumNumberOfEvaluations[level] <= 0)
+    {
+    return this->MaximumNumberOfEvaluations;
+    }
+  return this->Pyramid->MaximumNumberOfEvaluations[level];
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistration::SetLevelInterpolatorType(int level, int type)
+{
+  if (level < 0 || level >= this->NumberOfLevels)
+    {
+    vtkErrorMacro("SetLevelInterpolatorType: level " << level
+                  << " is out of range");
+    return;
+    }
+  this->Pyramid->InterpolatorTypes[level] = type;
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+int vtkImageRegistration::GetLevelInterpolatorType(int level)
+{
+  if (level < 0 || level >= this->NumberOfLevels ||
+      this->Pyramid->InterpolatorTypes[level] < 0)
+    {
+    return this->InterpolatorType;
+    }
+  return this->Pyramid->InterpolatorTypes[level];
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistration::SetLevelTransformTolerance(int level, double tol)
+{
+  if (level < 0 || level >= this->NumberOfLevels)
+    {
+    vtkErrorMacro("SetLevelTransformTolerance: level " << level
+                  << " is out of range");
+    return;
+    }
+  this->Pyramid->TransformTolerances[level] = tol;
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+double vtkImageRegistration::GetLevelTransformTolerance(int level)
+{
+  if (level < 0 || level >= this->NumberOfLevels)
+    {
+    return this->TransformTolerance;
+    }
+  double tol = this->Pyramid->TransformTolerances[level];
+  if (tol <= 0.0)
+    {
+    tol = this->TransformTolerance*this->GetLevelShrinkFactor(level);
+    }
+  return tol;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistration::SetLevelSamplingFraction(
+  int level, double fraction)
+{
+  if (level < 0 || level >= this->NumberOfLevels)
+    {
+    vtkErrorMacro("SetLevelSamplingFraction: level " << level
+                  << " is out of range");
+    return;
+    }
+  this->Pyramid->SamplingFractions[level] = fraction;
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+double vtkImageRegistration::GetLevelSamplingFraction(int level)
+{
+  if (level < 0 || level >= this->NumberOfLevels ||
+      this->Pyramid->SamplingFractions[level] <= 0.0)
+    {
+    return this->SamplingFraction;
+    }
+  double fraction = this->Pyramid->SamplingFractions[level];
+  return (fraction < 1.0 ? fraction : 1.0);
+}
+
+//----------------------------------------------------------------------------
+int vtkImageRegistration::GetCurrentLevel()
+{
+  return this->Pyramid->CurrentLevel;
+}
+
+//----------------------------------------------------------------------------
+vtkImageData *vtkImageRegistration::GetLevelSourceImage(int level)
+{
+  if (level < 0 ||
+      level >= static_cast<int>(this->Pyramid->SourceImages.size()))
+    {
+    return NULL;
+    }
+  return this->Pyramid->SourceImages[level];
+}
+
+//----------------------------------------------------------------------------
+vtkImageData *vtkImageRegistration::GetLevelTargetImage(int level)
+{
+  if (level < 0 ||
+      level >= static_cast<int>(this->Pyramid->TargetImages.size()))
+    {
+    return NULL;
+    }
+  return this->Pyramid->TargetImages[level];
+}
+
+//----------------------------------------------------------------------------
+double vtkImageRegistration::GetLevelElapsedTime(int level)
+{
+  if (level < 0 || level >= this->NumberOfLevels)
+    {
+    return 0.0;
+    }
+  return this->Pyramid->ElapsedTimes[level];
+}
+
+//----------------------------------------------------------------------------
+int vtkImageRegistration::GetLevelNumberOfEvaluations(int level)
+{
+  if (level < 0 || level >= this->NumberOfLevels)
+    {
+    return 0;
+    }
+  return this->Pyramid->NumberOfEvaluations[level];
+}
+
+//----------------------------------------------------------------------------
+double vtkImageRegistration::GetLevelUsedSamplingFraction(int level)
+{
+  if (level < 0 ||
+      level >= static_cast<int>(this->Pyramid->UsedSamplingFractions.size()))
+    {
+    return 0.0;
+    }
+  return this->Pyramid->UsedSamplingFractions[level];
+}
+
+//----------------------------------------------------------------------------
+double vtkImageRegistration::GetLevelTimeBudget(int level)
+{
+  if (level < 0 ||
+      level >= static_cast<int>(this->Pyramid->TimeBudgets.size()))
+    {
+    return 0.0;
+    }
+  return this->Pyramid->TimeBudgets[level];
+}
+
 //--------------------------------------------------------------------------
 namespace {
 
-void vtkTransformRotation(
-  vtkTransform *transform, double rx, double ry, double rz)
+// Compute the rotation matrix for a rotation vector, whose direction is
+// the axis and whose norm is the angle
+void vtkRotationMatrix(double rx, double ry, double rz, double matrix[16])
 {
+  vtkMatrix4x4::Identity(matrix);
+
   // angle is the norm of the parameters,
   // axis is the unit vector from the parameters
   double theta2 = rx*rx + ry*ry + rz*rz;
@@ -371,44 +879,38 @@ void vtkTransformRotation(
 
     double s = ww - xx - yy - zz;
 
-    double matrix[16];
     matrix[0] = xx*2 + s;
     matrix[1] = (xy - wz)*2;
     matrix[2] = (xz + wy)*2;
-    matrix[3] = 0.0;
     matrix[4] = (xy + wz)*2;
     matrix[5] = yy*2 + s;
     matrix[6] = (yz - wx)*2;
-    matrix[7] = 0.0;
     matrix[8] = (xz - wy)*2;
     matrix[9] = (yz + wx)*2;
     matrix[10] = zz*2 + s;
-    matrix[11] = 0.0;
-    matrix[12] = 0.0;
-    matrix[13] = 0.0;
-    matrix[14] = 0.0;
-    matrix[15] = 1.0;
-
-    transform->Concatenate(matrix);
     }
 }
 
-void vtkSetTransformParameters(vtkImageRegistrationInfo *registrationInfo)
+//--------------------------------------------------------------------------
+// Compute the matrix for the given optimizer parameters.  This is done in
+// closed form, rather than with vtkTransform, so that it can be called
+// for every evaluation without allocating any memory.
+void vtkComputeTransformMatrix(
+  vtkImageRegistrationInfo *registrationInfo, const double *parameters,
+  double matrix[16])
 {
-  vtkFunctionMinimizer* optimizer = registrationInfo->Optimizer;
-  vtkTransform* transform = registrationInfo->Transform;
   vtkMatrix4x4 *initialMatrix = registrationInfo->InitialMatrix;
   int transformType = registrationInfo->TransformType;
   int transformDim = registrationInfo->TransformDimensionality;
 
   int pcount = 0;
 
-  double tx = optimizer->GetParameterValue(pcount++);
-  double ty = optimizer->GetParameterValue(pcount++);
+  double tx = parameters[pcount++];
+  double ty = parameters[pcount++];
   double tz = 0.0;
   if (transformDim > 2)
     {
-    tz = optimizer->GetParameterValue(pcount++);
+    tz = parameters[pcount++];
     }
 
   double rx = 0.0;
@@ -419,10 +921,10 @@ void vtkSetTransformParameters(vtkImageRegistrationInfo *registrationInfo)
     {
     if (transformDim > 2)
       {
-      rx = optimizer->GetParameterValue(pcount++);
-      ry = optimizer->GetParameterValue(pcount++);
+      rx = parameters[pcount++];
+      ry = parameters[pcount++];
       }
-    rz = optimizer->GetParameterValue(pcount++);
+    rz = parameters[pcount++];
     }
 
   double sx = 1.0;
@@ -431,7 +933,7 @@ void vtkSetTransformParameters(vtkImageRegistrationInfo *registrationInfo)
 
   if (transformType > vtkImageRegistration::Rigid)
     {
-    sx = exp(optimizer->GetParameterValue(pcount++));
+    sx = exp(parameters[pcount++]);
     sy = sx;
     if (transformDim > 2)
       {
@@ -443,9 +945,9 @@ void vtkSetTransformParameters(vtkImageRegistrationInfo *registrationInfo)
     {
     if (transformDim > 2)
       {
-      sx = sz*exp(optimizer->GetParameterValue(pcount++));
+      sx = sz*exp(parameters[pcount++]);
       }
-    sy = sz*exp(optimizer->GetParameterValue(pcount++));
+    sy = sz*exp(parameters[pcount++]);
     }
 
   bool scaledAtSource =
@@ -459,119 +961,1639 @@ void vtkSetTransformParameters(vtkImageRegistrationInfo *registrationInfo)
     {
     if (transformDim > 2)
       {
-      qx = optimizer->GetParameterValue(pcount++);
-      qy = optimizer->GetParameterValue(pcount++);
+      qx = parameters[pcount++];
+      qy = parameters[pcount++];
       }
-    qz = optimizer->GetParameterValue(pcount++);
+    qz = parameters[pcount++];
     }
 
   double *center = registrationInfo->Center;
 
-  transform->Identity();
-  transform->PostMultiply();
-  transform->Translate(-center[0], -center[1], -center[2]);
+  // the scale along the axes given by the rotation q, i.e. R(q)*S*R(-q),
+  // where R(-q) is the transpose of R(q)
+  double scale[16];
+  double rotation[16];
+  double s[3] = { sx, sy, sz };
+  vtkRotationMatrix(qx, qy, qz, rotation);
+  vtkMatrix4x4::Identity(scale);
+  for (int i = 0; i < 3; i++)
+    {
+    for (int j = 0; j < 3; j++)
+      {
+      const double *ri = rotation + 4*i;
+      const double *rj = rotation + 4*j;
+      scale[4*i + j] = ri[0]*s[0]*rj[0] + ri[1]*s[1]*rj[1] + ri[2]*s[2]*rj[2];
+      }
+    }
+
+  // the transform about the center, in the same order in which it was
+  // concatenated in PostMultiply mode before the closed form was used
+  double m[16];
+  vtkRotationMatrix(rx, ry, rz, rotation);
   if (scaledAtSource)
     {
-    vtkTransformRotation(transform, -qx, -qy, -qz);
-    transform->Scale(sx, sy, sz);
-    vtkTransformRotation(transform, qx, qy, qz);
-    transform->Concatenate(initialMatrix);
-    vtkTransformRotation(transform, rx, ry, rz);
+    vtkMatrix4x4::Multiply4x4(*initialMatrix->Element, scale, m);
+    vtkMatrix4x4::Multiply4x4(rotation, m, m);
     }
   else
     {
-    vtkTransformRotation(transform, rx, ry, rz);
-    transform->Concatenate(initialMatrix);
-    vtkTransformRotation(transform, -qx, -qy, -qz);
-    transform->Scale(sx, sy, sz);
-    vtkTransformRotation(transform, qx, qy, qz);
+    vtkMatrix4x4::Multiply4x4(*initialMatrix->Element, rotation, m);
+    vtkMatrix4x4::Multiply4x4(scale, m, m);
+    }
+
+  // pre-translate by -center, post-translate by center + t
+  double t[3] = { center[0] + tx, center[1] + ty, center[2] + tz };
+  for (int i = 0; i < 4; i++)
+    {
+    const double *row = m + 4*i;
+    matrix[4*i] = row[0];
+    matrix[4*i + 1] = row[1];
+    matrix[4*i + 2] = row[2];
+    matrix[4*i + 3] = row[3] -
+      (row[0]*center[0] + row[1]*center[1] + row[2]*center[2]);
+    }
+  for (int i = 0; i < 3; i++)
+    {
+    for (int j = 0; j < 4; j++)
+      {
+      matrix[4*i + j] += t[i]*matrix[12 + j];
+      }
     }
-  transform->Translate(center[0], center[1], center[2]);
-  transform->Translate(tx,ty,tz);
 }
 
 //--------------------------------------------------------------------------
-void vtkEvaluateFunction(void * arg)
+// Create a transform whose matrix can be set with vtkSetTransformMatrix().
+vtkSmartPointer<vtkMatrixToLinearTransform> vtkNewMatrixTransform()
 {
-  vtkImageRegistrationInfo *registrationInfo =
-    static_cast<vtkImageRegistrationInfo*>(arg);
-
-  vtkFunctionMinimizer *optimizer = registrationInfo->Optimizer;
-  vtkImageSimilarityMetric *metric = registrationInfo->Metric;
+  vtkSmartPointer<vtkMatrixToLinearTransform> transform =
+    vtkSmartPointer<vtkMatrixToLinearTransform>::New();
+  vtkSmartPointer<vtkMatrix4x4> matrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  transform->SetInput(matrix);
+  return transform;
+}
 
-  vtkSetTransformParameters(registrationInfo);
+//--------------------------------------------------------------------------
+// Set the matrix of a transform in place, unlike vtkTransform::SetMatrix()
+// this does not allocate any memory.
+void vtkSetTransformMatrix(
+  vtkMatrixToLinearTransform *transform, const double matrix[16])
+{
+  transform->GetInput()->DeepCopy(matrix);
+}
 
-  registrationInfo->Metric->Update();
+//--------------------------------------------------------------------------
+// Set the transform from the given optimizer parameters.
+void vtkSetTransformParameters(
+  vtkImageRegistrationInfo *registrationInfo, const double *parameters,
+  vtkMatrixToLinearTransform *transform)
+{
+  double matrix[16];
+  vtkComputeTransformMatrix(registrationInfo, parameters, matrix);
+  vtkSetTransformMatrix(transform, matrix);
+}
 
-  optimizer->SetFunctionValue(metric->GetCost());
+//--------------------------------------------------------------------------
+// Set the registration transform from the current optimizer parameters.
+void vtkSetTransformParameters(vtkImageRegistrationInfo *registrationInfo)
+{
+  vtkFunctionMinimizer *optimizer = registrationInfo->Optimizer;
 
-  if (registrationInfo->MetricValues)
+  double parameters[12];
+  int n = optimizer->GetNumberOfParameters();
+  for (int i = 0; i < n; i++)
     {
-    registrationInfo->MetricValues->InsertNextValue(metric->GetValue());
+    parameters[i] = optimizer->GetParameterValue(i);
     }
-  if (registrationInfo->CostValues)
+
+  vtkSetTransformParameters(
+    registrationInfo, parameters, registrationInfo->Transform);
+}
+
+//--------------------------------------------------------------------------
+// Get a scratch buffer with room for at least n values.  The buffer only
+// grows, so after the first few evaluations it is never reallocated.
+double *vtkScratchBuffer(
+  vtkImageRegistrationInfo *registrationInfo, std::vector<double> *buffer,
+  size_t n)
+{
+  if (buffer->size() < n)
     {
-    registrationInfo->CostValues->InsertNextValue(metric->GetCost());
+    buffer->resize(n);
+    registrationInfo->NumberOfAllocations++;
     }
-  if (registrationInfo->ParameterValues)
+  return &(*buffer)[0];
+}
+
+//--------------------------------------------------------------------------
+// Count the trace arrays that will have to grow to hold "count" more
+// tuples, which only happens if more evaluations were done than were
+// reserved for when the level was initialized.
+void vtkCountTraceAllocations(
+  vtkImageRegistrationInfo *registrationInfo, int count)
+{
+  vtkDoubleArray *arrays[4] = {
+    registrationInfo->MetricValues, registrationInfo->CostValues,
+    registrationInfo->ParameterValues, registrationInfo->ProfileValues };
+  for (int i = 0; i < 4; i++)
     {
-    double parameters[12];
-    int n = optimizer->GetNumberOfParameters();
-    for (int i = 0; i < n; i++)
+    vtkDoubleArray *array = arrays[i];
+    if (array && array->GetMaxId() + 1 +
+        count*array->GetNumberOfComponents() > array->GetSize())
       {
-      parameters[i] = optimizer->GetParameterValue(i);
+      registrationInfo->NumberOfAllocations++;
       }
-    registrationInfo->ParameterValues->InsertNextTuple(parameters);
     }
-
-  registrationInfo->NumberOfEvaluations++;
 }
 
-} // end anonymous namespace
-
 //--------------------------------------------------------------------------
-void vtkImageRegistration::ComputeImageRange(
-  vtkImageData *data, vtkImageStencilData *stencil, double range[2])
+// Called by the optimizer when it starts a line search along "v".  If the
+// direction only changes the translation parameters, then the matrix is
+// linear in the step length along the line, so the matrix at the start of
+// the line and the change in the matrix per unit step are computed here,
+// and the metric will be given the line before its next evaluation.
+void vtkLineSearchFunction(void *arg, const double *p0, const double *v)
 {
-  vtkImageHistogramStatistics *hist =
-    vtkImageHistogramStatistics::New();
-  hist->SET_STENCIL_DATA(stencil);
-  hist->SET_INPUT_DATA(data);
-  hist->SetActiveComponent(0);
-  hist->Update();
+  vtkImageRegistrationInfo *registrationInfo =
+    static_cast<vtkImageRegistrationInfo *>(arg);
 
-  range[0] = hist->GetMinimum();
-  range[1] = hist->GetMaximum();
+  registrationInfo->LineActive = false;
+  if (p0 == NULL || v == NULL)
+    {
+    return;
+    }
 
-  if (range[0] >= range[1])
+  // the translation parameters always come first
+  int n = registrationInfo->Optimizer->GetNumberOfParameters();
+  int m = (registrationInfo->TransformDimensionality > 2 ? 3 : 2);
+  for (int i = m; i < n; i++)
     {
-    range[1] = range[0] + 1.0;
+    if (v[i] != 0.0)
+      {
+      return;
+      }
     }
 
-  hist->SET_INPUT_DATA(NULL);
-  hist->Delete();
+  double p1[12];
+  for (int i = 0; i < n; i++)
+    {
+    registrationInfo->LineOrigin[i] = p0[i];
+    registrationInfo->LineDirection[i] = v[i];
+    p1[i] = p0[i] + v[i];
+    }
+
+  double matrix[16];
+  vtkComputeTransformMatrix(
+    registrationInfo, p0, registrationInfo->LineMatrix);
+  vtkComputeTransformMatrix(registrationInfo, p1, matrix);
+  for (int k = 0; k < 16; k++)
+    {
+    registrationInfo->LineDelta[k] =
+      matrix[k] - registrationInfo->LineMatrix[k];
+    }
+
+  registrationInfo->LineActive = true;
+  registrationInfo->LineChanged = true;
 }
 
 //--------------------------------------------------------------------------
-void vtkImageRegistration::Initialize(vtkMatrix4x4 *matrix)
+// If the parameters lie on the current line search, compute the matrix
+// and the step along the line, and return true, otherwise return false.
+bool vtkLineSearchMatrix(
+  vtkImageRegistrationInfo *registrationInfo, const double *parameters,
+  double matrix[16], double *step)
 {
-  // update our inputs
-  this->Update();
-
-  int transformDim = this->TransformDimensionality;
-  if (transformDim < 2) { transformDim = 2; }
-  if (transformDim > 3) { transformDim = 3; }
-
-  vtkImageData *targetImage = this->GetTargetImage();
-  vtkImageData *sourceImage = this->GetSourceImage();
-
-  if (targetImage == NULL || sourceImage == NULL)
+  if (!registrationInfo->LineActive)
     {
-    vtkErrorMacro("Initialize: Input images are not set");
-    return;
+    return false;
     }
 
-  // get the source image center
+  // compute the step from the largest component of the direction
+  vtkFunctionMinimizer *optimizer = registrationInfo->Optimizer;
+  int n = optimizer->GetNumberOfParameters();
+  const double *p0 = registrationInfo->LineOrigin;
+  const double *v = registrationInfo->LineDirection;
+  int j = 0;
+  for (int i = 1; i < n; i++)
+    {
+    if (fabs(v[i]) > fabs(v[j]))
+      {
+      j = i;
+      }
+    }
+  if (v[j] == 0.0)
+    {
+    return false;
+    }
+  double t = (parameters[j] - p0[j])/v[j];
+
+  // check that the point is on the line, to within roundoff
+  for (int i = 0; i < n; i++)
+    {
+    double tol = 1e-9*optimizer->GetParameterScale(i);
+    if (fabs(p0[i] + t*v[i] - parameters[i]) > tol)
+      {
+      return false;
+      }
+    }
+
+  for (int k = 0; k < 16; k++)
+    {
+    matrix[k] = registrationInfo->LineMatrix[k] +
+      t*registrationInfo->LineDelta[k];
+    }
+  *step = t;
+
+  return true;
+}
+
+//--------------------------------------------------------------------------
+// Give the current line search to the metric, if it has changed since the
+// metric was last given it.  This is only possible for a metric that was
+// prepared with an interpolator.  Returns false if the metric cannot be
+// evaluated along the line.
+bool vtkLineSearchPrepare(vtkImageRegistrationInfo *registrationInfo)
+{
+  vtkImageSimilarityMetric *metric = registrationInfo->Metric;
+  if (!metric->IsPrepared() || metric->GetInterpolator() == NULL)
+    {
+    return false;
+    }
+
+  if (registrationInfo->LineChanged || !metric->HasLine())
+    {
+    if (!metric->SetLine(
+          registrationInfo->LineMatrix, registrationInfo->LineDelta))
+      {
+      return false;
+      }
+    registrationInfo->LineChanged = false;
+    }
+
+  return true;
+}
+
+//--------------------------------------------------------------------------
+// Evaluate the metric for the given parameters
+double vtkEvaluateMetric(
+  vtkImageRegistrationInfo *registrationInfo, const double *parameters)
+{
+  vtkImageSimilarityMetric *metric = registrationInfo->Metric;
+
+  // the profile is only measured if it is being collected
+  double *profile = NULL;
+  double lastTime = 0.0;
+  if (registrationInfo->ProfileValues)
+    {
+    profile = registrationInfo->Profile;
+    lastTime = vtkTimerLog::GetUniversalTime();
+    }
+
+  double matrix[16];
+  double step = 0.0;
+  bool onLine =
+    vtkLineSearchMatrix(registrationInfo, parameters, matrix, &step);
+  if (!onLine)
+    {
+    vtkComputeTransformMatrix(registrationInfo, parameters, matrix);
+    }
+  vtkSetTransformMatrix(registrationInfo->Transform, matrix);
+
+  if (profile)
+    {
+    double t = vtkTimerLog::GetUniversalTime();
+    profile[0] = t - lastTime;
+    profile[1] = 0.0;
+    lastTime = t;
+    }
+
+  // the metric can stop early if it cannot improve on the best cost
+  if (registrationInfo->EarlyAbandon)
+    {
+    metric->SetCostCeiling(registrationInfo->BestCost);
+    }
+
+  // only the first evaluation goes through the pipeline, after that the
+  // metric is evaluated directly
+  bool preparing = !metric->IsPrepared();
+  if (preparing)
+    {
+    metric->Prepare();
+    }
+  else
+    {
+    if (registrationInfo->Reslice)
+      {
+      registrationInfo->Reslice->Update();
+      if (profile)
+        {
+        double t = vtkTimerLog::GetUniversalTime();
+        profile[1] = t - lastTime;
+        lastTime = t;
+        }
+      }
+    if (onLine && vtkLineSearchPrepare(registrationInfo))
+      {
+      metric->EvaluateLine(step);
+      }
+    else
+      {
+      metric->Evaluate(matrix);
+      }
+    }
+
+  if (profile)
+    {
+    // when the metric was prepared, the time that it did not spend on
+    // its own execution was spent updating its inputs
+    double elapsed = vtkTimerLog::GetUniversalTime() - lastTime;
+    profile[2] = elapsed - metric->GetReduceSeconds();
+    profile[3] = metric->GetReduceSeconds();
+    if (preparing)
+      {
+      profile[1] = profile[2] - metric->GetPieceSeconds();
+      profile[2] = metric->GetPieceSeconds();
+      }
+    profile[4] = 0.0;
+    profile[5] = static_cast<double>(metric->GetNumberOfVoxels());
+    profile[6] = metric->GetThreadUtilization();
+    }
+
+  double cost = metric->GetCost();
+  if (cost < registrationInfo->BestCost)
+    {
+    registrationInfo->BestCost = cost;
+    int n = registrationInfo->Optimizer->GetNumberOfParameters();
+    for (int i = 0; i < n; i++)
+      {
+      registrationInfo->BestParameters[i] = parameters[i];
+      }
+    }
+
+  return cost;
+}
+
+//--------------------------------------------------------------------------
+// Evaluate the metric for the given parameters, and record the result
+double vtkEvaluateParameters(
+  vtkImageRegistrationInfo *registrationInfo, const double *parameters)
+{
+  vtkImageSimilarityMetric *metric = registrationInfo->Metric;
+
+  // the optimizer time is the time since the previous evaluation ended
+  double startTime = 0.0;
+  if (registrationInfo->ProfileValues)
+    {
+    startTime = vtkTimerLog::GetUniversalTime();
+    }
+
+  double cost = vtkEvaluateMetric(registrationInfo, parameters);
+
+  vtkCountTraceAllocations(registrationInfo, 1);
+  if (registrationInfo->MetricValues)
+    {
+    registrationInfo->MetricValues->InsertNextValue(metric->GetValue());
+    }
+  if (registrationInfo->CostValues)
+    {
+    registrationInfo->CostValues->InsertNextValue(cost);
+    }
+  if (registrationInfo->ParameterValues)
+    {
+    registrationInfo->ParameterValues->InsertNextTuple(parameters);
+    }
+  if (registrationInfo->ProfileValues)
+    {
+    double *profile = registrationInfo->Profile;
+    if (registrationInfo->ProfileTime > 0.0)
+      {
+      profile[4] = startTime - registrationInfo->ProfileTime;
+      }
+    registrationInfo->ProfileValues->InsertNextTuple(profile);
+    registrationInfo->ProfileTime = vtkTimerLog::GetUniversalTime();
+    }
+
+  registrationInfo->NumberOfEvaluations++;
+
+  return cost;
+}
+
+//--------------------------------------------------------------------------
+void vtkEvaluateFunction(void * arg)
+{
+  vtkImageRegistrationInfo *registrationInfo =
+    static_cast<vtkImageRegistrationInfo*>(arg);
+
+  vtkFunctionMinimizer *optimizer = registrationInfo->Optimizer;
+
+  double parameters[12];
+  int n = optimizer->GetNumberOfParameters();
+  for (int i = 0; i < n; i++)
+    {
+    parameters[i] = optimizer->GetParameterValue(i);
+    }
+
+  optimizer->SetFunctionValue(
+    vtkEvaluateParameters(registrationInfo, parameters));
+
+  if (registrationInfo->Deadline > 0 &&
+      vtkTimerLog::GetUniversalTime() > registrationInfo->Deadline)
+    {
+    optimizer->AbortFlagOn();
+    }
+}
+
+//--------------------------------------------------------------------------
+// Create a metric of the specified type
+vtkImageSimilarityMetric *vtkImageRegistrationNewMetric(
+  int metricType, int histogramSize[2])
+{
+  vtkImageSimilarityMetric *metric = NULL;
+
+  switch (metricType)
+    {
+    case vtkImageRegistration::SquaredDifference:
+      {
+      metric = vtkImageSquaredDifference::New();
+      }
+      break;
+
+    case vtkImageRegistration::CrossCorrelation:
+    case vtkImageRegistration::NormalizedCrossCorrelation:
+      {
+      vtkImageCrossCorrelation *cc = vtkImageCrossCorrelation::New();
+      metric = cc;
+
+      if (metricType ==
+          vtkImageRegistration::NormalizedCrossCorrelation)
+        {
+        cc->SetMetricToNormalizedCrossCorrelation();
+        }
+      else
+        {
+        cc->SetMetricToCrossCorrelation();
+        }
+      }
+      break;
+
+    case vtkImageRegistration::NeighborhoodCorrelation:
+      {
+      metric = vtkImageNeighborhoodCorrelation::New();
+      }
+      break;
+
+    case vtkImageRegistration::CorrelationRatio:
+      {
+      metric = vtkImageCorrelationRatio::New();
+      }
+      break;
+
+    case vtkImageRegistration::MutualInformation:
+    case vtkImageRegistration::NormalizedMutualInformation:
+      {
+      vtkImageMutualInformation *mi = vtkImageMutualInformation::New();
+      metric = mi;
+
+      mi->SetNumberOfBins(histogramSize);
+
+      if (metricType ==
+          vtkImageRegistration::NormalizedMutualInformation)
+        {
+        mi->SetMetricToNormalizedMutualInformation();
+        }
+      else
+        {
+        mi->SetMetricToMutualInformation();
+        }
+      }
+      break;
+    }
+
+  return metric;
+}
+
+//--------------------------------------------------------------------------
+// The information that is shared by the threads during a batch evaluation
+struct vtkImageRegistrationBatch
+{
+  vtkImageRegistrationInfo *Info;
+  const double *Matrices;
+  const double *Steps;
+  double *Costs;
+  double *Values;
+  double *Profile;
+  int Count;
+};
+
+//--------------------------------------------------------------------------
+// Each thread evaluates a share of the points with its own probe metric
+void vtkImageRegistrationBatchExecute(
+  void *data, int threadId, int numberOfThreads)
+{
+  vtkImageRegistrationBatch *batch =
+    static_cast<vtkImageRegistrationBatch *>(data);
+  vtkImageRegistrationInfo *registrationInfo = batch->Info;
+
+  int stride = static_cast<int>(registrationInfo->Probes.size());
+  stride = (numberOfThreads < stride ? numberOfThreads : stride);
+  if (threadId < stride)
+    {
+    vtkImageRegistrationProbe *probe = &registrationInfo->Probes[threadId];
+    for (int k = threadId; k < batch->Count; k += stride)
+      {
+      const double *matrix = batch->Matrices + 16*k;
+      double *profile = (batch->Profile ? batch->Profile + 7*k : NULL);
+      double lastTime = 0.0;
+      if (profile)
+        {
+        lastTime = vtkTimerLog::GetUniversalTime();
+        }
+      if (probe->Reslice)
+        {
+        vtkSetTransformMatrix(probe->Transform, matrix);
+        probe->Reslice->Update();
+        if (profile)
+          {
+          double t = vtkTimerLog::GetUniversalTime();
+          profile[1] = t - lastTime;
+          lastTime = t;
+          }
+        }
+      if (batch->Steps && batch->Steps[k] != VTK_DOUBLE_MAX)
+        {
+        batch->Costs[k] = probe->Metric->EvaluateLine(batch->Steps[k]);
+        }
+      else
+        {
+        batch->Costs[k] = probe->Metric->Evaluate(matrix);
+        }
+      batch->Values[k] = probe->Metric->GetValue();
+      if (profile)
+        {
+        vtkImageSimilarityMetric *metric = probe->Metric;
+        double elapsed = vtkTimerLog::GetUniversalTime() - lastTime;
+        profile[2] = elapsed - metric->GetReduceSeconds();
+        profile[3] = metric->GetReduceSeconds();
+        profile[5] = static_cast<double>(metric->GetNumberOfVoxels());
+        profile[6] = metric->GetThreadUtilization();
+        }
+      }
+    }
+}
+
+//--------------------------------------------------------------------------
+// Evaluate several points concurrently with one probe per thread, or one
+// at a time with the multithreaded metric if there are no probes.  If
+// "profile" is not NULL, it receives the profile of each evaluation.
+void vtkScoreBatch(
+  vtkImageRegistrationInfo *registrationInfo, const double *params,
+  int count, double *costs, double *values, double *profile = NULL)
+{
+  int n = registrationInfo->Optimizer->GetNumberOfParameters();
+
+  if (registrationInfo->Probes.empty())
+    {
+    for (int k = 0; k < count; k++)
+      {
+      costs[k] = vtkEvaluateMetric(registrationInfo, params + k*n);
+      values[k] = registrationInfo->Metric->GetValue();
+      if (profile)
+        {
+        for (int i = 0; i < 7; i++)
+          {
+          profile[7*k + i] = registrationInfo->Profile[i];
+          }
+        }
+      }
+    return;
+    }
+
+  // the probes go through the pipeline only once, and they share the
+  // sample list of the main metric or of the previous probe
+  for (size_t j = 0; j < registrationInfo->Probes.size(); j++)
+    {
+    vtkImageSimilarityMetric *metric = registrationInfo->Probes[j].Metric;
+    if (!metric->IsPrepared())
+      {
+      metric->ShareSampleList(
+        j == 0 ? registrationInfo->Metric :
+                 registrationInfo->Probes[j - 1].Metric.GetPointer());
+      metric->Prepare();
+      }
+    if (registrationInfo->EarlyAbandon)
+      {
+      metric->SetCostCeiling(registrationInfo->BestCost);
+      }
+    }
+
+  // compute all the matrices before the threads are started, and the
+  // steps for the points on the line search, or VTK_DOUBLE_MAX for the
+  // points that are not on the line
+  double *matrices = vtkScratchBuffer(
+    registrationInfo, &registrationInfo->BatchMatrices, 16*count);
+  double *steps = vtkScratchBuffer(
+    registrationInfo, &registrationInfo->BatchSteps, count);
+  bool onLine = false;
+  for (int k = 0; k < count; k++)
+    {
+    double startTime = 0.0;
+    if (profile)
+      {
+      startTime = vtkTimerLog::GetUniversalTime();
+      }
+    steps[k] = VTK_DOUBLE_MAX;
+    if (vtkLineSearchMatrix(
+          registrationInfo, params + k*n, matrices + 16*k, steps + k))
+      {
+      onLine = true;
+      }
+    else
+      {
+      vtkComputeTransformMatrix(
+        registrationInfo, params + k*n, matrices + 16*k);
+      }
+    if (profile)
+      {
+      for (int i = 0; i < 7; i++)
+        {
+        profile[7*k + i] = 0.0;
+        }
+      profile[7*k] = vtkTimerLog::GetUniversalTime() - startTime;
+      }
+    }
+
+  // the probes see the line of the main metric
+  if (onLine && vtkLineSearchPrepare(registrationInfo))
+    {
+    for (size_t j = 0; j < registrationInfo->Probes.size(); j++)
+      {
+      registrationInfo->Probes[j].Metric->ShareLine(registrationInfo->Metric);
+      }
+    }
+  else
+    {
+    steps = NULL;
+    }
+
+  vtkImageRegistrationBatch batch;
+  batch.Info = registrationInfo;
+  batch.Matrices = matrices;
+  batch.Steps = steps;
+  batch.Costs = costs;
+  batch.Values = values;
+  batch.Profile = profile;
+  batch.Count = count;
+
+  registrationInfo->ThreadPool->Execute(
+    vtkImageRegistrationBatchExecute, &batch);
+
+  for (int k = 0; k < count; k++)
+    {
+    if (costs[k] < registrationInfo->BestCost)
+      {
+      registrationInfo->BestCost = costs[k];
+      for (int i = 0; i < n; i++)
+        {
+        registrationInfo->BestParameters[i] = params[k*n + i];
+        }
+      }
+    }
+}
+
+//--------------------------------------------------------------------------
+// Evaluate several points for the optimizer, either concurrently with
+// one probe per thread, or one at a time with the multithreaded metric
+void vtkEvaluateBatch(
+  void *arg, const double *params, int count, double *costs)
+{
+  vtkImageRegistrationInfo *registrationInfo =
+    static_cast<vtkImageRegistrationInfo*>(arg);
+
+  vtkFunctionMinimizer *optimizer = registrationInfo->Optimizer;
+  int n = optimizer->GetNumberOfParameters();
+
+  if (count < registrationInfo->ConcurrentBatchSize)
+    {
+    for (int k = 0; k < count; k++)
+      {
+      costs[k] = vtkEvaluateParameters(registrationInfo, params + k*n);
+      }
+    return;
+    }
+
+  // the optimizer time is the time since the previous evaluation ended
+  double startTime = 0.0;
+  double *profile = NULL;
+  if (registrationInfo->ProfileValues)
+    {
+    startTime = vtkTimerLog::GetUniversalTime();
+    profile = vtkScratchBuffer(
+      registrationInfo, &registrationInfo->BatchProfile, 7*count);
+    }
+
+  double *values = vtkScratchBuffer(
+    registrationInfo, &registrationInfo->BatchValues, count);
+  vtkScoreBatch(registrationInfo, params, count, costs, values, profile);
+
+  if (profile && registrationInfo->ProfileTime > 0.0)
+    {
+    profile[4] = startTime - registrationInfo->ProfileTime;
+    }
+
+  vtkCountTraceAllocations(registrationInfo, count);
+  for (int k = 0; k < count; k++)
+    {
+    if (registrationInfo->MetricValues)
+      {
+      registrationInfo->MetricValues->InsertNextValue(values[k]);
+      }
+    if (registrationInfo->CostValues)
+      {
+      registrationInfo->CostValues->InsertNextValue(costs[k]);
+      }
+    if (registrationInfo->ParameterValues)
+      {
+      registrationInfo->ParameterValues->InsertNextTuple(params + k*n);
+      }
+    if (registrationInfo->ProfileValues)
+      {
+      registrationInfo->ProfileValues->InsertNextTuple(profile + 7*k);
+      }
+    }
+
+  if (registrationInfo->ProfileValues)
+    {
+    registrationInfo->ProfileTime = vtkTimerLog::GetUniversalTime();
+    }
+
+  registrationInfo->NumberOfEvaluations += count;
+
+  if (registrationInfo->Deadline > 0 &&
+      vtkTimerLog::GetUniversalTime() > registrationInfo->Deadline)
+    {
+    optimizer->AbortFlagOn();
+    }
+}
+
+//--------------------------------------------------------------------------
+// A short local search from one of the GridSearch candidates, which uses
+// a probe metric (or the main metric) and has its own transform
+struct vtkImageRegistrationSeed
+{
+  vtkImageRegistrationInfo *Info;
+  vtkImageSimilarityMetric *Metric;
+  vtkImageReslice *Reslice;
+  vtkMatrixToLinearTransform *ResliceTransform;
+  vtkSmartPointer<vtkNelderMeadMinimizer> Optimizer;
+  int MaximumNumberOfEvaluations;
+  double EndTime;
+  double BestCost;
+  double BestParameters[12];
+};
+
+//--------------------------------------------------------------------------
+void vtkEvaluateSeed(void *arg)
+{
+  vtkImageRegistrationSeed *seed =
+    static_cast<vtkImageRegistrationSeed *>(arg);
+  vtkFunctionMinimizer *optimizer = seed->Optimizer;
+
+  double parameters[12];
+  int n = optimizer->GetNumberOfParameters();
+  for (int i = 0; i < n; i++)
+    {
+    parameters[i] = optimizer->GetParameterValue(i);
+    }
+
+  double matrix[16];
+  vtkComputeTransformMatrix(seed->Info, parameters, matrix);
+  if (seed->Reslice)
+    {
+    vtkSetTransformMatrix(seed->ResliceTransform, matrix);
+    seed->Reslice->Update();
+    }
+  double cost = seed->Metric->Evaluate(matrix);
+  optimizer->SetFunctionValue(cost);
+
+  if (cost < seed->BestCost)
+    {
+    seed->BestCost = cost;
+    for (int i = 0; i < n; i++)
+      {
+      seed->BestParameters[i] = parameters[i];
+      }
+    }
+
+  if (optimizer->GetFunctionEvaluations() + 1 >=
+        seed->MaximumNumberOfEvaluations ||
+      (seed->EndTime > 0 && vtkTimerLog::GetUniversalTime() > seed->EndTime))
+    {
+    optimizer->AbortFlagOn();
+    }
+}
+
+//--------------------------------------------------------------------------
+// The seeds that are refined concurrently
+struct vtkImageRegistrationSeedBatch
+{
+  vtkImageRegistrationInfo *Info;
+  vtkImageRegistrationSeed *Seeds;
+  int Count;
+};
+
+//--------------------------------------------------------------------------
+// Each thread refines a share of the seeds with its own probe metric
+void vtkImageRegistrationSeedExecute(
+  void *data, int threadId, int numberOfThreads)
+{
+  vtkImageRegistrationSeedBatch *batch =
+    static_cast<vtkImageRegistrationSeedBatch *>(data);
+  vtkImageRegistrationInfo *registrationInfo = batch->Info;
+
+  int stride = static_cast<int>(registrationInfo->Probes.size());
+  stride = (numberOfThreads < stride ? numberOfThreads : stride);
+  if (threadId < stride)
+    {
+    vtkImageRegistrationProbe *probe = &registrationInfo->Probes[threadId];
+    for (int k = threadId; k < batch->Count; k += stride)
+      {
+      vtkImageRegistrationSeed *seed = &batch->Seeds[k];
+      seed->Metric = probe->Metric;
+      seed->Reslice = probe->Reslice;
+      seed->ResliceTransform = probe->Transform;
+      seed->Optimizer->Minimize();
+      }
+    }
+}
+
+//--------------------------------------------------------------------------
+// The spectra for phase correlation, which are split between the threads
+struct vtkPhaseCorrelationData
+{
+  double *Target;
+  const double *Source;
+  vtkIdType Size;
+};
+
+//--------------------------------------------------------------------------
+// Replace the target spectrum with the normalized cross-power spectrum,
+// the spectra are stored as interleaved complex values
+void vtkPhaseCorrelationExecute(
+  void *arg, int threadId, int numberOfThreads)
+{
+  vtkPhaseCorrelationData *data = static_cast<vtkPhaseCorrelationData *>(arg);
+  vtkIdType begin = data->Size*threadId/numberOfThreads;
+  vtkIdType end = data->Size*(threadId + 1)/numberOfThreads;
+  double *t = data->Target + 2*begin;
+  const double *s = data->Source + 2*begin;
+
+  for (vtkIdType k = begin; k < end; k++)
+    {
+    // multiply the target by the conjugate of the source
+    double re = t[0]*s[0] + t[1]*s[1];
+    double im = t[1]*s[0] - t[0]*s[1];
+    double mag = sqrt(re*re + im*im);
+    if (mag > 0)
+      {
+      re /= mag;
+      im /= mag;
+      }
+    t[0] = re;
+    t[1] = im;
+    t += 2;
+    s += 2;
+    }
+}
+
+//--------------------------------------------------------------------------
+// Convert a rotation matrix into a rotation vector, whose direction is
+// the axis and whose norm is the angle (the inverse of the conversion
+// that is done by vtkRotationMatrix)
+void vtkRotationVector(const double rotation[3][3], double r[3])
+{
+  double quat[4];
+  vtkMath::Matrix3x3ToQuaternion(rotation, quat);
+  if (quat[0] < 0)
+    {
+    quat[0] = -quat[0];
+    quat[1] = -quat[1];
+    quat[2] = -quat[2];
+    quat[3] = -quat[3];
+    }
+  double s = sqrt(quat[1]*quat[1] + quat[2]*quat[2] + quat[3]*quat[3]);
+  double f = 0.0;
+  if (s > 0)
+    {
+    f = 2*atan2(s, quat[0])/s;
+    }
+  r[0] = f*quat[1];
+  r[1] = f*quat[2];
+  r[2] = f*quat[3];
+}
+
+//--------------------------------------------------------------------------
+// Compute the gradient magnitude at the voxel at "ptr", which has the
+// structured coordinates "idx", by using central differences (or one-sided
+// differences at the boundaries).  Only the first component is used.
+template<class T>
+double vtkImageRegistrationGradient(
+  const T *ptr, const int idx[3], const int extent[6],
+  const vtkIdType inc[3], const double spacing[3])
+{
+  double g2 = 0.0;
+  for (int j = 0; j < 3; j++)
+    {
+    int lo = (idx[j] > extent[2*j] ? -1 : 0);
+    int hi = (idx[j] < extent[2*j+1] ? 1 : 0);
+    if (hi > lo)
+      {
+      double d = (static_cast<double>(ptr[hi*inc[j]]) -
+                  static_cast<double>(ptr[lo*inc[j]]));
+      d /= (hi - lo)*spacing[j];
+      g2 += d*d;
+      }
+    }
+
+  return sqrt(g2);
+}
+
+//--------------------------------------------------------------------------
+// Choose a subset of the voxels within the stencil, and store the result
+// in the "samples" stencil.  Each voxel is given a weight, and a sample
+// is taken whenever the running sum of fraction*weight crosses the next
+// threshold.  For regular sampling the thresholds are evenly spaced, for
+// the other strategies each threshold is placed randomly within its own
+// unit interval.  For gradient sampling, the weight is proportional to
+// the gradient magnitude (plus a floor, so that flat regions are not
+// ignored) and is normalized so that the mean weight is one.
+template<class T>
+void vtkImageRegistrationSampleExecute(
+  vtkImageData *data, const T *dataPtr, vtkImageStencilData *stencil,
+  vtkImageStencilData *samples, double fraction, int strategy)
+{
+  int extent[6];
+  double spacing[3];
+  vtkIdType inc[3];
+  data->GetExtent(extent);
+  data->GetSpacing(spacing);
+  data->GetIncrements(inc);
+
+  samples->SetExtent(extent);
+  samples->SetSpacing(data->GetSpacing());
+  samples->SetOrigin(data->GetOrigin());
+  samples->AllocateExtents();
+
+  // use a fixed seed, so that the samples are repeatable
+  vtkMinimalStandardRandomSequence *random =
+    vtkMinimalStandardRandomSequence::New();
+  random->SetSeed(1);
+
+  bool useGradient = (strategy == vtkImageRegistration::GradientSampling);
+  bool useRandom = (strategy != vtkImageRegistration::RegularSampling);
+  double gradientFloor = 0.0;
+  double gradientScale = 1.0;
+
+  // the first pass (if needed) computes the mean gradient magnitude
+  for (int pass = (useGradient ? 0 : 1); pass < 2; pass++)
+    {
+    double gradientSum = 0.0;
+    double count = 0.0;
+    double sum = 0.0;
+    double threshold = 0.5;
+    if (useRandom)
+      {
+      random->Next();
+      threshold = random->GetValue();
+      }
+
+    int idx[3];
+    for (idx[2] = extent[4]; idx[2] <= extent[5]; idx[2]++)
+      {
+      for (idx[1] = extent[2]; idx[1] <= extent[3]; idx[1]++)
+        {
+        const T *ptrY = dataPtr + ((idx[2] - extent[4])*inc[2] +
+                                   (idx[1] - extent[2])*inc[1]);
+
+        // loop over stencil extents (break at end if no stencil)
+        int iter = 0;
+        int r1 = extent[0];
+        int r2 = extent[1];
+        do
+          {
+          if (stencil && stencil->GetNextExtent(
+                r1, r2, extent[0], extent[1], idx[1], idx[2], iter) == 0)
+            {
+            break;
+            }
+
+          // start of the current run of samples
+          int s1 = r2 + 1;
+          const T *ptr = ptrY + (r1 - extent[0])*inc[0];
+          for (idx[0] = r1; idx[0] <= r2; idx[0]++)
+            {
+            double weight = 1.0;
+            if (useGradient)
+              {
+              weight = vtkImageRegistrationGradient(
+                ptr, idx, extent, inc, spacing);
+              }
+            ptr += inc[0];
+
+            if (pass == 0)
+              {
+              gradientSum += weight;
+              count++;
+              continue;
+              }
+
+            sum += fraction*(weight + gradientFloor)*gradientScale;
+            if (sum > threshold)
+              {
+              s1 = (s1 > r2 ? idx[0] : s1);
+              threshold = floor(sum) + 1.0;
+              if (useRandom)
+                {
+                random->Next();
+                threshold += random->GetValue();
+                }
+              else
+                {
+                threshold += 0.5;
+                }
+              }
+            else if (s1 <= r2)
+              {
+              samples->InsertNextExtent(s1, idx[0] - 1, idx[1], idx[2]);
+              s1 = r2 + 1;
+              }
+            }
+
+          if (s1 <= r2)
+            {
+            samples->InsertNextExtent(s1, r2, idx[1], idx[2]);
+            }
+          }
+        while (stencil);
+        }
+      }
+
+    if (pass == 0 && gradientSum > 0)
+      {
+      // use 10% of the mean gradient as the floor
+      double meanGradient = gradientSum/count;
+      gradientFloor = 0.1*meanGradient;
+      gradientScale = 1.0/(meanGradient + gradientFloor);
+      }
+    else if (pass == 0)
+      {
+      // image is flat, so the weights are all equal
+      gradientFloor = 1.0;
+      gradientScale = 1.0;
+      }
+    }
+
+  random->Delete();
+}
+
+//--------------------------------------------------------------------------
+// Resample a stencil to the geometry of the given image, by using the
+// nearest stencil voxel for each image voxel.
+void vtkImageRegistrationResampleStencil(
+  vtkImageStencilData *stencil, vtkImageData *image,
+  vtkImageStencilData *output)
+{
+  int extent[6];
+  double origin[3];
+  double spacing[3];
+  image->GetExtent(extent);
+  image->GetOrigin(origin);
+  image->GetSpacing(spacing);
+
+  int stencilExtent[6];
+  double stencilOrigin[3];
+  double stencilSpacing[3];
+  stencil->GetExtent(stencilExtent);
+  stencil->GetOrigin(stencilOrigin);
+  stencil->GetSpacing(stencilSpacing);
+
+  output->SetExtent(extent);
+  output->SetOrigin(origin);
+  output->SetSpacing(spacing);
+  output->AllocateExtents();
+
+  // compute the stencil index for each column, row, and slice
+  std::vector<int> index[3];
+  for (int j = 0; j < 3; j++)
+    {
+    for (int i = extent[2*j]; i <= extent[2*j+1]; i++)
+      {
+      double x = origin[j] + i*spacing[j];
+      int k = vtkMath::Floor((x - stencilOrigin[j])/stencilSpacing[j] + 0.5);
+      if (k < stencilExtent[2*j] || k > stencilExtent[2*j+1])
+        {
+        // outside of the stencil extent
+        k = VTK_INT_MIN;
+        }
+      index[j].push_back(k);
+      }
+    }
+
+  for (int idZ = extent[4]; idZ <= extent[5]; idZ++)
+    {
+    int sz = index[2][idZ - extent[4]];
+    for (int idY = extent[2]; idY <= extent[3]; idY++)
+      {
+      int sy = index[1][idY - extent[2]];
+      if (sy == VTK_INT_MIN || sz == VTK_INT_MIN)
+        {
+        continue;
+        }
+
+      // start of the current run of inside voxels
+      int r1 = extent[1] + 1;
+      for (int idX = extent[0]; idX <= extent[1]; idX++)
+        {
+        int sx = index[0][idX - extent[0]];
+        if (sx != VTK_INT_MIN && stencil->IsInside(sx, sy, sz))
+          {
+          r1 = (r1 > extent[1] ? idX : r1);
+          }
+        else if (r1 <= extent[1])
+          {
+          output->InsertNextExtent(r1, idX - 1, idY, idZ);
+          r1 = extent[1] + 1;
+          }
+        }
+      if (r1 <= extent[1])
+        {
+        output->InsertNextExtent(r1, extent[1], idY, idZ);
+        }
+      }
+    }
+}
+
+//--------------------------------------------------------------------------
+// Make a shallow copy of an image, so that the copy shares the image data
+// but not the data object.  Images that have already been copied (as given
+// by the "originals" list) are not copied again, but instead their copy
+// is returned, so that images that were shared remain shared.
+vtkImageData *vtkImageRegistrationShareImage(
+  vtkImageData *image, std::vector<vtkImageData *> *originals,
+  std::vector<vtkSmartPointer<vtkImageData> > *copies)
+{
+  if (image == NULL)
+    {
+    return NULL;
+    }
+
+  for (size_t i = 0; i < originals->size(); i++)
+    {
+    if ((*originals)[i] == image)
+      {
+      return (*copies)[i];
+      }
+    }
+
+  vtkSmartPointer<vtkImageData> copy = vtkSmartPointer<vtkImageData>::New();
+  copy->ShallowCopy(image);
+  originals->push_back(image);
+  copies->push_back(copy);
+
+  return copy;
+}
+
+//--------------------------------------------------------------------------
+// An image that is being copied by the threads of the pool, where each
+// thread copies the points from Ranges[2*threadId] up to, but not
+// including, Ranges[2*threadId + 1]
+struct vtkImageRegistrationPlacement
+{
+  const vtkIdType *Ranges;
+  size_t PointSize;
+  const char *InPtr;
+  char *OutPtr;
+};
+
+//--------------------------------------------------------------------------
+// Copy the points that the metric will give to this thread, so that the
+// pages are first touched, and therefore placed on the NUMA node of this
+// thread
+void vtkImageRegistrationPlaceExecute(
+  void *arg, int threadId, int vtkNotUsed(numberOfThreads))
+{
+  vtkImageRegistrationPlacement *data =
+    static_cast<vtkImageRegistrationPlacement *>(arg);
+
+  vtkIdType begin = data->Ranges[2*threadId];
+  vtkIdType end = data->Ranges[2*threadId + 1];
+  if (end > begin)
+    {
+    size_t offset = begin*data->PointSize;
+    memcpy(data->OutPtr + offset, data->InPtr + offset,
+           (end - begin)*data->PointSize);
+    }
+}
+
+//--------------------------------------------------------------------------
+// Copy the scalars of an image into a new array that is first touched by
+// the threads of the pool, with "ranges" giving the points that each
+// thread copies.  The ranges must cover all of the points, and must not
+// overlap.
+void vtkImageRegistrationPlaceImage(
+  vtkWorkerThreadPool *pool, const vtkIdType *ranges,
+  vtkImageData *image, vtkImageData *output)
+{
+  vtkDataArray *scalars = image->GetPointData()->GetScalars();
+  if (scalars == NULL)
+    {
+    return;
+    }
+
+  // the new array is not initialized, so none of its pages are touched
+  // until the threads copy the data into it
+  vtkDataArray *array = scalars->NewInstance();
+  array->SetName(scalars->GetName());
+  array->SetNumberOfComponents(scalars->GetNumberOfComponents());
+  array->SetNumberOfTuples(scalars->GetNumberOfTuples());
+
+  vtkImageRegistrationPlacement data;
+  data.Ranges = ranges;
+  data.PointSize = static_cast<size_t>(scalars->GetDataTypeSize())*
+    scalars->GetNumberOfComponents();
+  data.InPtr = static_cast<const char *>(scalars->GetVoidPointer(0));
+  data.OutPtr = static_cast<char *>(array->GetVoidPointer(0));
+
+  pool->Execute(vtkImageRegistrationPlaceExecute, &data);
+
+  output->CopyStructure(image);
+  output->GetPointData()->SetScalars(array);
+  array->Delete();
+}
+
+//--------------------------------------------------------------------------
+// Get the points of the source that each thread copies, from the pieces
+// that the metric split the source into when it last executed.  The
+// pieces take the balanced split, the sample list, and the overlap of the
+// inputs into account.
+void vtkImageRegistrationSourceRanges(
+  vtkImageSimilarityMetric *metric, vtkIdType numberOfPoints,
+  int numberOfThreads, vtkIdType *ranges)
+{
+  for (int i = 0; i < numberOfThreads; i++)
+    {
+    vtkIdType *range = ranges + 2*i;
+    int pieces = metric->GetPieceVoxelRange(i, range);
+    if (pieces == 0)
+      {
+      // the metric did not execute, so split evenly
+      range[0] = numberOfPoints*i/numberOfThreads;
+      range[1] = numberOfPoints*(i + 1)/numberOfThreads;
+      }
+    }
+}
+
+//--------------------------------------------------------------------------
+// Get the points of the target that each thread copies.  The corners of
+// the bounding box of each thread's piece of the source are mapped through
+// the pose that the registration starts from, and the target slices that
+// the mapped corners span are the slices that the piece will read.  The
+// pieces are then sorted by the middle of their spans, and where the
+// spans of neighboring pieces overlap, or leave a gap, the slices are
+// split at the midpoint.  Every slice of the target is copied by exactly
+// one thread, and the threads that have empty pieces copy nothing.
+void vtkImageRegistrationTargetRanges(
+  vtkImageData *sourceImage, vtkImageData *targetImage,
+  const double pose[16], int numberOfThreads,
+  const vtkIdType *sourceRanges, vtkIdType *ranges)
+{
+  int sext[6], text[6];
+  double sorigin[3], sspacing[3], torigin[3], tspacing[3];
+  sourceImage->GetExtent(sext);
+  sourceImage->GetOrigin(sorigin);
+  sourceImage->GetSpacing(sspacing);
+  targetImage->GetExtent(text);
+  targetImage->GetOrigin(torigin);
+  targetImage->GetSpacing(tspacing);
+
+  vtkIdType snx = sext[1] - sext[0] + 1;
+  vtkIdType sny = sext[3] - sext[2] + 1;
+  vtkIdType tnz = text[5] - text[4] + 1;
+  vtkIdType tsliceSize =
+    static_cast<vtkIdType>(text[1] - text[0] + 1)*(text[3] - text[2] + 1);
+
+  // the span of target slices for each piece, and the pieces in order of
+  // the middles of their spans
+  std::vector<double> spans(2*numberOfThreads);
+  std::vector<std::pair<double, int> > order;
+  for (int i = 0; i < numberOfThreads; i++)
+    {
+    ranges[2*i] = 0;
+    ranges[2*i + 1] = 0;
+    vtkIdType begin = sourceRanges[2*i];
+    vtkIdType end = sourceRanges[2*i + 1];
+    if (end <= begin)
+      {
+      continue;
+      }
+
+    // the bounding box of the piece, in source indices relative to the
+    // extent, where the piece covers whole rows unless it is within one
+    // row, and whole slices unless it is within one slice
+    vtkIdType last = end - 1;
+    int box[6];
+    box[0] = 0;
+    box[1] = static_cast<int>(snx - 1);
+    box[2] = 0;
+    box[3] = static_cast<int>(sny - 1);
+    box[4] = static_cast<int>(begin/(snx*sny));
+    box[5] = static_cast<int>(last/(snx*sny));
+    if (box[4] == box[5])
+      {
+      box[2] = static_cast<int>((begin/snx) % sny);
+      box[3] = static_cast<int>((last/snx) % sny);
+      if (box[2] == box[3])
+        {
+        box[0] = static_cast<int>(begin % snx);
+        box[1] = static_cast<int>(last % snx);
+        }
+      }
+
+    double zmin = VTK_DOUBLE_MAX;
+    double zmax = -VTK_DOUBLE_MAX;
+    for (int c = 0; c < 8; c++)
+      {
+      double point[3];
+      for (int j = 0; j < 3; j++)
+        {
+        int idx = box[2*j + ((c >> j) & 1)];
+        point[j] = sorigin[j] + (sext[2*j] + idx)*sspacing[j];
+        }
+      const double *row = pose + 8;
+      double z = (row[0]*point[0] + row[1]*point[1] + row[2]*point[2] +
+                  row[3] - torigin[2])/tspacing[2] - text[4];
+      zmin = (z < zmin ? z : zmin);
+      zmax = (z > zmax ? z : zmax);
+      }
+    spans[2*i] = zmin;
+    spans[2*i + 1] = zmax;
+    order.push_back(std::make_pair(0.5*(zmin + zmax), i));
+    }
+
+  if (order.empty())
+    {
+    ranges[1] = tnz*tsliceSize;
+    return;
+    }
+  std::sort(order.begin(), order.end());
+
+  vtkIdType slice = 0;
+  for (size_t j = 0; j < order.size(); j++)
+    {
+    int i = order[j].second;
+    vtkIdType nextSlice = tnz;
+    if (j + 1 < order.size())
+      {
+      // the slices up to the midpoint go to this piece
+      double middle = 0.5*(spans[2*i + 1] + spans[2*order[j + 1].second]);
+      nextSlice = vtkMath::Floor(middle) + 1;
+      nextSlice = (nextSlice > slice ? nextSlice : slice);
+      nextSlice = (nextSlice < tnz ? nextSlice : tnz);
+      }
+    ranges[2*i] = slice*tsliceSize;
+    ranges[2*i + 1] = nextSlice*tsliceSize;
+    slice = nextSlice;
+    }
+}
+
+//--------------------------------------------------------------------------
+// Release the probes and the images that their reslice pipelines produced,
+// so that their memory is not held while the next level is set up.
+void vtkImageRegistrationReleaseProbes(vtkImageRegistrationInfo *info)
+{
+  for (size_t j = 0; j < info->Probes.size(); j++)
+    {
+    info->Probes[j].Metric->RemoveAllInputs();
+    if (info->Probes[j].Reslice)
+      {
+      info->Probes[j].Reslice->GetOutput()->ReleaseData();
+      }
+    }
+  info->Probes.clear();
+  info->ConcurrentBatchSize = VTK_INT_MAX;
+}
+
+//--------------------------------------------------------------------------
+// Give a filter the same number of threads as the pool.  The threads of
+// vtkSMPTools cannot be limited for just one filter, so SMP is turned off
+// if the pool has fewer threads than the default.
+void vtkImageRegistrationLimitThreads(
+  vtkThreadedImageAlgorithm *filter, vtkWorkerThreadPool *pool)
+{
+  int n = pool->GetNumberOfThreads();
+  filter->SetNumberOfThreads(n);
+#ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
+  filter->SetEnableSMP(
+    n >= vtkMultiThreader::GetGlobalDefaultNumberOfThreads() &&
+    vtkThreadedImageAlgorithm::GetGlobalDefaultEnableSMP());
+#endif
+}
+
+} // end anonymous namespace
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::SetPreparedTarget(
+  vtkImageRegistrationTarget *target)
+{
+  if (target == this->PreparedTarget)
+    {
+    return;
+    }
+  if (target && !target->GetBuilt())
+    {
+    vtkErrorMacro("SetPreparedTarget: The target must be built first");
+    return;
+    }
+
+  if (this->PreparedTarget)
+    {
+    this->PreparedTarget->UnRegister(this);
+    }
+  this->PreparedTarget = target;
+
+  vtkImageRegistrationPyramid *pyramid = this->Pyramid;
+  pyramid->PreparedImages.clear();
+  pyramid->PreparedQuantizedImages.clear();
+  pyramid->PreparedCoefficients.clear();
+
+  if (target)
+    {
+    target->Register(this);
+
+    // the copies become part of this registration's pipeline, while the
+    // prepared target's own images are never used by any pipeline
+    std::vector<vtkImageData *> originals;
+    std::vector<vtkSmartPointer<vtkImageData> > copies;
+    int n = target->GetNumberOfLevels();
+    for (int level = -1; level < n; level++)
+      {
+      pyramid->PreparedImages.push_back(
+        vtkImageRegistrationShareImage(
+          target->GetLevelImage(level), &originals, &copies));
+      pyramid->PreparedQuantizedImages.push_back(
+        vtkImageRegistrationShareImage(
+          target->GetLevelQuantizedImage(level), &originals, &copies));
+      pyramid->PreparedCoefficients.push_back(
+        vtkImageRegistrationShareImage(
+          target->GetLevelCoefficients(level), &originals, &copies));
+      }
+
+    this->SetTargetImage(pyramid->PreparedImages[0]);
+    }
+
+  this->Modified();
+}
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::ComputeImageRange(
+  vtkImageData *data, vtkImageStencilData *stencil, double range[2])
+{
+  vtkImageHistogramStatistics *hist =
+    vtkImageHistogramStatistics::New();
+  hist->SET_STENCIL_DATA(stencil);
+  hist->SET_INPUT_DATA(data);
+  hist->SetActiveComponent(0);
+  hist->Update();
+
+  range[0] = hist->GetMinimum();
+  range[1] = hist->GetMaximum();
+
+  if (range[0] >= range[1])
+    {
+    range[1] = range[0] + 1.0;
+    }
+
+  hist->SET_INPUT_DATA(NULL);
+  hist->Delete();
+}
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::ComputeSamplingStencil(
+  vtkImageData *data, vtkImageStencilData *stencil,
+  vtkImageStencilData *samples, double fraction)
+{
+  void *dataPtr = data->GetScalarPointer();
+
+  switch (data->GetScalarType())
+    {
+    vtkTemplateAliasMacro(
+      vtkImageRegistrationSampleExecute(
+        data, static_cast<const VTK_TT *>(dataPtr), stencil, samples,
+        fraction, this->SamplingStrategy));
+    default:
+      vtkErrorMacro("ComputeSamplingStencil: Unknown ScalarType");
+    }
+}
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::Initialize(vtkMatrix4x4 *matrix)
+{
+  // update our inputs
+  this->Update();
+
+  // this ends any multi-resolution registration that was in progress
+  this->Pyramid->CurrentLevel = -1;
+  this->AbortExecute = 0;
+
+  this->StartTimeBudget();
+  this->InitializeLevel(-1, matrix);
+}
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::InitializeLevel(int level, vtkMatrix4x4 *matrix)
+{
+  int transformDim = this->TransformDimensionality;
+  if (transformDim < 2) { transformDim = 2; }
+  if (transformDim > 3) { transformDim = 3; }
+
+  vtkImageData *targetImage = this->GetTargetImage();
+  vtkImageData *sourceImage = this->GetSourceImage();
+  vtkImageStencilData *sourceStencil = this->GetSourceImageStencil();
+
+  // the settings that can be changed for each pyramid level
+  int interpolatorType = this->InterpolatorType;
+  int initializerType = this->InitializerType;
+  double transformTolerance = this->TransformTolerance;
+  double samplingFraction = this->SamplingFraction;
+
+  if (level >= 0)
+    {
+    targetImage = this->Pyramid->TargetImages[level];
+    sourceImage = this->Pyramid->SourceImages[level];
+    sourceStencil = this->Pyramid->SourceStencils[level];
+    interpolatorType = this->GetLevelInterpolatorType(level);
+    transformTolerance = this->GetLevelTransformTolerance(level);
+    samplingFraction = this->GetLevelSamplingFraction(level);
+    if (level < static_cast<int>(
+          this->Pyramid->BudgetSamplingFractions.size()) &&
+        this->Pyramid->BudgetSamplingFractions[level] > 0.0)
+      {
+      // the level was reduced to fit within the time budget
+      samplingFraction = this->Pyramid->BudgetSamplingFractions[level];
+      }
+    if (level < static_cast<int>(
+          this->Pyramid->UsedSamplingFractions.size()))
+      {
+      this->Pyramid->UsedSamplingFractions[level] =
+        (samplingFraction > 0.0 && samplingFraction < 1.0 ?
+         samplingFraction : 1.0);
+      }
+    if (level > 0)
+      {
+      // use the transform from the previous level as-is
+      initializerType = vtkImageRegistration::None;
+      }
+    }
+
+  if (targetImage == NULL || sourceImage == NULL)
+    {
+    vtkErrorMacro("Initialize: Input images are not set");
+    return;
+    }
+
+  // keep the filters within the thread budget of the pool
+  vtkImageRegistrationLimitThreads(this->ImageReslice, this->ThreadPool);
+  vtkImageRegistrationLimitThreads(this->ImageBSpline, this->ThreadPool);
+  vtkImageRegistrationLimitThreads(
+    this->SourceImageTypecast, this->ThreadPool);
+  vtkImageRegistrationLimitThreads(
+    this->TargetImageTypecast, this->ThreadPool);
+
+  // keep the images from before they are quantized or filtered
+  vtkImageData *levelSourceImage = sourceImage;
+  vtkImageData *levelTargetImage = targetImage;
+
+  // the prepared target can be used if this level's target image came
+  // from it, and if it was built with the same interpolator
+  vtkImageRegistrationTarget *prepared = NULL;
+  bool preparedRange = false;
+  size_t preparedIndex = static_cast<size_t>(level + 1);
+  if (this->PreparedTarget &&
+      preparedIndex < this->Pyramid->PreparedImages.size() &&
+      targetImage == this->Pyramid->PreparedImages[preparedIndex] &&
+      this->PreparedTarget->GetLevelInterpolatorType(level) ==
+        interpolatorType)
+    {
+    prepared = this->PreparedTarget;
+    double *range = prepared->GetTargetImageRange();
+    int metricType = prepared->GetMetricType();
+    preparedRange =
+      ((metricType == vtkImageRegistration::MutualInformation ||
+        metricType == vtkImageRegistration::NormalizedMutualInformation) &&
+       range[0] == this->TargetImageRange[0] &&
+       range[1] == this->TargetImageRange[1]);
+    }
+
+  // get the source image center
   double bounds[6];
   double center[3];
   double size[3];
@@ -583,512 +2605,1921 @@ void vtkImageRegistration::Initialize(vtkMatrix4x4 *matrix)
   size[1] = (bounds[3] - bounds[2]);
   size[2] = (bounds[5] - bounds[4]);
 
-  vtkTransform *transform = this->Transform;
-  vtkMatrix4x4 *initialMatrix = this->InitialTransformMatrix;
+  vtkMatrix4x4 *initialMatrix = this->InitialTransformMatrix;
+
+  // create an initial transform
+  initialMatrix->Identity();
+  this->Transform->GetInput()->Identity();
+
+  // the initial translation
+  double tx = 0.0;
+  double ty = 0.0;
+  double tz = 0.0;
+
+  // initialize from the supplied matrix
+  if (matrix)
+    {
+    // move the translation into tx, ty, tz variables
+    tx = matrix->Element[0][3];
+    ty = matrix->Element[1][3];
+    tz = matrix->Element[2][3];
+
+    // move rotation/scale/shear into the InitialTransformMatrix
+    initialMatrix->DeepCopy(matrix);
+    initialMatrix->Element[0][3] = 0.0;
+    initialMatrix->Element[1][3] = 0.0;
+    initialMatrix->Element[2][3] = 0.0;
+
+    // adjust the translation for the transform centering
+    double scenter[4];
+    scenter[0] = center[0];
+    scenter[1] = center[1];
+    scenter[2] = center[2];
+    scenter[3] = 1.0;
+
+    initialMatrix->MultiplyPoint(scenter, scenter);
+
+    tx -= center[0] - scenter[0];
+    ty -= center[1] - scenter[1];
+    tz -= center[2] - scenter[2];
+    }
+
+  if (initializerType == vtkImageRegistration::Centered ||
+      (initializerType == vtkImageRegistration::GridSearch && !matrix))
+    {
+    // set an initial translation from one image center to the other image center
+    double tbounds[6];
+    double tcenter[3];
+    targetImage->GetBounds(tbounds);
+    tcenter[0] = 0.5*(tbounds[0] + tbounds[1]);
+    tcenter[1] = 0.5*(tbounds[2] + tbounds[3]);
+    tcenter[2] = 0.5*(tbounds[4] + tbounds[5]);
+
+    tx = tcenter[0] - center[0];
+    ty = tcenter[1] - center[1];
+    tz = tcenter[2] - center[2];
+    }
+
+  if (transformDim <= 2)
+    {
+    center[2] = 0.0;
+    tz = 0.0;
+    }
+
+  // do the setup for mutual information
+  double sourceImageRange[2];
+  double targetImageRange[2];
+  sourceImageRange[0] = this->SourceImageRange[0];
+  sourceImageRange[1] = this->SourceImageRange[1];
+  targetImageRange[0] = this->TargetImageRange[0];
+  targetImageRange[1] = this->TargetImageRange[1];
+
+  if (this->MetricType == vtkImageRegistration::MutualInformation ||
+      this->MetricType == vtkImageRegistration::NormalizedMutualInformation)
+    {
+    if (sourceImageRange[0] >= sourceImageRange[1])
+      {
+      this->ComputeImageRange(sourceImage, sourceStencil, sourceImageRange);
+      }
+    if (preparedRange)
+      {
+      prepared->GetLevelImageRange(level, targetImageRange);
+      }
+    else if (targetImageRange[0] >= targetImageRange[1])
+      {
+      this->ComputeImageRange(targetImage, NULL,
+        targetImageRange);
+      }
+
+    if (interpolatorType == vtkImageRegistration::Nearest &&
+        this->JointHistogramSize[0] <= 256 &&
+        this->JointHistogramSize[1] <= 256)
+      {
+      // If nearest-neighbor interpolation is used, then the image instensity
+      // can be quantized during initialization, instead of being done at each
+      // iteration of the registration.
+
+      double sourceScale = ((this->JointHistogramSize[1] - 1)/
+        (sourceImageRange[1] - sourceImageRange[0]));
+      // The "0.5/sourceScale" causes the vtkImageShiftScale filter to
+      // round the value, instead of truncating it.
+      double sourceShift = (-sourceImageRange[0] + 0.5/sourceScale);
+
+      vtkImageShiftScale *sourceQuantizer = this->SourceImageTypecast;
+      sourceQuantizer->SET_INPUT_DATA(sourceImage);
+      sourceQuantizer->SetOutputScalarTypeToUnsignedChar();
+      sourceQuantizer->ClampOverflowOn();
+      sourceQuantizer->SetShift(sourceShift);
+      sourceQuantizer->SetScale(sourceScale);
+      sourceQuantizer->Update();
+      sourceImage = sourceQuantizer->GetOutput();
+
+      vtkImageData *quantized = NULL;
+      if (preparedRange &&
+          prepared->GetJointHistogramSize() == this->JointHistogramSize[0])
+        {
+        quantized = this->Pyramid->PreparedQuantizedImages[preparedIndex];
+        }
+
+      if (quantized)
+        {
+        targetImage = quantized;
+        }
+      else
+        {
+        double targetScale = ((this->JointHistogramSize[0] - 1)/
+          (targetImageRange[1] - targetImageRange[0]));
+        double targetShift = (-targetImageRange[0] + 0.5/targetScale);
+
+        vtkImageShiftScale *targetQuantizer = this->TargetImageTypecast;
+        targetQuantizer->SET_INPUT_DATA(targetImage);
+        targetQuantizer->SetOutputScalarTypeToUnsignedChar();
+        targetQuantizer->ClampOverflowOn();
+        targetQuantizer->SetShift(targetShift);
+        targetQuantizer->SetScale(targetScale);
+        targetQuantizer->Update();
+        targetImage = targetQuantizer->GetOutput();
+        }
+
+      // the rescaled image range is now the histogram range
+      targetImageRange[0] = 0;
+      targetImageRange[1] = this->JointHistogramSize[0] - 1;
+      sourceImageRange[0] = 0;
+      sourceImageRange[1] = this->JointHistogramSize[1] - 1;
+      }
+    }
+
+  // for single precision, no image is kept as double
+  bool singlePrecision =
+    (this->Precision == vtkImageRegistration::SinglePrecision);
+  if (singlePrecision && sourceImage->GetScalarType() == VTK_DOUBLE)
+    {
+    vtkImageShiftScale *sourceCast = this->SourceImageTypecast;
+    sourceCast->SET_INPUT_DATA(sourceImage);
+    sourceCast->SetOutputScalarType(VTK_FLOAT);
+    sourceCast->ClampOverflowOff();
+    sourceCast->SetShift(0.0);
+    sourceCast->SetScale(1.0);
+    sourceCast->Update();
+    sourceImage = sourceCast->GetOutput();
+    }
+  if (singlePrecision && targetImage->GetScalarType() == VTK_DOUBLE)
+    {
+    vtkImageShiftScale *targetCast = this->TargetImageTypecast;
+    targetCast->SET_INPUT_DATA(targetImage);
+    targetCast->SetOutputScalarType(VTK_FLOAT);
+    targetCast->ClampOverflowOff();
+    targetCast->SetShift(0.0);
+    targetCast->SetScale(1.0);
+    targetCast->Update();
+    targetImage = targetCast->GetOutput();
+    }
+
+  // make sure source range is computed for CorrelationRatio
+  if (this->MetricType == vtkImageRegistration::CorrelationRatio)
+    {
+    if (sourceImageRange[0] >= sourceImageRange[1])
+      {
+      this->ComputeImageRange(sourceImage, sourceStencil, sourceImageRange);
+      }
+    }
+
+  // apply b-spline prefilter if b-spline interpolator is used
+  if (interpolatorType == vtkImageRegistration::BSpline)
+    {
+    int scalarType = VTK_FLOAT;
+    if (!singlePrecision &&
+        (targetImage->GetScalarType() == VTK_DOUBLE ||
+         sourceImage->GetScalarType() == VTK_DOUBLE))
+      {
+      scalarType = VTK_DOUBLE;
+      }
+
+    if (sourceImage->GetScalarType() != scalarType)
+      {
+      vtkImageShiftScale *sourceCast = this->SourceImageTypecast;
+      sourceCast->SET_INPUT_DATA(sourceImage);
+      sourceCast->SetOutputScalarType(scalarType);
+      sourceCast->ClampOverflowOff();
+      sourceCast->SetShift(0.0);
+      sourceCast->SetScale(1.0);
+      sourceCast->Update();
+      sourceImage = sourceCast->GetOutput();
+      }
+
+    vtkImageData *coeffs = NULL;
+    if (prepared)
+      {
+      coeffs = this->Pyramid->PreparedCoefficients[preparedIndex];
+      }
+
+    if (coeffs && coeffs->GetScalarType() == scalarType)
+      {
+      targetImage = coeffs;
+      }
+    else
+      {
+      vtkImageBSplineCoefficients *bspline = this->ImageBSpline;
+      bspline->SET_INPUT_DATA(targetImage);
+      bspline->SetOutputScalarType(scalarType);
+      bspline->Update();
+      targetImage = bspline->GetOutput();
+      }
+    }
+
+  // coerce types if NeighborhoodCorrelation
+  if (sourceImage->GetScalarType() != targetImage->GetScalarType() &&
+      (this->MetricType == vtkImageRegistration::SquaredDifference ||
+       this->MetricType == vtkImageRegistration::NeighborhoodCorrelation))
+    {
+    // coerce the types to make them compatible
+    int sourceType = sourceImage->GetScalarType();
+    int targetType = targetImage->GetScalarType();
+    int sourceSize = sourceImage->GetScalarSize();
+    int targetSize = targetImage->GetScalarSize();
+    int coercedType = VTK_DOUBLE;
+
+    if (singlePrecision && (sourceSize > 4 || targetSize > 4))
+      {
+      coercedType = VTK_FLOAT;
+      }
+    else if (sourceSize < targetSize)
+      {
+      coercedType = targetType;
+      }
+    else if (sourceSize > targetSize)
+      {
+      coercedType = sourceType;
+      }
+    else if (sourceSize < 8 && targetSize < 8)
+      {
+      coercedType = VTK_FLOAT;
+      }
+
+    if (sourceType != coercedType)
+      {
+      vtkImageShiftScale *sourceCast = this->SourceImageTypecast;
+      sourceCast->SET_INPUT_DATA(sourceImage);
+      sourceCast->SetOutputScalarType(coercedType);
+      sourceCast->ClampOverflowOff();
+      sourceCast->SetShift(0.0);
+      sourceCast->SetScale(1.0);
+      sourceCast->Update();
+      sourceImage = sourceCast->GetOutput();
+      }
+
+    if (targetType != coercedType)
+      {
+      vtkImageShiftScale *targetCast = this->TargetImageTypecast;
+      targetCast->SET_INPUT_DATA(targetImage);
+      targetCast->SetOutputScalarType(coercedType);
+      targetCast->ClampOverflowOff();
+      targetCast->SetShift(0.0);
+      targetCast->SetScale(1.0);
+      targetCast->Update();
+      targetImage = targetCast->GetOutput();
+      }
+    }
+
+  if (this->Interpolator)
+    {
+    this->Interpolator->Delete();
+    this->Interpolator = NULL;
+    }
+
+  switch (interpolatorType)
+    {
+    case vtkImageRegistration::Nearest:
+    case vtkImageRegistration::Linear:
+    case vtkImageRegistration::Cubic:
+      {
+      vtkImageInterpolator *interp = vtkImageInterpolator::New();
+      if (interpolatorType == vtkImageRegistration::Nearest)
+        {
+        interp->SetInterpolationModeToNearest();
+        }
+      else if (interpolatorType == vtkImageRegistration::Linear)
+        {
+        interp->SetInterpolationModeToLinear();
+        }
+      else
+        {
+        interp->SetInterpolationModeToCubic();
+        }
+      this->Interpolator = interp;
+      }
+      break;
+    case vtkImageRegistration::BSpline:
+      {
+      this->Interpolator = vtkImageBSplineInterpolator::New();
+      }
+      break;
+    case vtkImageRegistration::Sinc:
+      {
+      vtkImageSincInterpolator *interp = vtkImageSincInterpolator::New();
+      interp->SetWindowFunctionToBlackman();
+      this->Interpolator = interp;
+      }
+      break;
+    case vtkImageRegistration::ASinc:
+      {
+      vtkImageSincInterpolator *interp = vtkImageSincInterpolator::New();
+      interp->SetWindowFunctionToBlackman();
+      interp->AntialiasingOn();
+      this->Interpolator = interp;
+      }
+      break;
+    case vtkImageRegistration::Label:
+      {
+      this->Interpolator = vtkLabelInterpolator::New();
+      }
+      break;
+    default:
+      {
+      this->Interpolator = vtkImageInterpolator::New();
+      }
+      break;
+    }
+
+  // choose the source voxels that will be used by the metric
+  if (samplingFraction > 0.0 && samplingFraction < 1.0 &&
+      this->MetricType != vtkImageRegistration::NeighborhoodCorrelation)
+    {
+    this->ComputeSamplingStencil(
+      sourceImage, sourceStencil, this->SamplingStencil, samplingFraction);
+    sourceStencil = this->SamplingStencil;
+    }
+
+  if (this->FusedEvaluation)
+    {
+    // the metric will interpolate the target image itself, use the
+    // same half-voxel border tolerance that vtkImageReslice uses
+    this->Interpolator->SetTolerance(0.5);
+    this->Interpolator->SetComponentCount(1);
+    }
+
+  if (this->Metric)
+    {
+    this->Metric->RemoveAllInputs();
+    this->Metric->Delete();
+    this->Metric = 0;
+    }
+
+  this->Metric = vtkImageRegistrationNewMetric(
+    this->MetricType, this->JointHistogramSize);
+
+  if (this->Optimizer)
+    {
+    this->Optimizer->Delete();
+    this->Optimizer = 0;
+    }
+
+  switch (this->OptimizerType)
+    {
+    case vtkImageRegistration::Powell:
+      {
+      this->Optimizer = vtkPowellMinimizer::New();
+      }
+      break;
+
+    case vtkImageRegistration::Amoeba:
+      {
+      vtkNelderMeadMinimizer *amoeba = vtkNelderMeadMinimizer::New();
+      // use golden ratio
+      amoeba->SetExpansionRatio(1.618);
+      amoeba->SetContractionRatio(0.618);
+      this->Optimizer = amoeba;
+      }
+      break;
 
-  // create an initial transform
-  initialMatrix->Identity();
-  transform->Identity();
+    case vtkImageRegistration::LBFGS:
+      {
+      this->Optimizer = vtkLBFGSMinimizer::New();
+      }
+      break;
+    }
 
-  // the initial translation
-  double tx = 0.0;
-  double ty = 0.0;
-  double tz = 0.0;
+  // the threads of the pool are pinned for NUMA placement, and the
+  // previous setting is restored when the registration is initialized
+  // again, so that it only stays pinned while placement is on
+  vtkImageRegistrationInfo *placement = this->RegistrationInfo;
+  if (placement->SavedPinThreads >= 0)
+    {
+    this->ThreadPool->SetPinThreads(placement->SavedPinThreads);
+    placement->SavedPinThreads = -1;
+    }
+  if (this->NUMAPlacement)
+    {
+    placement->SavedPinThreads = this->ThreadPool->GetPinThreads();
+    this->ThreadPool->PinThreadsOn();
+    }
 
-  // initialize from the supplied matrix
-  if (matrix)
+  this->Metric->SetThreadPool(this->ThreadPool);
+  this->Metric->SetSinglePrecision(singlePrecision);
+  this->Metric->SetUseSampleList(this->UseSampleList);
+  this->Metric->SetBalancedSplit(this->BalancedSplit);
+  this->Metric->SetNodeLocalAccumulators(this->NUMAPlacement);
+  this->Metric->SET_INPUT_DATA(sourceImage);
+  if (this->FusedEvaluation)
     {
-    // move the translation into tx, ty, tz variables
-    tx = matrix->Element[0][3];
-    ty = matrix->Element[1][3];
-    tz = matrix->Element[2][3];
+    this->Metric->SET_INPUT_DATA(1, targetImage);
+    this->Metric->SetStencilData(sourceStencil);
+    this->Metric->SetInterpolator(this->Interpolator);
+    this->Metric->SetTransform(this->Transform);
+    }
+  else
+    {
+    vtkImageReslice *reslice = this->ImageReslice;
+    reslice->SetInformationInput(sourceImage);
+    reslice->SET_INPUT_DATA(targetImage);
+    reslice->SET_STENCIL_DATA(sourceStencil);
+    reslice->SetResliceTransform(this->Transform);
+    reslice->GenerateStencilOutputOn();
+    reslice->SetInterpolator(this->Interpolator);
+    this->Metric->SetInputConnection(1, reslice->GetOutputPort());
+    this->Metric->SetInputConnection(2, reslice->GetStencilOutputPort());
+    }
+  this->Metric->SetInputRange(0, sourceImageRange);
+  this->Metric->SetInputRange(1, targetImageRange);
 
-    // move rotation/scale/shear into the InitialTransformMatrix
-    initialMatrix->DeepCopy(matrix);
-    initialMatrix->Element[0][3] = 0.0;
-    initialMatrix->Element[1][3] = 0.0;
-    initialMatrix->Element[2][3] = 0.0;
+  // copy the images into memory that is local to the threads that will
+  // read them, where each thread copies the voxels of the piece that the
+  // metric will give it.  The copies are kept for later levels that use
+  // the same images.  Without fusion, the images are not placed, since
+  // the metric reads the output of vtkImageReslice, which is reallocated
+  // whenever it is updated.
+  if (this->NUMAPlacement && this->FusedEvaluation)
+    {
+    int numberOfThreads = this->ThreadPool->GetNumberOfThreads();
+    vtkImageRegistrationPlacedImage *placedSource =
+      &placement->PlacedSourceImage;
+    vtkImageRegistrationPlacedImage *placedTarget =
+      &placement->PlacedTargetImage;
+    bool sourcePlaced = placedSource->IsCopyOf(sourceImage, numberOfThreads);
+    bool targetPlaced = placedTarget->IsCopyOf(targetImage, numberOfThreads);
+
+    // the split is computed without executing the metric
+    std::vector<vtkIdType> sourceRanges(2*numberOfThreads);
+    if (!sourcePlaced || !targetPlaced)
+      {
+      this->Metric->ComputePieceSplit();
+      vtkImageRegistrationSourceRanges(
+        this->Metric, sourceImage->GetNumberOfPoints(), numberOfThreads,
+        &sourceRanges[0]);
+      }
 
-    // adjust the translation for the transform centering
-    double scenter[4];
-    scenter[0] = center[0];
-    scenter[1] = center[1];
-    scenter[2] = center[2];
-    scenter[3] = 1.0;
+    if (!targetPlaced)
+      {
+      // the pose that the registration starts from, which maps each
+      // piece of the source to the part of the target that it reads
+      double pose[16];
+      vtkMatrix4x4::DeepCopy(pose, initialMatrix);
+      double t[3] = { tx, ty, tz };
+      for (int j = 0; j < 3; j++)
+        {
+        double *row = pose + 4*j;
+        row[3] = center[j] + t[j] -
+          (row[0]*center[0] + row[1]*center[1] + row[2]*center[2]);
+        }
+
+      std::vector<vtkIdType> targetRanges(2*numberOfThreads);
+      vtkImageRegistrationTargetRanges(
+        sourceImage, targetImage, pose, numberOfThreads,
+        &sourceRanges[0], &targetRanges[0]);
+
+      // release the old copy before the new one is made
+      placedTarget->Release();
+      placedTarget->Copy = vtkSmartPointer<vtkImageData>::New();
+      vtkImageRegistrationPlaceImage(
+        this->ThreadPool, &targetRanges[0], targetImage, placedTarget->Copy);
+      placedTarget->Original = targetImage;
+      placedTarget->NumberOfThreads = numberOfThreads;
+      placedTarget->CopyTime.Modified();
+      }
+
+    if (!sourcePlaced)
+      {
+      placedSource->Release();
+      placedSource->Copy = vtkSmartPointer<vtkImageData>::New();
+      vtkImageRegistrationPlaceImage(
+        this->ThreadPool, &sourceRanges[0], sourceImage, placedSource->Copy);
+      placedSource->Original = sourceImage;
+      placedSource->NumberOfThreads = numberOfThreads;
+      placedSource->CopyTime.Modified();
+      }
+
+    sourceImage = placedSource->Copy;
+    targetImage = placedTarget->Copy;
+    this->Metric->SET_INPUT_DATA(sourceImage);
+    this->Metric->SET_INPUT_DATA(1, targetImage);
+    }
+  else
+    {
+    placement->PlacedSourceImage.Release();
+    placement->PlacedTargetImage.Release();
+    }
+
+  // create one probe per thread for evaluating batches of points
+  // concurrently, each with its own interpolator and, if fusion is off,
+  // its own reslice pipeline.  The probes use shallow copies of the
+  // images, so that they do not share any data objects.
+  vtkImageRegistrationInfo *info = this->RegistrationInfo;
+  vtkImageRegistrationReleaseProbes(info);
+
+  int numberOfProbes = this->ThreadPool->GetNumberOfThreads();
+  if (!this->FusedEvaluation)
+    {
+    // each reslice pipeline has an output as large as the source image,
+    // so only as many probes are made as fit within the memory budget
+    double probeSize = static_cast<double>(sourceImage->GetNumberOfPoints())*
+      targetImage->GetScalarSize()*targetImage->GetNumberOfScalarComponents();
+    double budget = this->ProbeMemoryLimit*1048576.0;
+    if (probeSize*numberOfProbes > budget)
+      {
+      numberOfProbes = static_cast<int>(budget/probeSize);
+      }
+    }
+  if (numberOfProbes > 1 && this->Metric)
+    {
+    for (int j = 0; j < numberOfProbes; j++)
+      {
+      vtkImageRegistrationProbe probe;
+      vtkImageSimilarityMetric *metric = vtkImageRegistrationNewMetric(
+        this->MetricType, this->JointHistogramSize);
+      vtkAbstractImageInterpolator *interpolator =
+        this->Interpolator->NewInstance();
+      interpolator->DeepCopy(this->Interpolator);
+
+      vtkSmartPointer<vtkImageData> source =
+        vtkSmartPointer<vtkImageData>::New();
+      source->ShallowCopy(sourceImage);
+      vtkSmartPointer<vtkImageData> target =
+        vtkSmartPointer<vtkImageData>::New();
+      target->ShallowCopy(targetImage);
+      vtkSmartPointer<vtkImageStencilData> stencil;
+      if (sourceStencil)
+        {
+        stencil = vtkSmartPointer<vtkImageStencilData>::New();
+        stencil->ShallowCopy(sourceStencil);
+        }
+
+      metric->SetNumberOfThreads(1);
+#ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
+      metric->SetEnableSMP(false);
+#endif
+      metric->SetSinglePrecision(singlePrecision);
+      metric->SetUseSampleList(this->UseSampleList);
+      metric->SET_INPUT_DATA(source);
+      if (this->FusedEvaluation)
+        {
+        metric->SET_INPUT_DATA(1, target);
+        metric->SetStencilData(stencil);
+        metric->SetInterpolator(interpolator);
+        }
+      else
+        {
+        probe.Transform = vtkNewMatrixTransform();
+        probe.Reslice = vtkSmartPointer<vtkImageReslice>::New();
+        vtkImageReslice *reslice = probe.Reslice;
+        reslice->SetInformationInput(source);
+        reslice->SET_INPUT_DATA(target);
+        reslice->SET_STENCIL_DATA(stencil);
+        reslice->SetResliceTransform(probe.Transform);
+        reslice->GenerateStencilOutputOn();
+        reslice->SetInterpolator(interpolator);
+        reslice->SetNumberOfThreads(1);
+#ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
+        reslice->SetEnableSMP(false);
+#endif
+        metric->SetInputConnection(1, reslice->GetOutputPort());
+        metric->SetInputConnection(2, reslice->GetStencilOutputPort());
+        }
+      metric->SetInputRange(0, sourceImageRange);
+      metric->SetInputRange(1, targetImageRange);
+      interpolator->Delete();
+
+      probe.Metric = metric;
+      metric->Delete();
+      info->Probes.push_back(probe);
+      }
+
+    // smaller batches are evaluated one point at a time, since the metric
+    // itself is multithreaded, unless the image is too small to be split
+    // efficiently between the threads
+    int dims[3];
+    sourceImage->GetDimensions(dims);
+    double samples = static_cast<double>(dims[0])*dims[1]*dims[2];
+    if (samplingFraction > 0.0 && samplingFraction < 1.0)
+      {
+      samples *= samplingFraction;
+      }
+    info->ConcurrentBatchSize =
+      (samples < 16384.0*numberOfProbes ? 2 : (numberOfProbes + 1)/2);
+    }
+
+  this->Optimizer->SetTolerance(this->CostTolerance);
+  this->Optimizer->SetParameterTolerance(transformTolerance);
+  this->Optimizer->SetMaxIterations(this->MaximumNumberOfIterations);
+
+  this->RegistrationInfo->Transform = this->Transform;
+  this->RegistrationInfo->Optimizer = this->Optimizer;
+  this->RegistrationInfo->Metric = this->Metric;
+  this->RegistrationInfo->Reslice =
+    (this->FusedEvaluation ? NULL : this->ImageReslice);
+  this->RegistrationInfo->InitialMatrix = this->InitialTransformMatrix;
+  this->RegistrationInfo->ThreadPool = this->ThreadPool;
+
+  if (this->CollectValues)
+    {
+    this->RegistrationInfo->MetricValues = this->MetricValues;
+    this->RegistrationInfo->CostValues = this->CostValues;
+    this->RegistrationInfo->ParameterValues = this->ParameterValues;
+    }
+  else
+    {
+    this->RegistrationInfo->MetricValues = NULL;
+    this->RegistrationInfo->CostValues = NULL;
+    this->RegistrationInfo->ParameterValues = NULL;
+    }
+
+  this->RegistrationInfo->ProfileValues =
+    (this->CollectProfile ? this->ProfileValues : NULL);
+  this->RegistrationInfo->ProfileTime = 0.0;
+  if (this->Metric)
+    {
+    this->Metric->SetCollectProfile(this->CollectProfile);
+    this->Metric->SetCostCeiling(VTK_DOUBLE_MAX);
+    }
+  for (size_t j = 0; j < info->Probes.size(); j++)
+    {
+    info->Probes[j].Metric->SetCollectProfile(this->CollectProfile);
+    info->Probes[j].Metric->SetCostCeiling(VTK_DOUBLE_MAX);
+    }
+
+  this->RegistrationInfo->TransformDimensionality =
+    this->TransformDimensionality;
+  this->RegistrationInfo->TransformType = this->TransformType;
+  this->RegistrationInfo->OptimizerType = this->OptimizerType;
+  this->RegistrationInfo->MetricType = this->MetricType;
+
+  this->RegistrationInfo->NumberOfEvaluations = 0;
+  this->RegistrationInfo->LineActive = false;
+  this->RegistrationInfo->LineChanged = false;
+  this->RegistrationInfo->EarlyAbandon = this->EarlyAbandon;
+  this->RegistrationInfo->BestCost = VTK_DOUBLE_MAX;
+
+  this->RegistrationInfo->Center[0] = center[0];
+  this->RegistrationInfo->Center[1] = center[1];
+  this->RegistrationInfo->Center[2] = center[2];
+
+  vtkFunctionMinimizer *optimizer = this->Optimizer;
+  optimizer->SetFunction(&vtkEvaluateFunction,
+                         (void*)(this->RegistrationInfo));
+  optimizer->SetBatchFunction(&vtkEvaluateBatch);
+  optimizer->SetMinimumConcurrentBatch(info->ConcurrentBatchSize);
+  optimizer->SetLineSearchFunction(
+    this->IncrementalLineSearch ? &vtkLineSearchFunction : NULL);
+
+  // compute minimum spacing of target image
+  double spacing[3];
+  targetImage->GetSpacing(spacing);
+  double minspacing = spacing[0];
+  minspacing = ((minspacing < spacing[1]) ? minspacing : spacing[1]);
+  minspacing = ((minspacing < spacing[2]) ? minspacing : spacing[2]);
+
+  // compute a radius of gyration from the two larger dimensions
+  double r2 = 0.0;
+  double mindim = VTK_DOUBLE_MAX;
+  for (int ii = 0; ii < transformDim; ii++)
+    {
+    mindim = (size[ii] > mindim ? mindim : size[ii]);
+    r2 += size[ii]*size[ii];
+    }
+  r2 -= mindim*mindim;
+  double r = sqrt(r2/12);
+
+  // compute parameter scales
+  double tscale = transformTolerance*10;
+  tscale = ((tscale >= minspacing) ? tscale : minspacing);
+  double rscale = tscale/r;
+  double sscale = tscale/r;
+  if (rscale > 0.5)
+    {
+    rscale = 0.5;
+    }
+  if (sscale > 0.1)
+    {
+    sscale = 0.1;
+    }
+
+  optimizer->Initialize();
+
+  int pcount = 0;
+
+  // translation parameters
+  optimizer->SetParameterValue(pcount, tx);
+  optimizer->SetParameterScale(pcount++, tscale);
+  optimizer->SetParameterValue(pcount, ty);
+  optimizer->SetParameterScale(pcount++, tscale);
+  if (transformDim > 2)
+    {
+    optimizer->SetParameterValue(pcount, tz);
+    optimizer->SetParameterScale(pcount++, tscale);
+    }
+
+  // rotation parameters
+  if (this->TransformType > vtkImageRegistration::Translation)
+    {
+    if (transformDim > 2)
+      {
+      optimizer->SetParameterValue(pcount, 0);
+      optimizer->SetParameterScale(pcount++, rscale);
+      optimizer->SetParameterValue(pcount, 0);
+      optimizer->SetParameterScale(pcount++, rscale);
+      }
+    optimizer->SetParameterValue(pcount, 0);
+    optimizer->SetParameterScale(pcount++, rscale);
+    }
+
+  if (this->TransformType > vtkImageRegistration::Rigid)
+    {
+    // single scale parameter
+    optimizer->SetParameterValue(pcount, 0);
+    optimizer->SetParameterScale(pcount++, sscale);
+    }
+
+  if (this->TransformType > vtkImageRegistration::Similarity)
+    {
+    // extra scale parameters, weighed at 25%
+    optimizer->SetParameterValue(pcount, 0);
+    optimizer->SetParameterScale(pcount++, sscale*0.25);
+    if (transformDim > 2)
+      {
+      optimizer->SetParameterValue(pcount, 0);
+      optimizer->SetParameterScale(pcount++, sscale*0.25);
+      }
+    }
+
+  if (this->TransformType == vtkImageRegistration::Affine)
+    {
+    // extra rotation parameters, scaled at 25%
+    if (transformDim > 2)
+      {
+      optimizer->SetParameterValue(pcount, 0);
+      optimizer->SetParameterScale(pcount++, rscale*0.25);
+      optimizer->SetParameterValue(pcount, 0);
+      optimizer->SetParameterScale(pcount++, rscale*0.25);
+      }
+    optimizer->SetParameterValue(pcount, 0);
+    optimizer->SetParameterScale(pcount++, rscale*0.25);
+    }
+
+  // search for a better starting point for the optimizer, the initializers
+  // compare their candidates by cost so the costs must not be abandoned
+  this->InitializerCostValues->Initialize();
+  this->InitializerParameterValues->Initialize();
+  info->EarlyAbandon = false;
+  if (initializerType == vtkImageRegistration::GridSearch)
+    {
+    this->InitializeByGridSearch(transformTolerance);
+    }
+  else if (initializerType == vtkImageRegistration::Moments)
+    {
+    this->InitializeByMoments(
+      levelSourceImage, sourceStencil, levelTargetImage);
+    }
+  else if (initializerType == vtkImageRegistration::PhaseCorrelation)
+    {
+    this->InitializeByPhaseCorrelation(levelSourceImage, levelTargetImage);
+    }
+
+  // the cost ceiling is only used by the optimizer, which starts over
+  // with its own best cost
+  info->EarlyAbandon = this->EarlyAbandon;
+  info->BestCost = VTK_DOUBLE_MAX;
+  this->Metric->SetCostCeiling(VTK_DOUBLE_MAX);
+  for (size_t j = 0; j < info->Probes.size(); j++)
+    {
+    info->Probes[j].Metric->SetCostCeiling(VTK_DOUBLE_MAX);
+    }
+
+  // build the initial transform from the parameters
+  vtkSetTransformParameters(this->RegistrationInfo);
+
+  this->MetricValues->Initialize();
+  this->CostValues->Initialize();
+  this->ParameterValues->Initialize();
+  this->ParameterValues->SetNumberOfComponents(
+    optimizer->GetNumberOfParameters());
+  this->ProfileValues->Initialize();
+  this->ProfileValues->SetNumberOfComponents(7);
+  this->RegistrationInfo->ProfileTime = 0.0;
+
+  // reserve the trace for the maximum number of evaluations, so that the
+  // evaluation loop does not have to allocate memory, with room for one
+  // more iteration since the limit is only checked between iterations
+  int n = optimizer->GetNumberOfParameters();
+  int maxEvaluations = this->MaximumNumberOfEvaluations;
+  if (level >= 0)
+    {
+    maxEvaluations = this->GetLevelMaximumNumberOfEvaluations(level);
+    }
+  vtkIdType reserve = (maxEvaluations < 65536 ? maxEvaluations : 65536);
+  reserve += 32*n;
+  if (this->CollectValues)
+    {
+    this->MetricValues->Allocate(reserve);
+    this->CostValues->Allocate(reserve);
+    this->ParameterValues->Allocate(reserve*n);
+    }
+  if (this->CollectProfile)
+    {
+    this->ProfileValues->Allocate(reserve*7);
+    }
+
+  // the largest batch that the optimizers use is 2*n points
+  vtkScratchBuffer(info, &info->BatchMatrices, 16*2*n);
+  vtkScratchBuffer(info, &info->BatchSteps, 2*n);
+  vtkScratchBuffer(info, &info->BatchValues, 2*n);
+  vtkScratchBuffer(info, &info->BatchProfile, 7*2*n);
+
+  this->Modified();
+}
 
-    initialMatrix->MultiplyPoint(scenter, scenter);
+//--------------------------------------------------------------------------
+void vtkImageRegistration::InitializeByGridSearch(double transformTolerance)
+{
+  vtkImageRegistrationInfo *info = this->RegistrationInfo;
+  vtkFunctionMinimizer *optimizer = this->Optimizer;
+  int n = optimizer->GetNumberOfParameters();
+  int transformDim = info->TransformDimensionality;
+  transformDim = (transformDim > 2 ? 3 : 2);
 
-    tx -= center[0] - scenter[0];
-    ty -= center[1] - scenter[1];
-    tz -= center[2] - scenter[2];
+  double startTime = vtkTimerLog::GetUniversalTime();
+  double endTime = 0.0;
+  if (this->InitializerMaximumTime > 0)
+    {
+    endTime = startTime + this->InitializerMaximumTime;
     }
-
-  if (this->InitializerType == vtkImageRegistration::Centered)
+  if (info->Deadline > 0 && (endTime == 0 || endTime > info->Deadline))
     {
-    // set an initial translation from one image center to the other image center
-    double tbounds[6];
-    double tcenter[3];
-    targetImage->GetBounds(tbounds);
-    tcenter[0] = 0.5*(tbounds[0] + tbounds[1]);
-    tcenter[1] = 0.5*(tbounds[2] + tbounds[3]);
-    tcenter[2] = 0.5*(tbounds[4] + tbounds[5]);
+    // the search must also end before the time budget runs out
+    endTime = info->Deadline;
+    }
+  int maxEvaluations = this->InitializerMaximumNumberOfEvaluations;
+  if (maxEvaluations <= 0)
+    {
+    maxEvaluations = VTK_INT_MAX;
+    }
 
-    tx = tcenter[0] - center[0];
-    ty = tcenter[1] - center[1];
-    tz = tcenter[2] - center[2];
+  double base[12];
+  for (int i = 0; i < n; i++)
+    {
+    base[i] = optimizer->GetParameterValue(i);
     }
 
-  if (transformDim <= 2)
+  // the rotations, about the x, y, and z axes, with duplicates removed
+  std::vector<double> rotations;
+  if (this->TransformType > vtkImageRegistration::Translation)
     {
-    center[2] = 0.0;
-    tz = 0.0;
+    int steps = vtkMath::Floor(360.0/this->InitializerAngleStep + 0.5);
+    steps = (steps > 1 ? steps : 1);
+    int xysteps = (transformDim > 2 ? steps : 1);
+    std::vector<double> matrices;
+    vtkSmartPointer<vtkTransform> rotation =
+      vtkSmartPointer<vtkTransform>::New();
+    for (int iz = 0; iz < steps; iz++)
+      {
+      for (int iy = 0; iy < xysteps; iy++)
+        {
+        for (int ix = 0; ix < xysteps; ix++)
+          {
+          rotation->Identity();
+          rotation->PostMultiply();
+          rotation->RotateX(ix*360.0/steps);
+          rotation->RotateY(iy*360.0/steps);
+          rotation->RotateZ(iz*360.0/steps);
+          double m[3][3];
+          vtkMatrix4x4 *matrix = rotation->GetMatrix();
+          for (int i = 0; i < 3; i++)
+            {
+            for (int j = 0; j < 3; j++)
+              {
+              m[i][j] = matrix->Element[i][j];
+              }
+            }
+          bool duplicate = false;
+          for (size_t k = 0; k < matrices.size() && !duplicate; k += 9)
+            {
+            double d = 0.0;
+            for (int i = 0; i < 9; i++)
+              {
+              d = fabs(matrices[k + i] - (*m)[i]);
+              if (d > 1e-6) { break; }
+              }
+            duplicate = (d <= 1e-6);
+            }
+          if (!duplicate)
+            {
+            matrices.insert(matrices.end(), *m, *m + 9);
+            double r[3];
+            vtkRotationVector(m, r);
+            rotations.insert(rotations.end(), r, r + 3);
+            }
+          }
+        }
+      }
+    }
+  else
+    {
+    rotations.resize(3, 0.0);
     }
 
-  // do the setup for mutual information
-  double sourceImageRange[2];
-  double targetImageRange[2];
-  sourceImageRange[0] = this->SourceImageRange[0];
-  sourceImageRange[1] = this->SourceImageRange[1];
-  targetImageRange[0] = this->TargetImageRange[0];
-  targetImageRange[1] = this->TargetImageRange[1];
+  // the translations, starting with no translation
+  double size[3];
+  double bounds[6];
+  this->GetSourceImage()->GetBounds(bounds);
+  for (int i = 0; i < 3; i++)
+    {
+    size[i] = bounds[2*i + 1] - bounds[2*i];
+    }
+  std::vector<double> translations(3, 0.0);
+  int tsteps = (transformDim > 2 ? 27 : 9);
+  for (int k = 0; k < tsteps; k++)
+    {
+    int o[3];
+    o[0] = k % 3 - 1;
+    o[1] = (k / 3) % 3 - 1;
+    o[2] = k / 9 - 1;
+    if (transformDim <= 2) { o[2] = 0; }
+    if (o[0] == 0 && o[1] == 0 && o[2] == 0) { continue; }
+    for (int i = 0; i < 3; i++)
+      {
+      double step = this->InitializerTranslationStep;
+      if (step <= 0)
+        {
+        step = 0.125*size[i];
+        }
+      translations.push_back(o[i]*step);
+      }
+    }
 
-  if (this->MetricType == vtkImageRegistration::MutualInformation ||
-      this->MetricType == vtkImageRegistration::NormalizedMutualInformation)
+  // the candidates, every rotation is tried before moving on to the
+  // next translation, so that a truncated search is still useful
+  int numRotations = static_cast<int>(rotations.size()/3);
+  int numTranslations = static_cast<int>(translations.size()/3);
+  int count = numRotations*numTranslations;
+  count = (count < maxEvaluations ? count : maxEvaluations);
+  std::vector<double> candidates(n*count);
+  for (int k = 0; k < count; k++)
     {
-    if (sourceImageRange[0] >= sourceImageRange[1])
+    double *p = &candidates[n*k];
+    const double *r = &rotations[3*(k % numRotations)];
+    const double *t = &translations[3*(k / numRotations)];
+    for (int i = 0; i < n; i++)
       {
-      this->ComputeImageRange(sourceImage, this->GetSourceImageStencil(),
-        sourceImageRange);
+      p[i] = base[i];
       }
-    if (targetImageRange[0] >= targetImageRange[1])
+    for (int i = 0; i < transformDim; i++)
       {
-      this->ComputeImageRange(targetImage, NULL,
-        targetImageRange);
+      p[i] += t[i];
       }
-
-    if (this->InterpolatorType == vtkImageRegistration::Nearest &&
-        this->JointHistogramSize[0] <= 256 &&
-        this->JointHistogramSize[1] <= 256)
+    if (this->TransformType > vtkImageRegistration::Translation)
       {
-      // If nearest-neighbor interpolation is used, then the image instensity
-      // can be quantized during initialization, instead of being done at each
-      // iteration of the registration.
+      if (transformDim > 2)
+        {
+        p[3] = r[0];
+        p[4] = r[1];
+        p[5] = r[2];
+        }
+      else
+        {
+        p[2] = r[2];
+        }
+      }
+    }
 
-      double sourceScale = ((this->JointHistogramSize[1] - 1)/
-        (sourceImageRange[1] - sourceImageRange[0]));
-      // The "0.5/sourceScale" causes the vtkImageShiftScale filter to
-      // round the value, instead of truncating it.
-      double sourceShift = (-sourceImageRange[0] + 0.5/sourceScale);
+  // make sure the metric has gone through the pipeline
+  double baseCost = vtkEvaluateMetric(info, base);
+
+  // score the candidates in chunks, so that the time can be checked
+  std::vector<double> costs(count);
+  std::vector<double> values(count);
+  int chunk = 4*static_cast<int>(info->Probes.size());
+  chunk = (chunk > 16 ? chunk : 16);
+  int scored = 0;
+  while (scored < count &&
+         (endTime == 0 || vtkTimerLog::GetUniversalTime() < endTime))
+    {
+    int m = count - scored;
+    m = (m < chunk ? m : chunk);
+    vtkScoreBatch(info, &candidates[n*scored], m,
+                  &costs[scored], &values[scored]);
+    scored += m;
+    }
 
-      vtkImageShiftScale *sourceQuantizer = this->SourceImageTypecast;
-      sourceQuantizer->SET_INPUT_DATA(sourceImage);
-      sourceQuantizer->SetOutputScalarTypeToUnsignedChar();
-      sourceQuantizer->ClampOverflowOn();
-      sourceQuantizer->SetShift(sourceShift);
-      sourceQuantizer->SetScale(sourceScale);
-      sourceQuantizer->Update();
-      sourceImage = sourceQuantizer->GetOutput();
+  this->InitializerParameterValues->SetNumberOfComponents(n);
+  for (int k = 0; k < scored; k++)
+    {
+    this->InitializerCostValues->InsertNextValue(costs[k]);
+    this->InitializerParameterValues->InsertNextTuple(&candidates[n*k]);
+    }
 
-      double targetScale = ((this->JointHistogramSize[0] - 1)/
-        (targetImageRange[1] - targetImageRange[0]));
-      double targetShift = (-targetImageRange[0] + 0.5/targetScale);
+  // choose the best candidates as the seeds
+  std::vector<std::pair<double, int> > ranking(scored);
+  for (int k = 0; k < scored; k++)
+    {
+    ranking[k] = std::make_pair(costs[k], k);
+    }
+  int numSeeds = this->InitializerNumberOfSeeds;
+  numSeeds = (numSeeds < scored ? numSeeds : scored);
+  std::partial_sort(ranking.begin(), ranking.begin() + numSeeds,
+                    ranking.end());
+
+  // the remaining budget is divided between the seeds
+  int seedEvaluations = 10*(n + 1);
+  if (numSeeds > 0 && maxEvaluations - scored < numSeeds*seedEvaluations)
+    {
+    seedEvaluations = (maxEvaluations - scored)/numSeeds;
+    }
 
-      vtkImageShiftScale *targetQuantizer = this->TargetImageTypecast;
-      targetQuantizer->SET_INPUT_DATA(targetImage);
-      targetQuantizer->SetOutputScalarTypeToUnsignedChar();
-      targetQuantizer->ClampOverflowOn();
-      targetQuantizer->SetShift(targetShift);
-      targetQuantizer->SetScale(targetScale);
-      targetQuantizer->Update();
-      targetImage = targetQuantizer->GetOutput();
+  std::vector<vtkImageRegistrationSeed> seeds(numSeeds);
+  for (int j = 0; j < numSeeds; j++)
+    {
+    vtkImageRegistrationSeed *seed = &seeds[j];
+    const double *p = &candidates[n*ranking[j].second];
+    seed->Info = info;
+    seed->Metric = info->Metric;
+    seed->Reslice = info->Reslice;
+    seed->ResliceTransform = info->Transform;
+    seed->MaximumNumberOfEvaluations = seedEvaluations;
+    seed->EndTime = endTime;
+    seed->BestCost = ranking[j].first;
+    for (int i = 0; i < n; i++)
+      {
+      seed->BestParameters[i] = p[i];
+      }
 
-      // the rescaled image range is now the histogram range
-      targetImageRange[0] = 0;
-      targetImageRange[1] = this->JointHistogramSize[0] - 1;
-      sourceImageRange[0] = 0;
-      sourceImageRange[1] = this->JointHistogramSize[1] - 1;
+    // the local search uses the same scales and tolerances as the
+    // optimizer, and is stopped early if the budget is used up
+    vtkNelderMeadMinimizer *local = vtkNelderMeadMinimizer::New();
+    seed->Optimizer = local;
+    local->Delete();
+    local->SetFunction(&vtkEvaluateSeed, seed);
+    for (int i = 0; i < n; i++)
+      {
+      local->SetParameterValue(i, p[i]);
+      local->SetParameterScale(i, optimizer->GetParameterScale(i));
       }
+    local->SetTolerance(this->CostTolerance);
+    local->SetParameterTolerance(transformTolerance);
+    local->SetMaxIterations(this->MaximumNumberOfIterations);
     }
 
-  // make sure source range is computed for CorrelationRatio
-  if (this->MetricType == vtkImageRegistration::CorrelationRatio)
+  if (seedEvaluations > n + 1 &&
+      (endTime == 0 || vtkTimerLog::GetUniversalTime() < endTime))
     {
-    if (sourceImageRange[0] >= sourceImageRange[1])
+    if (info->Probes.empty())
+      {
+      for (int j = 0; j < numSeeds; j++)
+        {
+        seeds[j].Optimizer->Minimize();
+        }
+      }
+    else
       {
-      this->ComputeImageRange(sourceImage, this->GetSourceImageStencil(),
-        sourceImageRange);
+      vtkImageRegistrationSeedBatch batch;
+      batch.Info = info;
+      batch.Seeds = &seeds[0];
+      batch.Count = numSeeds;
+      this->ThreadPool->Execute(vtkImageRegistrationSeedExecute, &batch);
       }
     }
 
-  // apply b-spline prefilter if b-spline interpolator is used
-  if (this->InterpolatorType == vtkImageRegistration::BSpline)
+  // start the optimizer from the best seed, unless none of the seeds are
+  // better than the initial position
+  const double *best = base;
+  double bestCost = baseCost;
+  for (int j = 0; j < numSeeds; j++)
     {
-    int scalarType = VTK_FLOAT;
-    if (targetImage->GetScalarType() == VTK_DOUBLE ||
-        sourceImage->GetScalarType() == VTK_DOUBLE)
+    if (seeds[j].BestCost < bestCost)
       {
-      scalarType = VTK_DOUBLE;
+      bestCost = seeds[j].BestCost;
+      best = seeds[j].BestParameters;
       }
+    }
+  for (int i = 0; i < n; i++)
+    {
+    optimizer->SetParameterValue(i, best[i]);
+    }
+}
 
-    if (sourceImage->GetScalarType() != scalarType)
+//--------------------------------------------------------------------------
+void vtkImageRegistration::InitializeByMoments(
+  vtkImageData *sourceImage, vtkImageStencilData *sourceStencil,
+  vtkImageData *targetImage)
+{
+  vtkImageRegistrationInfo *info = this->RegistrationInfo;
+  vtkFunctionMinimizer *optimizer = this->Optimizer;
+  int n = optimizer->GetNumberOfParameters();
+  int transformDim = info->TransformDimensionality;
+  transformDim = (transformDim > 2 ? 3 : 2);
+  const double *center = info->Center;
+
+  // the intensity above the minimum is used as the weight
+  double sourceRange[2];
+  double targetRange[2];
+  sourceRange[0] = this->SourceImageRange[0];
+  sourceRange[1] = this->SourceImageRange[1];
+  targetRange[0] = this->TargetImageRange[0];
+  targetRange[1] = this->TargetImageRange[1];
+  if (sourceRange[0] >= sourceRange[1])
+    {
+    this->ComputeImageRange(sourceImage, sourceStencil, sourceRange);
+    }
+  if (targetRange[0] >= targetRange[1])
+    {
+    this->ComputeImageRange(targetImage, NULL, targetRange);
+    }
+
+  double cs[3], ct[3];
+  double as[9], at[9];
+  double ls[3], lt[3];
+  double vs[9], vt[9];
+
+  vtkSmartPointer<vtkCalcCentroid> moments =
+    vtkSmartPointer<vtkCalcCentroid>::New();
+  moments->SetThreadPool(this->ThreadPool);
+  moments->SetInput(sourceImage);
+  moments->SetStencil(sourceStencil);
+  moments->SetIntensityRange(sourceRange);
+  int sourceValid = moments->ComputeMoments();
+  for (int i = 0; i < 3; i++) { cs[i] = moments->GetCentroid()[i]; }
+  for (int i = 0; i < 3; i++) { ls[i] = moments->GetPrincipalMoments()[i]; }
+  for (int i = 0; i < 9; i++) { as[i] = moments->GetPrincipalAxes()[i]; }
+  for (int i = 0; i < 9; i++) { vs[i] = moments->GetCovarianceMatrix()[i]; }
+
+  moments->SetInput(targetImage);
+  moments->SetStencil(NULL);
+  moments->SetIntensityRange(targetRange);
+  int targetValid = moments->ComputeMoments();
+  for (int i = 0; i < 3; i++) { ct[i] = moments->GetCentroid()[i]; }
+  for (int i = 0; i < 3; i++) { lt[i] = moments->GetPrincipalMoments()[i]; }
+  for (int i = 0; i < 9; i++) { at[i] = moments->GetPrincipalAxes()[i]; }
+  for (int i = 0; i < 9; i++) { vt[i] = moments->GetCovarianceMatrix()[i]; }
+  moments->SetInput(NULL);
+
+  if (!sourceValid || !targetValid)
+    {
+    vtkWarningMacro("Initialize: Images have no intensity above the "
+                    "minimum, cannot initialize by moments.");
+    return;
+    }
+
+  // the rotations that take the source axes to the target axes, for
+  // each combination of axis signs that gives a proper rotation
+  std::vector<double> rotations;
+  if (this->TransformType == vtkImageRegistration::Translation)
+    {
+    double identity[9] = { 1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0 };
+    rotations.insert(rotations.end(), identity, identity + 9);
+    }
+  else if (transformDim <= 2)
+    {
+    // use the principal axes of the x-y covariance
+    double thetas = 0.5*atan2(2*vs[1], vs[0] - vs[4]);
+    double thetat = 0.5*atan2(2*vt[1], vt[0] - vt[4]);
+    for (int k = 0; k < 2; k++)
       {
-      vtkImageShiftScale *sourceCast = this->SourceImageTypecast;
-      sourceCast->SET_INPUT_DATA(sourceImage);
-      sourceCast->SetOutputScalarType(scalarType);
-      sourceCast->ClampOverflowOff();
-      sourceCast->SetShift(0.0);
-      sourceCast->SetScale(1.0);
-      sourceCast->Update();
-      sourceImage = sourceCast->GetOutput();
+      double theta = thetat - thetas + k*vtkMath::Pi();
+      double c = cos(theta);
+      double s = sin(theta);
+      double rotation[9] = { c, -s, 0.0, s, c, 0.0, 0.0, 0.0, 1.0 };
+      rotations.insert(rotations.end(), rotation, rotation + 9);
+      }
+    }
+  else
+    {
+    for (int k = 0; k < 8; k++)
+      {
+      // rotation = transpose(at) * diag(signs) * as
+      double signs[3];
+      signs[0] = ((k & 1) ? -1.0 : 1.0);
+      signs[1] = ((k & 2) ? -1.0 : 1.0);
+      signs[2] = ((k & 4) ? -1.0 : 1.0);
+      double rotation[3][3];
+      for (int i = 0; i < 3; i++)
+        {
+        for (int j = 0; j < 3; j++)
+          {
+          rotation[i][j] = 0.0;
+          for (int l = 0; l < 3; l++)
+            {
+            rotation[i][j] += at[3*l + i]*signs[l]*as[3*l + j];
+            }
+          }
+        }
+      if (vtkMath::Determinant3x3(rotation) > 0)
+        {
+        rotations.insert(rotations.end(), *rotation, *rotation + 9);
+        }
       }
+    }
 
-    vtkImageBSplineCoefficients *bspline = this->ImageBSpline;
-    bspline->SET_INPUT_DATA(targetImage);
-    bspline->SetOutputScalarType(scalarType);
-    bspline->Update();
-    targetImage = bspline->GetOutput();
+  // the isotropic scale that matches the spread of the intensities
+  double scale = 1.0;
+  if (this->TransformType > vtkImageRegistration::Rigid)
+    {
+    double ps = ls[0]*ls[1];
+    double pt = lt[0]*lt[1];
+    double power = 0.25;
+    if (transformDim > 2)
+      {
+      ps *= ls[2];
+      pt *= lt[2];
+      power = 1.0/6.0;
+      }
+    if (ps > 0 && pt > 0)
+      {
+      scale = pow(pt/ps, power);
+      }
     }
 
-  // coerce types if NeighborhoodCorrelation
-  if (sourceImage->GetScalarType() != targetImage->GetScalarType() &&
-      (this->MetricType == vtkImageRegistration::SquaredDifference ||
-       this->MetricType == vtkImageRegistration::NeighborhoodCorrelation))
+  // the incoming pose is also a candidate, as it might already be better
+  // than any of the moments, but it must be scored before the moments
+  // replace the initial matrix that its parameters are relative to
+  std::vector<double> incoming(n);
+  for (int i = 0; i < n; i++)
     {
-    // coerce the types to make them compatible
-    int sourceType = sourceImage->GetScalarType();
-    int targetType = targetImage->GetScalarType();
-    int sourceSize = sourceImage->GetScalarSize();
-    int targetSize = targetImage->GetScalarSize();
-    int coercedType = VTK_DOUBLE;
+    incoming[i] = optimizer->GetParameterValue(i);
+    }
+  double incomingCost;
+  double incomingValue;
+  vtkScoreBatch(info, &incoming[0], 1, &incomingCost, &incomingValue);
+  vtkSmartPointer<vtkMatrix4x4> incomingMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  incomingMatrix->DeepCopy(this->InitialTransformMatrix);
+
+  // the moments replace the initial matrix
+  this->InitialTransformMatrix->Identity();
+
+  int count = static_cast<int>(rotations.size()/9);
+  std::vector<double> candidates(n*count);
+  for (int k = 0; k < count; k++)
+    {
+    double *p = &candidates[n*k];
+    const double *rotation = &rotations[9*k];
+    for (int i = 0; i < n; i++)
+      {
+      p[i] = optimizer->GetParameterValue(i);
+      }
 
-    if (sourceSize < targetSize)
+    // the translation that takes the source centroid to the target
+    // centroid, after rotation and scaling about the center
+    double d[3];
+    for (int i = 0; i < 3; i++)
       {
-      coercedType = targetType;
+      d[i] = scale*(rotation[3*i]*(cs[0] - center[0]) +
+                    rotation[3*i + 1]*(cs[1] - center[1]) +
+                    rotation[3*i + 2]*(cs[2] - center[2]));
       }
-    else if (sourceSize > targetSize)
+    int pcount = 0;
+    for (int i = 0; i < transformDim; i++)
       {
-      coercedType = sourceType;
+      p[pcount++] = ct[i] - center[i] - d[i];
       }
-    else if (sourceSize < 8 && targetSize < 8)
+
+    if (this->TransformType > vtkImageRegistration::Translation)
       {
-      coercedType = VTK_FLOAT;
+      double m[3][3];
+      for (int i = 0; i < 9; i++)
+        {
+        (*m)[i] = rotation[i];
+        }
+      double r[3];
+      vtkRotationVector(m, r);
+      if (transformDim > 2)
+        {
+        p[pcount++] = r[0];
+        p[pcount++] = r[1];
+        }
+      p[pcount++] = r[2];
       }
 
-    if (sourceType != coercedType)
+    if (this->TransformType > vtkImageRegistration::Rigid)
       {
-      vtkImageShiftScale *sourceCast = this->SourceImageTypecast;
-      sourceCast->SET_INPUT_DATA(sourceImage);
-      sourceCast->SetOutputScalarType(coercedType);
-      sourceCast->ClampOverflowOff();
-      sourceCast->SetShift(0.0);
-      sourceCast->SetScale(1.0);
-      sourceCast->Update();
-      sourceImage = sourceCast->GetOutput();
+      p[pcount++] = log(scale);
       }
+    }
 
-    if (targetType != coercedType)
+  // score the candidates concurrently
+  std::vector<double> costs(count);
+  std::vector<double> values(count);
+  vtkScoreBatch(info, &candidates[0], count, &costs[0], &values[0]);
+
+  // the incoming pose is kept unless one of the moments is better
+  this->InitializerParameterValues->SetNumberOfComponents(n);
+  this->InitializerCostValues->InsertNextValue(incomingCost);
+  this->InitializerParameterValues->InsertNextTuple(&incoming[0]);
+  int best = -1;
+  double bestCost = incomingCost;
+  for (int k = 0; k < count; k++)
+    {
+    this->InitializerCostValues->InsertNextValue(costs[k]);
+    this->InitializerParameterValues->InsertNextTuple(&candidates[n*k]);
+    if (costs[k] < bestCost)
       {
-      vtkImageShiftScale *targetCast = this->TargetImageTypecast;
-      targetCast->SET_INPUT_DATA(targetImage);
-      targetCast->SetOutputScalarType(coercedType);
-      targetCast->ClampOverflowOff();
-      targetCast->SetShift(0.0);
-      targetCast->SetScale(1.0);
-      targetCast->Update();
-      targetImage = targetCast->GetOutput();
+      best = k;
+      bestCost = costs[k];
       }
     }
 
-  vtkImageReslice *reslice = this->ImageReslice;
-  reslice->SetInformationInput(sourceImage);
-  reslice->SET_INPUT_DATA(targetImage);
-  reslice->SET_STENCIL_DATA(this->GetSourceImageStencil());
-  reslice->SetResliceTransform(this->Transform);
-  reslice->GenerateStencilOutputOn();
-  reslice->SetInterpolator(0);
-  switch (this->InterpolatorType)
+  if (best < 0)
     {
-    case vtkImageRegistration::Nearest:
-      reslice->SetInterpolationModeToNearestNeighbor();
-      break;
-    case vtkImageRegistration::Linear:
-      reslice->SetInterpolationModeToLinear();
-      break;
-    case vtkImageRegistration::Cubic:
-      reslice->SetInterpolationModeToCubic();
-      break;
-    case vtkImageRegistration::BSpline:
+    this->InitialTransformMatrix->DeepCopy(incomingMatrix);
+    for (int i = 0; i < n; i++)
       {
-      vtkImageBSplineInterpolator *interp = vtkImageBSplineInterpolator::New();
-      reslice->SetInterpolator(interp);
-      interp->Delete();
+      optimizer->SetParameterValue(i, incoming[i]);
       }
-      break;
-    case vtkImageRegistration::Sinc:
+    }
+  else
+    {
+    for (int i = 0; i < n; i++)
       {
-      vtkImageSincInterpolator *interp = vtkImageSincInterpolator::New();
-      interp->SetWindowFunctionToBlackman();
-      reslice->SetInterpolator(interp);
-      interp->Delete();
+      optimizer->SetParameterValue(i, candidates[n*best + i]);
       }
-      break;
-    case vtkImageRegistration::ASinc:
+    }
+}
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::InitializeByPhaseCorrelation(
+  vtkImageData *sourceImage, vtkImageData *targetImage)
+{
+  vtkImageRegistrationInfo *info = this->RegistrationInfo;
+  vtkFunctionMinimizer *optimizer = this->Optimizer;
+  int n = optimizer->GetNumberOfParameters();
+  int transformDim = info->TransformDimensionality;
+  transformDim = (transformDim > 2 ? 3 : 2);
+
+  // the transform without its translation, which is what the phase
+  // correlation will find
+  double base[12];
+  double params[12];
+  for (int i = 0; i < n; i++)
+    {
+    base[i] = optimizer->GetParameterValue(i);
+    params[i] = (i < transformDim ? 0.0 : base[i]);
+    }
+  vtkSmartPointer<vtkMatrixToLinearTransform> transform =
+    vtkNewMatrixTransform();
+  vtkSetTransformParameters(info, params, transform);
+
+  // a grid that covers the source image, with enough padding on every
+  // side for the target to be displaced by up to the size of the image
+  const int gridSize = 64;
+  double bounds[6];
+  double center[3];
+  double maxSize = 0.0;
+  sourceImage->GetBounds(bounds);
+  for (int i = 0; i < 3; i++)
+    {
+    center[i] = 0.5*(bounds[2*i] + bounds[2*i + 1]);
+    double size = bounds[2*i + 1] - bounds[2*i];
+    maxSize = (size > maxSize ? size : maxSize);
+    }
+  int dims[3] = { gridSize, gridSize, gridSize };
+  if (transformDim <= 2 || bounds[4] == bounds[5])
+    {
+    dims[2] = 1;
+    }
+  double h = 2*maxSize/gridSize;
+  if (h <= 0)
+    {
+    return;
+    }
+  double origin[3];
+  for (int i = 0; i < 3; i++)
+    {
+    origin[i] = center[i] - 0.5*(dims[i] - 1)*h;
+    }
+
+  // resample both images onto the grid, the target through the transform
+  // so that the only difference between them is a translation, and then
+  // compute their spectra
+  vtkSmartPointer<vtkImageData> spectra[2];
+  for (int j = 0; j < 2; j++)
+    {
+    vtkImageData *image = (j == 0 ? sourceImage : targetImage);
+    double range[2];
+    this->ComputeImageRange(image, NULL, range);
+
+    vtkSmartPointer<vtkImageReslice> reslice =
+      vtkSmartPointer<vtkImageReslice>::New();
+    reslice->SET_INPUT_DATA(image);
+    if (j == 1)
       {
-      vtkImageSincInterpolator *interp = vtkImageSincInterpolator::New();
-      interp->SetWindowFunctionToBlackman();
-      interp->AntialiasingOn();
-      reslice->SetInterpolator(interp);
-      interp->Delete();
+      reslice->SetResliceTransform(transform);
       }
-      break;
-    case vtkImageRegistration::Label:
+    reslice->SetOutputOrigin(origin);
+    reslice->SetOutputSpacing(h, h, h);
+    reslice->SetOutputExtent(
+      0, dims[0] - 1, 0, dims[1] - 1, 0, dims[2] - 1);
+    reslice->SetInterpolationModeToLinear();
+    reslice->SetOutputScalarType(VTK_DOUBLE);
+    reslice->SetBackgroundLevel(range[0]);
+
+    vtkSmartPointer<vtkImageFFT> fft = vtkSmartPointer<vtkImageFFT>::New();
+    fft->SetDimensionality(dims[2] > 1 ? 3 : 2);
+    fft->SetInputConnection(reslice->GetOutputPort());
+    fft->Update();
+    spectra[j] = fft->GetOutput();
+    }
+
+  vtkPhaseCorrelationData data;
+  data.Target = static_cast<double *>(spectra[1]->GetScalarPointer());
+  data.Source = static_cast<double *>(spectra[0]->GetScalarPointer());
+  data.Size = static_cast<vtkIdType>(dims[0])*dims[1]*dims[2];
+  this->ThreadPool->Execute(vtkPhaseCorrelationExecute, &data);
+  spectra[1]->Modified();
+
+  vtkSmartPointer<vtkImageRFFT> rfft = vtkSmartPointer<vtkImageRFFT>::New();
+  rfft->SetDimensionality(dims[2] > 1 ? 3 : 2);
+  rfft->SET_INPUT_DATA(spectra[1]);
+  rfft->Update();
+  const double *corr =
+    static_cast<double *>(rfft->GetOutput()->GetScalarPointer());
+
+  // find the peak of the real part of the correlation
+  vtkIdType peak = 0;
+  for (vtkIdType k = 1; k < data.Size; k++)
+    {
+    if (corr[2*k] > corr[2*peak])
+      {
+      peak = k;
+      }
+    }
+  int idx[3];
+  idx[0] = static_cast<int>(peak % dims[0]);
+  idx[1] = static_cast<int>((peak / dims[0]) % dims[1]);
+  idx[2] = static_cast<int>(peak / (dims[0]*dims[1]));
+
+  // refine the peak with a parabola along each axis, and convert it into
+  // a displacement (the correlation is periodic)
+  vtkIdType inc[3] = { 1, dims[0], dims[0]*dims[1] };
+  double u[3] = { 0.0, 0.0, 0.0 };
+  for (int i = 0; i < 3 && dims[i] > 1; i++)
+    {
+    vtkIdType km = peak + ((idx[i] + dims[i] - 1) % dims[i] - idx[i])*inc[i];
+    vtkIdType kp = peak + ((idx[i] + 1) % dims[i] - idx[i])*inc[i];
+    double fm = corr[2*km];
+    double f0 = corr[2*peak];
+    double fp = corr[2*kp];
+    double offset = 0.0;
+    double denom = fm - 2*f0 + fp;
+    if (denom < 0)
       {
-      vtkLabelInterpolator *interp = vtkLabelInterpolator::New();
-      reslice->SetInterpolator(interp);
-      interp->Delete();
+      offset = 0.5*(fm - fp)/denom;
+      offset = (offset > -0.5 ? offset : -0.5);
+      offset = (offset < 0.5 ? offset : 0.5);
       }
-      break;
+    int shift = (idx[i] > dims[i]/2 ? idx[i] - dims[i] : idx[i]);
+    u[i] = (shift + offset)*h;
     }
 
-  if (this->Metric)
+  // the resampled target is the source displaced by u, in the source
+  // coordinates, so the translation is u after the linear transform
+  double candidates[24];
+  vtkMatrix4x4 *matrix = transform->GetMatrix();
+  for (int i = 0; i < n; i++)
     {
-    this->Metric->RemoveAllInputs();
-    this->Metric->Delete();
-    this->Metric = 0;
+    candidates[i] = base[i];
+    candidates[n + i] = params[i];
+    }
+  for (int i = 0; i < transformDim; i++)
+    {
+    candidates[n + i] = (matrix->Element[i][0]*u[0] +
+                         matrix->Element[i][1]*u[1] +
+                         matrix->Element[i][2]*u[2]);
     }
 
-  switch (this->MetricType)
+  // keep the initial translation unless the new one is better
+  double costs[2];
+  double values[2];
+  vtkScoreBatch(info, candidates, 2, costs, values);
+
+  this->InitializerParameterValues->SetNumberOfComponents(n);
+  for (int k = 0; k < 2; k++)
     {
-    case vtkImageRegistration::SquaredDifference:
+    this->InitializerCostValues->InsertNextValue(costs[k]);
+    this->InitializerParameterValues->InsertNextTuple(&candidates[n*k]);
+    }
+
+  int best = (costs[1] < costs[0] ? 1 : 0);
+  for (int i = 0; i < n; i++)
+    {
+    optimizer->SetParameterValue(i, candidates[n*best + i]);
+    }
+}
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::BuildPyramid()
+{
+  vtkImageRegistrationPyramid *pyramid = this->Pyramid;
+  vtkImageData *sourceImage = this->GetSourceImage();
+  vtkImageData *targetImage = this->GetTargetImage();
+  vtkImageStencilData *sourceStencil = this->GetSourceImageStencil();
+  int n = this->NumberOfLevels;
+
+  // if the inputs have changed, every level must be rebuilt
+  bool inputsModified =
+    (static_cast<int>(pyramid->SourceImages.size()) != n ||
+     sourceImage != pyramid->BuiltSourceImage ||
+     targetImage != pyramid->BuiltTargetImage ||
+     sourceStencil != pyramid->BuiltSourceStencil ||
+     sourceImage->GetMTime() > pyramid->BuildTime.GetMTime() ||
+     targetImage->GetMTime() > pyramid->BuildTime.GetMTime() ||
+     (sourceStencil &&
+      sourceStencil->GetMTime() > pyramid->BuildTime.GetMTime()));
+
+  if (inputsModified)
+    {
+    pyramid->SourceImages.assign(n, vtkSmartPointer<vtkImageData>());
+    pyramid->TargetImages.assign(n, vtkSmartPointer<vtkImageData>());
+    pyramid->SourceStencils.assign(
+      n, vtkSmartPointer<vtkImageStencilData>());
+    pyramid->BuiltShrinkFactors.assign(n, 0.0);
+    pyramid->BuiltInterpolate.assign(n, -1);
+    pyramid->BuiltSourceImage = sourceImage;
+    pyramid->BuiltTargetImage = targetImage;
+    pyramid->BuiltSourceStencil = sourceStencil;
+    }
+
+  // get the smallest source voxel spacing
+  double sourceSpacing[3];
+  double targetSpacing[3];
+  sourceImage->GetSpacing(sourceSpacing);
+  targetImage->GetSpacing(targetSpacing);
+  double minSpacing = VTK_DOUBLE_MAX;
+  for (int j = 0; j < 3; j++)
+    {
+    double s = fabs(sourceSpacing[j]);
+    minSpacing = (s < minSpacing ? s : minSpacing);
+    }
+
+  // build from the finest level to the coarsest level, so that
+  // each level can be built from a finer level
+  std::vector<bool> rebuilt(n, false);
+  for (int level = n - 1; level >= 0; level--)
+    {
+    double shrink = this->GetLevelShrinkFactor(level);
+    int interpolatorType = this->GetLevelInterpolatorType(level);
+    int interpolate = (interpolatorType != vtkImageRegistration::Nearest &&
+                       interpolatorType != vtkImageRegistration::Label);
+
+    // find the finer level that this level will be built from
+    int prev = level + 1;
+    while (prev < n && pyramid->BuiltInterpolate[prev] != interpolate)
       {
-      this->Metric = vtkImageSquaredDifference::New();
+      prev++;
       }
-      break;
 
-    case vtkImageRegistration::CrossCorrelation:
-    case vtkImageRegistration::NormalizedCrossCorrelation:
+    // check whether the cached level is still good
+    if (pyramid->SourceImages[level] &&
+        pyramid->BuiltShrinkFactors[level] == shrink &&
+        pyramid->BuiltInterpolate[level] == interpolate &&
+        (prev >= n || !rebuilt[prev]))
       {
-      vtkImageCrossCorrelation *metric = vtkImageCrossCorrelation::New();
-      this->Metric = metric;
-
-      if (this->MetricType ==
-          vtkImageRegistration::NormalizedCrossCorrelation)
-        {
-        metric->SetMetricToNormalizedCrossCorrelation();
-        }
-      else
-        {
-        metric->SetMetricToCrossCorrelation();
-        }
+      continue;
       }
-      break;
 
-    case vtkImageRegistration::NeighborhoodCorrelation:
+    rebuilt[level] = true;
+    pyramid->BuiltShrinkFactors[level] = shrink;
+    pyramid->BuiltInterpolate[level] = interpolate;
+
+    if (shrink < 1.1)
       {
-      this->Metric = vtkImageNeighborhoodCorrelation::New();
+      // full resolution: no blurring or resampling
+      pyramid->SourceImages[level] = sourceImage;
+      pyramid->TargetImages[level] = targetImage;
+      pyramid->SourceStencils[level] = sourceStencil;
+      continue;
       }
-      break;
 
-    case vtkImageRegistration::CorrelationRatio:
+    if (prev < n && pyramid->BuiltShrinkFactors[prev] == shrink)
       {
-      this->Metric = vtkImageCorrelationRatio::New();
+      // same as the finer level, so share its images
+      pyramid->SourceImages[level] = pyramid->SourceImages[prev];
+      pyramid->TargetImages[level] = pyramid->TargetImages[prev];
+      pyramid->SourceStencils[level] = pyramid->SourceStencils[prev];
+      continue;
       }
-      break;
 
-    case vtkImageRegistration::MutualInformation:
-    case vtkImageRegistration::NormalizedMutualInformation:
+    vtkImageData *prevSource = sourceImage;
+    vtkImageData *prevTarget = targetImage;
+    if (prev < n)
       {
-      vtkImageMutualInformation *metric = vtkImageMutualInformation::New();
-      this->Metric = metric;
-
-      metric->SetNumberOfBins(this->JointHistogramSize);
-
-      if (this->MetricType ==
-          vtkImageRegistration::NormalizedMutualInformation)
-        {
-        metric->SetMetricToNormalizedMutualInformation();
-        }
-      else
-        {
-        metric->SetMetricToMutualInformation();
-        }
+      prevSource = pyramid->SourceImages[prev];
+      prevTarget = pyramid->TargetImages[prev];
       }
-      break;
-    }
 
-  if (this->Optimizer)
-    {
-    this->Optimizer->Delete();
-    this->Optimizer = 0;
-    }
+    // compute the source spacing for this level, and the blur factors
+    // relative to the spacing of the image it is built from
+    double prevSpacing[3];
+    double spacing[3];
+    double sourceBlur[3];
+    double targetBlur[3];
+    prevSource->GetSpacing(prevSpacing);
+    for (int j = 0; j < 3; j++)
+      {
+      double s = shrink*minSpacing;
+      s = (s > fabs(sourceSpacing[j]) ? s : fabs(sourceSpacing[j]));
+      sourceBlur[j] = s/fabs(prevSpacing[j]);
+      sourceBlur[j] = (sourceBlur[j] > 1.0 ? sourceBlur[j] : 1.0);
+      spacing[j] = (sourceSpacing[j] < 0 ? -s : s);
+      // the target keeps its original spacing, so its blur factor
+      // is always relative to the original spacing
+      targetBlur[j] = shrink*minSpacing/fabs(targetSpacing[j]);
+      targetBlur[j] = (targetBlur[j] > 1.0 ? targetBlur[j] : 1.0);
+      }
 
-  switch (this->OptimizerType)
-    {
-    case vtkImageRegistration::Powell:
+    // blur the source with a Blackman-windowed sinc, and reduce the
+    // resolution
+    vtkImageSincInterpolator *sourceKernel = vtkImageSincInterpolator::New();
+    sourceKernel->SetWindowFunctionToBlackman();
+    sourceKernel->AntialiasingOn();
+    sourceKernel->SetBlurFactors(sourceBlur);
+
+    vtkImageResize *sourceResize = vtkImageResize::New();
+    vtkImageRegistrationLimitThreads(sourceResize, this->ThreadPool);
+    sourceResize->SET_INPUT_DATA(prevSource);
+    sourceResize->SetResizeMethodToOutputSpacing();
+    sourceResize->SetOutputSpacing(spacing);
+    sourceResize->SetInterpolator(sourceKernel);
+    sourceResize->SetInterpolate(interpolate);
+    sourceResize->Update();
+
+    vtkImageData *levelSource = vtkImageData::New();
+    levelSource->ShallowCopy(sourceResize->GetOutput());
+    pyramid->SourceImages[level] = levelSource;
+    levelSource->Delete();
+    sourceResize->Delete();
+    sourceKernel->Delete();
+
+    // use the prepared target if it was blurred for this level
+    vtkImageRegistrationTarget *prepared = this->PreparedTarget;
+    int preparedType = vtkImageRegistration::Nearest;
+    if (prepared)
       {
-      this->Optimizer = vtkPowellMinimizer::New();
+      preparedType = prepared->GetLevelInterpolatorType(level);
+      }
+    if (interpolate && prepared &&
+        static_cast<size_t>(level + 1) < pyramid->PreparedImages.size() &&
+        targetImage == pyramid->PreparedImages[0] &&
+        prepared->GetLevelShrinkFactor(level) == shrink &&
+        preparedType != vtkImageRegistration::Nearest &&
+        preparedType != vtkImageRegistration::Label)
+      {
+      pyramid->TargetImages[level] = pyramid->PreparedImages[level + 1];
+      }
+    // blur the target, but keep it at full resolution
+    else if (interpolate)
+      {
+      vtkImageData *levelTarget = vtkImageData::New();
+      vtkImageRegistrationTarget::BlurImage(
+        prevTarget, targetBlur, levelTarget,
+        this->ThreadPool->GetNumberOfThreads());
+      pyramid->TargetImages[level] = levelTarget;
+      levelTarget->Delete();
+      }
+    else
+      {
+      pyramid->TargetImages[level] = prevTarget;
       }
-      break;
 
-    case vtkImageRegistration::Amoeba:
+    // resample the stencil to match the source for this level
+    pyramid->SourceStencils[level] = NULL;
+    if (sourceStencil)
       {
-      vtkNelderMeadMinimizer *amoeba = vtkNelderMeadMinimizer::New();
-      // use golden ratio
-      amoeba->SetExpansionRatio(1.618);
-      amoeba->SetContractionRatio(0.618);
-      this->Optimizer = amoeba;
+      vtkImageStencilData *levelStencil = vtkImageStencilData::New();
+      vtkImageRegistrationResampleStencil(
+        sourceStencil, pyramid->SourceImages[level], levelStencil);
+      pyramid->SourceStencils[level] = levelStencil;
+      levelStencil->Delete();
       }
-      break;
     }
 
-  this->Metric->SET_INPUT_DATA(sourceImage);
-  this->Metric->SetInputConnection(1, reslice->GetOutputPort());
-  this->Metric->SetInputConnection(2, reslice->GetStencilOutputPort());
-  this->Metric->SetInputRange(0, sourceImageRange);
-  this->Metric->SetInputRange(1, targetImageRange);
-
-  this->Optimizer->SetTolerance(this->CostTolerance);
-  this->Optimizer->SetParameterTolerance(this->TransformTolerance);
-  this->Optimizer->SetMaxIterations(this->MaximumNumberOfIterations);
+  pyramid->BuildTime.Modified();
+}
 
-  this->RegistrationInfo->Transform = this->Transform;
-  this->RegistrationInfo->Optimizer = this->Optimizer;
-  this->RegistrationInfo->Metric = this->Metric;
-  this->RegistrationInfo->InitialMatrix = this->InitialTransformMatrix;
+//--------------------------------------------------------------------------
+void vtkImageRegistration::InitializePyramid(vtkMatrix4x4 *matrix)
+{
+  // update our inputs
+  this->Update();
 
-  if (this->CollectValues)
+  if (this->GetTargetImage() == NULL || this->GetSourceImage() == NULL)
     {
-    this->RegistrationInfo->MetricValues = this->MetricValues;
-    this->RegistrationInfo->CostValues = this->CostValues;
-    this->RegistrationInfo->ParameterValues = this->ParameterValues;
-    }
-  else
-    {
-    this->RegistrationInfo->MetricValues = NULL;
-    this->RegistrationInfo->CostValues = NULL;
-    this->RegistrationInfo->ParameterValues = NULL;
+    vtkErrorMacro("InitializePyramid: Input images are not set");
+    return;
     }
 
-  this->RegistrationInfo->TransformDimensionality =
-    this->TransformDimensionality;
-  this->RegistrationInfo->TransformType = this->TransformType;
-  this->RegistrationInfo->OptimizerType = this->OptimizerType;
-  this->RegistrationInfo->MetricType = this->MetricType;
+  this->BuildPyramid();
 
-  this->RegistrationInfo->NumberOfEvaluations = 0;
+  vtkImageRegistrationPyramid *pyramid = this->Pyramid;
+  pyramid->ElapsedTimes.assign(this->NumberOfLevels, 0.0);
+  pyramid->NumberOfEvaluations.assign(this->NumberOfLevels, 0);
+  pyramid->BudgetSamplingFractions.assign(this->NumberOfLevels, 0.0);
+  pyramid->UsedSamplingFractions.assign(this->NumberOfLevels, 0.0);
+  pyramid->TimeBudgets.assign(this->NumberOfLevels, 0.0);
+  pyramid->CurrentLevel = 0;
+  pyramid->StartTime = vtkTimerLog::GetUniversalTime();
 
-  this->RegistrationInfo->Center[0] = center[0];
-  this->RegistrationInfo->Center[1] = center[1];
-  this->RegistrationInfo->Center[2] = center[2];
+  // the first level always runs, this only records the time budget
+  this->AbortExecute = 0;
+  this->StartTimeBudget();
+  this->FitLevelToTimeBudget(0);
 
-  vtkFunctionMinimizer *optimizer = this->Optimizer;
-  optimizer->SetFunction(&vtkEvaluateFunction,
-                         (void*)(this->RegistrationInfo));
+  this->InitializeLevel(0, matrix);
+}
 
-  // compute minimum spacing of target image
-  double spacing[3];
-  targetImage->GetSpacing(spacing);
-  double minspacing = spacing[0];
-  minspacing = ((minspacing < spacing[1]) ? minspacing : spacing[1]);
-  minspacing = ((minspacing < spacing[2]) ? minspacing : spacing[2]);
+//--------------------------------------------------------------------------
+int vtkImageRegistration::IteratePyramid()
+{
+  vtkImageRegistrationPyramid *pyramid = this->Pyramid;
+  int level = pyramid->CurrentLevel;
 
-  // compute a radius of gyration from the two larger dimensions
-  double r2 = 0.0;
-  double mindim = VTK_DOUBLE_MAX;
-  for (int ii = 0; ii < transformDim; ii++)
+  if (level < 0 || level >= this->NumberOfLevels)
     {
-    mindim = (size[ii] > mindim ? mindim : size[ii]);
-    r2 += size[ii]*size[ii];
+    return 0;
     }
-  r2 -= mindim*mindim;
-  double r = sqrt(r2/12);
 
-  // compute parameter scales
-  double tscale = this->TransformTolerance*10;
-  tscale = ((tscale >= minspacing) ? tscale : minspacing);
-  double rscale = tscale/r;
-  double sscale = tscale/r;
-  if (rscale > 0.5)
+  if (this->Iterate())
     {
-    rscale = 0.5;
+    return 1;
     }
-  if (sscale > 0.1)
+
+  // the current level is finished, record the results
+  double currentTime = vtkTimerLog::GetUniversalTime();
+  pyramid->ElapsedTimes[level] = currentTime - pyramid->StartTime;
+  pyramid->NumberOfEvaluations[level] =
+    this->RegistrationInfo->NumberOfEvaluations;
+  pyramid->StartTime = currentTime;
+  pyramid->CurrentLevel = ++level;
+  vtkImageRegistrationReleaseProbes(this->RegistrationInfo);
+
+  if (level >= this->NumberOfLevels)
     {
-    sscale = 0.1;
+    return 0;
     }
 
-  optimizer->Initialize();
+  // if the next level cannot finish in the time that is left, then the
+  // result of the current level is the final result
+  if (this->StoppedByTimeBudget || !this->FitLevelToTimeBudget(level))
+    {
+    this->StoppedByTimeBudget = true;
+    pyramid->CurrentLevel = this->NumberOfLevels;
+    return 0;
+    }
 
-  int pcount = 0;
+  // a registration that was cancelled does not start another level
+  if (this->AbortExecute)
+    {
+    pyramid->CurrentLevel = this->NumberOfLevels;
+    return 0;
+    }
 
-  // translation parameters
-  optimizer->SetParameterValue(pcount, tx);
-  optimizer->SetParameterScale(pcount++, tscale);
-  optimizer->SetParameterValue(pcount, ty);
-  optimizer->SetParameterScale(pcount++, tscale);
-  if (transformDim > 2)
+  // start the next level from the current transform
+  vtkMatrix4x4 *matrix = vtkMatrix4x4::New();
+  matrix->DeepCopy(this->Transform->GetMatrix());
+  this->InitializeLevel(level, matrix);
+  matrix->Delete();
+
+  return 1;
+}
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::StartTimeBudget()
+{
+  this->StoppedByTimeBudget = false;
+  this->RegistrationInfo->Deadline = 0.0;
+  if (this->TimeBudget > 0)
     {
-    optimizer->SetParameterValue(pcount, tz);
-    optimizer->SetParameterScale(pcount++, tscale);
+    this->RegistrationInfo->Deadline =
+      vtkTimerLog::GetUniversalTime() + this->TimeBudget;
     }
+}
 
-  // rotation parameters
-  if (this->TransformType > vtkImageRegistration::Translation)
+//--------------------------------------------------------------------------
+bool vtkImageRegistration::FitLevelToTimeBudget(int level)
+{
+  vtkImageRegistrationPyramid *pyramid = this->Pyramid;
+  double deadline = this->RegistrationInfo->Deadline;
+  if (deadline <= 0)
     {
-    if (transformDim > 2)
-      {
-      optimizer->SetParameterValue(pcount, 0);
-      optimizer->SetParameterScale(pcount++, rscale);
-      optimizer->SetParameterValue(pcount, 0);
-      optimizer->SetParameterScale(pcount++, rscale);
-      }
-    optimizer->SetParameterValue(pcount, 0);
-    optimizer->SetParameterScale(pcount++, rscale);
+    return true;
     }
 
-  if (this->TransformType > vtkImageRegistration::Rigid)
+  double remaining = deadline - vtkTimerLog::GetUniversalTime();
+  pyramid->TimeBudgets[level] = (remaining > 0 ? remaining : 0.0);
+  if (level == 0)
     {
-    // single scale parameter
-    optimizer->SetParameterValue(pcount, 0);
-    optimizer->SetParameterScale(pcount++, sscale);
+    return true;
+    }
+  if (remaining <= 0)
+    {
+    return false;
     }
 
-  if (this->TransformType > vtkImageRegistration::Similarity)
+  // estimate the time for this level from the time taken by the previous
+  // level, assuming that the time is proportional to the number of voxels
+  double fraction = this->GetLevelSamplingFraction(level);
+  fraction = (fraction > 0.0 && fraction < 1.0 ? fraction : 1.0);
+  double prevFraction = pyramid->UsedSamplingFractions[level - 1];
+  double points = static_cast<double>(
+    pyramid->SourceImages[level]->GetNumberOfPoints());
+  double prevPoints = static_cast<double>(
+    pyramid->SourceImages[level - 1]->GetNumberOfPoints());
+  double prevVoxels = prevFraction*prevPoints;
+  if (prevVoxels <= 0)
     {
-    // extra scale parameters, weighed at 25%
-    optimizer->SetParameterValue(pcount, 0);
-    optimizer->SetParameterScale(pcount++, sscale*0.25);
-    if (transformDim > 2)
-      {
-      optimizer->SetParameterValue(pcount, 0);
-      optimizer->SetParameterScale(pcount++, sscale*0.25);
-      }
+    return true;
     }
 
-  if (this->TransformType == vtkImageRegistration::Affine)
+  double estimate =
+    pyramid->ElapsedTimes[level - 1]*fraction*points/prevVoxels;
+  if (estimate > remaining)
     {
-    // extra rotation parameters, scaled at 25%
-    if (transformDim > 2)
+    // sample fewer voxels, but if that means sampling no more voxels than
+    // the previous level did, then this level would not add anything
+    fraction *= remaining/estimate;
+    if (fraction*points <= prevVoxels)
       {
-      optimizer->SetParameterValue(pcount, 0);
-      optimizer->SetParameterScale(pcount++, rscale*0.25);
-      optimizer->SetParameterValue(pcount, 0);
-      optimizer->SetParameterScale(pcount++, rscale*0.25);
+      return false;
       }
-    optimizer->SetParameterValue(pcount, 0);
-    optimizer->SetParameterScale(pcount++, rscale*0.25);
+    pyramid->BudgetSamplingFractions[level] = fraction;
     }
 
-  // build the initial transform from the parameters
-  vtkSetTransformParameters(this->RegistrationInfo);
+  return true;
+}
 
-  this->MetricValues->Initialize();
-  this->CostValues->Initialize();
-  this->ParameterValues->Initialize();
-  this->ParameterValues->SetNumberOfComponents(
-    optimizer->GetNumberOfParameters());
+//--------------------------------------------------------------------------
+bool vtkImageRegistration::CheckTimeBudget()
+{
+  vtkImageRegistrationInfo *info = this->RegistrationInfo;
+  if (info->Deadline <= 0 ||
+      vtkTimerLog::GetUniversalTime() <= info->Deadline)
+    {
+    return false;
+    }
 
-  this->Modified();
+  // the optimizer was stopped mid-search, so use the best transform that
+  // it found rather than the point where it stopped
+  this->StoppedByTimeBudget = true;
+  if (info->BestCost < VTK_DOUBLE_MAX)
+    {
+    vtkSetTransformParameters(info, info->BestParameters, info->Transform);
+    this->MetricValue = info->BestCost;
+    }
+
+  return true;
+}
+
+//--------------------------------------------------------------------------
+double vtkImageRegistration::GetBestCost()
+{
+  return this->RegistrationInfo->BestCost;
+}
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::GetBestMatrix(vtkMatrix4x4 *matrix)
+{
+  vtkImageRegistrationInfo *info = this->RegistrationInfo;
+  if (info->BestCost < VTK_DOUBLE_MAX && this->Optimizer)
+    {
+    double elements[16];
+    vtkComputeTransformMatrix(info, info->BestParameters, elements);
+    matrix->DeepCopy(elements);
+    }
+  else
+    {
+    matrix->DeepCopy(this->Transform->GetMatrix());
+    }
+}
+
+//--------------------------------------------------------------------------
+vtkTypeUInt64 vtkImageRegistration::GetNumberOfAllocations()
+{
+  vtkImageRegistrationInfo *info = this->RegistrationInfo;
+  vtkTypeUInt64 count = info->NumberOfAllocations;
+  if (this->Metric)
+    {
+    count += this->Metric->GetNumberOfAllocations();
+    }
+  for (size_t j = 0; j < info->Probes.size(); j++)
+    {
+    count += info->Probes[j].Metric->GetNumberOfAllocations();
+    }
+  return count;
 }
 
 //--------------------------------------------------------------------------
@@ -1122,6 +4553,12 @@ int vtkImageRegistration::ExecuteRegistration()
       vtkSetTransformParameters(this->RegistrationInfo);
       this->MetricValue = optimizer->GetFunctionValue();
 
+      if (this->CheckTimeBudget())
+        {
+        converged = 0;
+        break;
+        }
+
       if (this->RegistrationInfo->NumberOfEvaluations >=
           this->MaximumNumberOfEvaluations)
         {
@@ -1147,17 +4584,27 @@ int vtkImageRegistration::Iterate()
 {
   vtkFunctionMinimizer *optimizer = this->Optimizer;
 
-  if (optimizer)
+  if (optimizer && !this->AbortExecute)
     {
+    int maxEvaluations = this->MaximumNumberOfEvaluations;
+    int level = this->Pyramid->CurrentLevel;
+    if (level >= 0 && level < this->NumberOfLevels)
+      {
+      maxEvaluations = this->GetLevelMaximumNumberOfEvaluations(level);
+      }
+
     int result = optimizer->Iterate();
     if (optimizer->GetIterations() >= this->MaximumNumberOfIterations ||
-        this->RegistrationInfo->NumberOfEvaluations >=
-          this->MaximumNumberOfEvaluations)
+        this->RegistrationInfo->NumberOfEvaluations >= maxEvaluations)
       {
       result = 0;
       }
     vtkSetTransformParameters(this->RegistrationInfo);
     this->MetricValue = optimizer->GetFunctionValue();
+    if (this->CheckTimeBudget())
+      {
+      result = 0;
+      }
     return result;
     }
 
@@ -26,7 +26,7 @@
 class vtkImageData;
 class vtkImageStencilData;
 class vtkLinearTransform;
-class vtkTransform;
+class vtkMatrixToLinearTransform;
 class vtkMatrix4x4;
 class vtkDoubleArray;
 class vtkImageReslice;
@@ -35,8 +35,11 @@ class vtkImageBSplineCoefficients;
 class vtkAbstractImageInterpolator;
 class vtkFunctionMinimizer;
 class vtkImageSimilarityMetric;
+class vtkWorkerThreadPool;
+class vtkImageRegistrationTarget;
 
 struct vtkImageRegistrationInfo;
+struct vtkImageRegistrationPyramid;
 
 class VTK_EXPORT vtkImageRegistration : public vtkAlgorithm
 {
@@ -70,6 +73,20 @@ public:
   void SetTargetImage(vtkImageData *input);
   vtkImageData *GetTargetImage();
 
+  // Description:
+  // Use a target that has been prepared for registration.  This sets the
+  // TargetImage, and for every level where the prepared target was built
+  // with the same settings as this registration, the blurred image, the
+  // image range, the quantized image, and the b-spline coefficients are
+  // taken from the prepared target instead of being computed again.
+  // The registration keeps shallow copies of the prepared images, so the
+  // image data is shared by all of the registrations that use the same
+  // prepared target, and these registrations can run concurrently.  The
+  // prepared target must be built before it is set.
+  void SetPreparedTarget(vtkImageRegistrationTarget *target);
+  vtkImageRegistrationTarget *GetPreparedTarget() {
+    return this->PreparedTarget; }
+
   // Description:
   // Set a stencil to apply to the fixed image, to register by using
   // only a portion of the image.  This can only be done for the fixed image.
@@ -80,7 +97,8 @@ public:
   enum
   {
     Amoeba,
-    Powell
+    Powell,
+    LBFGS
   };
 
   // Metric types
@@ -122,7 +140,25 @@ public:
   enum
   {
     None,
-    Centered
+    Centered,
+    GridSearch,
+    Moments,
+    PhaseCorrelation
+  };
+
+  // Sampling strategies
+  enum
+  {
+    RegularSampling,
+    StratifiedSampling,
+    GradientSampling
+  };
+
+  // Precision policies
+  enum
+  {
+    DefaultPrecision,
+    SinglePrecision
   };
 
   // Description:
@@ -143,14 +179,29 @@ public:
   vtkGetMacro(MetricType, int);
 
   // Description:
-  // Set the optimizer.  The default is Powell.
+  // Set the optimizer.  The default is Powell.  The LBFGS optimizer uses
+  // finite-difference gradients.  Whenever an optimizer has several
+  // independent points to evaluate (the gradient probes for LBFGS, the
+  // bracket points for Powell, the initial simplex for Amoeba) they are
+  // evaluated concurrently, with one metric per thread of the ThreadPool.
   vtkSetMacro(OptimizerType, int);
   void SetOptimizerTypeToAmoeba() {
     this->SetOptimizerType(Amoeba); }
   void SetOptimizerTypeToPowell() {
     this->SetOptimizerType(Powell); }
+  void SetOptimizerTypeToLBFGS() {
+    this->SetOptimizerType(LBFGS); }
   vtkGetMacro(OptimizerType, int);
 
+  // Description:
+  // Set the memory, in megabytes, that the concurrent evaluations of a
+  // batch may use for their resampled images when FusedEvaluation is off.
+  // Each thread needs its own reslice output, as large as the source
+  // image, so fewer threads evaluate the batch if their outputs would not
+  // fit.  The default is 512.
+  vtkSetClampMacro(ProbeMemoryLimit, double, 0.0, VTK_DOUBLE_MAX);
+  vtkGetMacro(ProbeMemoryLimit, double);
+
   // Description:
   // Set the image interpolator.  The default is Linear.
   vtkSetMacro(InterpolatorType, int);
@@ -202,14 +253,217 @@ public:
   // Description:
   // Set the initializer type.  The default is None.  The Centered
   // initializer sets an initial translation that will center the
-  // images over each other.
+  // images over each other.  The GridSearch initializer scores a coarse
+  // grid of rotations and translations (about the centered position, or
+  // about the supplied matrix), runs a short local search from each of
+  // the best few candidates, and starts the optimizer from the best one.
+  // This is useful when the initial rotation might be large, e.g. for
+  // prone vs. supine images.  The Moments initializer aligns the
+  // intensity-weighted centroids and the principal axes of the images,
+  // and chooses the best of the axis sign combinations, unless the
+  // incoming pose (the matrix that is given to Initialize(), or the
+  // centered position) scores better, in which case that is kept.  The
+  // PhaseCorrelation initializer resamples both images onto a coarse
+  // common grid and finds the translation from the peak of the normalized
+  // cross-power spectrum, which is fast and robust for same-modality
+  // images that differ mainly by translation.  For multi-resolution
+  // registration, the initializer is only used at the coarsest level.
   vtkSetMacro(InitializerType, int);
   void SetInitializerTypeToNone() {
     this->SetInitializerType(None); }
   void SetInitializerTypeToCentered() {
     this->SetInitializerType(Centered); }
+  void SetInitializerTypeToGridSearch() {
+    this->SetInitializerType(GridSearch); }
+  void SetInitializerTypeToMoments() {
+    this->SetInitializerType(Moments); }
+  void SetInitializerTypeToPhaseCorrelation() {
+    this->SetInitializerType(PhaseCorrelation); }
   vtkGetMacro(InitializerType, int);
 
+  // Description:
+  // Set the angle between the rotations in the GridSearch, in degrees.
+  // The grid covers all rotations about each axis, so the default of 90
+  // gives the 24 distinct axis-aligned orientations in 3D.
+  vtkSetClampMacro(InitializerAngleStep, double, 1.0, 180.0);
+  vtkGetMacro(InitializerAngleStep, double);
+
+  // Description:
+  // Set the translation step for the GridSearch, in physical units.  The
+  // grid uses steps of -1, 0, and +1 along each axis.  If this is zero
+  // (the default), then an eighth of the source image size is used.
+  vtkSetMacro(InitializerTranslationStep, double);
+  vtkGetMacro(InitializerTranslationStep, double);
+
+  // Description:
+  // Set the number of grid candidates that are refined by a short
+  // local search before the best one is chosen.  The default is 4.
+  // The local searches are run concurrently on the ThreadPool.
+  vtkSetClampMacro(InitializerNumberOfSeeds, int, 1, 1000);
+  vtkGetMacro(InitializerNumberOfSeeds, int);
+
+  // Description:
+  // Set a budget for the GridSearch, either as a number of evaluations
+  // or as a time in seconds.  The grid is scored first, with the most
+  // likely candidates first, and whatever remains of the budget is
+  // divided between the seeds.  The default, zero, means no limit.
+  vtkSetMacro(InitializerMaximumNumberOfEvaluations, int);
+  vtkGetMacro(InitializerMaximumNumberOfEvaluations, int);
+  vtkSetMacro(InitializerMaximumTime, double);
+  vtkGetMacro(InitializerMaximumTime, double);
+
+  // Description:
+  // Get the costs and the parameters of the GridSearch, Moments, or
+  // PhaseCorrelation candidates, with one value or tuple per candidate
+  // that was scored.  The parameters are ordered as for
+  // GetParameterValues().
+  vtkGetObjectMacro(InitializerCostValues, vtkDoubleArray);
+  vtkGetObjectMacro(InitializerParameterValues, vtkDoubleArray);
+
+  // Description:
+  // Turn this on to fuse the resampling of the target image with the
+  // evaluation of the metric.  Instead of using vtkImageReslice to write
+  // a resampled copy of the target image for every evaluation, the metric
+  // will interpolate the target image directly at the transformed source
+  // voxel locations.  This reduces memory traffic, and avoids allocating
+  // a full-size image for each evaluation.  The default is Off.
+  vtkSetMacro(FusedEvaluation, bool);
+  vtkGetMacro(FusedEvaluation, bool);
+  vtkBooleanMacro(FusedEvaluation, bool);
+
+  // Description:
+  // Turn this on to speed up the line searches of the Powell optimizer.
+  // When the optimizer searches along a direction that only changes the
+  // translation, the transform matrix is a linear function of the step
+  // length, so the matrix at the start of the line and its change per
+  // step are computed once per direction.  With FusedEvaluation, the
+  // metric also computes the target position of the first voxel of each
+  // source row and its derivative along the line once per direction, so
+  // that each point on the line costs one multiply-add per coordinate per
+  // row instead of a matrix product.  This needs 48 bytes per row of the
+  // source image, and the rows are not used when UseSampleList is on.
+  // The results can differ from the full rebuild in the last few bits.
+  // The default is Off.
+  vtkSetMacro(IncrementalLineSearch, bool);
+  vtkGetMacro(IncrementalLineSearch, bool);
+  vtkBooleanMacro(IncrementalLineSearch, bool);
+
+  // Description:
+  // Turn this on to abandon evaluations that cannot improve on the best
+  // cost so far.  The best cost is passed to the metric as its ceiling,
+  // and metrics that support it (currently SquaredDifference) stop once
+  // their running total proves that the cost will exceed the ceiling.
+  // An abandoned evaluation reports a lower bound on its cost, which is
+  // still worse than the best cost, so comparisons by the optimizer are
+  // unaffected, but interpolation between the costs can be less accurate.
+  // The default is Off.
+  vtkSetMacro(EarlyAbandon, bool);
+  vtkGetMacro(EarlyAbandon, bool);
+  vtkBooleanMacro(EarlyAbandon, bool);
+
+  // Description:
+  // Turn this on to compile the source stencil into a list of samples
+  // once per level, when FusedEvaluation is on.  The metric then iterates
+  // linearly over contiguous arrays of the coordinates and values of the
+  // source voxels within the stencil, instead of walking the stencil for
+  // every evaluation, and the threads split the samples evenly.  This is
+  // fastest for masks with many short spans.  The list takes 28 bytes per
+  // sample, and is shared by the probes that evaluate batches of points.
+  // The default is Off.
+  vtkSetMacro(UseSampleList, bool);
+  vtkGetMacro(UseSampleList, bool);
+  vtkBooleanMacro(UseSampleList, bool);
+
+  // Description:
+  // Turn this on to split the metric computation between the threads
+  // according to the number of voxels within the stencil, rather than
+  // according to the size of the extent.  This helps when the mask is
+  // concentrated in part of the image, which would otherwise leave most
+  // of the work to a few threads.  It has no effect with UseSampleList,
+  // since the samples are always split evenly.  The default is Off.
+  vtkSetMacro(BalancedSplit, bool);
+  vtkGetMacro(BalancedSplit, bool);
+  vtkBooleanMacro(BalancedSplit, bool);
+
+  // Description:
+  // Turn this on to place the images in memory for machines with several
+  // NUMA nodes (e.g. dual-socket servers).  The threads of the ThreadPool
+  // are pinned, and at the start of each level the source and target
+  // images are copied into new buffers by the pool threads, with each
+  // thread copying the voxels of the piece that the metric will give it.
+  // Since a page is placed on the node of the thread that first touches
+  // it, each thread then reads its piece from its own node.  The copies
+  // are kept for later levels that use the same images.  The images are
+  // only placed if FusedEvaluation is on, since otherwise the metric reads
+  // the output of the reslice filter, which is reallocated by every
+  // update.  The previous PinThreads setting of the ThreadPool is restored
+  // when the registration is initialized with NUMAPlacement off.  The
+  // histograms and partial sums of the metric are also kept local to each
+  // thread, with or without FusedEvaluation.  This needs memory for a
+  // second copy of the images for the current level, and it is pointless
+  // on machines with only one node.  The metric must use the ThreadPool
+  // rather than vtkSMPTools, since the threads of the latter cannot be
+  // pinned.  The default is Off.
+  vtkSetMacro(NUMAPlacement, bool);
+  vtkGetMacro(NUMAPlacement, bool);
+  vtkBooleanMacro(NUMAPlacement, bool);
+
+  // Description:
+  // Set the precision policy for the registration.  With DefaultPrecision,
+  // images of different types are coerced to double for SquaredDifference
+  // and NeighborhoodCorrelation, and the b-spline coefficients are double
+  // if either image is double.  With SinglePrecision, double images are
+  // cast to float, so the resampled images, the casts and the b-spline
+  // coefficients are all stored as float, and the metrics that support
+  // it use float arithmetic in their inner loops, with only the reductions
+  // done in double.  This halves the memory bandwidth, at some cost in
+  // accuracy.  The default is DefaultPrecision.
+  vtkSetClampMacro(Precision, int, DefaultPrecision, SinglePrecision);
+  void SetPrecisionToDefault() {
+    this->SetPrecision(DefaultPrecision); }
+  void SetPrecisionToSingle() {
+    this->SetPrecision(SinglePrecision); }
+  vtkGetMacro(Precision, int);
+
+  // Description:
+  // Get the pool of worker threads that is used by the metric.  The
+  // threads are created once and then reused for every evaluation, rather
+  // than being created and joined each time the metric is evaluated.
+  // This is only used if the metric has EnableSMP set to Off, except
+  // that batches of points from the optimizer always use it.  The
+  // filters that resample, cast, and prefilter the images, including
+  // those that build the pyramid, are given the same number of threads
+  // as the pool, and if the pool has fewer threads than the default
+  // for vtkMultiThreader then SMP is turned off for these filters.
+  vtkGetObjectMacro(ThreadPool, vtkWorkerThreadPool);
+
+  // Description:
+  // Set the fraction of the source voxels to use for the metric.  The
+  // default is 1.0, which means that all voxels within the stencil are
+  // used.  The samples are chosen once by Initialize(), and the same
+  // samples are used for every evaluation so that the cost function
+  // remains smooth.  Sampling is not applied to NeighborhoodCorrelation,
+  // since that metric requires contiguous neighborhoods.
+  vtkSetClampMacro(SamplingFraction, double, 0.0, 1.0);
+  vtkGetMacro(SamplingFraction, double);
+
+  // Description:
+  // Set the strategy for choosing the samples.  Regular sampling takes
+  // evenly spaced voxels in raster order, Stratified sampling takes one
+  // randomly chosen voxel from each run of evenly spaced voxels, and
+  // Gradient sampling is like stratified sampling but places more
+  // samples where the source image gradient is large.  A fixed seed is
+  // used for the random sampling, so the results are repeatable.
+  // The default is Stratified.
+  vtkSetClampMacro(SamplingStrategy, int, RegularSampling, GradientSampling);
+  void SetSamplingStrategyToRegular() {
+    this->SetSamplingStrategy(RegularSampling); }
+  void SetSamplingStrategyToStratified() {
+    this->SetSamplingStrategy(StratifiedSampling); }
+  void SetSamplingStrategyToGradient() {
+    this->SetSamplingStrategy(GradientSampling); }
+  vtkGetMacro(SamplingStrategy, int);
+
   // Description:
   // Set the size of the joint histogram for mutual information.
   // The default size is 64 by 64.
@@ -308,9 +562,40 @@ public:
   // axes of the scale parameters.
   vtkGetObjectMacro(ParameterValues, vtkDoubleArray)
 
+  // Description:
+  // Turn this on to measure where the time goes during registration.
+  // This will cause the ProfileValues to be collected, and has a small
+  // cost of its own since the clock is read several times for every
+  // function evaluation.
+  vtkGetMacro(CollectProfile, bool);
+  vtkSetMacro(CollectProfile, bool);
+  vtkBooleanMacro(CollectProfile, bool);
+
+  // Description:
+  // Get an array of profile values since registration started, with one
+  // tuple for each function evaluation that was performed.  The components
+  // are, in order: the time to build the transform, the time to resample
+  // the source image (zero for fused evaluation), the time for the metric
+  // to execute its pieces, the time for the metric to reduce the results
+  // of its threads, the time spent by the optimizer since the previous
+  // evaluation, the number of voxels that were compared, and the thread
+  // utilization of the metric.  Times are in seconds.  For evaluations
+  // that were done concurrently in a batch, the optimizer time is given
+  // to the first evaluation in the batch.
+  vtkGetObjectMacro(ProfileValues, vtkDoubleArray)
+
+  // Description:
+  // Get the number of times that the evaluation loop has allocated
+  // memory, including the allocations made by the metrics.  This is for
+  // tests that check that the count does not change after the first
+  // evaluation of a level.  Only the FusedEvaluation loop is free of
+  // allocations, since vtkImageReslice allocates memory within the
+  // pipeline, and the pipeline's allocations are not counted.
+  vtkTypeUInt64 GetNumberOfAllocations();
+
   // Description:
   // Iterate the registration.  Returns zero if the termination condition has
-  // been reached.
+  // been reached, or if AbortExecute has been set.
   int Iterate();
 
   // Description:
@@ -321,13 +606,151 @@ public:
   // zero if the maximum number of iterations was reached before convergence.
   int UpdateRegistration();
 
+  // Description:
+  // Set the number of levels for multi-resolution registration.  The
+  // default is one, which means that only the original images are used.
+  // The levels are numbered from zero (the coarsest) to NumberOfLevels-1
+  // (the finest).  Multi-resolution registration is done by calling
+  // InitializePyramid() and IteratePyramid(), instead of Initialize()
+  // and Iterate().
+  void SetNumberOfLevels(int n);
+  vtkGetMacro(NumberOfLevels, int);
+
+  // Description:
+  // Set the shrink factor for a pyramid level.  For each level, the
+  // images are blurred to this factor times the smallest source voxel
+  // spacing, and the source image is resampled to that spacing.  Any
+  // factor less than 1.1 means that the original images will be used.
+  // The default is 2^(NumberOfLevels-1-level), so the finest level uses
+  // the original images and each coarser level halves the resolution.
+  void SetLevelShrinkFactor(int level, double factor);
+  double GetLevelShrinkFactor(int level);
+
+  // Description:
+  // Set the maximum number of metric evaluations for a pyramid level.
+  // The default is to use MaximumNumberOfEvaluations.
+  void SetLevelMaximumNumberOfEvaluations(int level, int n);
+  int GetLevelMaximumNumberOfEvaluations(int level);
+
+  // Description:
+  // Set the interpolator type for a pyramid level.  The default is to use
+  // the InterpolatorType.  For levels that use Nearest or Label
+  // interpolation, the images are subsampled without blurring.
+  void SetLevelInterpolatorType(int level, int type);
+  int GetLevelInterpolatorType(int level);
+
+  // Description:
+  // Set the transform tolerance for a pyramid level.  The default is
+  // the TransformTolerance multiplied by the level's shrink factor.
+  void SetLevelTransformTolerance(int level, double tol);
+  double GetLevelTransformTolerance(int level);
+
+  // Description:
+  // Set the sampling fraction for a pyramid level.  The default is to
+  // use the SamplingFraction.
+  void SetLevelSamplingFraction(int level, double fraction);
+  double GetLevelSamplingFraction(int level);
+
+  // Description:
+  // Initialize a multi-resolution registration.  The blurred images for
+  // all levels are generated (each from the next finer level), or are
+  // reused from the previous call if the inputs and the shrink factors
+  // have not changed.  The registration is then initialized at the
+  // coarsest level, as if by Initialize(matrix).
+  void InitializePyramid(vtkMatrix4x4 *matrix);
+
+  // Description:
+  // Iterate the multi-resolution registration.  When a level has
+  // converged, the registration moves to the next finer level and is
+  // initialized with the current transform.  Returns zero when the
+  // finest level has converged.  If AbortExecute is set, the current
+  // level stops and no further levels are started.
+  int IteratePyramid();
+
+  // Description:
+  // Get the level that the multi-resolution registration is working on.
+  // After the registration is complete, this will be NumberOfLevels.
+  int GetCurrentLevel();
+
+  // Description:
+  // Get the images for a pyramid level.  These are only available
+  // after InitializePyramid() has been called.
+  vtkImageData *GetLevelSourceImage(int level);
+  vtkImageData *GetLevelTargetImage(int level);
+
+  // Description:
+  // Get the time in seconds that was spent on a pyramid level, and the
+  // number of metric evaluations that were done for that level.  These
+  // are set when the level is complete.
+  double GetLevelElapsedTime(int level);
+  int GetLevelNumberOfEvaluations(int level);
+
+  // Description:
+  // Set a wall-clock budget, in seconds, for the registration.  The clock
+  // starts when Initialize() or InitializePyramid() is called.  When the
+  // deadline is reached, the optimizer is stopped and the Transform is set
+  // to the best point that was found at the current level.  Before each
+  // pyramid level after the first, the time for the level is estimated
+  // from the time for the previous level, scaled by the number of voxels
+  // that will be sampled, and if the estimate exceeds the remaining time,
+  // the sampling fraction for the level is reduced to fit.  If that would
+  // leave no more samples than the previous level had, then this level
+  // and all finer levels are skipped.  The default is zero, for no limit.
+  vtkSetMacro(TimeBudget, double);
+  vtkGetMacro(TimeBudget, double);
+
+  // Description:
+  // Check whether the registration was stopped early by the TimeBudget,
+  // either at the deadline or by skipping levels.
+  vtkGetMacro(StoppedByTimeBudget, bool);
+
+  // Description:
+  // Get the lowest cost that has been found at the current level, and the
+  // matrix for the transform that produced it.  Unlike GetTransform(),
+  // which is updated after each iteration of the optimizer, these are
+  // updated after every evaluation, so they can be used from an observer
+  // or from another thread to get an answer at any time.  The cost is
+  // VTK_DOUBLE_MAX until the first evaluation of the level.
+  double GetBestCost();
+  void GetBestMatrix(vtkMatrix4x4 *matrix);
+
+  // Description:
+  // Get the sampling fraction that was used for a pyramid level, which is
+  // less than GetLevelSamplingFraction() if it was reduced to fit within
+  // the TimeBudget, and is zero if the level was skipped.  Also get the
+  // time that remained in the budget when the level started.
+  double GetLevelUsedSamplingFraction(int level);
+  double GetLevelTimeBudget(int level);
+
+  // Description:
+  // Compute the range of the first component of an image, within the
+  // stencil if one is given.  This is the range that is used for the
+  // histograms of the mutual information metrics, if the range was not
+  // set.  If the image is constant, the range is widened to one.
+  static void ComputeImageRange(vtkImageData *data,
+                                vtkImageStencilData *stencil,
+                                double range[2]);
+
 protected:
   vtkImageRegistration();
   ~vtkImageRegistration();
 
-  void ComputeImageRange(vtkImageData *data, vtkImageStencilData *stencil,
-                         double range[2]);
+  void ComputeSamplingStencil(vtkImageData *data,
+                              vtkImageStencilData *stencil,
+                              vtkImageStencilData *samples,
+                              double fraction);
   int ExecuteRegistration();
+  void InitializeLevel(int level, vtkMatrix4x4 *matrix);
+  void StartTimeBudget();
+  bool FitLevelToTimeBudget(int level);
+  bool CheckTimeBudget();
+  void InitializeByGridSearch(double transformTolerance);
+  void InitializeByMoments(vtkImageData *sourceImage,
+                           vtkImageStencilData *sourceStencil,
+                           vtkImageData *targetImage);
+  void InitializeByPhaseCorrelation(vtkImageData *sourceImage,
+                                    vtkImageData *targetImage);
+  void BuildPyramid();
 
   // Functions overridden from Superclass
   virtual int ProcessRequest(vtkInformation *,
@@ -346,11 +769,30 @@ protected:
   virtual int FillOutputPortInformation(int port, vtkInformation* info);
 
   int                              OptimizerType;
+  double                           ProbeMemoryLimit;
   int                              MetricType;
   int                              InterpolatorType;
   int                              TransformType;
   int                              InitializerType;
+  double                           InitializerAngleStep;
+  double                           InitializerTranslationStep;
+  int                              InitializerNumberOfSeeds;
+  int                              InitializerMaximumNumberOfEvaluations;
+  double                           InitializerMaximumTime;
   int                              TransformDimensionality;
+  bool                             FusedEvaluation;
+  bool                             IncrementalLineSearch;
+  bool                             EarlyAbandon;
+  bool                             UseSampleList;
+  bool                             BalancedSplit;
+  bool                             NUMAPlacement;
+  double                           TimeBudget;
+  bool                             StoppedByTimeBudget;
+  int                              Precision;
+  double                           SamplingFraction;
+  int                              SamplingStrategy;
+
+  int                              NumberOfLevels;
 
   int                              MaximumNumberOfIterations;
   int                              MaximumNumberOfEvaluations;
@@ -368,20 +810,28 @@ protected:
   vtkFunctionMinimizer            *Optimizer;
   vtkImageSimilarityMetric        *Metric;
   vtkAbstractImageInterpolator    *Interpolator;
-  vtkTransform                    *Transform;
+  vtkMatrixToLinearTransform      *Transform;
 
   vtkMatrix4x4                    *InitialTransformMatrix;
   vtkImageReslice                 *ImageReslice;
   vtkImageBSplineCoefficients     *ImageBSpline;
   vtkImageShiftScale              *SourceImageTypecast;
   vtkImageShiftScale              *TargetImageTypecast;
+  vtkImageStencilData             *SamplingStencil;
+  vtkWorkerThreadPool             *ThreadPool;
+  vtkImageRegistrationTarget      *PreparedTarget;
 
   vtkImageRegistrationInfo        *RegistrationInfo;
+  vtkImageRegistrationPyramid     *Pyramid;
 
   bool                             CollectValues;
   vtkDoubleArray                  *MetricValues;
   vtkDoubleArray                  *CostValues;
   vtkDoubleArray                  *ParameterValues;
+  bool                             CollectProfile;
+  vtkDoubleArray                  *ProfileValues;
+  vtkDoubleArray                  *InitializerCostValues;
+  vtkDoubleArray                  *InitializerParameterValues;
 
 private:
   // Copy constructor and assigment operator are purposely not implemented
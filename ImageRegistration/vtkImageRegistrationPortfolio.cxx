@@ -0,0 +1,670 @@
+/*=========================================================================
+
+  Module: vtkImageRegistrationPortfolio.cxx
+
+  Copyright (c) 2016 David Gobbi
+  All rights reserved.
+  See Copyright.txt or http://dgobbi.github.io/bsd3.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notice for more information.
+
+=========================================================================*/
+#include "vtkImageRegistrationPortfolio.h"
+#include "vtkImageRegistration.h"
+#include "vtkWorkerThreadPool.h"
+
+#include "vtkImageSquaredDifference.h"
+#include "vtkImageMutualInformation.h"
+#include "vtkImageCorrelationRatio.h"
+#include "vtkImageCrossCorrelation.h"
+
+#include <vtkObjectFactory.h>
+#include <vtkImageData.h>
+#include <vtkImageStencilData.h>
+#include <vtkMath.h>
+#include <vtkImageInterpolator.h>
+#include <vtkLinearTransform.h>
+#include <vtkTransform.h>
+#include <vtkMatrix4x4.h>
+#include <vtkDoubleArray.h>
+#include <vtkMultiThreader.h>
+#include <vtkSmartPointer.h>
+#include <vtkVersion.h>
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+// A macro to assist VTK 5 backwards compatibility
+#if VTK_MAJOR_VERSION >= 6
+#define SET_INPUT_DATA SetInputData
+#define SET_STENCIL_DATA SetStencilData
+#else
+#define SET_INPUT_DATA SetInput
+#define SET_STENCIL_DATA SetStencil
+#endif
+
+vtkStandardNewMacro(vtkImageRegistrationPortfolio);
+
+// The registrations, their results, and the validation metric
+struct vtkImageRegistrationPortfolioEntries
+{
+  std::vector<vtkSmartPointer<vtkImageRegistration> > Registrations;
+  std::vector<double> ValidationCosts;
+  std::vector<int> CancelledLevels;
+
+  vtkSmartPointer<vtkImageSimilarityMetric> Metric;
+  vtkSmartPointer<vtkImageStencilData> Samples;
+  vtkSmartPointer<vtkImageStencilData> Remainder;
+  vtkSmartPointer<vtkTransform> Transform;
+};
+
+// The work for one round, which runs each registration to the end of
+// its given level in its own thread
+struct vtkImageRegistrationPortfolioRound
+{
+  vtkImageRegistration **Registrations;
+  int *Levels;
+  int Count;
+  vtkMatrix4x4 *Matrix;
+};
+
+//----------------------------------------------------------------------------
+vtkImageRegistrationPortfolio::vtkImageRegistrationPortfolio()
+{
+  this->SourceImage = NULL;
+  this->TargetImage = NULL;
+  this->SourceImageStencil = NULL;
+  this->NumberOfThreads =
+    vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  this->ValidationMetricType =
+    vtkImageRegistration::NormalizedMutualInformation;
+  this->ValidationSamplingFraction = 0.05;
+  this->SurvivalFraction = 0.5;
+  this->BestIndex = -1;
+
+  this->TraceValues = vtkDoubleArray::New();
+  this->TraceValues->SetNumberOfComponents(8);
+
+  this->Entries = new vtkImageRegistrationPortfolioEntries;
+}
+
+//----------------------------------------------------------------------------
+vtkImageRegistrationPortfolio::~vtkImageRegistrationPortfolio()
+{
+  this->SetSourceImage(NULL);
+  this->SetTargetImage(NULL);
+  this->SetSourceImageStencil(NULL);
+  this->TraceValues->Delete();
+  delete this->Entries;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationPortfolio::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os, indent);
+
+  os << indent << "SourceImage: " << this->SourceImage << "\n";
+  os << indent << "TargetImage: " << this->TargetImage << "\n";
+  os << indent << "SourceImageStencil: " << this->SourceImageStencil << "\n";
+  os << indent << "NumberOfRegistrations: "
+     << this->GetNumberOfRegistrations() << "\n";
+  os << indent << "NumberOfThreads: " << this->NumberOfThreads << "\n";
+  os << indent << "ValidationMetricType: "
+     << this->ValidationMetricType << "\n";
+  os << indent << "ValidationSamplingFraction: "
+     << this->ValidationSamplingFraction << "\n";
+  os << indent << "SurvivalFraction: " << this->SurvivalFraction << "\n";
+  os << indent << "BestIndex: " << this->BestIndex << "\n";
+  os << indent << "TraceValues: " << this->TraceValues << "\n";
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationPortfolio::SetSourceImage(vtkImageData *image)
+{
+  if (image != this->SourceImage)
+    {
+    if (this->SourceImage)
+      {
+      this->SourceImage->UnRegister(this);
+      }
+    this->SourceImage = image;
+    if (image)
+      {
+      image->Register(this);
+      }
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationPortfolio::SetTargetImage(vtkImageData *image)
+{
+  if (image != this->TargetImage)
+    {
+    if (this->TargetImage)
+      {
+      this->TargetImage->UnRegister(this);
+      }
+    this->TargetImage = image;
+    if (image)
+      {
+      image->Register(this);
+      }
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationPortfolio::SetSourceImageStencil(
+  vtkImageStencilData *stencil)
+{
+  if (stencil != this->SourceImageStencil)
+    {
+    if (this->SourceImageStencil)
+      {
+      this->SourceImageStencil->UnRegister(this);
+      }
+    this->SourceImageStencil = stencil;
+    if (stencil)
+      {
+      stencil->Register(this);
+      }
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationPortfolio::AddRegistration(
+  vtkImageRegistration *registration)
+{
+  if (registration)
+    {
+    this->Entries->Registrations.push_back(registration);
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationPortfolio::RemoveAllRegistrations()
+{
+  if (!this->Entries->Registrations.empty())
+    {
+    this->Entries->Registrations.clear();
+    this->Entries->ValidationCosts.clear();
+    this->Entries->CancelledLevels.clear();
+    this->BestIndex = -1;
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+int vtkImageRegistrationPortfolio::GetNumberOfRegistrations()
+{
+  return static_cast<int>(this->Entries->Registrations.size());
+}
+
+//----------------------------------------------------------------------------
+vtkImageRegistration *vtkImageRegistrationPortfolio::GetRegistration(int i)
+{
+  if (i < 0 || i >= this->GetNumberOfRegistrations())
+    {
+    return NULL;
+    }
+  return this->Entries->Registrations[i];
+}
+
+//----------------------------------------------------------------------------
+vtkImageRegistration *vtkImageRegistrationPortfolio::GetBestRegistration()
+{
+  return this->GetRegistration(this->BestIndex);
+}
+
+//----------------------------------------------------------------------------
+double vtkImageRegistrationPortfolio::GetValidationCost(int i)
+{
+  if (i < 0 || i >= static_cast<int>(this->Entries->ValidationCosts.size()))
+    {
+    return VTK_DOUBLE_MAX;
+    }
+  return this->Entries->ValidationCosts[i];
+}
+
+//----------------------------------------------------------------------------
+int vtkImageRegistrationPortfolio::GetCancelledLevel(int i)
+{
+  if (i < 0 || i >= static_cast<int>(this->Entries->CancelledLevels.size()))
+    {
+    return -1;
+    }
+  return this->Entries->CancelledLevels[i];
+}
+
+//----------------------------------------------------------------------------
+namespace {
+
+// Choose the voxels on a lattice whose stride gives the requested
+// fraction, offset by half the stride so that the lattice avoids the
+// image boundary, and keep only the voxels that are within the stencil.
+// The other voxels within the stencil are stored in the remainder, which
+// is given to the registrations so that the lattice is held out.
+void vtkPortfolioSampleLattice(
+  vtkImageData *data, vtkImageStencilData *stencil,
+  vtkImageStencilData *samples, vtkImageStencilData *remainder,
+  double fraction)
+{
+  int extent[6];
+  data->GetExtent(extent);
+
+  samples->SetExtent(extent);
+  samples->SetSpacing(data->GetSpacing());
+  samples->SetOrigin(data->GetOrigin());
+  samples->AllocateExtents();
+
+  remainder->SetExtent(extent);
+  remainder->SetSpacing(data->GetSpacing());
+  remainder->SetOrigin(data->GetOrigin());
+  remainder->AllocateExtents();
+
+  int dims = (extent[4] < extent[5] ? 3 : 2);
+  int stride = 1;
+  if (fraction > 0.0 && fraction < 1.0)
+    {
+    stride = vtkMath::Floor(pow(fraction, -1.0/dims) + 0.5);
+    stride = (stride > 1 ? stride : 1);
+    }
+  int start[3];
+  for (int i = 0; i < 3; i++)
+    {
+    start[i] = extent[2*i] + (i < dims ? stride/2 : 0);
+    }
+
+  // if every voxel is a sample, then nothing can be held out
+  bool holdOut = (stride > 1);
+
+  for (int idZ = extent[4]; idZ <= extent[5]; idZ++)
+    {
+    bool latticeZ = (idZ >= start[2] && (idZ - start[2]) % stride == 0);
+    for (int idY = extent[2]; idY <= extent[3]; idY++)
+      {
+      bool latticeRow =
+        (latticeZ && idY >= start[1] && (idY - start[1]) % stride == 0);
+
+      // loop over stencil extents (break at end if no stencil)
+      int iter = 0;
+      int r1 = extent[0];
+      int r2 = extent[1];
+      do
+        {
+        if (stencil && stencil->GetNextExtent(
+              r1, r2, extent[0], extent[1], idY, idZ, iter) == 0)
+          {
+          break;
+          }
+
+        // the first lattice point within the run
+        int idX = r2 + 1;
+        if (latticeRow)
+          {
+          idX = start[0];
+          if (idX < r1)
+            {
+            idX += (r1 - idX + stride - 1)/stride*stride;
+            }
+          }
+
+        // the voxels between the lattice points are the remainder
+        int s1 = r1;
+        for (; idX <= r2; idX += stride)
+          {
+          samples->InsertNextExtent(idX, idX, idY, idZ);
+          if (holdOut)
+            {
+            if (s1 < idX)
+              {
+              remainder->InsertNextExtent(s1, idX - 1, idY, idZ);
+              }
+            s1 = idX + 1;
+            }
+          }
+        if (s1 <= r2)
+          {
+          remainder->InsertNextExtent(s1, r2, idY, idZ);
+          }
+        }
+      while (stencil);
+      }
+    }
+}
+
+// Get the shrink factor of a pyramid level, where any factor less than
+// 1.1 means that the original images are used
+double vtkPortfolioLevelShrink(vtkImageRegistration *registration, int level)
+{
+  double shrink = registration->GetLevelShrinkFactor(level);
+  return (shrink < 1.1 ? 1.0 : shrink);
+}
+
+// Run each registration to the end of its level, the pyramid of each
+// registration is initialized in the round that runs its first level
+VTK_THREAD_RETURN_TYPE vtkPortfolioRoundExecute(void *arg)
+{
+  vtkMultiThreader::ThreadInfo *info =
+    static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  vtkImageRegistrationPortfolioRound *round =
+    static_cast<vtkImageRegistrationPortfolioRound *>(info->UserData);
+
+  for (int k = info->ThreadID; k < round->Count; k += info->NumberOfThreads)
+    {
+    vtkImageRegistration *registration = round->Registrations[k];
+    int level = round->Levels[k];
+    if (level == 0)
+      {
+      registration->InitializePyramid(round->Matrix);
+      }
+    while (registration->GetCurrentLevel() == level &&
+           registration->IteratePyramid()) { }
+    }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+} // end anonymous namespace
+
+//----------------------------------------------------------------------------
+int vtkImageRegistrationPortfolio::PrepareValidation()
+{
+  vtkImageRegistrationPortfolioEntries *entries = this->Entries;
+
+  vtkImageSimilarityMetric *metric = NULL;
+  switch (this->ValidationMetricType)
+    {
+    case vtkImageRegistration::SquaredDifference:
+      {
+      metric = vtkImageSquaredDifference::New();
+      }
+      break;
+
+    case vtkImageRegistration::CrossCorrelation:
+    case vtkImageRegistration::NormalizedCrossCorrelation:
+      {
+      vtkImageCrossCorrelation *cc = vtkImageCrossCorrelation::New();
+      if (this->ValidationMetricType ==
+          vtkImageRegistration::NormalizedCrossCorrelation)
+        {
+        cc->SetMetricToNormalizedCrossCorrelation();
+        }
+      else
+        {
+        cc->SetMetricToCrossCorrelation();
+        }
+      metric = cc;
+      }
+      break;
+
+    case vtkImageRegistration::CorrelationRatio:
+      {
+      metric = vtkImageCorrelationRatio::New();
+      }
+      break;
+
+    case vtkImageRegistration::MutualInformation:
+    case vtkImageRegistration::NormalizedMutualInformation:
+      {
+      vtkImageMutualInformation *mi = vtkImageMutualInformation::New();
+      mi->SetNumberOfBins(64, 64);
+      if (this->ValidationMetricType ==
+          vtkImageRegistration::NormalizedMutualInformation)
+        {
+        mi->SetMetricToNormalizedMutualInformation();
+        }
+      else
+        {
+        mi->SetMetricToMutualInformation();
+        }
+      metric = mi;
+      }
+      break;
+    }
+
+  // the neighborhood metric needs dense samples, so it cannot be used
+  if (metric == NULL)
+    {
+    vtkErrorMacro("Execute: ValidationMetricType "
+                  << this->ValidationMetricType << " is not supported");
+    return 0;
+    }
+
+  // the metric receives shallow copies, like the registrations do
+  vtkSmartPointer<vtkImageData> source =
+    vtkSmartPointer<vtkImageData>::New();
+  source->ShallowCopy(this->SourceImage);
+  vtkSmartPointer<vtkImageData> target =
+    vtkSmartPointer<vtkImageData>::New();
+  target->ShallowCopy(this->TargetImage);
+
+  entries->Samples = vtkSmartPointer<vtkImageStencilData>::New();
+  entries->Remainder = vtkSmartPointer<vtkImageStencilData>::New();
+  vtkPortfolioSampleLattice(
+    source, this->SourceImageStencil, entries->Samples, entries->Remainder,
+    this->ValidationSamplingFraction);
+
+  // the same half-voxel border tolerance as the registration
+  vtkSmartPointer<vtkImageInterpolator> interpolator =
+    vtkSmartPointer<vtkImageInterpolator>::New();
+  interpolator->SetInterpolationModeToLinear();
+  interpolator->SetTolerance(0.5);
+  interpolator->SetComponentCount(1);
+
+  entries->Transform = vtkSmartPointer<vtkTransform>::New();
+
+  metric->SET_INPUT_DATA(source);
+  metric->SET_INPUT_DATA(1, target);
+  metric->SetStencilData(entries->Samples);
+  metric->SetInterpolator(interpolator);
+  metric->SetTransform(entries->Transform);
+
+  double range[2];
+  vtkImageRegistration::ComputeImageRange(
+    source, this->SourceImageStencil, range);
+  metric->SetInputRange(0, range);
+  vtkImageRegistration::ComputeImageRange(target, NULL, range);
+  metric->SetInputRange(1, range);
+
+  entries->Metric = metric;
+  metric->Delete();
+
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+double vtkImageRegistrationPortfolio::ComputeValidationCost(
+  vtkImageRegistration *registration)
+{
+  vtkImageSimilarityMetric *metric = this->Entries->Metric;
+  vtkMatrix4x4 *matrix = registration->GetTransform()->GetMatrix();
+  this->Entries->Transform->SetMatrix(matrix);
+
+  if (!metric->IsPrepared())
+    {
+    metric->Prepare();
+    }
+  else
+    {
+    metric->Evaluate(*matrix->Element);
+    }
+
+  return metric->GetCost();
+}
+
+//----------------------------------------------------------------------------
+int vtkImageRegistrationPortfolio::Execute(vtkMatrix4x4 *matrix)
+{
+  vtkImageRegistrationPortfolioEntries *entries = this->Entries;
+  int n = this->GetNumberOfRegistrations();
+
+  this->BestIndex = -1;
+  this->TraceValues->Initialize();
+  this->TraceValues->SetNumberOfComponents(8);
+  entries->ValidationCosts.assign(n, VTK_DOUBLE_MAX);
+  entries->CancelledLevels.assign(n, -1);
+
+  if (n == 0 || this->SourceImage == NULL || this->TargetImage == NULL)
+    {
+    vtkErrorMacro("Execute: The images and registrations must be set");
+    return 0;
+    }
+
+  int numberOfRounds = 0;
+  for (int i = 0; i < n; i++)
+    {
+    int levels = entries->Registrations[i]->GetNumberOfLevels();
+    if (levels <= 0)
+      {
+      vtkErrorMacro("Execute: Every registration must use a pyramid");
+      return 0;
+      }
+    numberOfRounds = (levels > numberOfRounds ? levels : numberOfRounds);
+    }
+
+  if (!this->PrepareValidation())
+    {
+    return 0;
+    }
+
+  // give each registration its own shallow copies of the inputs, and
+  // a stencil that holds out the validation samples
+  std::vector<int> active;
+  for (int i = 0; i < n; i++)
+    {
+    vtkImageRegistration *registration = entries->Registrations[i];
+    vtkSmartPointer<vtkImageData> source =
+      vtkSmartPointer<vtkImageData>::New();
+    source->ShallowCopy(this->SourceImage);
+    vtkSmartPointer<vtkImageData> target =
+      vtkSmartPointer<vtkImageData>::New();
+    target->ShallowCopy(this->TargetImage);
+    vtkSmartPointer<vtkImageStencilData> stencil =
+      vtkSmartPointer<vtkImageStencilData>::New();
+    stencil->ShallowCopy(entries->Remainder);
+    registration->SetSourceImage(source);
+    registration->SetTargetImage(target);
+    registration->SetSourceImageStencil(stencil);
+    registration->SetAbortExecute(0);
+    active.push_back(i);
+    }
+
+  std::vector<vtkImageRegistration *> running(n);
+  std::vector<int> levels(n);
+  std::vector<int> indices(n);
+  std::vector<int> waiting;
+  std::vector<std::pair<double, int> > ranking;
+
+  // the registrations with fewer levels start in a later round, so that
+  // every registration does its finest level in the final round
+  for (int round = 0; round < numberOfRounds; round++)
+    {
+    int count = 0;
+    waiting.clear();
+    for (size_t k = 0; k < active.size(); k++)
+      {
+      int i = active[k];
+      vtkImageRegistration *registration = entries->Registrations[i];
+      int level =
+        round - (numberOfRounds - registration->GetNumberOfLevels());
+      if (level < 0)
+        {
+        waiting.push_back(i);
+        continue;
+        }
+      running[count] = registration;
+      levels[count] = level;
+      indices[count] = i;
+      count++;
+      }
+
+    // divide the threads between the registrations that are running
+    int threads = this->NumberOfThreads/count;
+    threads = (threads > 1 ? threads : 1);
+    for (int k = 0; k < count; k++)
+      {
+      running[k]->GetThreadPool()->SetNumberOfThreads(threads);
+      }
+
+    vtkImageRegistrationPortfolioRound work;
+    work.Registrations = &running[0];
+    work.Levels = &levels[0];
+    work.Count = count;
+    work.Matrix = matrix;
+
+    vtkMultiThreader *threader = vtkMultiThreader::New();
+    threader->SetNumberOfThreads(count);
+    threader->SetSingleMethod(vtkPortfolioRoundExecute, &work);
+    threader->SingleMethodExecute();
+    threader->Delete();
+
+    // score every registration with the same metric and samples
+    ranking.clear();
+    for (int k = 0; k < count; k++)
+      {
+      double cost = this->ComputeValidationCost(running[k]);
+      entries->ValidationCosts[indices[k]] = cost;
+      ranking.push_back(std::make_pair(cost, k));
+      }
+    std::sort(ranking.begin(), ranking.end());
+
+    // registrations are only cancelled if all of their levels have the
+    // same voxel spacing, since a coarser level is not a fair comparison
+    bool comparable = true;
+    double shrink = vtkPortfolioLevelShrink(running[0], levels[0]);
+    for (int k = 1; k < count; k++)
+      {
+      double s = vtkPortfolioLevelShrink(running[k], levels[k]);
+      comparable &= (fabs(s - shrink) <= 1e-6*shrink);
+      }
+
+    // keep the best, but keep everything after the final round
+    int survivors = count;
+    if (round + 1 < numberOfRounds && comparable)
+      {
+      survivors = static_cast<int>(ceil(count*this->SurvivalFraction));
+      survivors = (survivors > 1 ? survivors : 1);
+      }
+
+    active.clear();
+    for (int j = 0; j < count; j++)
+      {
+      int k = ranking[j].second;
+      int i = indices[k];
+      vtkImageRegistration *registration = running[k];
+      bool survived = (j < survivors);
+      if (survived)
+        {
+        active.push_back(i);
+        }
+      else
+        {
+        registration->SetAbortExecute(1);
+        entries->CancelledLevels[i] = levels[k];
+        }
+
+      double tuple[8];
+      tuple[0] = i;
+      tuple[1] = levels[k];
+      tuple[2] = ranking[j].first;
+      tuple[3] = registration->GetMetricValue();
+      tuple[4] = registration->GetLevelElapsedTime(levels[k]);
+      tuple[5] = registration->GetLevelNumberOfEvaluations(levels[k]);
+      tuple[6] = threads;
+      tuple[7] = survived;
+      this->TraceValues->InsertNextTuple(tuple);
+      }
+    active.insert(active.end(), waiting.begin(), waiting.end());
+
+    this->BestIndex = indices[ranking[0].second];
+    }
+
+  return 1;
+}
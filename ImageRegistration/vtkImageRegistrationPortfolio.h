@@ -0,0 +1,163 @@
+/*=========================================================================
+
+  Module: vtkImageRegistrationPortfolio.h
+
+  Copyright (c) 2016 David Gobbi
+  All rights reserved.
+  See Copyright.txt or http://dgobbi.github.io/bsd3.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notice for more information.
+
+=========================================================================*/
+// .NAME vtkImageRegistrationPortfolio - race several registrations
+// .SECTION Description
+// vtkImageRegistrationPortfolio runs several differently-configured
+// vtkImageRegistration objects concurrently on the same pair of images,
+// for when it is not known in advance which metric or optimizer will
+// work best.  The registrations advance through their pyramid levels in
+// rounds, with one level per round, and the thread budget is divided
+// between the registrations that are running.  At the end of each round,
+// every registration is scored with a common validation metric on a
+// common set of sample voxels, so that registrations that use different
+// metrics can be compared, and the registrations with the worst scores
+// are cancelled by setting their AbortExecute flag.  The validation
+// samples lie on a sparse lattice within the full-resolution source
+// image, and they are held out from the registrations by removing them
+// from the source stencil that the registrations are given.
+// .SECTION See Also
+// vtkImageRegistration
+
+#ifndef vtkImageRegistrationPortfolio_h
+#define vtkImageRegistrationPortfolio_h
+
+#include "vtkObject.h"
+
+class vtkImageData;
+class vtkImageStencilData;
+class vtkImageRegistration;
+class vtkMatrix4x4;
+class vtkDoubleArray;
+
+struct vtkImageRegistrationPortfolioEntries;
+
+class VTK_EXPORT vtkImageRegistrationPortfolio : public vtkObject
+{
+public:
+  vtkTypeMacro(vtkImageRegistrationPortfolio, vtkObject);
+  static vtkImageRegistrationPortfolio *New();
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  // Description:
+  // Set the images that all of the registrations will use.  These are
+  // given to each registration as shallow copies when Execute() is
+  // called, so that the registrations do not share any data objects.
+  void SetSourceImage(vtkImageData *image);
+  vtkImageData *GetSourceImage() { return this->SourceImage; }
+  void SetTargetImage(vtkImageData *image);
+  vtkImageData *GetTargetImage() { return this->TargetImage; }
+  void SetSourceImageStencil(vtkImageStencilData *stencil);
+  vtkImageStencilData *GetSourceImageStencil() {
+    return this->SourceImageStencil; }
+
+  // Description:
+  // Add a registration to the portfolio.  The registration should be
+  // fully configured, except for its input images and its stencil, which
+  // are set by the portfolio.  The registrations can use pyramids with
+  // different numbers of levels, those with fewer levels start in a later
+  // round so that all of them do their finest level in the final round.
+  // Registrations are only cancelled at the end of a round in which all
+  // of the running levels have the same voxel spacing.
+  void AddRegistration(vtkImageRegistration *registration);
+  void RemoveAllRegistrations();
+  int GetNumberOfRegistrations();
+  vtkImageRegistration *GetRegistration(int i);
+
+  // Description:
+  // Set the total number of threads for the registrations.  This is
+  // divided evenly between the registrations that are running in each
+  // round, by setting the size of each registration's ThreadPool, which
+  // also limits the filters that the registration uses to resample and
+  // prefilter the images.  The default is the number of threads that is
+  // reported by vtkMultiThreader.
+  vtkSetClampMacro(NumberOfThreads, int, 1, VTK_MAX_THREADS);
+  vtkGetMacro(NumberOfThreads, int);
+
+  // Description:
+  // Set the metric that is used to compare the registrations.  Since the
+  // registrations might use different metrics, their own costs cannot be
+  // compared.  The default is NormalizedMutualInformation.
+  vtkSetMacro(ValidationMetricType, int);
+  vtkGetMacro(ValidationMetricType, int);
+
+  // Description:
+  // Set the fraction of source voxels that are used for validation.
+  // If this is zero or one, then every voxel is used for validation and
+  // nothing can be held out from the registrations.  The default is 0.05.
+  vtkSetClampMacro(ValidationSamplingFraction, double, 0.0, 1.0);
+  vtkGetMacro(ValidationSamplingFraction, double);
+
+  // Description:
+  // Set the fraction of the running registrations that survive at the
+  // end of each level.  At least one registration always survives.  The
+  // default is 0.5, which halves the field at each level.
+  vtkSetClampMacro(SurvivalFraction, double, 0.0, 1.0);
+  vtkGetMacro(SurvivalFraction, double);
+
+  // Description:
+  // Run the registrations from the given initial matrix until only one
+  // is left or all levels are complete.  Returns zero on failure.
+  int Execute(vtkMatrix4x4 *matrix);
+
+  // Description:
+  // Get the index of the registration with the best validation score in
+  // the final round, or -1 if Execute() has not been called.  The
+  // winner's transform is its GetTransform().
+  vtkGetMacro(BestIndex, int);
+  vtkImageRegistration *GetBestRegistration();
+
+  // Description:
+  // Get the last validation cost for a registration, and the level at
+  // which it was cancelled, or -1 if it was not cancelled.
+  double GetValidationCost(int i);
+  int GetCancelledLevel(int i);
+
+  // Description:
+  // Get the trace, which has one tuple per registration per completed
+  // level.  The components are: the registration index, its level, the
+  // validation cost, the registration's own cost, the elapsed time for
+  // the level, the number of evaluations for the level, the number of
+  // threads used, and whether the registration survived the level.
+  vtkGetObjectMacro(TraceValues, vtkDoubleArray);
+
+protected:
+  vtkImageRegistrationPortfolio();
+  ~vtkImageRegistrationPortfolio();
+
+  // Description:
+  // Create the validation metric and its sample stencil.
+  int PrepareValidation();
+
+  // Description:
+  // Compute the validation cost for a registration's current transform.
+  double ComputeValidationCost(vtkImageRegistration *registration);
+
+  vtkImageData *SourceImage;
+  vtkImageData *TargetImage;
+  vtkImageStencilData *SourceImageStencil;
+  int NumberOfThreads;
+  int ValidationMetricType;
+  double ValidationSamplingFraction;
+  double SurvivalFraction;
+  int BestIndex;
+  vtkDoubleArray *TraceValues;
+
+  vtkImageRegistrationPortfolioEntries *Entries;
+
+private:
+  vtkImageRegistrationPortfolio(const vtkImageRegistrationPortfolio&);  // Not implemented.
+  void operator=(const vtkImageRegistrationPortfolio&);  // Not implemented.
+};
+
+#endif
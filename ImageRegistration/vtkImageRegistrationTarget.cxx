@@ -0,0 +1,526 @@
+/*=========================================================================
+
+  Module: vtkImageRegistrationTarget.cxx
+
+  Copyright (c) 2016 David Gobbi
+  All rights reserved.
+  See Copyright.txt or http://dgobbi.github.io/bsd3.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notice for more information.
+
+=========================================================================*/
+#include "vtkImageRegistrationTarget.h"
+#include "vtkImageRegistration.h"
+
+#include <vtkObjectFactory.h>
+#include <vtkImageData.h>
+#include <vtkImageShiftScale.h>
+#include <vtkImageBSplineCoefficients.h>
+#include <vtkImageSincInterpolator.h>
+#include <vtkImageResize.h>
+#include <vtkMultiThreader.h>
+#include <vtkSmartPointer.h>
+#include <vtkVersion.h>
+
+#include <vector>
+#include <math.h>
+
+// A macro to assist VTK 5 backwards compatibility
+#if VTK_MAJOR_VERSION >= 6
+#define SET_INPUT_DATA SetInputData
+#else
+#define SET_INPUT_DATA SetInput
+#endif
+
+// Check whether vtkThreadedImageAlgorithm has EnableSMP
+#if VTK_MAJOR_VERSION > 7 || (VTK_MAJOR_VERSION == 7 && VTK_MINOR_VERSION >= 0)
+#define USE_SMP_THREADED_IMAGE_ALGORITHM
+#endif
+
+vtkStandardNewMacro(vtkImageRegistrationTarget);
+
+// The settings and the products for each pyramid level
+struct vtkImageRegistrationTargetLevels
+{
+  // the settings for each level, zero or -1 means "use default"
+  std::vector<double> ShrinkFactors;
+  std::vector<int> InterpolatorTypes;
+
+  // the products, indexed by level + 1 so that the original image is first
+  std::vector<vtkSmartPointer<vtkImageData> > Images;
+  std::vector<vtkSmartPointer<vtkImageData> > QuantizedImages;
+  std::vector<vtkSmartPointer<vtkImageData> > Coefficients;
+  std::vector<double> Ranges;
+};
+
+//----------------------------------------------------------------------------
+vtkImageRegistrationTarget::vtkImageRegistrationTarget()
+{
+  this->TargetImage = NULL;
+  this->MetricType = vtkImageRegistration::MutualInformation;
+  this->InterpolatorType = vtkImageRegistration::Linear;
+  this->JointHistogramSize = 64;
+  this->TargetImageRange[0] = 0.0;
+  this->TargetImageRange[1] = -1.0;
+  this->NumberOfLevels = 1;
+  this->ReferenceSpacing = 0.0;
+  this->Built = 0;
+
+  this->Levels = new vtkImageRegistrationTargetLevels;
+  this->Levels->ShrinkFactors.assign(1, 0.0);
+  this->Levels->InterpolatorTypes.assign(1, -1);
+}
+
+//----------------------------------------------------------------------------
+vtkImageRegistrationTarget::~vtkImageRegistrationTarget()
+{
+  if (this->TargetImage)
+    {
+    this->TargetImage->UnRegister(this);
+    }
+  delete this->Levels;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os, indent);
+
+  os << indent << "TargetImage: " << this->TargetImage << "\n";
+  os << indent << "MetricType: " << this->MetricType << "\n";
+  os << indent << "InterpolatorType: " << this->InterpolatorType << "\n";
+  os << indent << "JointHistogramSize: " << this->JointHistogramSize << "\n";
+  os << indent << "TargetImageRange: " << this->TargetImageRange[0] << " "
+     << this->TargetImageRange[1] << "\n";
+  os << indent << "NumberOfLevels: " << this->NumberOfLevels << "\n";
+  os << indent << "ReferenceSpacing: " << this->ReferenceSpacing << "\n";
+  os << indent << "Built: " << (this->Built ? "On\n" : "Off\n");
+}
+
+//----------------------------------------------------------------------------
+int vtkImageRegistrationTarget::CheckNotBuilt(const char *method)
+{
+  if (this->Built)
+    {
+    vtkErrorMacro(<< method << ": The target has already been built, "
+                  "so it cannot be changed");
+    return 0;
+    }
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::SetTargetImage(vtkImageData *image)
+{
+  if (image != this->TargetImage && this->CheckNotBuilt("SetTargetImage"))
+    {
+    if (this->TargetImage)
+      {
+      this->TargetImage->UnRegister(this);
+      }
+    this->TargetImage = image;
+    if (image)
+      {
+      image->Register(this);
+      }
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::SetMetricType(int type)
+{
+  if (type != this->MetricType && this->CheckNotBuilt("SetMetricType"))
+    {
+    this->MetricType = type;
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::SetInterpolatorType(int type)
+{
+  if (type != this->InterpolatorType &&
+      this->CheckNotBuilt("SetInterpolatorType"))
+    {
+    this->InterpolatorType = type;
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::SetJointHistogramSize(int size)
+{
+  if (size != this->JointHistogramSize &&
+      this->CheckNotBuilt("SetJointHistogramSize"))
+    {
+    this->JointHistogramSize = size;
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::SetTargetImageRange(double r0, double r1)
+{
+  if ((r0 != this->TargetImageRange[0] || r1 != this->TargetImageRange[1]) &&
+      this->CheckNotBuilt("SetTargetImageRange"))
+    {
+    this->TargetImageRange[0] = r0;
+    this->TargetImageRange[1] = r1;
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::SetNumberOfLevels(int n)
+{
+  n = (n > 1 ? n : 1);
+  if (n != this->NumberOfLevels && this->CheckNotBuilt("SetNumberOfLevels"))
+    {
+    this->NumberOfLevels = n;
+    this->Levels->ShrinkFactors.assign(n, 0.0);
+    this->Levels->InterpolatorTypes.assign(n, -1);
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::SetLevelShrinkFactor(
+  int level, double factor)
+{
+  if (level >= 0 && level < this->NumberOfLevels &&
+      factor != this->Levels->ShrinkFactors[level] &&
+      this->CheckNotBuilt("SetLevelShrinkFactor"))
+    {
+    this->Levels->ShrinkFactors[level] = factor;
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+double vtkImageRegistrationTarget::GetLevelShrinkFactor(int level)
+{
+  if (level < 0 || level >= this->NumberOfLevels)
+    {
+    return 1.0;
+    }
+  double factor = this->Levels->ShrinkFactors[level];
+  if (factor <= 0.0)
+    {
+    factor = ldexp(1.0, this->NumberOfLevels - 1 - level);
+    }
+  return factor;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::SetLevelInterpolatorType(
+  int level, int type)
+{
+  if (level >= 0 && level < this->NumberOfLevels &&
+      type != this->Levels->InterpolatorTypes[level] &&
+      this->CheckNotBuilt("SetLevelInterpolatorType"))
+    {
+    this->Levels->InterpolatorTypes[level] = type;
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+int vtkImageRegistrationTarget::GetLevelInterpolatorType(int level)
+{
+  if (level < 0 || level >= this->NumberOfLevels ||
+      this->Levels->InterpolatorTypes[level] < 0)
+    {
+    return this->InterpolatorType;
+    }
+  return this->Levels->InterpolatorTypes[level];
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::SetReferenceSpacing(double spacing)
+{
+  if (spacing != this->ReferenceSpacing &&
+      this->CheckNotBuilt("SetReferenceSpacing"))
+    {
+    this->ReferenceSpacing = spacing;
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::CopySettings(
+  vtkImageRegistration *registration)
+{
+  if (!this->CheckNotBuilt("CopySettings"))
+    {
+    return;
+    }
+
+  this->SetMetricType(registration->GetMetricType());
+  this->SetInterpolatorType(registration->GetInterpolatorType());
+  this->SetJointHistogramSize(registration->GetJointHistogramSize()[0]);
+  this->SetTargetImageRange(registration->GetTargetImageRange());
+
+  int n = registration->GetNumberOfLevels();
+  this->SetNumberOfLevels(n);
+  for (int level = 0; level < n; level++)
+    {
+    this->SetLevelShrinkFactor(
+      level, registration->GetLevelShrinkFactor(level));
+    this->SetLevelInterpolatorType(
+      level, registration->GetLevelInterpolatorType(level));
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::BlurImage(
+  vtkImageData *input, const double blur[3], vtkImageData *output,
+  int numberOfThreads)
+{
+  vtkImageSincInterpolator *kernel = vtkImageSincInterpolator::New();
+  kernel->SetWindowFunctionToBlackman();
+  kernel->AntialiasingOn();
+  kernel->SetBlurFactors(blur[0], blur[1], blur[2]);
+
+  vtkImageResize *resize = vtkImageResize::New();
+  if (numberOfThreads > 0)
+    {
+    resize->SetNumberOfThreads(numberOfThreads);
+#ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
+    resize->SetEnableSMP(
+      numberOfThreads >= vtkMultiThreader::GetGlobalDefaultNumberOfThreads() &&
+      vtkThreadedImageAlgorithm::GetGlobalDefaultEnableSMP());
+#endif
+    }
+  resize->SET_INPUT_DATA(input);
+  resize->SetResizeMethodToMagnificationFactors();
+  resize->SetMagnificationFactors(1.0, 1.0, 1.0);
+  resize->SetInterpolator(kernel);
+  resize->InterpolateOn();
+  resize->Update();
+
+  output->ShallowCopy(resize->GetOutput());
+  resize->Delete();
+  kernel->Delete();
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::Build()
+{
+  if (!this->CheckNotBuilt("Build"))
+    {
+    return;
+    }
+  if (this->TargetImage == NULL)
+    {
+    vtkErrorMacro("Build: No target image has been set");
+    return;
+    }
+
+  vtkImageRegistrationTargetLevels *levels = this->Levels;
+  int n = this->NumberOfLevels;
+  levels->Images.assign(n + 1, vtkSmartPointer<vtkImageData>());
+  levels->QuantizedImages.assign(n + 1, vtkSmartPointer<vtkImageData>());
+  levels->Coefficients.assign(n + 1, vtkSmartPointer<vtkImageData>());
+  levels->Ranges.assign(2*(n + 1), 0.0);
+
+  // keep a copy of the original image that is not part of any pipeline
+  vtkImageData *targetImage = vtkImageData::New();
+  targetImage->ShallowCopy(this->TargetImage);
+  levels->Images[0] = targetImage;
+  targetImage->Delete();
+
+  double targetSpacing[3];
+  targetImage->GetSpacing(targetSpacing);
+  double minSpacing = this->ReferenceSpacing;
+  if (minSpacing <= 0.0)
+    {
+    minSpacing = VTK_DOUBLE_MAX;
+    for (int j = 0; j < 3; j++)
+      {
+      double s = fabs(targetSpacing[j]);
+      minSpacing = (s < minSpacing ? s : minSpacing);
+      }
+    }
+
+  // blur from the finest level to the coarsest level, in the same way
+  // as vtkImageRegistration builds its pyramid
+  std::vector<double> builtShrink(n + 1, 1.0);
+  std::vector<int> builtInterpolate(n + 1, -1);
+  for (int level = n - 1; level >= 0; level--)
+    {
+    int i = level + 1;
+    double shrink = this->GetLevelShrinkFactor(level);
+    int interpolatorType = this->GetLevelInterpolatorType(level);
+    int interpolate = (interpolatorType != vtkImageRegistration::Nearest &&
+                       interpolatorType != vtkImageRegistration::Label);
+    builtShrink[i] = shrink;
+    builtInterpolate[i] = interpolate;
+
+    // find the finer level that this level will be built from
+    int prev = i + 1;
+    while (prev <= n && builtInterpolate[prev] != interpolate)
+      {
+      prev++;
+      }
+    vtkImageData *prevImage = levels->Images[(prev <= n ? prev : 0)];
+
+    if (shrink < 1.1)
+      {
+      levels->Images[i] = targetImage;
+      }
+    else if (prev <= n && builtShrink[prev] == shrink)
+      {
+      levels->Images[i] = prevImage;
+      }
+    else if (!interpolate)
+      {
+      levels->Images[i] = prevImage;
+      }
+    else
+      {
+      double blur[3];
+      for (int j = 0; j < 3; j++)
+        {
+        blur[j] = shrink*minSpacing/fabs(targetSpacing[j]);
+        blur[j] = (blur[j] > 1.0 ? blur[j] : 1.0);
+        }
+      vtkImageData *image = vtkImageData::New();
+      vtkImageRegistrationTarget::BlurImage(prevImage, blur, image, 0);
+      levels->Images[i] = image;
+      image->Delete();
+      }
+    }
+
+  // compute the products for each level, and share them between the
+  // levels that have the same image and the same interpolator
+  bool mutualInformation =
+    (this->MetricType == vtkImageRegistration::MutualInformation ||
+     this->MetricType == vtkImageRegistration::NormalizedMutualInformation);
+  int bins = this->JointHistogramSize;
+
+  for (int i = n; i >= 0; i--)
+    {
+    vtkImageData *image = levels->Images[i];
+    int interpolatorType = this->GetLevelInterpolatorType(i - 1);
+    double *range = &levels->Ranges[2*i];
+
+    int k = i + 1;
+    while (k <= n && (levels->Images[k] != image ||
+           this->GetLevelInterpolatorType(k - 1) != interpolatorType))
+      {
+      k++;
+      }
+    if (k <= n)
+      {
+      levels->QuantizedImages[i] = levels->QuantizedImages[k];
+      levels->Coefficients[i] = levels->Coefficients[k];
+      range[0] = levels->Ranges[2*k];
+      range[1] = levels->Ranges[2*k + 1];
+      continue;
+      }
+
+    range[0] = this->TargetImageRange[0];
+    range[1] = this->TargetImageRange[1];
+
+    if (mutualInformation)
+      {
+      if (range[0] >= range[1])
+        {
+        vtkImageRegistration::ComputeImageRange(image, NULL, range);
+        }
+
+      if (interpolatorType == vtkImageRegistration::Nearest && bins <= 256)
+        {
+        // quantize exactly as vtkImageRegistration::Initialize() would
+        double scale = (bins - 1)/(range[1] - range[0]);
+        double shift = (-range[0] + 0.5/scale);
+
+        vtkImageShiftScale *quantizer = vtkImageShiftScale::New();
+        quantizer->SET_INPUT_DATA(image);
+        quantizer->SetOutputScalarTypeToUnsignedChar();
+        quantizer->ClampOverflowOn();
+        quantizer->SetShift(shift);
+        quantizer->SetScale(scale);
+        quantizer->Update();
+
+        vtkImageData *quantized = vtkImageData::New();
+        quantized->ShallowCopy(quantizer->GetOutput());
+        levels->QuantizedImages[i] = quantized;
+        quantized->Delete();
+        quantizer->Delete();
+        }
+      }
+
+    if (interpolatorType == vtkImageRegistration::BSpline)
+      {
+      // a double source image will require double coefficients, and
+      // in that case the registration will compute its own
+      int scalarType = VTK_FLOAT;
+      if (image->GetScalarType() == VTK_DOUBLE)
+        {
+        scalarType = VTK_DOUBLE;
+        }
+
+      vtkImageBSplineCoefficients *bspline =
+        vtkImageBSplineCoefficients::New();
+      bspline->SET_INPUT_DATA(image);
+      bspline->SetOutputScalarType(scalarType);
+      bspline->Update();
+
+      vtkImageData *coeffs = vtkImageData::New();
+      coeffs->ShallowCopy(bspline->GetOutput());
+      levels->Coefficients[i] = coeffs;
+      coeffs->Delete();
+      bspline->Delete();
+      }
+    }
+
+  this->Built = 1;
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+vtkImageData *vtkImageRegistrationTarget::GetLevelImage(int level)
+{
+  if (!this->Built || level < -1 || level >= this->NumberOfLevels)
+    {
+    return NULL;
+    }
+  return this->Levels->Images[level + 1];
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::GetLevelImageRange(
+  int level, double range[2])
+{
+  range[0] = 0.0;
+  range[1] = -1.0;
+  if (this->Built && level >= -1 && level < this->NumberOfLevels)
+    {
+    range[0] = this->Levels->Ranges[2*(level + 1)];
+    range[1] = this->Levels->Ranges[2*(level + 1) + 1];
+    }
+}
+
+//----------------------------------------------------------------------------
+vtkImageData *vtkImageRegistrationTarget::GetLevelQuantizedImage(int level)
+{
+  if (!this->Built || level < -1 || level >= this->NumberOfLevels)
+    {
+    return NULL;
+    }
+  return this->Levels->QuantizedImages[level + 1];
+}
+
+//----------------------------------------------------------------------------
+vtkImageData *vtkImageRegistrationTarget::GetLevelCoefficients(int level)
+{
+  if (!this->Built || level < -1 || level >= this->NumberOfLevels)
+    {
+    return NULL;
+    }
+  return this->Levels->Coefficients[level + 1];
+}
@@ -0,0 +1,163 @@
+/*=========================================================================
+
+  Module: vtkImageRegistrationTarget.h
+
+  Copyright (c) 2016 David Gobbi
+  All rights reserved.
+  See Copyright.txt or http://dgobbi.github.io/bsd3.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notice for more information.
+
+=========================================================================*/
+// .NAME vtkImageRegistrationTarget - a target image prepared for registration
+// .SECTION Description
+// vtkImageRegistrationTarget holds a target image together with the
+// images that vtkImageRegistration derives from it: the blurred image
+// for each pyramid level, its intensity range, the quantized image that
+// is used for mutual information with nearest-neighbor interpolation,
+// and the b-spline coefficients that are used for b-spline interpolation.
+// When many images are registered to the same target, as is done when
+// building an atlas, these can be computed once by calling Build(), and
+// the prepared target can then be given to any number of registrations
+// with vtkImageRegistration::SetPreparedTarget().  After Build() has been
+// called, the prepared target cannot be modified, so it can safely be
+// shared by registrations that run concurrently in different threads.
+// .SECTION See Also
+// vtkImageRegistration
+
+#ifndef vtkImageRegistrationTarget_h
+#define vtkImageRegistrationTarget_h
+
+#include "vtkObject.h"
+
+class vtkImageData;
+class vtkImageRegistration;
+
+struct vtkImageRegistrationTargetLevels;
+
+class VTK_EXPORT vtkImageRegistrationTarget : public vtkObject
+{
+public:
+  vtkTypeMacro(vtkImageRegistrationTarget, vtkObject);
+  static vtkImageRegistrationTarget *New();
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  // Description:
+  // Set the target image.  A shallow copy of the image is taken when
+  // Build() is called, so the image data must not be modified after
+  // that point.
+  void SetTargetImage(vtkImageData *image);
+  vtkImageData *GetTargetImage() { return this->TargetImage; }
+
+  // Description:
+  // Copy the settings that affect the target image from a registration:
+  // the metric type, the interpolator type, the size of the target axis
+  // of the joint histogram, the target image range, and the number of
+  // levels with the shrink factor and interpolator type for each level.
+  void CopySettings(vtkImageRegistration *registration);
+
+  // Description:
+  // Set the metric type.  The intensity range and the quantized images
+  // are only computed for mutual information metrics.  The default is
+  // vtkImageRegistration::MutualInformation.
+  void SetMetricType(int type);
+  vtkGetMacro(MetricType, int);
+
+  // Description:
+  // Set the interpolator type for the original image, which is used
+  // when the registration does not use a pyramid.  The default is
+  // vtkImageRegistration::Linear.
+  void SetInterpolatorType(int type);
+  vtkGetMacro(InterpolatorType, int);
+
+  // Description:
+  // Set the number of bins for the target axis of the joint histogram.
+  // The default is 64.
+  void SetJointHistogramSize(int size);
+  vtkGetMacro(JointHistogramSize, int);
+
+  // Description:
+  // Set the range of the target axis of the joint histogram.  The default
+  // is to use the full range of values in the image at each level.
+  void SetTargetImageRange(double r0, double r1);
+  void SetTargetImageRange(const double range[2]) {
+    this->SetTargetImageRange(range[0], range[1]); }
+  vtkGetVector2Macro(TargetImageRange, double);
+
+  // Description:
+  // Set the number of pyramid levels, and the shrink factor and the
+  // interpolator type for each level.  These have the same meaning and
+  // the same defaults as for vtkImageRegistration.
+  void SetNumberOfLevels(int n);
+  vtkGetMacro(NumberOfLevels, int);
+  void SetLevelShrinkFactor(int level, double factor);
+  double GetLevelShrinkFactor(int level);
+  void SetLevelInterpolatorType(int level, int type);
+  int GetLevelInterpolatorType(int level);
+
+  // Description:
+  // Set the voxel spacing that the blur of each level is relative to.
+  // For each level, vtkImageRegistration blurs the target to the shrink
+  // factor times the smallest source voxel spacing, but the prepared
+  // target must be built before the source images are known, so this
+  // spacing is used instead.  The default, zero, means that the smallest
+  // voxel spacing of the target image is used.
+  void SetReferenceSpacing(double spacing);
+  vtkGetMacro(ReferenceSpacing, double);
+
+  // Description:
+  // Compute the images for every level.  This can only be done once,
+  // after which none of the settings can be changed.
+  void Build();
+
+  // Description:
+  // Check whether Build() has been called.
+  int GetBuilt() { return this->Built; }
+
+  // Description:
+  // Get the products for a pyramid level, or for the original image if
+  // the level is -1.  The quantized image is NULL unless the level uses
+  // nearest-neighbor interpolation with mutual information, and the
+  // coefficients are NULL unless the level uses b-spline interpolation.
+  // These are only available after Build(), and must not be modified.
+  vtkImageData *GetLevelImage(int level);
+  void GetLevelImageRange(int level, double range[2]);
+  vtkImageData *GetLevelQuantizedImage(int level);
+  vtkImageData *GetLevelCoefficients(int level);
+
+  // Description:
+  // Blur an image with a Blackman-windowed sinc, without changing its
+  // sampling.  The blur factors are in units of the voxel spacing.  This
+  // is how the target image is blurred for each pyramid level.  If the
+  // number of threads is not zero, the filter is limited to that many
+  // threads, and SMP is turned off if that is fewer than the default.
+  static void BlurImage(vtkImageData *input, const double blur[3],
+                        vtkImageData *output, int numberOfThreads);
+
+protected:
+  vtkImageRegistrationTarget();
+  ~vtkImageRegistrationTarget();
+
+  // Description:
+  // Report an error if Build() has been called.
+  int CheckNotBuilt(const char *method);
+
+  vtkImageData *TargetImage;
+  int MetricType;
+  int InterpolatorType;
+  int JointHistogramSize;
+  double TargetImageRange[2];
+  int NumberOfLevels;
+  double ReferenceSpacing;
+  int Built;
+
+  vtkImageRegistrationTargetLevels *Levels;
+
+private:
+  vtkImageRegistrationTarget(const vtkImageRegistrationTarget&);  // Not implemented.
+  void operator=(const vtkImageRegistrationTarget&);  // Not implemented.
+};
+
+#endif
@@ -13,13 +13,21 @@
 
 =========================================================================*/
 #include "vtkImageSimilarityMetric.h"
+#include "vtkWorkerThreadPool.h"
 
 #include <vtkImageData.h>
 #include <vtkImageStencilData.h>
+#include <vtkAbstractImageInterpolator.h>
+#include <vtkLinearTransform.h>
+#include <vtkMatrix4x4.h>
 #include <vtkInformation.h>
 #include <vtkInformationVector.h>
+#include <vtkExecutive.h>
 #include <vtkStreamingDemandDrivenPipeline.h>
 #include <vtkMultiThreader.h>
+#include <vtkMutexLock.h>
+#include <vtkTimerLog.h>
+#include <vtkTemplateAliasMacro.h>
 #include <vtkVersion.h>
 
 #include "vtkImageSimilarityMetricInternals.h"
@@ -38,47 +46,831 @@ vtkImageSimilarityMetric::vtkImageSimilarityMetric()
   this->Value = 0.0;
   this->Cost = 0.0;
 
+  this->Interpolator = NULL;
+  this->Transform = NULL;
+  this->ThreadPool = NULL;
+  vtkMatrix4x4::Identity(this->IndexMatrix);
+  this->SinglePrecision = false;
+
+  this->Prepared = false;
+  this->Evaluating = false;
+  this->EvaluateMatrix = NULL;
+  this->EvaluateRequest = NULL;
+  this->PreparedInputs = NULL;
+  this->PreparedOutputs = NULL;
+  this->PreparedStencil = NULL;
+
+  this->CollectProfile = false;
+  this->PieceSeconds = 0.0;
+  this->ReduceSeconds = 0.0;
+  this->NumberOfVoxels = 0;
+  this->ThreadUtilization = 0.0;
+  this->ThreadSeconds = NULL;
+  this->ThreadSecondsSize = 0;
+
+  this->SupportsCostCeiling = false;
+  this->UseCostCeiling = false;
+  this->Abandoned = false;
+  this->CostCeiling = VTK_DOUBLE_MAX;
+  this->PartialCost = 0.0;
+  for (int i = 0; i < 6; i++)
+    {
+    this->CeilingExtent[i] = 0;
+    }
+  this->MaximumCount = 0;
+  this->VisitedCount = 0;
+  this->NumberOfSkippedVoxels = 0;
+  this->SliceCounts = NULL;
+  this->SliceCountsSize = 0;
+  this->SliceCountsTotal = 0;
+  for (int i = 0; i < 6; i++)
+    {
+    this->SliceCountsExtent[i] = 0;
+    }
+  this->SliceCountsCached = false;
+  this->CeilingLock = new vtkSimpleMutexLock;
+
+  this->NumberOfAllocations = 0;
+
+  this->BalancedSplit = false;
+  this->BalancedSplitActive = false;
+  this->SplitSlices = NULL;
+  this->SplitSlicesSize = 0;
+  this->NumberOfPieces = 0;
+  this->PieceSplitTotal = 0;
+  for (int i = 0; i < 6; i++)
+    {
+    this->PieceSplitExtent[i] = 0;
+    this->PieceInputExtent[i] = 0;
+    }
+  this->PieceVoxels = NULL;
+  this->PieceVoxelsSize = 0;
+
+  this->NodeLocalAccumulators = false;
+
+  this->SupportsSampleList = false;
+  this->UseSampleList = false;
+  this->SampleListActive = false;
+  this->SampleListShared = false;
+  this->NumberOfSamplePieces = 1;
+  this->SampleList = NULL;
+
+  this->LineEvaluating = false;
+  this->LineActive = false;
+  this->LineShared = false;
+  this->LineStep = 0.0;
+  vtkMatrix4x4::Identity(this->LineMatrix);
+  this->Line = NULL;
+
   this->SetNumberOfInputPorts(3);
   this->SetNumberOfOutputPorts(0);
 }
 
-//----------------------------------------------------------------------------
-vtkImageSimilarityMetric::~vtkImageSimilarityMetric()
-{
+//----------------------------------------------------------------------------
+vtkImageSimilarityMetric::~vtkImageSimilarityMetric()
+{
+  if (this->Interpolator)
+    {
+    if (this->Prepared)
+      {
+      this->Interpolator->ReleaseData();
+      }
+    this->Interpolator->Delete();
+    }
+  if (this->EvaluateRequest)
+    {
+    this->EvaluateRequest->Delete();
+    }
+  if (this->Transform)
+    {
+    this->Transform->Delete();
+    }
+  if (this->ThreadPool)
+    {
+    this->ThreadPool->Delete();
+    }
+  delete [] this->ThreadSeconds;
+  delete [] this->SliceCounts;
+  delete [] this->SplitSlices;
+  delete [] this->PieceVoxels;
+  delete this->CeilingLock;
+  if (this->SampleList)
+    {
+    this->SampleList->UnRegister();
+    }
+  if (this->Line)
+    {
+    this->Line->UnRegister();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSimilarityMetric::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os,indent);
+
+  os << indent << "Stencil: " << this->GetStencil() << "\n";
+  os << indent << "InputRange: ("
+     << this->InputRange[0][0] << ", " << this->InputRange[0][1] << "), ("
+     << this->InputRange[1][0] << ", " << this->InputRange[1][1] << ")\n";
+  os << indent << "Interpolator: " << this->Interpolator << "\n";
+  os << indent << "Transform: " << this->Transform << "\n";
+  os << indent << "ThreadPool: " << this->ThreadPool << "\n";
+  os << indent << "SinglePrecision: "
+     << (this->SinglePrecision ? "On\n" : "Off\n");
+  os << indent << "CollectProfile: "
+     << (this->CollectProfile ? "On\n" : "Off\n");
+  os << indent << "CostCeiling: " << this->CostCeiling << "\n";
+  os << indent << "UseSampleList: "
+     << (this->UseSampleList ? "On\n" : "Off\n");
+  os << indent << "NumberOfSamples: " << this->GetNumberOfSamples() << "\n";
+  os << indent << "BalancedSplit: "
+     << (this->BalancedSplit ? "On\n" : "Off\n");
+  os << indent << "NodeLocalAccumulators: "
+     << (this->NodeLocalAccumulators ? "On\n" : "Off\n");
+  os << indent << "Value: " << this->Value << "\n";
+  os << indent << "Cost: " << this->Cost << "\n";
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSimilarityMetric::SetStencilData(vtkImageStencilData *stencil)
+{
+#if VTK_MAJOR_VERSION >= 6
+  this->SetInputData(2, stencil);
+#else
+  this->SetInput(2, stencil);
+#endif
+}
+
+//----------------------------------------------------------------------------
+vtkImageStencilData *vtkImageSimilarityMetric::GetStencil()
+{
+  if (this->Prepared)
+    {
+    return this->PreparedStencil;
+    }
+  if (this->GetNumberOfInputConnections(2) < 1)
+    {
+    return NULL;
+    }
+  return vtkImageStencilData::SafeDownCast(
+    this->GetExecutive()->GetInputData(2, 0));
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSimilarityMetric::SetInterpolator(
+  vtkAbstractImageInterpolator *interpolator)
+{
+  if (interpolator != this->Interpolator)
+    {
+    if (this->Interpolator)
+      {
+      this->Interpolator->Delete();
+      }
+    if (interpolator)
+      {
+      interpolator->Register(this);
+      }
+    this->Interpolator = interpolator;
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSimilarityMetric::SetTransform(vtkLinearTransform *transform)
+{
+  if (transform != this->Transform)
+    {
+    if (this->Transform)
+      {
+      this->Transform->Delete();
+      }
+    if (transform)
+      {
+      transform->Register(this);
+      }
+    this->Transform = transform;
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSimilarityMetric::SetThreadPool(vtkWorkerThreadPool *pool)
+{
+  // the pool does not affect the output, so Modified() is not called
+  if (pool != this->ThreadPool)
+    {
+    if (this->ThreadPool)
+      {
+      this->ThreadPool->Delete();
+      }
+    if (pool)
+      {
+      pool->Register(this);
+      }
+    this->ThreadPool = pool;
+    }
+}
+
+//----------------------------------------------------------------------------
+int vtkImageSimilarityMetric::GetNumberOfExecutionThreads()
+{
+  if (this->ThreadPool)
+    {
+    return this->ThreadPool->GetNumberOfThreads();
+    }
+  return this->NumberOfThreads;
+}
+
+//----------------------------------------------------------------------------
+#ifdef VTK_HAS_MTIME_TYPE
+vtkMTimeType vtkImageSimilarityMetric::GetMTime()
+{
+  vtkMTimeType mTime = this->Superclass::GetMTime();
+  vtkMTimeType t;
+#else
+unsigned long vtkImageSimilarityMetric::GetMTime()
+{
+  unsigned long mTime = this->Superclass::GetMTime();
+  unsigned long t;
+#endif
+
+  if (this->Interpolator)
+    {
+    t = this->Interpolator->GetMTime();
+    mTime = (t > mTime ? t : mTime);
+    }
+  if (this->Transform)
+    {
+    t = this->Transform->GetMTime();
+    mTime = (t > mTime ? t : mTime);
+    }
+
+  return mTime;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSimilarityMetric::ComputeIndexMatrix(
+  vtkImageData *inData0, vtkImageData *inData1, double matrix[16])
+{
+  double origin0[3], spacing0[3];
+  double origin1[3], spacing1[3];
+  inData0->GetOrigin(origin0);
+  inData0->GetSpacing(spacing0);
+  inData1->GetOrigin(origin1);
+  inData1->GetSpacing(spacing1);
+
+  double transform[16];
+  vtkMatrix4x4::Identity(transform);
+  if (this->EvaluateMatrix)
+    {
+    for (int k = 0; k < 16; k++)
+      {
+      transform[k] = this->EvaluateMatrix[k];
+      }
+    }
+  else if (this->Transform)
+    {
+    vtkMatrix4x4::DeepCopy(transform, this->Transform->GetMatrix());
+    }
+
+  // matrix = inverse(indexToData1) * transform * indexToData0
+  for (int i = 0; i < 3; i++)
+    {
+    const double *row = transform + 4*i;
+    double *outRow = matrix + 4*i;
+    outRow[0] = row[0]*spacing0[0]/spacing1[i];
+    outRow[1] = row[1]*spacing0[1]/spacing1[i];
+    outRow[2] = row[2]*spacing0[2]/spacing1[i];
+    outRow[3] = (row[0]*origin0[0] + row[1]*origin0[1] +
+                 row[2]*origin0[2] + row[3] - origin1[i])/spacing1[i];
+    }
+
+  matrix[12] = 0.0;
+  matrix[13] = 0.0;
+  matrix[14] = 0.0;
+  matrix[15] = 1.0;
+}
+
+//----------------------------------------------------------------------------
+int vtkImageSimilarityMetric::GetInterleavedSlice(const int extent[6], int n)
+{
+  // the offsets within each stride, in bit-reversed order
+  static const int offsets[8] = { 0, 4, 2, 6, 1, 5, 3, 7 };
+
+  int nz = extent[5] - extent[4] + 1;
+  for (int j = 0; j < 8; j++)
+    {
+    int o = offsets[j];
+    int count = (nz > o ? (nz - o + 7)/8 : 0);
+    if (n < count)
+      {
+      return extent[4] + o + 8*n;
+      }
+    n -= count;
+    }
+
+  return extent[5];
+}
+
+//----------------------------------------------------------------------------
+bool vtkImageSimilarityMetric::AddSliceCost(int idZ, double sum)
+{
+  this->CeilingLock->Lock();
+  this->PartialCost += sum;
+  this->VisitedCount += this->SliceCounts[idZ - this->CeilingExtent[4]];
+  if (!this->Abandoned &&
+      this->PartialCost > this->CostCeiling*this->MaximumCount)
+    {
+    this->Abandoned = true;
+    }
+  bool abandoned = this->Abandoned;
+  this->CeilingLock->Unlock();
+
+  return abandoned;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSimilarityMetric::ShareSampleList(
+  vtkImageSimilarityMetric *metric)
+{
+  // only a prepared metric is guaranteed to have an up-to-date list
+  if (metric && metric != this && metric->Prepared && metric->SampleList &&
+      metric->SampleList != this->SampleList)
+    {
+    metric->SampleList->Register();
+    if (this->SampleList)
+      {
+      this->SampleList->UnRegister();
+      }
+    this->SampleList = metric->SampleList;
+    this->SampleListShared = true;
+    }
+}
+
+//----------------------------------------------------------------------------
+vtkIdType vtkImageSimilarityMetric::GetNumberOfSamples()
+{
+  return (this->SampleList ? this->SampleList->NumberOfSamples : 0);
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSimilarityMetric::GetSampleRange(
+  vtkIdType piece, vtkIdType range[2])
+{
+  vtkIdType n = this->SampleList->NumberOfSamples;
+  vtkIdType pieces = this->NumberOfSamplePieces;
+  range[0] = n*piece/pieces;
+  range[1] = n*(piece + 1)/pieces;
+}
+
+//----------------------------------------------------------------------------
+int vtkImageSimilarityMetric::SetLine(
+  const double matrix[16], const double delta[16])
+{
+  if (!this->Prepared || this->Interpolator == NULL)
+    {
+    vtkErrorMacro("SetLine: Prepare() must be called with an interpolator.");
+    return 0;
+    }
+
+  vtkImageData *inData0 = vtkImageData::SafeDownCast(
+    this->PreparedInputs[0]->GetInformationObject(0)->Get(
+      vtkDataObject::DATA_OBJECT()));
+  vtkImageData *inData1 = vtkImageData::SafeDownCast(
+    this->PreparedInputs[1]->GetInformationObject(0)->Get(
+      vtkDataObject::DATA_OBJECT()));
+
+  // the index matrices at the start of the line and at one step along it
+  double endMatrix[16];
+  for (int k = 0; k < 16; k++)
+    {
+    endMatrix[k] = matrix[k] + delta[k];
+    }
+  double startIndexMatrix[16];
+  double endIndexMatrix[16];
+  this->EvaluateMatrix = matrix;
+  this->ComputeIndexMatrix(inData0, inData1, startIndexMatrix);
+  this->EvaluateMatrix = endMatrix;
+  this->ComputeIndexMatrix(inData0, inData1, endIndexMatrix);
+  this->EvaluateMatrix = NULL;
+
+  // a shared line belongs to another metric, so make a new one
+  if (this->Line == NULL || this->LineShared)
+    {
+    if (this->Line)
+      {
+      this->Line->UnRegister();
+      }
+    this->Line = new vtkImageSimilarityMetricLine;
+    this->LineShared = false;
+    this->NumberOfAllocations++;
+    }
+
+  vtkImageSimilarityMetricLine *line = this->Line;
+  int *extent = line->Extent;
+  inData0->GetExtent(extent);
+  for (int k = 0; k < 16; k++)
+    {
+    line->Matrix[k] = matrix[k];
+    line->Delta[k] = delta[k];
+    }
+
+  size_t n = 6*static_cast<size_t>(extent[3] - extent[2] + 1)*
+    (extent[5] - extent[4] + 1);
+  if (n > line->Rows.capacity())
+    {
+    this->NumberOfAllocations++;
+    }
+  line->Rows.resize(n);
+
+  // the base position and the derivative of the first voxel of each row
+  double *row = (n > 0 ? &line->Rows[0] : NULL);
+  for (int idZ = extent[4]; idZ <= extent[5]; idZ++)
+    {
+    for (int idY = extent[2]; idY <= extent[3]; idY++)
+      {
+      for (int i = 0; i < 3; i++)
+        {
+        const double *m0 = startIndexMatrix + 4*i;
+        const double *m1 = endIndexMatrix + 4*i;
+        double base = m0[1]*idY + m0[2]*idZ + m0[3];
+        row[i] = base;
+        row[3 + i] = m1[1]*idY + m1[2]*idZ + m1[3] - base;
+        }
+      row += 6;
+      }
+    }
+
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSimilarityMetric::ShareLine(vtkImageSimilarityMetric *metric)
+{
+  if (metric && metric != this && metric->Line &&
+      metric->Line != this->Line)
+    {
+    metric->Line->Register();
+    if (this->Line)
+      {
+      this->Line->UnRegister();
+      }
+    this->Line = metric->Line;
+    this->LineShared = true;
+    }
+}
+
+//----------------------------------------------------------------------------
+vtkIdType vtkImageSimilarityMetric::CountStencilVoxels(const int extent[6])
+{
+  vtkImageStencilData *stencil = this->GetStencil();
+  if (stencil == NULL)
+    {
+    return static_cast<vtkIdType>(extent[1] - extent[0] + 1)*
+      (extent[3] - extent[2] + 1)*(extent[5] - extent[4] + 1);
+    }
+
+  vtkIdType count = 0;
+  for (int idZ = extent[4]; idZ <= extent[5]; idZ++)
+    {
+    for (int idY = extent[2]; idY <= extent[3]; idY++)
+      {
+      int iter = 0;
+      int r1, r2;
+      while (stencil->GetNextExtent(
+               r1, r2, extent[0], extent[1], idY, idZ, iter))
+        {
+        count += r2 - r1 + 1;
+        }
+      }
+    }
+
+  return count;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSimilarityMetric::ComputeSliceCounts(const int extent[6])
+{
+  // while prepared with an interpolator, the stencil is fixed, so the
+  // counts only have to be recomputed if the extent changes
+  bool cacheable = (this->Prepared && this->Interpolator != NULL);
+  if (cacheable && this->SliceCountsCached)
+    {
+    bool same = true;
+    for (int i = 0; i < 6 && same; i++)
+      {
+      same = (this->SliceCountsExtent[i] == extent[i]);
+      }
+    if (same)
+      {
+      return;
+      }
+    }
+
+  int nz = extent[5] - extent[4] + 1;
+  if (this->SliceCountsSize < nz)
+    {
+    delete [] this->SliceCounts;
+    this->SliceCounts = new vtkIdType[nz];
+    this->SliceCountsSize = nz;
+    this->NumberOfAllocations++;
+    }
+
+  this->SliceCountsTotal = 0;
+  for (int idZ = extent[4]; idZ <= extent[5]; idZ++)
+    {
+    int sliceExt[6];
+    for (int i = 0; i < 4; i++)
+      {
+      sliceExt[i] = extent[i];
+      }
+    sliceExt[4] = idZ;
+    sliceExt[5] = idZ;
+    vtkIdType count = this->CountStencilVoxels(sliceExt);
+    this->SliceCounts[idZ - extent[4]] = count;
+    this->SliceCountsTotal += count;
+    }
+
+  for (int i = 0; i < 6; i++)
+    {
+    this->SliceCountsExtent[i] = extent[i];
+    }
+  this->SliceCountsCached = cacheable;
+}
+
+//----------------------------------------------------------------------------
+bool vtkImageSimilarityMetric::ComputeBalancedSplit(
+  const int extent[6], int pieces)
+{
+  int nz = extent[5] - extent[4] + 1;
+  vtkIdType total = this->SliceCountsTotal;
+  if (pieces < 2 || nz < pieces || total == 0)
+    {
+    return false;
+    }
+
+  if (this->SplitSlicesSize < pieces + 1)
+    {
+    delete [] this->SplitSlices;
+    this->SplitSlices = new int[pieces + 1];
+    this->SplitSlicesSize = pieces + 1;
+    this->NumberOfAllocations++;
+    }
+
+  // each slice goes to the piece whose share of the voxels contains the
+  // midpoint of the slice's voxels, so the pieces are within half of a
+  // slice of being equal
+  int *splitSlices = this->SplitSlices;
+  splitSlices[0] = extent[4];
+  int p = 1;
+  vtkIdType sum = 0;
+  for (int i = 0; i < nz && p < pieces; i++)
+    {
+    vtkIdType count = this->SliceCounts[i];
+    double middle = sum + 0.5*count;
+    while (p < pieces && middle >= static_cast<double>(total)*p/pieces)
+      {
+      splitSlices[p++] = extent[4] + i;
+      }
+    sum += count;
+    }
+  while (p <= pieces)
+    {
+    splitSlices[p++] = extent[5] + 1;
+    }
+
+  return true;
+}
+
+//----------------------------------------------------------------------------
+int vtkImageSimilarityMetric::GetPieceExtent(
+  int splitExt[6], int extent[6], int piece, int total)
+{
+  if (!this->BalancedSplitActive)
+    {
+    return this->SplitExtent(splitExt, extent, piece, total);
+    }
+
+  if (splitExt && piece < this->NumberOfPieces)
+    {
+    for (int i = 0; i < 4; i++)
+      {
+      splitExt[i] = extent[i];
+      }
+    splitExt[4] = this->SplitSlices[piece];
+    splitExt[5] = this->SplitSlices[piece + 1] - 1;
+    }
+
+  return this->NumberOfPieces;
+}
+
+//----------------------------------------------------------------------------
+vtkIdType vtkImageSimilarityMetric::GetPieceStartVoxel(int piece)
+{
+  const int *inExt = this->PieceInputExtent;
+  vtkIdType nx = inExt[1] - inExt[0] + 1;
+  vtkIdType ny = inExt[3] - inExt[2] + 1;
+  vtkIdType nz = inExt[5] - inExt[4] + 1;
+
+  int idX, idY, idZ;
+  if (this->SampleListActive)
+    {
+    // the samples are in the same order as the voxels
+    vtkIdType range[2];
+    this->GetSampleRange(piece, range);
+    if (range[0] >= this->SampleList->NumberOfSamples)
+      {
+      return nx*ny*nz;
+      }
+    idX = static_cast<int>(this->SampleList->X[range[0]]);
+    idY = static_cast<int>(this->SampleList->Y[range[0]]);
+    idZ = static_cast<int>(this->SampleList->Z[range[0]]);
+    }
+  else
+    {
+    int splitExt[6];
+    int total = this->GetPieceExtent(
+      splitExt, this->PieceSplitExtent, piece, this->PieceSplitTotal);
+    if (piece >= total)
+      {
+      return nx*ny*nz;
+      }
+    idX = splitExt[0];
+    idY = splitExt[2];
+    idZ = splitExt[4];
+    }
+
+  return ((idZ - inExt[4])*ny + (idY - inExt[2]))*nx + (idX - inExt[0]);
+}
+
+//----------------------------------------------------------------------------
+int vtkImageSimilarityMetric::GetPieceVoxelRange(
+  int piece, vtkIdType range[2])
+{
+  const int *inExt = this->PieceInputExtent;
+  vtkIdType n = static_cast<vtkIdType>(inExt[1] - inExt[0] + 1)*
+    (inExt[3] - inExt[2] + 1)*(inExt[5] - inExt[4] + 1);
+  int pieces = this->NumberOfPieces;
+
+  // the first piece also gets the voxels before the split extent, and
+  // the last piece gets the voxels after it
+  range[0] = 0;
+  range[1] = n;
+  if (pieces <= 0 || piece < 0 || piece >= pieces)
+    {
+    range[1] = 0;
+    return (pieces > 0 ? pieces : 0);
+    }
+
+  // the starts are made monotonic, so that the ranges never overlap
+  vtkIdType start = 0;
+  for (int i = 1; i <= piece + 1 && i < pieces; i++)
+    {
+    vtkIdType nextStart = this->GetPieceStartVoxel(i);
+    start = (nextStart > start ? nextStart : start);
+    start = (start < n ? start : n);
+    range[(i <= piece ? 0 : 1)] = start;
+    }
+
+  return pieces;
+}
+
+//----------------------------------------------------------------------------
+int vtkImageSimilarityMetric::SplitPieces(
+  const int extent[6], vtkImageData *inData0, bool balance)
+{
+  int numberOfThreads = this->GetNumberOfExecutionThreads();
+
+  // with vtkSMPTools, a balanced split makes several pieces per thread,
+  // so that the threads that finish first can take the remaining pieces
+  int numberOfPieces = numberOfThreads;
+  int piecesPerThread = 1;
+#ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
+  if (this->EnableSMP)
+    {
+    numberOfPieces = this->NumberOfThreads;
+    piecesPerThread = 4;
+    }
+#endif
+  int *ext = const_cast<int *>(extent);
+  this->BalancedSplitActive = false;
+  if (balance)
+    {
+    this->BalancedSplitActive = this->ComputeBalancedSplit(
+      extent, numberOfPieces*piecesPerThread);
+    if (this->BalancedSplitActive)
+      {
+      numberOfPieces *= piecesPerThread;
+      }
+    }
+  this->NumberOfPieces = numberOfPieces;
+  if (this->SampleListActive)
+    {
+    this->NumberOfPieces = static_cast<int>(this->NumberOfSamplePieces);
+    }
+  else
+    {
+    // do a dummy execution to compute the actual number of pieces
+    this->NumberOfPieces =
+      this->GetPieceExtent(0, ext, 0, numberOfPieces);
+    }
+
+  // vtkSMPTools splits by the actual number of pieces, while the threads
+  // of vtkMultiThreader split by the number of threads
+  int splitTotal = numberOfThreads;
+#ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
+  if (this->EnableSMP)
+    {
+    splitTotal = this->NumberOfPieces;
+    }
+#endif
+
+  // keep the split, so that GetPieceVoxelRange() can report it
+  this->PieceSplitTotal = splitTotal;
+  inData0->GetExtent(this->PieceInputExtent);
+  for (int i = 0; i < 6; i++)
+    {
+    this->PieceSplitExtent[i] = extent[i];
+    }
+
+  return splitTotal;
 }
 
 //----------------------------------------------------------------------------
-void vtkImageSimilarityMetric::PrintSelf(ostream& os, vtkIndent indent)
+int vtkImageSimilarityMetric::ComputePieceSplit()
 {
-  this->Superclass::PrintSelf(os,indent);
+  vtkExecutive *executive = this->GetExecutive();
+  vtkImageData *inData0 = vtkImageData::SafeDownCast(
+    executive->GetInputData(0, 0));
+  vtkImageData *inData1 = vtkImageData::SafeDownCast(
+    executive->GetInputData(1, 0));
+  if (inData0 == NULL || inData1 == NULL)
+    {
+    vtkErrorMacro("ComputePieceSplit: The inputs have not been set.");
+    return 0;
+    }
 
-  os << indent << "Stencil: " << this->GetStencil() << "\n";
-  os << indent << "InputRange: ("
-     << this->InputRange[0][0] << ", " << this->InputRange[0][1] << "), ("
-     << this->InputRange[1][0] << ", " << this->InputRange[1][1] << ")\n";
-  os << indent << "Value: " << this->Value << "\n";
-  os << indent << "Cost: " << this->Cost << "\n";
+  // the extent is chosen in the same way as by RequestData()
+  int extent[6];
+  inData0->GetExtent(extent);
+  if (this->Interpolator == NULL)
+    {
+    int inExt1[6];
+    inData1->GetExtent(inExt1);
+    for (int i = 0; i < 6; i += 2)
+      {
+      int j = i + 1;
+      extent[i] = ((extent[i] > inExt1[i]) ? extent[i] : inExt1[i]);
+      extent[j] = ((extent[j] < inExt1[j]) ? extent[j] : inExt1[j]);
+      if (extent[i] > extent[j])
+        {
+        this->NumberOfPieces = 0;
+        return 0;
+        }
+      }
+    }
+
+  // the sample list would split the samples evenly, which is the same
+  // as the balanced split to within a slice
+  this->SampleListActive = false;
+  bool balance =
+    (this->BalancedSplit ||
+     (this->UseSampleList && this->SupportsSampleList && this->Interpolator));
+  if (balance)
+    {
+    this->ComputeSliceCounts(extent);
+    }
+  this->SplitPieces(extent, inData0, balance);
+
+  return this->NumberOfPieces;
 }
 
 //----------------------------------------------------------------------------
-void vtkImageSimilarityMetric::SetStencilData(vtkImageStencilData *stencil)
+int vtkImageSimilarityMetric::GetAccumulatorSlot(vtkIdType pieceId)
 {
-#if VTK_MAJOR_VERSION >= 6
-  this->SetInputData(2, stencil);
-#else
-  this->SetInput(2, stencil);
+  // only the threads of the pool execute the same piece every time
+  if (!this->NodeLocalAccumulators || this->ThreadPool == NULL)
+    {
+    return -1;
+    }
+#ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
+  if (this->EnableSMP)
+    {
+    return -1;
+    }
 #endif
+  return static_cast<int>(pieceId);
 }
 
 //----------------------------------------------------------------------------
-vtkImageStencilData *vtkImageSimilarityMetric::GetStencil()
+vtkIdType vtkImageSimilarityMetric::GetPieceNumberOfVoxels(int piece)
 {
-  if (this->GetNumberOfInputConnections(2) < 1)
+  if (piece >= 0 && piece < this->NumberOfPieces && this->PieceVoxels)
     {
-    return NULL;
+    return this->PieceVoxels[piece];
     }
-  return vtkImageStencilData::SafeDownCast(
-    this->GetExecutive()->GetInputData(2, 0));
+  return 0;
 }
 
 //----------------------------------------------------------------------------
@@ -159,44 +951,90 @@ int vtkImageSimilarityMetric::RequestUpdateExtent(
 struct vtkImageSimilarityMetricThreadStruct
 {
   static VTK_THREAD_RETURN_TYPE ThreadExecute(void *arg);
+  static void PoolExecute(void *arg, int threadId, int numberOfThreads);
+  void ExecutePiece(int piece, int numberOfPieces);
 
   vtkImageSimilarityMetric *Algorithm;
   vtkInformation *Request;
   vtkInformationVector **InputsInfo;
   vtkInformationVector *OutputsInfo;
   int Extent[6];
+  double *ThreadSeconds;
 };
 
 //----------------------------------------------------------------------------
 // override from vtkThreadedImageAlgorithm to split input extent, instead
 // of splitting the output extent
-VTK_THREAD_RETURN_TYPE
-vtkImageSimilarityMetricThreadStruct::ThreadExecute(void *arg)
+void vtkImageSimilarityMetricThreadStruct::ExecutePiece(
+  int piece, int numberOfPieces)
 {
-  vtkMultiThreader::ThreadInfo *ti =
-    static_cast<vtkMultiThreader::ThreadInfo *>(arg);
-  vtkImageSimilarityMetricThreadStruct *ts =
-    static_cast<vtkImageSimilarityMetricThreadStruct *>(ti->UserData);
-
   // execute the actual method with appropriate extent
   // first find out how many pieces extent can be split into.
   int splitExt[6];
-  int total = ts->Algorithm->SplitExtent(
-    splitExt, ts->Extent, ti->ThreadID, ti->NumberOfThreads);
+  int total = numberOfPieces;
+  if (this->Algorithm->SampleListActive)
+    {
+    // the samples are split instead of the extent
+    for (int i = 0; i < 6; i++)
+      {
+      splitExt[i] = this->Extent[i];
+      }
+    }
+  else
+    {
+    total = this->Algorithm->GetPieceExtent(
+      splitExt, this->Extent, piece, numberOfPieces);
+    }
 
-  if (ti->ThreadID < total &&
+  if (piece < total &&
       splitExt[1] >= splitExt[0] &&
       splitExt[3] >= splitExt[2] &&
       splitExt[5] >= splitExt[4])
     {
-    ts->Algorithm->PieceRequestData(
-      ts->Request, ts->InputsInfo, ts->OutputsInfo,
-      splitExt, ti->ThreadID);
+    double startTime = 0.0;
+    if (this->ThreadSeconds)
+      {
+      startTime = vtkTimerLog::GetUniversalTime();
+      }
+
+    this->Algorithm->PieceRequestData(
+      this->Request, this->InputsInfo, this->OutputsInfo,
+      splitExt, piece);
+
+    if (this->ThreadSeconds)
+      {
+      this->ThreadSeconds[piece] =
+        vtkTimerLog::GetUniversalTime() - startTime;
+      }
     }
+}
+
+//----------------------------------------------------------------------------
+// Called by vtkMultiThreader for each thread.
+VTK_THREAD_RETURN_TYPE
+vtkImageSimilarityMetricThreadStruct::ThreadExecute(void *arg)
+{
+  vtkMultiThreader::ThreadInfo *ti =
+    static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  vtkImageSimilarityMetricThreadStruct *ts =
+    static_cast<vtkImageSimilarityMetricThreadStruct *>(ti->UserData);
+
+  ts->ExecutePiece(ti->ThreadID, ti->NumberOfThreads);
 
   return VTK_THREAD_RETURN_VALUE;
 }
 
+//----------------------------------------------------------------------------
+// Called by vtkWorkerThreadPool for each thread.
+void vtkImageSimilarityMetricThreadStruct::PoolExecute(
+  void *arg, int threadId, int numberOfThreads)
+{
+  vtkImageSimilarityMetricThreadStruct *ts =
+    static_cast<vtkImageSimilarityMetricThreadStruct *>(arg);
+
+  ts->ExecutePiece(threadId, numberOfThreads);
+}
+
 //----------------------------------------------------------------------------
 #ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
 // Functor for vtkSMPTools execution
@@ -227,8 +1065,20 @@ void vtkImageSimilarityMetricFunctor::operator()(
     {
     int splitExt[6] = { 0, -1, 0, -1, 0, -1 };
 
-    vtkIdType total = ts->Algorithm->SplitExtent(
-      splitExt, ts->Extent, piece, this->NumberOfPieces);
+    vtkIdType total = this->NumberOfPieces;
+    if (ts->Algorithm->SampleListActive)
+      {
+      // the samples are split instead of the extent
+      for (int i = 0; i < 6; i++)
+        {
+        splitExt[i] = ts->Extent[i];
+        }
+      }
+    else
+      {
+      total = ts->Algorithm->GetPieceExtent(
+        splitExt, ts->Extent, piece, this->NumberOfPieces);
+      }
 
     // check for valid piece and extent
     if (piece < total &&
@@ -236,8 +1086,20 @@ void vtkImageSimilarityMetricFunctor::operator()(
         splitExt[2] <= splitExt[3] &&
         splitExt[4] <= splitExt[5])
       {
+      double startTime = 0.0;
+      if (ts->ThreadSeconds)
+        {
+        startTime = vtkTimerLog::GetUniversalTime();
+        }
+
       ts->Algorithm->PieceRequestData(
         ts->Request, ts->InputsInfo, ts->OutputsInfo, splitExt, piece);
+
+      if (ts->ThreadSeconds)
+        {
+        ts->ThreadSeconds[piece] =
+          vtkTimerLog::GetUniversalTime() - startTime;
+        }
       }
     }
 }
@@ -249,7 +1111,18 @@ void vtkImageSimilarityMetricFunctor::Reduce()
     static_cast<vtkImageSimilarityMetric *>(this->PipelineInfo->Algorithm);
   vtkImageSimilarityMetricThreadStruct *ts = this->PipelineInfo;
 
+  double startTime = 0.0;
+  if (ts->ThreadSeconds)
+    {
+    startTime = vtkTimerLog::GetUniversalTime();
+    }
+
   self->ReduceRequestData(ts->Request, ts->InputsInfo, ts->OutputsInfo);
+
+  if (ts->ThreadSeconds)
+    {
+    self->ReduceSeconds = vtkTimerLog::GetUniversalTime() - startTime;
+    }
 }
 #endif
 
@@ -266,6 +1139,15 @@ int vtkImageSimilarityMetric::RequestData(
   ts.Request = request;
   ts.InputsInfo = inputVector;
   ts.OutputsInfo = outputVector;
+  ts.ThreadSeconds = NULL;
+
+  if (this->CollectProfile)
+    {
+    this->PieceSeconds = 0.0;
+    this->ReduceSeconds = 0.0;
+    this->NumberOfVoxels = 0;
+    this->ThreadUtilization = 0.0;
+    }
 
   vtkInformation *inInfo0 = inputVector[0]->GetInformationObject(0);
   vtkInformation *inInfo1 = inputVector[1]->GetInformationObject(0);
@@ -303,21 +1185,161 @@ int vtkImageSimilarityMetric::RequestData(
       }
     }
 
-  // Get the intersection of the input extents
-  int inExt1[6];
-  inData0->GetExtent(ts.Extent);
-  inData1->GetExtent(inExt1);
+  vtkAbstractImageInterpolator *interpolator = this->Interpolator;
 
-  for (int i = 0; i < 6; i += 2)
+  if (interpolator)
     {
-    int j = i + 1;
-    ts.Extent[i] = ((ts.Extent[i] > inExt1[i]) ? ts.Extent[i] : inExt1[i]);
-    ts.Extent[j] = ((ts.Extent[j] < inExt1[j]) ? ts.Extent[j] : inExt1[j]);
-    if (ts.Extent[i] > ts.Extent[j])
+    // the second input will be interpolated at the voxels of the first
+    // input, so only the extent of the first input is used
+    inData0->GetExtent(ts.Extent);
+
+    // when prepared, the interpolator is already initialized
+    if (!this->Evaluating)
+      {
+      interpolator->Initialize(inData1);
+      }
+    if (interpolator->GetNumberOfComponents() != 1)
       {
-      // no overlap, nothing to do!
+      vtkErrorMacro("The interpolator must provide a single component.");
+      if (!this->Prepared)
+        {
+        interpolator->ReleaseData();
+        }
       return 1;
       }
+
+    this->ComputeIndexMatrix(inData0, inData1, this->IndexMatrix);
+    }
+  else
+    {
+    // Get the intersection of the input extents
+    int inExt1[6];
+    inData0->GetExtent(ts.Extent);
+    inData1->GetExtent(inExt1);
+
+    for (int i = 0; i < 6; i += 2)
+      {
+      int j = i + 1;
+      ts.Extent[i] = ((ts.Extent[i] > inExt1[i]) ? ts.Extent[i] : inExt1[i]);
+      ts.Extent[j] = ((ts.Extent[j] < inExt1[j]) ? ts.Extent[j] : inExt1[j]);
+      if (ts.Extent[i] > ts.Extent[j])
+        {
+        // no overlap, nothing to do!
+        return 1;
+        }
+      }
+    }
+
+  // the sample list is only used when evaluating with an interpolator
+  int numberOfThreads = this->GetNumberOfExecutionThreads();
+  this->SampleListActive =
+    (this->Evaluating && interpolator != NULL && this->SampleList != NULL);
+  this->NumberOfSamplePieces = numberOfThreads;
+
+  // the line is only used by the fused loops over the extent
+  this->LineActive =
+    (this->LineEvaluating && interpolator != NULL && this->Line != NULL &&
+     !this->SampleListActive);
+  for (int i = 0; i < 6 && this->LineActive; i++)
+    {
+    this->LineActive = (this->Line->Extent[i] == ts.Extent[i]);
+    }
+
+  // for the cost ceiling, count the voxels in the stencil for each slice,
+  // so that the running total of the cost can be bounded
+  this->UseCostCeiling =
+    (this->SupportsCostCeiling && this->CostCeiling < VTK_DOUBLE_MAX &&
+     !this->SampleListActive);
+  this->Abandoned = false;
+  this->NumberOfSkippedVoxels = 0;
+
+  // the slice counts are also used to balance the pieces, and to report
+  // the number of voxels in each piece
+  bool balance = (this->BalancedSplit && !this->SampleListActive);
+  if (this->UseCostCeiling || balance ||
+      (this->CollectProfile && !this->SampleListActive))
+    {
+    this->ComputeSliceCounts(ts.Extent);
+    }
+
+  if (this->UseCostCeiling)
+    {
+    this->MaximumCount = this->SliceCountsTotal;
+    for (int i = 0; i < 6; i++)
+      {
+      this->CeilingExtent[i] = ts.Extent[i];
+      }
+    this->PartialCost = 0.0;
+    this->VisitedCount = 0;
+    }
+
+  int splitTotal = this->SplitPieces(ts.Extent, inData0, balance);
+
+  // the profile uses one slot per piece, which is only reallocated
+  // if the number of pieces increases
+  int numberOfSlots =
+    (numberOfThreads > this->NumberOfPieces ?
+     numberOfThreads : this->NumberOfPieces);
+  double startTime = 0.0;
+  if (this->CollectProfile)
+    {
+    if (this->ThreadSecondsSize < numberOfSlots)
+      {
+      delete [] this->ThreadSeconds;
+      this->ThreadSeconds = new double[numberOfSlots];
+      this->ThreadSecondsSize = numberOfSlots;
+      this->NumberOfAllocations++;
+      }
+    for (int i = 0; i < numberOfSlots; i++)
+      {
+      this->ThreadSeconds[i] = 0.0;
+      }
+    ts.ThreadSeconds = this->ThreadSeconds;
+
+    // the number of voxels within the stencil for each piece, and for
+    // all of the pieces together
+    if (this->PieceVoxelsSize < this->NumberOfPieces)
+      {
+      delete [] this->PieceVoxels;
+      this->PieceVoxels = new vtkIdType[this->NumberOfPieces];
+      this->PieceVoxelsSize = this->NumberOfPieces;
+      this->NumberOfAllocations++;
+      }
+    this->NumberOfVoxels = 0;
+    for (int piece = 0; piece < this->NumberOfPieces; piece++)
+      {
+      vtkIdType count = 0;
+      if (this->SampleListActive)
+        {
+        vtkIdType range[2];
+        this->GetSampleRange(piece, range);
+        count = range[1] - range[0];
+        }
+      else
+        {
+        int splitExt[6];
+        this->GetPieceExtent(splitExt, ts.Extent, piece, splitTotal);
+        if (splitExt[0] == ts.Extent[0] && splitExt[1] == ts.Extent[1] &&
+            splitExt[2] == ts.Extent[2] && splitExt[3] == ts.Extent[3])
+          {
+          // whole slices, so the slice counts can be used
+          for (int idZ = splitExt[4]; idZ <= splitExt[5]; idZ++)
+            {
+            count += this->SliceCounts[idZ - ts.Extent[4]];
+            }
+          }
+        else if (splitExt[0] <= splitExt[1] &&
+                 splitExt[2] <= splitExt[3] &&
+                 splitExt[4] <= splitExt[5])
+          {
+          count = this->CountStencilVoxels(splitExt);
+          }
+        }
+      this->PieceVoxels[piece] = count;
+      this->NumberOfVoxels += count;
+      }
+
+    startTime = vtkTimerLog::GetUniversalTime();
     }
 
 #ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
@@ -325,34 +1347,235 @@ int vtkImageSimilarityMetric::RequestData(
     {
     // code for vtkSMPTools
 
-    // do a dummy execution of SplitExtent to compute the number of pieces
-    vtkIdType pieces = this->SplitExtent(
-      0, ts.Extent, 0, this->NumberOfThreads);
-
     // create the functor
-    vtkImageSimilarityMetricFunctor functor(&ts, pieces);
+    vtkIdType pieces = this->NumberOfPieces;
+    vtkImageSimilarityMetricFunctor functor(&ts, splitTotal);
 
+    // with a balanced split, each piece is a separate task
     bool debug = this->Debug;
     this->Debug = false;
-    vtkSMPTools::For(0, pieces, functor);
+    if (this->BalancedSplitActive)
+      {
+      vtkSMPTools::For(0, pieces, 1, functor);
+      }
+    else
+      {
+      vtkSMPTools::For(0, pieces, functor);
+      }
     this->Debug = debug;
     }
   else
 #endif
     {
-    // code for vtkMultiThreader
-    this->Threader->SetNumberOfThreads(this->NumberOfThreads);
-    this->Threader->SetSingleMethod(
-      vtkImageSimilarityMetricThreadStruct::ThreadExecute, &ts);
-
     // always shut off debugging to avoid threading problems with GetMacros
     int debug = this->Debug;
     this->Debug = 0;
-    this->Threader->SingleMethodExecute();
+
+    if (this->ThreadPool)
+      {
+      // code for vtkWorkerThreadPool, the threads are reused
+      this->ThreadPool->Execute(
+        vtkImageSimilarityMetricThreadStruct::PoolExecute, &ts);
+      }
+    else
+      {
+      // code for vtkMultiThreader
+      this->Threader->SetNumberOfThreads(this->NumberOfThreads);
+      this->Threader->SetSingleMethod(
+        vtkImageSimilarityMetricThreadStruct::ThreadExecute, &ts);
+      this->Threader->SingleMethodExecute();
+      }
+
     this->Debug = debug;
 
+    double reduceTime = 0.0;
+    if (this->CollectProfile)
+      {
+      reduceTime = vtkTimerLog::GetUniversalTime();
+      }
+
     this->ReduceRequestData(request, inputVector, outputVector);
+
+    if (this->CollectProfile)
+      {
+      this->ReduceSeconds = vtkTimerLog::GetUniversalTime() - reduceTime;
+      }
+    }
+
+  if (this->Abandoned)
+    {
+    this->NumberOfSkippedVoxels = this->MaximumCount - this->VisitedCount;
+    }
+
+  if (this->CollectProfile)
+    {
+    // the time for the pieces excludes the reduction
+    double elapsed = vtkTimerLog::GetUniversalTime() - startTime;
+    this->PieceSeconds = elapsed - this->ReduceSeconds;
+    double busy = 0.0;
+    for (int i = 0; i < numberOfSlots; i++)
+      {
+      busy += this->ThreadSeconds[i];
+      }
+    this->ThreadUtilization = 0.0;
+    if (this->PieceSeconds > 0.0 && numberOfThreads > 0)
+      {
+      this->ThreadUtilization =
+        busy/(this->PieceSeconds*numberOfThreads);
+      }
+    }
+
+  if (interpolator && !this->Prepared)
+    {
+    interpolator->ReleaseData();
+    }
+
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSimilarityMetric::Modified()
+{
+  this->SliceCountsCached = false;
+
+  if (this->Prepared)
+    {
+    this->Prepared = false;
+    this->PreparedInputs = NULL;
+    this->PreparedOutputs = NULL;
+    this->PreparedStencil = NULL;
+    if (this->Interpolator)
+      {
+      this->Interpolator->ReleaseData();
+      }
+    }
+
+  if (this->Line)
+    {
+    this->Line->UnRegister();
+    this->Line = NULL;
+    this->LineShared = false;
+    }
+
+  this->Superclass::Modified();
+}
+
+//----------------------------------------------------------------------------
+int vtkImageSimilarityMetric::Prepare()
+{
+  this->Modified();
+
+  // execute once through the pipeline, to update the inputs
+  this->Update();
+
+  vtkExecutive *executive = this->GetExecutive();
+  vtkImageData *inData1 = vtkImageData::SafeDownCast(
+    executive->GetInputData(1, 0));
+  if (this->GetNumberOfInputConnections(0) < 1 || inData1 == NULL)
+    {
+    vtkErrorMacro("Prepare: The inputs have not been set.");
+    return 0;
+    }
+
+  this->PreparedStencil = this->GetStencil();
+  this->PreparedInputs = executive->GetInputInformation();
+  this->PreparedOutputs = executive->GetOutputInformation();
+
+  if (this->EvaluateRequest == NULL)
+    {
+    this->EvaluateRequest = vtkInformation::New();
+    this->EvaluateRequest->Set(vtkDemandDrivenPipeline::REQUEST_DATA());
+    }
+
+  if (this->Interpolator)
+    {
+    this->Interpolator->Initialize(inData1);
+    }
+
+  // compile the stencil into a list of samples, unless a shared list
+  // for the same extent is available
+  if (this->UseSampleList && this->SupportsSampleList && this->Interpolator)
+    {
+    vtkImageData *inData0 = vtkImageData::SafeDownCast(
+      executive->GetInputData(0, 0));
+    int extent[6];
+    inData0->GetExtent(extent);
+    bool reuse = (this->SampleList && this->SampleListShared);
+    for (int i = 0; i < 6 && reuse; i++)
+      {
+      reuse = (this->SampleList->Extent[i] == extent[i]);
+      }
+    if (!reuse)
+      {
+      if (this->SampleList)
+        {
+        this->SampleList->UnRegister();
+        }
+      this->SampleList = new vtkImageSimilarityMetricSampleList;
+      this->SampleListShared = false;
+      void *inPtr = inData0->GetScalarPointerForExtent(extent);
+      switch (inData0->GetScalarType())
+        {
+        vtkTemplateAliasMacro(
+          vtkImageSimilarityMetricBuildSamples(
+            this->SampleList, inData0, static_cast<VTK_TT *>(inPtr),
+            this->PreparedStencil, extent));
+        default:
+          vtkErrorMacro("Prepare: Unknown ScalarType");
+        }
+      }
+    }
+  else if (this->SampleList)
+    {
+    this->SampleList->UnRegister();
+    this->SampleList = NULL;
+    this->SampleListShared = false;
     }
 
+  this->Prepared = true;
+
   return 1;
+}
+
+//----------------------------------------------------------------------------
+double vtkImageSimilarityMetric::Evaluate(const double matrix[16])
+{
+  if (!this->Prepared)
+    {
+    vtkErrorMacro("Evaluate: Prepare() must be called first.");
+    return VTK_DOUBLE_MAX;
+    }
+
+  this->EvaluateMatrix = matrix;
+  this->Evaluating = true;
+
+  this->RequestData(
+    this->EvaluateRequest, this->PreparedInputs, this->PreparedOutputs);
+
+  this->Evaluating = false;
+  this->EvaluateMatrix = NULL;
+
+  return this->Cost;
+}
+
+//----------------------------------------------------------------------------
+double vtkImageSimilarityMetric::EvaluateLine(double t)
+{
+  if (this->Line == NULL)
+    {
+    vtkErrorMacro("EvaluateLine: SetLine() must be called first.");
+    return VTK_DOUBLE_MAX;
+    }
+
+  for (int k = 0; k < 16; k++)
+    {
+    this->LineMatrix[k] = this->Line->Matrix[k] + t*this->Line->Delta[k];
+    }
+
+  this->LineStep = t;
+  this->LineEvaluating = true;
+  double cost = this->Evaluate(this->LineMatrix);
+  this->LineEvaluating = false;
+
+  return cost;
 }
\ No newline at end of file
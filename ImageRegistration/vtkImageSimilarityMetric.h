@@ -30,8 +30,14 @@
 #include "vtkThreadedImageAlgorithm.h"
 
 class vtkImageStencilData;
+class vtkAbstractImageInterpolator;
+class vtkLinearTransform;
+class vtkWorkerThreadPool;
 class vtkImageSimilarityMetricThreadData;
 class vtkImageSimilarityMetricSMPThreadLocal;
+class vtkImageSimilarityMetricSampleList;
+class vtkImageSimilarityMetricLine;
+class vtkSimpleMutexLock;
 
 class VTK_EXPORT vtkImageSimilarityMetric : public vtkThreadedImageAlgorithm
 {
@@ -65,6 +71,229 @@ public:
   void GetInputRange(int idx, double range[2]);
   //@}
 
+  //@{
+  //! Set an interpolator to fuse the resampling with the metric.
+  /*!
+   *  By default, the second input must already have been resampled onto
+   *  the voxels of the first input, for example with vtkImageReslice.
+   *  If an interpolator is set, then the second input is used as-is and
+   *  the metric interpolates it at the transformed position of each voxel
+   *  of the first input, so that no resampled image is ever generated.
+   *  Voxels that transform to positions outside of the bounds of the
+   *  second input do not contribute to the metric.
+   */
+  void SetInterpolator(vtkAbstractImageInterpolator *interpolator);
+  vtkAbstractImageInterpolator *GetInterpolator() {
+    return this->Interpolator; }
+
+  //! Set the transform from the first input to the second input.
+  /*!
+   *  This is only used if an interpolator has been set.  It maps the
+   *  data coordinates of the first input to the data coordinates of the
+   *  second input, in the same way as vtkImageReslice::SetResliceTransform().
+   */
+  void SetTransform(vtkLinearTransform *transform);
+  vtkLinearTransform *GetTransform() { return this->Transform; }
+  //@}
+
+  //@{
+  //! Use single-precision arithmetic in the inner loops.
+  /*!
+   *  When this is on, metrics that support it accumulate each span of
+   *  voxels (or each block of voxels, when the target is interpolated
+   *  directly) in single precision, and only the sums over the spans and
+   *  over the threads are done in double precision.  This halves the
+   *  width of the arithmetic, which is faster for float images, at some
+   *  cost in accuracy.  Metrics that do not support it ignore it.  The
+   *  default is off.
+   */
+  vtkSetMacro(SinglePrecision, bool);
+  vtkGetMacro(SinglePrecision, bool);
+  vtkBooleanMacro(SinglePrecision, bool);
+  //@}
+
+  //! Use a persistent pool of threads instead of vtkMultiThreader.
+  /*!
+   *  When EnableSMP is off, the metric normally uses vtkMultiThreader,
+   *  which creates and joins new threads every time the metric executes.
+   *  If a thread pool is set, its threads are reused instead, which is
+   *  much faster when the metric is evaluated repeatedly on small images.
+   *  The same pool can be shared by several metrics.  The number of
+   *  threads of the pool is used instead of NumberOfThreads, so that
+   *  the owner of the pool can change it between executions.
+   */
+  void SetThreadPool(vtkWorkerThreadPool *pool);
+  vtkWorkerThreadPool *GetThreadPool() { return this->ThreadPool; }
+
+  //! Get the number of threads that the metric will execute with.
+  /*!
+   *  This is the size of the thread pool if one is set, otherwise it is
+   *  NumberOfThreads.
+   */
+  int GetNumberOfExecutionThreads();
+
+  //@{
+  //! Bind the inputs for repeated, low-latency calls to Evaluate().
+  /*!
+   *  This updates the metric through the pipeline once, and then keeps
+   *  the inputs, the stencil, and the initialized interpolator so that
+   *  Evaluate() can execute the metric directly, without going through
+   *  the pipeline.  Any call to Modified(), including any change to the
+   *  inputs or to the settings of the metric, releases the bindings and
+   *  Prepare() must be called again.  Returns zero on failure.
+   */
+  int Prepare();
+  bool IsPrepared() { return this->Prepared; }
+
+  //! Evaluate the metric directly, and return the cost.
+  /*!
+   *  The matrix maps the data coordinates of the first input to the data
+   *  coordinates of the second input, and is used instead of the Transform.
+   *  It is only used if an interpolator has been set: otherwise, the caller
+   *  is responsible for updating the second input (e.g. by updating the
+   *  vtkImageReslice that produces it) before calling this method.  If the
+   *  matrix is NULL, then the Transform is used.
+   */
+  double Evaluate(const double matrix[16]);
+  //@}
+
+  //@{
+  //! Set up a line search, for use with EvaluateLine().
+  /*!
+   *  The line is the set of transform matrices M + t*D for a varying
+   *  step t, where M and D are the given matrix and delta.  Since the
+   *  index matrix is then linear in t, the transformed position of the
+   *  first voxel of each row of the first input is stored along with its
+   *  derivative with respect to t, so that each evaluation along the
+   *  line only needs one multiply-add per coordinate per row to find the
+   *  row positions.  The metric must be prepared with an interpolator.
+   *  The line costs 48 bytes per row, and it is released by Modified().
+   *  Returns zero on failure.
+   */
+  int SetLine(const double matrix[16], const double delta[16]);
+
+  //! Check whether a line has been set up.
+  bool HasLine() { return (this->Line != NULL); }
+
+  //! Evaluate the metric at a step along the line, and return the cost.
+  /*!
+   *  This gives the same cost as Evaluate() with the matrix M + t*D.
+   *  If the sample list is used, or if no line has been set up for the
+   *  current first input, the row positions are computed as usual.
+   */
+  double EvaluateLine(double t);
+
+  //! Share the line of another metric.
+  /*!
+   *  The other metric must have the same first input, and its line must
+   *  already have been set up.  This metric will then see the same line,
+   *  including any later changes to it by SetLine() on the other metric.
+   */
+  void ShareLine(vtkImageSimilarityMetric *metric);
+  //@}
+
+  //@{
+  //! Iterate over a compacted list of samples instead of the stencil.
+  /*!
+   *  When this is on and an interpolator has been set, Prepare() compiles
+   *  the voxels of the first input that lie within the stencil into
+   *  contiguous arrays of coordinates, offsets and values, and Evaluate()
+   *  iterates linearly over these arrays, with the threads splitting the
+   *  samples evenly instead of splitting the extent.  This avoids walking
+   *  the stencil spans for every evaluation, which is costly for masks
+   *  that have many short spans, at a cost of 28 bytes per sample.  When
+   *  the list is used, the CostCeiling is ignored.  Metrics that do not
+   *  support it ignore it.  The default is off.
+   */
+  vtkSetMacro(UseSampleList, bool);
+  vtkGetMacro(UseSampleList, bool);
+  vtkBooleanMacro(UseSampleList, bool);
+
+  //! Share the sample list of another metric.
+  /*!
+   *  The other metric must have the same first input and stencil, and it
+   *  must already have been prepared.  This metric will then use the same
+   *  list instead of building its own, for as long as the extent of its
+   *  first input matches.  This saves memory when several metrics compare
+   *  the same source image concurrently.
+   */
+  void ShareSampleList(vtkImageSimilarityMetric *metric);
+
+  //! Get the number of samples in the sample list, or zero if none.
+  vtkIdType GetNumberOfSamples();
+  //@}
+
+  //@{
+  //! Split the work between the threads according to the stencil.
+  /*!
+   *  By default, the extent is split into slabs of equal thickness,
+   *  without regard for the stencil, so with a mask or with a rotated
+   *  overlap some threads get nearly empty slabs while others get the
+   *  dense middle.  When this is on, the voxels within the stencil are
+   *  counted for each slice, and the slabs are chosen so that each holds
+   *  the same number of voxels.  The counts are kept while the metric
+   *  is prepared with an interpolator, since the stencil cannot change.
+   *  With vtkSMPTools, the extent is split into several slabs per thread,
+   *  so that threads that finish early can take more work.  This has no
+   *  effect when the sample list is used, since the samples are already
+   *  split evenly, or when there are fewer slices than pieces.  The
+   *  default is off.
+   */
+  vtkSetMacro(BalancedSplit, bool);
+  vtkGetMacro(BalancedSplit, bool);
+  vtkBooleanMacro(BalancedSplit, bool);
+  //@}
+
+  //@{
+  //! Keep each thread's accumulation buffers local to that thread.
+  /*!
+   *  By default, the histograms and partial sums are handed out to the
+   *  threads in the order that the threads ask for them, so a buffer
+   *  that was first touched by a thread on one NUMA node might be used
+   *  by a thread on another node for the next execution.  When this is
+   *  on and a ThreadPool with pinned threads is used, each thread always
+   *  gets the buffer that it allocated itself, so that the buffer stays
+   *  in that thread's local memory.  It has no effect with vtkSMPTools.
+   *  The default is off.
+   */
+  vtkSetMacro(NodeLocalAccumulators, bool);
+  vtkGetMacro(NodeLocalAccumulators, bool);
+  vtkBooleanMacro(NodeLocalAccumulators, bool);
+  //@}
+
+  //! Get the voxels of the first input that a piece starts with.
+  /*!
+   *  This gives the point ids of the first input from the first voxel of
+   *  the piece up to the first voxel of the next piece, as the extent or
+   *  the sample list was split for the last execution.  The ranges of all
+   *  the pieces cover the first input without any overlap, so they can be
+   *  used to copy the input into memory that is local to the thread that
+   *  executes each piece.  Returns the number of pieces, or zero if the
+   *  metric has not executed.
+   */
+  int GetPieceVoxelRange(int piece, vtkIdType range[2]);
+
+  //! Split the first input into pieces without executing the metric.
+  /*!
+   *  This computes the split that Evaluate() would use, so that it can
+   *  be reported by GetPieceVoxelRange() before the metric has executed.
+   *  If the sample list would be used, the voxels within the stencil are
+   *  split evenly instead, which matches the split of the samples to
+   *  within a slice.  The inputs must already be up to date, since they
+   *  are not updated through the pipeline.  Returns the number of pieces.
+   */
+  int ComputePieceSplit();
+
+  //! Release the bindings that were made by Prepare().
+  void Modified();
+
+  //! Include the interpolator and the transform in the MTime.
+#ifdef VTK_HAS_MTIME_TYPE
+  vtkMTimeType GetMTime();
+#else
+  unsigned long GetMTime();
+#endif
+
   //@{
   //! Get the metric value.
   /*!
@@ -83,6 +312,97 @@ public:
   double GetCost() { return this->Cost; }
   //@}
 
+  //! Get the number of allocations of working memory by the metric.
+  /*!
+   *  Metrics keep their thread-local data, and any histograms or partial
+   *  sums, between executions, so after the first execution this count
+   *  should stop increasing unless the number of bins or threads changes.
+   *  This is meant for tests that check the evaluation loop for heap use.
+   */
+  virtual vtkTypeUInt64 GetNumberOfAllocations() {
+    return this->NumberOfAllocations; }
+
+  //@{
+  //! Measure the time spent in each stage of every execution.
+  /*!
+   *  When this is on, each execution of the metric records the wall time
+   *  for the threaded execution of the pieces and for the reduction, the
+   *  number of voxels that were split among the threads, and the thread
+   *  utilization.  Changing this setting does not release the bindings
+   *  that were made by Prepare().  The default is off.
+   */
+  void SetCollectProfile(bool val) { this->CollectProfile = val; }
+  bool GetCollectProfile() { return this->CollectProfile; }
+  void CollectProfileOn() { this->CollectProfile = true; }
+  void CollectProfileOff() { this->CollectProfile = false; }
+
+  //! Get the wall time for executing the pieces, for the last execution.
+  double GetPieceSeconds() { return this->PieceSeconds; }
+
+  //! Get the wall time for the reduction, for the last execution.
+  double GetReduceSeconds() { return this->ReduceSeconds; }
+
+  //! Get the number of voxels that were split among the threads.
+  /*!
+   *  This is the number of voxels within the stencil, or the number of
+   *  samples if the sample list was used, summed over the pieces.  It
+   *  is only set if CollectProfile is on.
+   */
+  vtkIdType GetNumberOfVoxels() { return this->NumberOfVoxels; }
+
+  //! Get the thread utilization for the last execution.
+  /*!
+   *  This is the sum of the times that the threads spent executing their
+   *  pieces, divided by the wall time multiplied by the number of threads.
+   *  A value well below one means that the threads were mostly waiting,
+   *  either because the pieces were unbalanced or because the overhead
+   *  of starting the threads was large compared to the work.
+   */
+  double GetThreadUtilization() { return this->ThreadUtilization; }
+
+  //! Get the number of pieces that the work was split into.
+  /*!
+   *  With vtkMultiThreader or a thread pool, each thread executes one
+   *  piece.  With vtkSMPTools, the threads take pieces as they finish.
+   */
+  int GetNumberOfPieces() { return this->NumberOfPieces; }
+
+  //! Get the number of voxels within the stencil for each piece.
+  /*!
+   *  For the sample list, this is the number of samples for the piece.
+   *  Comparing these counts shows how well the work was balanced.
+   */
+  vtkIdType GetPieceNumberOfVoxels(int piece);
+  //@}
+
+  //@{
+  //! Set a ceiling on the cost, above which the evaluation can stop early.
+  /*!
+   *  When a metric supports it, the threads keep a shared running total
+   *  of the cost and the evaluation is abandoned as soon as the total
+   *  proves that the cost will exceed the ceiling.  The voxels are then
+   *  visited one slice at a time in an interleaved order, so that the
+   *  running total is representative of the whole image.  An abandoned
+   *  evaluation reports a lower bound on the cost, which is greater than
+   *  the ceiling, rather than the cost itself.  Changing the ceiling does
+   *  not release the bindings that were made by Prepare().  The default
+   *  is VTK_DOUBLE_MAX, which means that there is no ceiling.  Metrics
+   *  that do not support it ignore it.
+   */
+  void SetCostCeiling(double val) { this->CostCeiling = val; }
+  double GetCostCeiling() { return this->CostCeiling; }
+
+  //! Check whether the last evaluation was abandoned.
+  bool GetAbandoned() { return this->Abandoned; }
+
+  //! Get the number of voxels skipped by the last evaluation.
+  /*!
+   *  This is the number of voxels in the stencil that were not visited
+   *  because the evaluation was abandoned, and it is zero otherwise.
+   */
+  vtkIdType GetNumberOfSkippedVoxels() { return this->NumberOfSkippedVoxels; }
+  //@}
+
 protected:
   vtkImageSimilarityMetric();
   ~vtkImageSimilarityMetric();
@@ -132,8 +452,189 @@ protected:
 
   //! Subclasses call this to set the value to be minimized.
   void SetCost(double x) { this->Cost = x; }
+
+  //! Compute the matrix from the first input to the second input.
+  /*!
+   *  The matrix maps the structured coordinates (i.e. the voxel indices)
+   *  of the first input to the structured coordinates of the second input.
+   *  It is computed by RequestData() if an interpolator has been set.
+   */
+  void ComputeIndexMatrix(vtkImageData *inData0, vtkImageData *inData1,
+                          double matrix[16]);
+
+  //! Check whether the pieces should be executed against the ceiling.
+  /*!
+   *  This is only true for metrics that set SupportsCostCeiling in their
+   *  constructor, and only while a CostCeiling has been set.  The pieces
+   *  should then be executed one slice at a time, in the order given by
+   *  GetInterleavedSlice(), with a call to AddSliceCost() after each.
+   */
+  bool GetUseCostCeiling() { return this->UseCostCeiling; }
+
+  //! Get the z index of the nth slice to visit within the extent.
+  /*!
+   *  The slices are visited in strides, so that the first few slices
+   *  that are visited are spread out over the whole extent.
+   */
+  static int GetInterleavedSlice(const int extent[6], int n);
+
+  //! Add the cost of one slice to the shared running total.
+  /*!
+   *  This is for metrics whose cost is the mean, over the voxels in the
+   *  stencil, of a non-negative per-voxel cost.  The sum over the voxels
+   *  of the slice is added to the running total, and if the total proves
+   *  that the mean will exceed the CostCeiling, then the evaluation is
+   *  marked as abandoned.  It is thread safe, and returns true if the
+   *  caller should stop.  When the evaluation has been abandoned, the
+   *  metric should divide its sum by GetMaximumCount() to compute a lower
+   *  bound on the cost, instead of dividing by the number of voxels.
+   */
+  bool AddSliceCost(int idZ, double sum);
+
+  //! Get the number of voxels in the stencil, when using the ceiling.
+  vtkIdType GetMaximumCount() { return this->MaximumCount; }
+
+  //! Count the voxels within the stencil for each slice of the extent.
+  /*!
+   *  The counts are stored in SliceCounts, and their sum is stored in
+   *  SliceCountsTotal.  While the metric is prepared with an interpolator
+   *  the counts are kept, and they are only recomputed if the extent
+   *  changes.
+   */
+  void ComputeSliceCounts(const int extent[6]);
+
+  //! Count the voxels within the stencil for the given extent.
+  vtkIdType CountStencilVoxels(const int extent[6]);
+
+  //! Split the extent into slabs that have equal numbers of voxels.
+  /*!
+   *  This requires the SliceCounts for the extent.  The first slice of
+   *  each slab is stored in SplitSlices.  Returns false if the extent
+   *  cannot be split into the requested number of slabs.
+   */
+  bool ComputeBalancedSplit(const int extent[6], int pieces);
+
+  //! Split the extent into pieces, and keep the split.
+  /*!
+   *  This sets NumberOfPieces, and keeps the split so that it can be
+   *  reported by GetPieceVoxelRange().  If "balance" is set, then the
+   *  SliceCounts for the extent are used to balance the pieces.  It
+   *  returns the total that is to be given to GetPieceExtent().
+   */
+  int SplitPieces(const int extent[6], vtkImageData *inData0, bool balance);
+
+  //! Get the extent of a piece, like SplitExtent().
+  /*!
+   *  This uses the balanced split if one was computed for the current
+   *  execution, otherwise it calls SplitExtent().  It returns the total
+   *  number of pieces.
+   */
+  int GetPieceExtent(int splitExt[6], int extent[6], int piece, int total);
+
+  //! Get the point id of the first voxel of a piece of the first input.
+  vtkIdType GetPieceStartVoxel(int piece);
+
+  //! Get the arena slot for the accumulators of a piece.
+  /*!
+   *  This is the thread of the ThreadPool that executes the piece, if
+   *  NodeLocalAccumulators is on, or -1 if the buffers are to be handed
+   *  out in whatever order the threads request them.
+   */
+  int GetAccumulatorSlot(vtkIdType pieceId);
+
+  //! Get the sample list, if it is used for the current execution.
+  /*!
+   *  This is only non-NULL for metrics that set SupportsSampleList in
+   *  their constructor, during Evaluate(), if UseSampleList is on.  Each
+   *  piece is then given the whole extent, and the metric should iterate
+   *  over the samples given by GetSampleRange() instead of the extent.
+   */
+  vtkImageSimilarityMetricSampleList *GetSampleList() {
+    return (this->SampleListActive ? this->SampleList : NULL); }
+
+  //! Get the range of samples to use for the given piece.
+  void GetSampleRange(vtkIdType piece, vtkIdType range[2]);
+
+  //! Get the line, if it is used for the current execution.
+  /*!
+   *  This is only non-NULL during EvaluateLine(), if the sample list is
+   *  not used.  The fused loops should then take the positions of the
+   *  rows from the line at GetLineStep(), see SetLine().
+   */
+  const vtkImageSimilarityMetricLine *GetLine() {
+    return (this->LineActive ? this->Line : NULL); }
+
+  //! Get the step along the line for the current execution.
+  double GetLineStep() { return this->LineStep; }
   //@}
 
+  vtkAbstractImageInterpolator *Interpolator;
+  vtkLinearTransform *Transform;
+  vtkWorkerThreadPool *ThreadPool;
+  double IndexMatrix[16];
+  bool SinglePrecision;
+
+  bool Prepared;
+  bool Evaluating;
+  const double *EvaluateMatrix;
+  vtkInformation *EvaluateRequest;
+  vtkInformationVector **PreparedInputs;
+  vtkInformationVector *PreparedOutputs;
+  vtkImageStencilData *PreparedStencil;
+
+  bool CollectProfile;
+  double PieceSeconds;
+  double ReduceSeconds;
+  vtkIdType NumberOfVoxels;
+  double ThreadUtilization;
+  double *ThreadSeconds;
+  int ThreadSecondsSize;
+
+  bool SupportsCostCeiling;
+  bool UseCostCeiling;
+  bool Abandoned;
+  double CostCeiling;
+  double PartialCost;
+  int CeilingExtent[6];
+  vtkIdType MaximumCount;
+  vtkIdType VisitedCount;
+  vtkIdType NumberOfSkippedVoxels;
+  vtkIdType *SliceCounts;
+  int SliceCountsSize;
+  vtkIdType SliceCountsTotal;
+  int SliceCountsExtent[6];
+  bool SliceCountsCached;
+  vtkSimpleMutexLock *CeilingLock;
+
+  vtkTypeUInt64 NumberOfAllocations;
+
+  bool BalancedSplit;
+  bool BalancedSplitActive;
+  int *SplitSlices;
+  int SplitSlicesSize;
+  int NumberOfPieces;
+  int PieceSplitTotal;
+  int PieceSplitExtent[6];
+  int PieceInputExtent[6];
+  vtkIdType *PieceVoxels;
+  int PieceVoxelsSize;
+
+  bool NodeLocalAccumulators;
+
+  bool SupportsSampleList;
+  bool UseSampleList;
+  bool SampleListActive;
+  bool SampleListShared;
+  vtkIdType NumberOfSamplePieces;
+  vtkImageSimilarityMetricSampleList *SampleList;
+
+  bool LineEvaluating;
+  bool LineActive;
+  bool LineShared;
+  double LineStep;
+  double LineMatrix[16];
+  vtkImageSimilarityMetricLine *Line;
+
 private:
   vtkImageSimilarityMetric(const vtkImageSimilarityMetric&);
   void operator=(const vtkImageSimilarityMetric&);
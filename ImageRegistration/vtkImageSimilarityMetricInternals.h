@@ -21,6 +21,14 @@
 #define vtkImageSimilarityMetricInternals_h
 
 #include <vtkThreadedImageAlgorithm.h>
+#include <vtkAbstractImageInterpolator.h>
+#include <vtkImageData.h>
+#include <vtkImageStencilData.h>
+#include <vtkTypeTraits.h>
+#include <vtkMath.h>
+#include <vtkMutexLock.h>
+
+#include <vector>
 
 // Do the VTK version check to see if vtkSMPTools will be used
 #if VTK_MAJOR_VERSION > 7 || (VTK_MAJOR_VERSION == 7 && VTK_MINOR_VERSION >= 0)
@@ -100,14 +108,38 @@ public:
     delete [] this->MT;
     }
 
-  void Initialize(vtkImageSimilarityMetric *a)
+  // Reset the thread-local objects for a new execution.  The objects are
+  // kept between executions, and the return value is true only if they
+  // had to be reallocated because the number of threads changed.
+  bool Initialize(vtkImageSimilarityMetric *a)
     {
-    if (!a->GetEnableSMP())
+    if (a->GetEnableSMP())
       {
-      size_t n = a->GetNumberOfThreads();
-      this->MT = new T[n];
-      this->NumberOfThreads = n;
+      delete [] this->MT;
+      this->MT = 0;
+      this->NumberOfThreads = 0;
+      for (typename vtkSMPThreadLocal<T>::iterator iter = this->SMP.begin();
+           iter != this->SMP.end(); ++iter)
+        {
+        *iter = T();
+        }
+      return false;
       }
+
+    size_t n = a->GetNumberOfExecutionThreads();
+    if (this->MT && n == this->NumberOfThreads)
+      {
+      for (size_t i = 0; i < n; i++)
+        {
+        this->MT[i] = T();
+        }
+      return false;
+      }
+
+    delete [] this->MT;
+    this->MT = new T[n];
+    this->NumberOfThreads = n;
+    return true;
     }
 
   T& Local(size_t threadId)
@@ -174,11 +206,25 @@ public:
     delete [] this->MT;
     }
 
-  void Initialize(vtkImageSimilarityMetric *a)
+  // Reset the thread-local objects for a new execution.  The objects are
+  // kept between executions, and the return value is true only if they
+  // had to be reallocated because the number of threads changed.
+  bool Initialize(vtkImageSimilarityMetric *a)
     {
-    size_t n = a->GetNumberOfThreads();
+    size_t n = a->GetNumberOfExecutionThreads();
+    if (this->MT && n == this->NumberOfThreads)
+      {
+      for (size_t i = 0; i < n; i++)
+        {
+        this->MT[i] = T();
+        }
+      return false;
+      }
+
+    delete [] this->MT;
     this->MT = new T[n];
     this->NumberOfThreads = n;
+    return true;
     }
 
   T& Local(size_t threadId)
@@ -206,4 +252,516 @@ private:
 
 #endif
 
+//----------------------------------------------------------------------------
+// A set of accumulation buffers that persist across executions of a metric,
+// so that histograms and partial sums do not have to be allocated and
+// zeroed every time the metric is evaluated.  Each thread acquires one
+// buffer, and the buffers are guaranteed to be zero when acquired.  The
+// metric must zero each buffer as it reduces it (while the buffer is still
+// in cache), and then call ReleaseAll().  Each buffer is aligned to, and
+// padded to, a cache line to avoid false sharing between threads.
+template<class T>
+class vtkImageSimilarityMetricArena
+{
+public:
+  vtkImageSimilarityMetricArena()
+    : BufferSize(0), NextBuffer(0), NumberOfAllocations(0) {}
+
+  ~vtkImageSimilarityMetricArena()
+    {
+    this->FreeAll();
+    }
+
+  // Set the number of elements per buffer.  If the size changes, then
+  // the existing buffers are freed.  Not thread safe.
+  void SetBufferSize(size_t n)
+    {
+    if (n != this->BufferSize)
+      {
+      this->FreeAll();
+      this->BufferSize = n;
+      }
+    }
+
+  size_t GetBufferSize() { return this->BufferSize; }
+
+  // Get a zeroed buffer, allocating it only if all existing buffers are
+  // in use.  This can be called concurrently from different threads.
+  // If a slot is given, then the buffer for that slot is returned, so
+  // that a pinned thread always gets the buffer that it allocated, and
+  // whose pages are therefore on that thread's NUMA node.
+  T *Acquire(int slot = -1)
+    {
+    this->Lock.Lock();
+    size_t i = (slot < 0 ? this->NextBuffer++ : static_cast<size_t>(slot));
+    if (i >= this->Buffers.size())
+      {
+      this->Buffers.resize(i + 1, static_cast<T *>(0));
+      }
+    T *buffer = this->Buffers[i];
+    this->Lock.Unlock();
+
+    if (buffer == 0)
+      {
+      // allocate (and first touch) the buffer from the calling thread
+      buffer = this->Allocate(this->BufferSize);
+      this->Lock.Lock();
+      this->Buffers[i] = buffer;
+      this->NumberOfAllocations++;
+      this->Lock.Unlock();
+      }
+
+    return buffer;
+    }
+
+  // Return all buffers to the arena, after they have been zeroed.
+  void ReleaseAll()
+    {
+    this->NextBuffer = 0;
+    }
+
+  // Get the number of buffer allocations since the arena was created.
+  vtkTypeUInt64 GetNumberOfAllocations()
+    {
+    return this->NumberOfAllocations;
+    }
+
+private:
+  vtkImageSimilarityMetricArena(const vtkImageSimilarityMetricArena&);
+  void operator=(const vtkImageSimilarityMetricArena&);
+
+  enum { CacheLineSize = 64 };
+
+  // Allocate a zeroed buffer, with the original block pointer stored
+  // just before the aligned data so that it can be freed
+  static T *Allocate(size_t n)
+    {
+    size_t bytes = n*sizeof(T);
+    bytes = (bytes + CacheLineSize - 1)/CacheLineSize*CacheLineSize;
+    char *block = new char[bytes + CacheLineSize + sizeof(char *)];
+    size_t address = reinterpret_cast<size_t>(block + sizeof(char *));
+    address = (address + CacheLineSize - 1)/CacheLineSize*CacheLineSize;
+    char *data = reinterpret_cast<char *>(address);
+    reinterpret_cast<char **>(data)[-1] = block;
+    T *buffer = reinterpret_cast<T *>(data);
+    for (size_t i = 0; i < n; i++)
+      {
+      buffer[i] = 0;
+      }
+    return buffer;
+    }
+
+  void FreeAll()
+    {
+    for (size_t i = 0; i < this->Buffers.size(); i++)
+      {
+      if (this->Buffers[i])
+        {
+        delete [] reinterpret_cast<char **>(this->Buffers[i])[-1];
+        }
+      }
+    this->Buffers.clear();
+    this->NextBuffer = 0;
+    }
+
+  std::vector<T *> Buffers;
+  size_t BufferSize;
+  size_t NextBuffer;
+  vtkTypeUInt64 NumberOfAllocations;
+  vtkSimpleMutexLock Lock;
+};
+
+//----------------------------------------------------------------------------
+// The transformed positions of the rows of the first input, for a line
+// search in which the transform matrix is M + t*D for a varying step t.
+// The index matrix is then linear in t, so for each row (y,z) the position
+// of the voxel at x index zero is a base position plus t times its
+// derivative, which are stored as six values per row.  The line is
+// reference counted so that several metrics with the same first input
+// can share it, but the counting is not thread safe.
+class vtkImageSimilarityMetricLine
+{
+public:
+  vtkImageSimilarityMetricLine()
+    : ReferenceCount(1)
+    {
+    for (int i = 0; i < 6; i++)
+      {
+      this->Extent[i] = 0;
+      }
+    for (int k = 0; k < 16; k++)
+      {
+      this->Matrix[k] = 0.0;
+      this->Delta[k] = 0.0;
+      }
+    }
+
+  void Register() { this->ReferenceCount++; }
+
+  void UnRegister()
+    {
+    if (--this->ReferenceCount == 0)
+      {
+      delete this;
+      }
+    }
+
+  // Get the base position and the derivative for the row
+  const double *GetRow(int idY, int idZ) const
+    {
+    vtkIdType rowId = (idZ - this->Extent[4]);
+    rowId = rowId*(this->Extent[3] - this->Extent[2] + 1) +
+            (idY - this->Extent[2]);
+    return &this->Rows[6*rowId];
+    }
+
+  int Extent[6];
+  double Matrix[16];
+  double Delta[16];
+  std::vector<double> Rows;
+
+private:
+  int ReferenceCount;
+};
+
+//----------------------------------------------------------------------------
+// Interpolate the second input at the transformed position of each voxel
+// of the first input that lies within the stencil, and call the functor
+// with the value of the first input and the interpolated value.  Voxels
+// that transform to a position outside the bounds of the second input are
+// skipped.  The "matrix" is the index matrix that was computed by the
+// metric, and "inPtr" must point to the first voxel of the extent.  If a
+// line is given, the row positions are taken from the line at the given
+// step instead of being computed from the matrix.
+template<class T, class F>
+void vtkImageSimilarityMetricFusedExecute(
+  vtkAlgorithm *progress, vtkImageData *inData, T *inPtr,
+  vtkImageStencilData *stencil, vtkAbstractImageInterpolator *interpolator,
+  const double matrix[16], const int extent[6], F& functor,
+  const vtkImageSimilarityMetricLine *line = NULL, double step = 0.0)
+{
+  vtkIdType inInc[3];
+  inData->GetIncrements(inInc);
+
+  // progress reporting variables
+  int progressGoal = (extent[3] - extent[2] + 1)*(extent[5] - extent[4] + 1);
+  int progressStep = (progressGoal + 49)/50;
+  int progressCount = 0;
+
+  for (int idZ = extent[4]; idZ <= extent[5]; idZ++)
+    {
+    T *inPtrY = inPtr;
+    for (int idY = extent[2]; idY <= extent[3]; idY++)
+      {
+      if (progress != NULL && (progressCount % progressStep) == 0)
+        {
+        progress->UpdateProgress(progressCount*1.0/progressGoal);
+        }
+      progressCount++;
+
+      // the transformed position of the voxel at x index zero
+      double rowPoint[3];
+      if (line)
+        {
+        const double *row = line->GetRow(idY, idZ);
+        rowPoint[0] = row[0] + step*row[3];
+        rowPoint[1] = row[1] + step*row[4];
+        rowPoint[2] = row[2] + step*row[5];
+        }
+      else
+        {
+        rowPoint[0] = matrix[1]*idY + matrix[2]*idZ + matrix[3];
+        rowPoint[1] = matrix[5]*idY + matrix[6]*idZ + matrix[7];
+        rowPoint[2] = matrix[9]*idY + matrix[10]*idZ + matrix[11];
+        }
+
+      // loop over stencil extents (break at end if no stencil)
+      int iter = 0;
+      int r1 = extent[0];
+      int r2 = extent[1];
+      do
+        {
+        if (stencil && stencil->GetNextExtent(
+              r1, r2, extent[0], extent[1], idY, idZ, iter) == 0)
+          {
+          break;
+          }
+
+        T *tmpPtr = inPtrY + (r1 - extent[0])*inInc[0];
+        for (int idX = r1; idX <= r2; idX++)
+          {
+          double point[3];
+          point[0] = rowPoint[0] + matrix[0]*idX;
+          point[1] = rowPoint[1] + matrix[4]*idX;
+          point[2] = rowPoint[2] + matrix[8]*idX;
+          if (interpolator->CheckBoundsIJK(point))
+            {
+            double y;
+            interpolator->InterpolateIJK(point, &y);
+            functor(static_cast<double>(*tmpPtr), y);
+            }
+          tmpPtr += inInc[0];
+          }
+        }
+      while (stencil);
+
+      inPtrY += inInc[1];
+      }
+    inPtr += inInc[2];
+    }
+}
+
+//----------------------------------------------------------------------------
+// A compacted list of the voxels of the first input that lie within the
+// stencil, stored as a structure of arrays: the structured coordinates of
+// each voxel, its offset from the first voxel of the extent, and its value.
+// Iterating over this list replaces the walk over the stencil spans.  The
+// list is reference counted so that several metrics with the same first
+// input and stencil can share it, but the counting is not thread safe.
+class vtkImageSimilarityMetricSampleList
+{
+public:
+  vtkImageSimilarityMetricSampleList()
+    : NumberOfSamples(0), ReferenceCount(1)
+    {
+    for (int i = 0; i < 6; i++)
+      {
+      this->Extent[i] = 0;
+      }
+    }
+
+  void Register() { this->ReferenceCount++; }
+
+  void UnRegister()
+    {
+    if (--this->ReferenceCount == 0)
+      {
+      delete this;
+      }
+    }
+
+  int Extent[6];
+  vtkIdType NumberOfSamples;
+  std::vector<float> X;
+  std::vector<float> Y;
+  std::vector<float> Z;
+  std::vector<vtkIdType> Offsets;
+  std::vector<double> Values;
+
+private:
+  int ReferenceCount;
+};
+
+//----------------------------------------------------------------------------
+// Build the sample list for the voxels of "inData" within the stencil and
+// the extent, where "inPtr" must point to the first voxel of the extent.
+template<class T>
+void vtkImageSimilarityMetricBuildSamples(
+  vtkImageSimilarityMetricSampleList *samples, vtkImageData *inData,
+  T *inPtr, vtkImageStencilData *stencil, const int extent[6])
+{
+  vtkIdType inInc[3];
+  inData->GetIncrements(inInc);
+
+  // count the samples first, so that the arrays are only allocated once
+  vtkIdType n = 0;
+  for (int pass = 0; pass < 2; pass++)
+    {
+    if (pass == 1)
+      {
+      samples->X.resize(n);
+      samples->Y.resize(n);
+      samples->Z.resize(n);
+      samples->Offsets.resize(n);
+      samples->Values.resize(n);
+      n = 0;
+      }
+
+    for (int idZ = extent[4]; idZ <= extent[5]; idZ++)
+      {
+      for (int idY = extent[2]; idY <= extent[3]; idY++)
+        {
+        vtkIdType rowOffset = (idZ - extent[4])*inInc[2] +
+                              (idY - extent[2])*inInc[1];
+        int iter = 0;
+        int r1 = extent[0];
+        int r2 = extent[1];
+        do
+          {
+          if (stencil && stencil->GetNextExtent(
+                r1, r2, extent[0], extent[1], idY, idZ, iter) == 0)
+            {
+            break;
+            }
+
+          if (pass == 0)
+            {
+            n += r2 - r1 + 1;
+            }
+          else
+            {
+            for (int idX = r1; idX <= r2; idX++)
+              {
+              vtkIdType offset = rowOffset + (idX - extent[0])*inInc[0];
+              samples->X[n] = static_cast<float>(idX);
+              samples->Y[n] = static_cast<float>(idY);
+              samples->Z[n] = static_cast<float>(idZ);
+              samples->Offsets[n] = offset;
+              samples->Values[n] = static_cast<double>(inPtr[offset]);
+              n++;
+              }
+            }
+          }
+        while (stencil);
+        }
+      }
+    }
+
+  samples->NumberOfSamples = n;
+  for (int i = 0; i < 6; i++)
+    {
+    samples->Extent[i] = extent[i];
+    }
+}
+
+//----------------------------------------------------------------------------
+// Like vtkImageSimilarityMetricFusedExecute(), but iterate linearly over
+// the samples in the given range of the sample list, instead of walking
+// the stencil.  The functor is called with the same values, in the same
+// order, as by the fused execution over the voxels of the range.
+template<class F>
+void vtkImageSimilarityMetricSampleExecute(
+  const vtkImageSimilarityMetricSampleList *samples, const vtkIdType range[2],
+  vtkAbstractImageInterpolator *interpolator, const double matrix[16],
+  F& functor)
+{
+  if (range[0] >= range[1])
+    {
+    return;
+    }
+
+  const float *xPtr = &samples->X[0];
+  const float *yPtr = &samples->Y[0];
+  const float *zPtr = &samples->Z[0];
+  const double *valuePtr = &samples->Values[0];
+
+  for (vtkIdType i = range[0]; i < range[1]; i++)
+    {
+    double x = xPtr[i];
+    double y = yPtr[i];
+    double z = zPtr[i];
+
+    // same order of operations as the fused execution, so that the
+    // positions are identical
+    double point[3];
+    point[0] = (matrix[1]*y + matrix[2]*z + matrix[3]) + matrix[0]*x;
+    point[1] = (matrix[5]*y + matrix[6]*z + matrix[7]) + matrix[4]*x;
+    point[2] = (matrix[9]*y + matrix[10]*z + matrix[11]) + matrix[8]*x;
+    if (interpolator->CheckBoundsIJK(point))
+      {
+      double v;
+      interpolator->InterpolateIJK(point, &v);
+      functor(valuePtr[i], v);
+      }
+    }
+}
+
+//----------------------------------------------------------------------------
+// Conversion of interpolated values to the scalar type of the buffer that
+// is filled by vtkImageSimilarityMetricFusedResample(), with rounding and
+// clamping for integer types.
+template<class T>
+inline void vtkImageSimilarityMetricConvert(double val, T& out)
+{
+  double minval = static_cast<double>(vtkTypeTraits<T>::Min());
+  double maxval = static_cast<double>(vtkTypeTraits<T>::Max());
+  val = (val > minval ? val : minval);
+  val = (val < maxval ? val : maxval);
+  out = static_cast<T>(vtkMath::Floor(val + 0.5));
+}
+
+inline void vtkImageSimilarityMetricConvert(double val, float& out)
+{
+  out = static_cast<float>(val);
+}
+
+inline void vtkImageSimilarityMetricConvert(double val, double& out)
+{
+  out = val;
+}
+
+//----------------------------------------------------------------------------
+// For metrics that need neighborhoods rather than individual voxels, this
+// fills a buffer (with contiguous voxels and one component) by interpolating
+// the second input over the given extent of the first input.  It generates
+// a stencil that includes only those voxels that are within the input
+// stencil and that transform to positions within the bounds of the second
+// input.  Voxels outside of this stencil are set to zero.
+template<class T>
+void vtkImageSimilarityMetricFusedResample(
+  vtkImageStencilData *stencil, vtkAbstractImageInterpolator *interpolator,
+  const double matrix[16], const int extent[6], T *outPtr,
+  vtkImageStencilData *outStencil)
+{
+  int *ext = const_cast<int *>(extent);
+  outStencil->SetExtent(ext);
+  outStencil->AllocateExtents();
+
+  for (int idZ = extent[4]; idZ <= extent[5]; idZ++)
+    {
+    for (int idY = extent[2]; idY <= extent[3]; idY++)
+      {
+      // the transformed position of the voxel at x index zero
+      double rowPoint[3];
+      rowPoint[0] = matrix[1]*idY + matrix[2]*idZ + matrix[3];
+      rowPoint[1] = matrix[5]*idY + matrix[6]*idZ + matrix[7];
+      rowPoint[2] = matrix[9]*idY + matrix[10]*idZ + matrix[11];
+
+      T *rowPtr = outPtr;
+      int n = extent[1] - extent[0] + 1;
+      do { *outPtr++ = 0; } while (--n);
+
+      // loop over stencil extents (break at end if no stencil)
+      int iter = 0;
+      int r1 = extent[0];
+      int r2 = extent[1];
+      do
+        {
+        if (stencil && stencil->GetNextExtent(
+              r1, r2, extent[0], extent[1], idY, idZ, iter) == 0)
+          {
+          break;
+          }
+
+        // start of current run of in-bounds voxels
+        int s1 = r2 + 1;
+        for (int idX = r1; idX <= r2; idX++)
+          {
+          double point[3];
+          point[0] = rowPoint[0] + matrix[0]*idX;
+          point[1] = rowPoint[1] + matrix[4]*idX;
+          point[2] = rowPoint[2] + matrix[8]*idX;
+          if (interpolator->CheckBoundsIJK(point))
+            {
+            double y;
+            interpolator->InterpolateIJK(point, &y);
+            vtkImageSimilarityMetricConvert(y, rowPtr[idX - extent[0]]);
+            s1 = (s1 <= idX ? s1 : idX);
+            }
+          else if (s1 < idX)
+            {
+            outStencil->InsertNextExtent(s1, idX - 1, idY, idZ);
+            s1 = r2 + 1;
+            }
+          }
+        if (s1 <= r2)
+          {
+          outStencil->InsertNextExtent(s1, r2, idY, idZ);
+          }
+        }
+      while (stencil);
+      }
+    }
+}
+
 #endif /* vtkImageSimilarityMetricInternals_h */
\ No newline at end of file
@@ -56,11 +56,16 @@ class vtkImageSquaredDifferenceTLS
 // Constructor sets default values
 vtkImageSquaredDifference::vtkImageSquaredDifference()
 {
+  this->SupportsCostCeiling = true;
+  this->SupportsSampleList = true;
+
+  this->ThreadData = new vtkImageSquaredDifferenceTLS;
 }
 
 //----------------------------------------------------------------------------
 vtkImageSquaredDifference::~vtkImageSquaredDifference()
 {
+  delete this->ThreadData;
 }
 
 //----------------------------------------------------------------------------
@@ -73,16 +78,18 @@ void vtkImageSquaredDifference::PrintSelf(ostream& os, vtkIndent indent)
 namespace {
 
 //----------------------------------------------------------------------------
-template<class T1, class T2>
+// The arithmetic for each span is done with type F (float or double), and
+// the spans are summed in double precision.
+template<class F, class T1, class T2>
 void vtkImageSquaredDifferenceExecute(
   vtkImageSquaredDifference *self,
   vtkImageData *inData0, vtkImageData *inData1, vtkImageStencilData *stencil,
-  T1 *inPtr, T2 *inPtr1, const int extent[6], vtkIdType pieceId,
+  T1 *inPtr, T2 *inPtr1, const int extent[6], vtkAlgorithm *progress,
   vtkImageSquaredDifferenceThreadData *output)
 {
   int *ext = const_cast<int *>(extent);
   vtkImageStencilIterator<T1>
-    inIter(inData0, stencil, ext, ((pieceId == 0) ? self : NULL));
+    inIter(inData0, stencil, ext, progress);
   vtkImageStencilIterator<T2>
     inIter1(inData1, stencil, ext, NULL);
 
@@ -98,18 +105,19 @@ void vtkImageSquaredDifferenceExecute(
       T1 *inPtrEnd = inIter.EndSpan();
       inPtr1 = inIter1.BeginSpan();
 
-      double s = 0;
+      F s = 0;
+
+      count += static_cast<vtkIdType>(inPtrEnd - inPtr);
 
       // iterate over all voxels in the span
       while (inPtr != inPtrEnd)
         {
-        double x = *inPtr++;
-        double y = *inPtr1++;
-        double d = y - x;
+        F x = static_cast<F>(*inPtr++);
+        F y = static_cast<F>(*inPtr1++);
+        F d = y - x;
         s += d*d;
         }
 
-      count += static_cast<vtkIdType>(inPtrEnd - inPtr);
       sqsum += s;
       }
     inIter.NextSpan();
@@ -125,20 +133,112 @@ template<class T1>
 void vtkImageSquaredDifferenceExecute1(
   vtkImageSquaredDifference *self,
   vtkImageData *inData0, vtkImageData *inData1, vtkImageStencilData *stencil,
-  T1 *inPtr, void *inPtr1, const int extent[6], vtkIdType pieceId,
+  T1 *inPtr, void *inPtr1, const int extent[6], vtkAlgorithm *progress,
   vtkImageSquaredDifferenceThreadData *output)
 {
+  if (self->GetSinglePrecision())
+    {
+    switch (inData1->GetScalarType())
+      {
+      vtkTemplateAliasMacro(
+        vtkImageSquaredDifferenceExecute<float>(
+          self, inData0, inData1, stencil,
+          inPtr, static_cast<VTK_TT *>(inPtr1), extent, progress, output));
+      default:
+        vtkErrorWithObjectMacro(self, "Execute: Unknown input ScalarType");
+      }
+    return;
+    }
+
   switch (inData1->GetScalarType())
     {
     vtkTemplateAliasMacro(
-      vtkImageSquaredDifferenceExecute(
+      vtkImageSquaredDifferenceExecute<double>(
         self, inData0, inData1, stencil,
-        inPtr, static_cast<VTK_TT *>(inPtr1), extent, pieceId, output));
+        inPtr, static_cast<VTK_TT *>(inPtr1), extent, progress, output));
     default:
       vtkErrorWithObjectMacro(self, "Execute: Unknown input ScalarType");
     }
 }
 
+//----------------------------------------------------------------------------
+// Accumulate the squared differences when the target is interpolated
+// directly, see vtkImageSimilarityMetricFusedExecute().  As for the spans
+// of vtkImageSquaredDifferenceExecute(), the arithmetic is done with type
+// F for each block of voxels, and the blocks are summed in double.
+template<class F>
+class vtkImageSquaredDifferenceFunctor
+{
+public:
+  vtkImageSquaredDifferenceFunctor()
+    : SumSquares(0.0), Count(0), BlockSum(0), BlockCount(0) {}
+
+  void operator()(double x, double y)
+  {
+    F d = static_cast<F>(y) - static_cast<F>(x);
+    this->BlockSum += d*d;
+    if (++this->BlockCount == BlockSize)
+      {
+      this->Flush();
+      }
+  }
+
+  // Add the current block to the totals, must be called at the end
+  void Flush()
+  {
+    this->SumSquares += this->BlockSum;
+    this->Count += this->BlockCount;
+    this->BlockSum = 0;
+    this->BlockCount = 0;
+  }
+
+  double SumSquares;
+  vtkIdType Count;
+
+private:
+  enum { BlockSize = 256 };
+
+  F BlockSum;
+  int BlockCount;
+};
+
+//----------------------------------------------------------------------------
+// Interpolate the target at the source voxels of the extent, or at the
+// given range of the sample list, with arithmetic of type F.
+template<class F>
+void vtkImageSquaredDifferenceFused(
+  vtkImageSquaredDifference *self, vtkImageData *inData0, void *inPtr0,
+  vtkImageStencilData *stencil, vtkImageSimilarityMetricSampleList *samples,
+  const vtkIdType range[2], vtkAbstractImageInterpolator *interpolator,
+  const double matrix[16], const vtkImageSimilarityMetricLine *line,
+  double step, const int extent[6], vtkAlgorithm *progress,
+  vtkImageSquaredDifferenceThreadData *output)
+{
+  vtkImageSquaredDifferenceFunctor<F> functor;
+
+  if (samples)
+    {
+    vtkImageSimilarityMetricSampleExecute(
+      samples, range, interpolator, matrix, functor);
+    }
+  else
+    {
+    switch (inData0->GetScalarType())
+      {
+      vtkTemplateAliasMacro(
+        vtkImageSimilarityMetricFusedExecute(
+          progress, inData0, static_cast<VTK_TT *>(inPtr0), stencil,
+          interpolator, matrix, extent, functor, line, step));
+      default:
+        vtkErrorWithObjectMacro(self, "Execute: Unknown ScalarType");
+      }
+    }
+
+  functor.Flush();
+  output->SumSquares += functor.SumSquares;
+  output->Count += functor.Count;
+}
+
 } // end anonymous namespace
 
 //----------------------------------------------------------------------------
@@ -147,15 +247,14 @@ int vtkImageSquaredDifference::RequestData(
   vtkInformationVector** inputVector,
   vtkInformationVector* outputVector)
 {
-  // create the thread-local object
-  vtkImageSquaredDifferenceTLS tlocal;
-  tlocal.Initialize(this);
-  this->ThreadData = &tlocal;
+  // reset the thread-local objects, which are kept between executions
+  if (this->ThreadData->Initialize(this))
+    {
+    this->NumberOfAllocations++;
+    }
 
   this->Superclass::RequestData(request, inputVector, outputVector);
 
-  this->ThreadData = 0;
-
   return 1;
 }
 
@@ -178,7 +277,10 @@ void vtkImageSquaredDifference::PieceRequestData(
   vtkImageData *inData1 = vtkImageData::SafeDownCast(
     inInfo1->Get(vtkDataObject::DATA_OBJECT()));
 
-  if (inData0->GetScalarType() != inData1->GetScalarType())
+  vtkImageStencilData *stencil = this->GetStencil();
+
+  if (!this->Interpolator &&
+      inData0->GetScalarType() != inData1->GetScalarType())
     {
     if (pieceId == 0)
       {
@@ -187,18 +289,83 @@ void vtkImageSquaredDifference::PieceRequestData(
     return;
     }
 
+  if (this->GetUseCostCeiling())
+    {
+    // visit one slice at a time, and stop as soon as the running total
+    // shows that the cost will exceed the ceiling
+    vtkImageSquaredDifferenceThreadData *output =
+      &this->ThreadData->Local(pieceId);
+    int sliceExt[6];
+    sliceExt[0] = extent[0];
+    sliceExt[1] = extent[1];
+    sliceExt[2] = extent[2];
+    sliceExt[3] = extent[3];
+    int nz = extent[5] - extent[4] + 1;
+    for (int n = 0; n < nz; n++)
+      {
+      sliceExt[4] = this->GetInterleavedSlice(extent, n);
+      sliceExt[5] = sliceExt[4];
+      double sqsum = output->SumSquares;
+      this->ExecuteExtent(
+        inData0, inData1, stencil, sliceExt, pieceId, NULL);
+      if (this->AddSliceCost(sliceExt[4], output->SumSquares - sqsum))
+        {
+        break;
+        }
+      }
+    return;
+    }
+
+  this->ExecuteExtent(
+    inData0, inData1, stencil, extent, pieceId,
+    ((pieceId == 0) ? this : NULL));
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSquaredDifference::ExecuteExtent(
+  vtkImageData *inData0, vtkImageData *inData1, vtkImageStencilData *stencil,
+  const int extent[6], vtkIdType pieceId, vtkAlgorithm *progress)
+{
   int *ext = const_cast<int *>(extent);
   void *inPtr0 = inData0->GetScalarPointerForExtent(ext);
-  void *inPtr1 = inData1->GetScalarPointerForExtent(ext);
 
-  vtkImageStencilData *stencil = this->GetStencil();
+  if (this->Interpolator)
+    {
+    // interpolate the target directly, instead of using a resampled target
+    vtkImageSimilarityMetricSampleList *samples = this->GetSampleList();
+    vtkIdType range[2] = { 0, 0 };
+    if (samples)
+      {
+      this->GetSampleRange(pieceId, range);
+      }
+
+    vtkImageSquaredDifferenceThreadData *output =
+      &this->ThreadData->Local(pieceId);
+    if (this->GetSinglePrecision())
+      {
+      vtkImageSquaredDifferenceFused<float>(
+        this, inData0, inPtr0, stencil, samples, range,
+        this->Interpolator, this->IndexMatrix, this->GetLine(),
+        this->GetLineStep(), extent, progress, output);
+      }
+    else
+      {
+      vtkImageSquaredDifferenceFused<double>(
+        this, inData0, inPtr0, stencil, samples, range,
+        this->Interpolator, this->IndexMatrix, this->GetLine(),
+        this->GetLineStep(), extent, progress, output);
+      }
+    return;
+    }
+
+  void *inPtr1 = inData1->GetScalarPointerForExtent(ext);
 
   switch (inData0->GetScalarType())
     {
     vtkTemplateAliasMacro(
       vtkImageSquaredDifferenceExecute1(
         this, inData0, inData1, stencil,
-        static_cast<VTK_TT *>(inPtr0), inPtr1, extent, pieceId,
+        static_cast<VTK_TT *>(inPtr0), inPtr1, extent, progress,
         &this->ThreadData->Local(pieceId)));
     default:
       vtkErrorMacro(<< "Execute: Unknown ScalarType");
@@ -220,6 +387,12 @@ void vtkImageSquaredDifference::ReduceRequestData(
     count += iter->Count;
     }
 
+  // an abandoned evaluation reports a lower bound on the cost
+  if (this->GetAbandoned())
+    {
+    count = this->GetMaximumCount();
+    }
+
   if (count == 0)
     {
     count = 1;
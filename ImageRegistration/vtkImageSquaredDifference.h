@@ -15,7 +15,8 @@
 // .SECTION Description
 // vtkImageSquaredDifference computes the average squared difference of
 // pixel values between two images. The images must have the same origin
-// and spacing.
+// and spacing.  Since the sum of squares can only increase as voxels are
+// added, this metric supports SetCostCeiling() for early abandonment.
 
 #ifndef vtkImageSquaredDifference_h
 #define vtkImageSquaredDifference_h
@@ -45,6 +46,12 @@ protected:
                         vtkInformationVector *outputVector,
                         const int pieceExtent[6], vtkIdType pieceId);
 
+  // Description:
+  // Accumulate the squared differences over the given extent.
+  void ExecuteExtent(vtkImageData *inData0, vtkImageData *inData1,
+                     vtkImageStencilData *stencil, const int extent[6],
+                     vtkIdType pieceId, vtkAlgorithm *progress);
+
   void ReduceRequestData(vtkInformation *request,
                          vtkInformationVector **inInfo,
                          vtkInformationVector *outInfo);
@@ -0,0 +1,350 @@
+/*=========================================================================
+
+  Module: vtkLBFGSMinimizer.cxx
+
+  Copyright (c) 2016 David Gobbi
+  All rights reserved.
+  See Copyright.txt or http://dgobbi.github.io/bsd3.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notice for more information.
+
+=========================================================================*/
+#include "vtkLBFGSMinimizer.h"
+#include "vtkObjectFactory.h"
+
+#include <math.h>
+
+vtkStandardNewMacro(vtkLBFGSMinimizer);
+
+//----------------------------------------------------------------------------
+vtkLBFGSMinimizer::vtkLBFGSMinimizer()
+{
+  this->NumberOfCorrections = 5;
+  this->GradientStep = 0.1;
+
+  this->Workspace = 0;
+  this->Gradient = 0;
+  this->Corrections = 0;
+  this->CorrectionSize = 0;
+  this->CorrectionCount = 0;
+  this->CorrectionIndex = 0;
+}
+
+//----------------------------------------------------------------------------
+vtkLBFGSMinimizer::~vtkLBFGSMinimizer()
+{
+  delete [] this->Workspace;
+  delete [] this->Gradient;
+  delete [] this->Corrections;
+}
+
+//----------------------------------------------------------------------------
+void vtkLBFGSMinimizer::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os, indent);
+
+  os << indent << "NumberOfCorrections: " << this->NumberOfCorrections << "\n";
+  os << indent << "GradientStep: " << this->GradientStep << "\n";
+}
+
+//----------------------------------------------------------------------------
+void vtkLBFGSMinimizer::ComputeGradient(double *g)
+{
+  int n = this->NumberOfParameters;
+  const double *p = this->ParameterValues;
+  const double *vs = this->ParameterScales;
+  double h = this->GradientStep;
+
+  // the probe points follow the first three vectors in the workspace
+  double *probes = this->Workspace + 3*n;
+  double *costs = probes + 2*n*n;
+
+  for (int j = 0; j < n; j++)
+    {
+    double *pf = probes + 2*j*n;
+    double *pb = pf + n;
+    for (int i = 0; i < n; i++)
+      {
+      pf[i] = p[i];
+      pb[i] = p[i];
+      }
+    pf[j] += h*vs[j];
+    pb[j] -= h*vs[j];
+    }
+
+  this->EvaluateBatch(probes, 2*n, costs);
+
+  for (int j = 0; j < n; j++)
+    {
+    g[j] = (costs[2*j] - costs[2*j + 1])/(2*h);
+    }
+}
+
+//----------------------------------------------------------------------------
+int vtkLBFGSMinimizer::LineSearch(
+  const double *p0, double y0, const double *d, double dy0, bool expand)
+{
+  // the fraction of the linear decrease that is required (Armijo)
+  const double c1 = 1e-4;
+  // the maximum number of steps in the search
+  const int maxsteps = 20;
+
+  int n = this->NumberOfParameters;
+  double *p = this->ParameterValues;
+  const double *vs = this->ParameterScales;
+  double ptol = this->ParameterTolerance;
+
+  double dmax = 0.0;
+  for (int i = 0; i < n; i++)
+    {
+    double t = fabs(d[i]);
+    dmax = (dmax > t ? dmax : t);
+    }
+
+  double alpha = 1.0;
+  double y = y0;
+  bool found = false;
+
+  for (int ii = 0; ii < maxsteps && !this->AbortFlag; ii++)
+    {
+    for (int i = 0; i < n; i++)
+      {
+      p[i] = p0[i] + alpha*d[i]*vs[i];
+      }
+    this->EvaluateFunction();
+    y = this->FunctionValue;
+
+    if (y <= y0 + c1*alpha*dy0)
+      {
+      found = true;
+      break;
+      }
+
+    // backtrack to the minimum of the interpolating parabola, but
+    // keep the new step within a reasonable fraction of the old step
+    double a = 0.5*alpha;
+    double denom = 2*(y - y0 - dy0*alpha);
+    if (denom > 0)
+      {
+      a = -dy0*alpha*alpha/denom;
+      a = (a > 0.1*alpha ? a : 0.1*alpha);
+      a = (a < 0.5*alpha ? a : 0.5*alpha);
+      }
+    alpha = a;
+
+    // stop if the step has become smaller than the tolerance
+    if (alpha*dmax < ptol)
+      {
+      break;
+      }
+    }
+
+  if (!found || this->AbortFlag)
+    {
+    for (int i = 0; i < n; i++) { p[i] = p0[i]; }
+    this->FunctionValue = y0;
+    return 0;
+    }
+
+  // if the search direction was not scaled by the Hessian, then the
+  // initial step might have been too short, so try some longer steps
+  if (expand)
+    {
+    for (int ii = 0; ii < maxsteps && !this->AbortFlag; ii++)
+      {
+      double a = 2*alpha;
+      for (int i = 0; i < n; i++)
+        {
+        p[i] = p0[i] + a*d[i]*vs[i];
+        }
+      this->EvaluateFunction();
+      if (this->FunctionValue >= y)
+        {
+        break;
+        }
+      alpha = a;
+      y = this->FunctionValue;
+      }
+
+    for (int i = 0; i < n; i++)
+      {
+      p[i] = p0[i] + alpha*d[i]*vs[i];
+      }
+    }
+
+  this->FunctionValue = y;
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+void vtkLBFGSMinimizer::Start()
+{
+  int n = this->NumberOfParameters;
+  int m = this->NumberOfCorrections;
+
+  delete [] this->Workspace;
+  delete [] this->Gradient;
+  delete [] this->Corrections;
+
+  // the workspace holds the previous point, the search direction, and
+  // the new gradient, followed by the probe points and their function
+  // values, and then the two-loop coefficients
+  this->Workspace = new double[3*n + 2*n*n + 2*n + m];
+  this->Gradient = new double[n];
+  this->Corrections = new double[2*m*n];
+  this->CorrectionSize = m;
+  this->CorrectionCount = 0;
+  this->CorrectionIndex = 0;
+
+  this->EvaluateFunction();
+  this->ComputeGradient(this->Gradient);
+}
+
+//----------------------------------------------------------------------------
+int vtkLBFGSMinimizer::Step()
+{
+  double ftol = this->Tolerance;
+  double ptol = this->ParameterTolerance;
+  double y0 = this->FunctionValue;
+  int n = this->NumberOfParameters;
+  int m = this->CorrectionSize;
+  double *p = this->ParameterValues;
+  const double *vs = this->ParameterScales;
+  double *g = this->Gradient;
+  double *p0 = this->Workspace;
+  double *d = p0 + n;
+  double *g1 = d + n;
+  double *a = this->Workspace + 3*n + 2*n*n + 2*n;
+
+  // save the current point
+  for (int i = 0; i < n; i++) { p0[i] = p[i]; }
+
+  // the two-loop recursion computes d = -H*g, where H is the inverse
+  // Hessian approximated from the stored corrections
+  int count = this->CorrectionCount;
+  for (int i = 0; i < n; i++) { d[i] = -g[i]; }
+  if (count > 0)
+    {
+    int newest = (this->CorrectionIndex + m - 1) % m;
+    for (int l = 0; l < count; l++)
+      {
+      int k = (newest + m - l) % m;
+      const double *s = this->Corrections + 2*k*n;
+      const double *yk = s + n;
+      double sy = 0.0;
+      double sq = 0.0;
+      for (int i = 0; i < n; i++)
+        {
+        sy += s[i]*yk[i];
+        sq += s[i]*d[i];
+        }
+      a[l] = sq/sy;
+      for (int i = 0; i < n; i++) { d[i] -= a[l]*yk[i]; }
+      }
+
+    // scale by the curvature of the most recent correction
+    const double *s = this->Corrections + 2*newest*n;
+    const double *yk = s + n;
+    double sy = 0.0;
+    double yy = 0.0;
+    for (int i = 0; i < n; i++)
+      {
+      sy += s[i]*yk[i];
+      yy += yk[i]*yk[i];
+      }
+    double gamma = sy/yy;
+    for (int i = 0; i < n; i++) { d[i] *= gamma; }
+
+    for (int l = count - 1; l >= 0; l--)
+      {
+      int k = (newest + m - l) % m;
+      const double *sk = this->Corrections + 2*k*n;
+      const double *yl = sk + n;
+      double syl = 0.0;
+      double yd = 0.0;
+      for (int i = 0; i < n; i++)
+        {
+        syl += sk[i]*yl[i];
+        yd += yl[i]*d[i];
+        }
+      double b = yd/syl;
+      for (int i = 0; i < n; i++) { d[i] += (a[l] - b)*sk[i]; }
+      }
+    }
+
+  // the directional derivative must be negative, if not then fall back
+  // to steepest descent
+  double gnorm = 0.0;
+  double dy0 = 0.0;
+  for (int i = 0; i < n; i++)
+    {
+    gnorm += g[i]*g[i];
+    dy0 += g[i]*d[i];
+    }
+  gnorm = sqrt(gnorm);
+  if (gnorm == 0)
+    {
+    return 0;
+    }
+  if (count == 0 || dy0 >= 0)
+    {
+    count = 0;
+    this->CorrectionCount = 0;
+    for (int i = 0; i < n; i++) { d[i] = -g[i]/gnorm; }
+    dy0 = -gnorm;
+    }
+
+  if (!this->LineSearch(p0, y0, d, dy0, (count == 0)))
+    {
+    // if the quasi-Newton direction failed, then the next iteration will
+    // use steepest descent, but if steepest descent failed then we are done
+    this->CorrectionCount = 0;
+    return (count > 0 && !this->AbortFlag);
+    }
+
+  double y = this->FunctionValue;
+
+  // compute the max distance for tolerance check
+  double maxw = 0.0;
+  for (int i = 0; i < n; i++)
+    {
+    double w = fabs(p0[i] - p[i])/vs[i];
+    maxw = (maxw > w ? maxw : w);
+    }
+
+  if (2*fabs(y0 - y) <= ftol*(fabs(y0) + fabs(y)) &&
+      maxw < ptol)
+    {
+    return 0;
+    }
+
+  // compute the gradient at the new point, and store the correction
+  // pair if it satisfies the curvature condition
+  this->ComputeGradient(g1);
+
+  double *s = this->Corrections + 2*this->CorrectionIndex*n;
+  double *yk = s + n;
+  double sy = 0.0;
+  double yy = 0.0;
+  for (int i = 0; i < n; i++)
+    {
+    s[i] = (p[i] - p0[i])/vs[i];
+    yk[i] = g1[i] - g[i];
+    sy += s[i]*yk[i];
+    yy += yk[i]*yk[i];
+    }
+  if (sy > 1e-10*yy)
+    {
+    this->CorrectionIndex = (this->CorrectionIndex + 1) % m;
+    if (this->CorrectionCount < m)
+      {
+      this->CorrectionCount++;
+      }
+    }
+
+  for (int i = 0; i < n; i++) { g[i] = g1[i]; }
+
+  return 1;
+}
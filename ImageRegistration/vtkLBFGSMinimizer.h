@@ -0,0 +1,95 @@
+/*=========================================================================
+
+  Module: vtkLBFGSMinimizer.h
+
+  Copyright (c) 2016 David Gobbi
+  All rights reserved.
+  See Copyright.txt or http://dgobbi.github.io/bsd3.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notice for more information.
+
+=========================================================================*/
+// .NAME vtkLBFGSMinimizer - use the L-BFGS method to minimize a function
+// .SECTION Description
+// vtkLBFGSMinimizer uses the limited-memory Broyden-Fletcher-Goldfarb-Shanno
+// method to minimize a function.  The gradient is estimated by central
+// differences, where the step for each parameter is a fraction of its
+// ParameterScale.  Each gradient requires two evaluations per parameter,
+// but these evaluations are independent of each other, so if a batch
+// function has been set, they can all be computed concurrently.  A line
+// search is done along each search direction to find the next point.
+
+#ifndef vtkLBFGSMinimizer_h
+#define vtkLBFGSMinimizer_h
+
+#include "vtkFunctionMinimizer.h"
+
+class VTK_EXPORT vtkLBFGSMinimizer : public vtkFunctionMinimizer
+{
+public:
+  static vtkLBFGSMinimizer *New();
+  vtkTypeMacro(vtkLBFGSMinimizer,vtkFunctionMinimizer);
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  // Description:
+  // Set the number of correction pairs to keep, which is the number of
+  // previous steps that are used to approximate the inverse Hessian.
+  // The default is 5.  This must be set before the minimization starts.
+  vtkSetClampMacro(NumberOfCorrections, int, 1, 100);
+  vtkGetMacro(NumberOfCorrections, int);
+
+  // Description:
+  // Set the finite-difference step for the gradient, as a fraction of
+  // the ParameterScale for each parameter.  The default is 0.1.  If the
+  // function is noisy at small scales, a larger step should be used.
+  vtkSetMacro(GradientStep, double);
+  vtkGetMacro(GradientStep, double);
+
+  // Description:
+  // Get the component of the gradient for the specified parameter,
+  // as computed at the current point.  The units are cost per
+  // ParameterScale.
+  double GetGradient(int i) { return this->Gradient[i]; };
+
+protected:
+  vtkLBFGSMinimizer();
+  ~vtkLBFGSMinimizer();
+
+  // Description:
+  // Compute the gradient at the current point by central differences.
+  void ComputeGradient(double *gradient);
+
+  // Description:
+  // Search along the direction "d" (in scaled units) from point "p0",
+  // which has value "y0" and directional derivative "dy0".  The point
+  // and its value are returned in ParameterValues and FunctionValue.
+  // The return value is zero if no decrease could be found.
+  int LineSearch(
+    const double *p0, double y0, const double *d, double dy0, bool expand);
+
+  // Description:
+  // Initialize the workspace required for the method.
+  void Start();
+
+  // Description:
+  // Run one iteration of the L-BFGS method.
+  int Step();
+
+  int NumberOfCorrections;
+  double GradientStep;
+
+  double *Workspace;
+  double *Gradient;
+  double *Corrections;
+  int CorrectionSize;
+  int CorrectionCount;
+  int CorrectionIndex;
+
+private:
+  vtkLBFGSMinimizer(const vtkLBFGSMinimizer&);  // Not implemented.
+  void operator=(const vtkLBFGSMinimizer&);  // Not implemented.
+};
+
+#endif
@@ -225,20 +225,16 @@ void  vtkNelderMeadMinimizer::InitializeAmoeba()
       this->AmoebaSum[j] += this->ParameterValues[j];
       }
     }
-  for( i = 0 ; i < n_parameters+1 ; i++ )
-    {
-    for( j = 0; j < n_parameters; j++ )
-      {
-      this->ParameterValues[j] = this->AmoebaVertices[i][j];
-      }
-    this->EvaluateFunction();
-    this->AmoebaValues[i] = this->FunctionValue;
-    }
-
-  for ( j = 0 ; j < n_parameters ; j++ )
+  // the first vertex is the current point, the rest are evaluated together
+  for( j = 0; j < n_parameters; j++ )
     {
     this->ParameterValues[j] = this->AmoebaVertices[0][j];
     }
+  this->EvaluateFunction();
+  this->AmoebaValues[0] = this->FunctionValue;
+
+  this->EvaluateBatch(this->AmoebaVertices[1], n_parameters,
+                      &this->AmoebaValues[1]);
 }
 
 /* ----------------------------- MNI Header -----------------------------------
@@ -454,16 +450,20 @@ int vtkNelderMeadMinimizer::PerformAmoeba()
           {
           for( j = 0 ; j < this->NumberOfParameters ; j++ )
             {
-            this->ParameterValues[j] = (this->AmoebaVertices[i][j] +
-                                        this->AmoebaVertices[low][j]) / 2.0;
-            this->AmoebaVertices[i][j] = this->ParameterValues[j];
+            this->AmoebaVertices[i][j] = (this->AmoebaVertices[i][j] +
+                                          this->AmoebaVertices[low][j]) / 2.0;
             }
-
-          this->EvaluateFunction();
-          this->AmoebaValues[i] = this->FunctionValue;
           }
         }
 
+      // the vertices are contiguous, so evaluate the ones before
+      // and after the lowest vertex as two batches
+      int n_parameters = this->NumberOfParameters;
+      this->EvaluateBatch(this->AmoebaVertices[0], low,
+                          &this->AmoebaValues[0]);
+      this->EvaluateBatch(this->AmoebaVertices[low+1], n_parameters - low,
+                          &this->AmoebaValues[low+1]);
+
       for( j = 0 ; j < this->NumberOfParameters ; j++ )
         {
         this->AmoebaSum[j] = 0.0;
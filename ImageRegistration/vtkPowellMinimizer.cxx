@@ -183,29 +183,60 @@ double vtkPowellMinimizer::PowellBracket(
   double fa = y0;
   double xa = 0.0;
   double xb = 1.0;
+  double xc, fb, fc;
 
-  for (int i = 0; i < n; i++)
+  if (this->GetMinimumConcurrentBatch() <= 3)
     {
-    point[i] = p0[i] + xb*vec[i];
+    // evaluate the first point together with both of the candidates for
+    // the second point, since the second point depends on the first, but
+    // only if the three points will really be evaluated concurrently
+    const double x[3] = { 1.0, 1.0 + g, -g };
+    double f[3];
+    double *points = this->PowellWorkspace + n*(n + 2);
+    for (int k = 0; k < 3; k++)
+      {
+      for (int i = 0; i < n; i++)
+        {
+        points[k*n + i] = p0[i] + x[k]*vec[i];
+        }
+      }
+    this->EvaluateBatch(points, 3, f);
+    fb = f[0];
+    if (fa < fb)
+      {
+      xa = xb;
+      xb = 0.0;
+      fa = fb;
+      fb = y0;
+      }
+    xc = xb + g*(xb - xa);
+    fc = (xb == 0.0 ? f[2] : f[1]);
     }
-  this->EvaluateFunction();
-  double fb = this->FunctionValue;
-  if (fa < fb)
+  else
     {
-    xa = xb;
-    xb = 0.0;
-    fa = fb;
-    fb = y0;
-    }
+    for (int i = 0; i < n; i++)
+      {
+      point[i] = p0[i] + xb*vec[i];
+      }
+    this->EvaluateFunction();
+    fb = this->FunctionValue;
+    if (fa < fb)
+      {
+      xa = xb;
+      xb = 0.0;
+      fa = fb;
+      fb = y0;
+      }
 
-  double xc = xb + g*(xb - xa);
+    xc = xb + g*(xb - xa);
 
-  for (int i = 0; i < n; i++)
-    {
-    point[i] = p0[i] + xc*vec[i];
+    for (int i = 0; i < n; i++)
+      {
+      point[i] = p0[i] + xc*vec[i];
+      }
+    this->EvaluateFunction();
+    fc = this->FunctionValue;
     }
-  this->EvaluateFunction();
-  double fc = this->FunctionValue;
 
   int ii = 0;
   while (fc < fb)
@@ -342,9 +373,9 @@ void vtkPowellMinimizer::Start()
   delete [] this->PowellWorkspace;
 
   // allocate memory for the current point and for
-  // the conjugate directions
+  // the conjugate directions, plus three points for batches
   double **vecs = new double *[n];
-  double *work = new double[n*(n+2)];
+  double *work = new double[n*(n+5)];
   for (int k = 0; k < n; k++)
     {
     double *v = work + n*(k + 2);
@@ -395,6 +426,7 @@ int vtkPowellMinimizer::Step()
     double gtol = ptol/l;
     double bracket[3];
     bool failed = false;
+    this->StartLineSearch(p0, v);
     y = this->PowellBracket(p0, y0, v, p, n, bracket, &failed);
     if (!failed)
       {
@@ -407,6 +439,7 @@ int vtkPowellMinimizer::Step()
       dymaxi = j;
       }
     }
+  this->StartLineSearch(NULL, NULL);
 
   // compute the max distance for tolerance check
   double maxw = 0.0;
@@ -0,0 +1,241 @@
+/*=========================================================================
+
+  Module: vtkWorkerThreadPool.cxx
+
+  Copyright (c) 2016 David Gobbi
+  All rights reserved.
+  See Copyright.txt or http://dgobbi.github.io/bsd3.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notice for more information.
+
+=========================================================================*/
+#include "vtkWorkerThreadPool.h"
+
+#include <vtkObjectFactory.h>
+#include <vtkMutexLock.h>
+#include <vtkConditionVariable.h>
+
+#if defined(__linux__) && defined(VTK_USE_PTHREADS)
+#define VTK_WORKER_THREAD_POOL_PIN
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+vtkStandardNewMacro(vtkWorkerThreadPool);
+
+//----------------------------------------------------------------------------
+// The information that is given to each worker thread when it is spawned.
+struct vtkWorkerThreadPoolWorker
+{
+  vtkWorkerThreadPool *Pool;
+  int ThreadId;
+  int SpawnId;
+  bool Pin;
+  unsigned long Generation;
+};
+
+//----------------------------------------------------------------------------
+vtkWorkerThreadPool::vtkWorkerThreadPool()
+{
+  this->Threader = vtkMultiThreader::New();
+  this->NumberOfThreads = this->Threader->GetNumberOfThreads();
+  this->PinThreads = 0;
+
+  this->Lock = new vtkSimpleMutexLock;
+  this->WorkCondition = new vtkSimpleConditionVariable;
+  this->DoneCondition = new vtkSimpleConditionVariable;
+
+  this->Workers = NULL;
+  this->NumberOfWorkers = 0;
+  this->PinnedThreads = 0;
+
+  this->Function = NULL;
+  this->Data = NULL;
+  this->Generation = 0;
+  this->Remaining = 0;
+  this->Terminating = false;
+}
+
+//----------------------------------------------------------------------------
+vtkWorkerThreadPool::~vtkWorkerThreadPool()
+{
+  this->Terminate();
+
+  delete this->WorkCondition;
+  delete this->DoneCondition;
+  delete this->Lock;
+
+  this->Threader->Delete();
+}
+
+//----------------------------------------------------------------------------
+void vtkWorkerThreadPool::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os,indent);
+
+  os << indent << "NumberOfThreads: " << this->NumberOfThreads << "\n";
+  os << indent << "PinThreads: " << (this->PinThreads ? "On\n" : "Off\n");
+}
+
+//----------------------------------------------------------------------------
+VTK_THREAD_RETURN_TYPE vtkWorkerThreadPool::WorkerMain(void *arg)
+{
+  vtkMultiThreader::ThreadInfo *ti =
+    static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  vtkWorkerThreadPoolWorker *worker =
+    static_cast<vtkWorkerThreadPoolWorker *>(ti->UserData);
+  vtkWorkerThreadPool *self = worker->Pool;
+
+#ifdef VTK_WORKER_THREAD_POOL_PIN
+  if (worker->Pin)
+    {
+    // pin to the Nth processor that this process is allowed to use
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+      {
+      int count = CPU_COUNT(&allowed);
+      int n = worker->ThreadId % (count > 0 ? count : 1);
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+          {
+          cpu_set_t mask;
+          CPU_ZERO(&mask);
+          CPU_SET(cpu, &mask);
+          pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+          break;
+          }
+        }
+      }
+    }
+#endif
+
+  unsigned long generation = worker->Generation;
+
+  self->Lock->Lock();
+  for (;;)
+    {
+    // wait until there is new work, or until told to terminate
+    while (generation == self->Generation && !self->Terminating)
+      {
+      self->WorkCondition->Wait(*self->Lock);
+      }
+    if (self->Terminating)
+      {
+      break;
+      }
+
+    generation = self->Generation;
+    vtkWorkerThreadPoolFunction func = self->Function;
+    void *data = self->Data;
+    int numberOfThreads = self->NumberOfWorkers + 1;
+    self->Lock->Unlock();
+
+    func(data, worker->ThreadId, numberOfThreads);
+
+    self->Lock->Lock();
+    if (--self->Remaining == 0)
+      {
+      self->DoneCondition->Signal();
+      }
+    }
+  self->Lock->Unlock();
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//----------------------------------------------------------------------------
+void vtkWorkerThreadPool::Start()
+{
+  int n = this->NumberOfThreads - 1;
+  this->Workers = new vtkWorkerThreadPoolWorker[n];
+  this->NumberOfWorkers = n;
+  this->PinnedThreads = this->PinThreads;
+  this->Terminating = false;
+
+  for (int i = 0; i < n; i++)
+    {
+    vtkWorkerThreadPoolWorker *worker = &this->Workers[i];
+    worker->Pool = this;
+    worker->ThreadId = i + 1;
+    worker->Pin = (this->PinThreads != 0);
+    worker->Generation = this->Generation;
+    worker->SpawnId = this->Threader->SpawnThread(
+      vtkWorkerThreadPool::WorkerMain, worker);
+    if (worker->SpawnId < 0)
+      {
+      vtkWarningMacro("Only " << (i + 1) << " threads could be started.");
+      this->NumberOfWorkers = i;
+      this->NumberOfThreads = i + 1;
+      break;
+      }
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkWorkerThreadPool::Terminate()
+{
+  if (this->Workers)
+    {
+    this->Lock->Lock();
+    this->Terminating = true;
+    this->WorkCondition->Broadcast();
+    this->Lock->Unlock();
+
+    for (int i = 0; i < this->NumberOfWorkers; i++)
+      {
+      this->Threader->TerminateThread(this->Workers[i].SpawnId);
+      }
+
+    delete [] this->Workers;
+    this->Workers = NULL;
+    this->NumberOfWorkers = 0;
+    this->Terminating = false;
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkWorkerThreadPool::Execute(vtkWorkerThreadPoolFunction func, void *data)
+{
+  if (this->NumberOfThreads <= 1)
+    {
+    this->Terminate();
+    func(data, 0, 1);
+    return;
+    }
+
+  // restart the workers if the settings have changed
+  if (this->Workers &&
+      (this->NumberOfWorkers != this->NumberOfThreads - 1 ||
+       this->PinnedThreads != this->PinThreads))
+    {
+    this->Terminate();
+    }
+  if (!this->Workers)
+    {
+    this->Start();
+    }
+
+  // wake the workers
+  this->Lock->Lock();
+  this->Function = func;
+  this->Data = data;
+  this->Remaining = this->NumberOfWorkers;
+  this->Generation++;
+  this->WorkCondition->Broadcast();
+  this->Lock->Unlock();
+
+  // the calling thread is thread zero
+  func(data, 0, this->NumberOfWorkers + 1);
+
+  // wait for the workers to finish
+  this->Lock->Lock();
+  while (this->Remaining > 0)
+    {
+    this->DoneCondition->Wait(*this->Lock);
+    }
+  this->Lock->Unlock();
+}
@@ -0,0 +1,121 @@
+/*=========================================================================
+
+  Module: vtkWorkerThreadPool.h
+
+  Copyright (c) 2016 David Gobbi
+  All rights reserved.
+  See Copyright.txt or http://dgobbi.github.io/bsd3.txt for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notice for more information.
+
+=========================================================================*/
+/*! \class vtkWorkerThreadPool
+ *  \brief A set of persistent threads for repeated parallel execution.
+ *
+ *  vtkMultiThreader::SingleMethodExecute() creates and joins a new set of
+ *  threads each time it is called, which is a significant overhead for
+ *  an image similarity metric that is evaluated thousands of times on
+ *  small images.  This class spawns its worker threads once, and then
+ *  wakes them for each call to Execute().  The calling thread acts as
+ *  thread zero, and Execute() returns once all threads have finished,
+ *  so it acts as a barrier.
+ *
+ *  Execute() must not be called concurrently from different threads,
+ *  but the pool can be shared by several objects that are used in turn.
+ */
+
+#ifndef vtkWorkerThreadPool_h
+#define vtkWorkerThreadPool_h
+
+#include "vtkObject.h"
+#include "vtkMultiThreader.h"
+
+class vtkSimpleMutexLock;
+class vtkSimpleConditionVariable;
+struct vtkWorkerThreadPoolWorker;
+
+//! The type of the function that is executed by each thread.
+typedef void (*vtkWorkerThreadPoolFunction)(
+  void *data, int threadId, int numberOfThreads);
+
+class VTK_EXPORT vtkWorkerThreadPool : public vtkObject
+{
+public:
+  static vtkWorkerThreadPool *New();
+  vtkTypeMacro(vtkWorkerThreadPool,vtkObject);
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  //@{
+  //! Set the number of threads, including the calling thread.
+  /*!
+   *  If the number of threads is changed, the worker threads will be
+   *  restarted the next time that Execute() is called.  The default
+   *  is the number of threads reported by vtkMultiThreader.
+   */
+  vtkSetClampMacro(NumberOfThreads, int, 1, VTK_MAX_THREADS);
+  vtkGetMacro(NumberOfThreads, int);
+  //@}
+
+  //@{
+  //! Pin each worker thread to a specific processor.
+  /*!
+   *  This keeps each worker on the same core for every execution, so that
+   *  its caches stay warm.  It is only supported on Linux, and it is off
+   *  by default because it is counterproductive if the machine is shared
+   *  with other busy processes.
+   */
+  vtkSetMacro(PinThreads, int);
+  vtkBooleanMacro(PinThreads, int);
+  vtkGetMacro(PinThreads, int);
+  //@}
+
+  //! Call the function from every thread, and wait for completion.
+  /*!
+   *  The function is called with threadId from zero to the number of
+   *  threads minus one, where thread zero is the calling thread.
+   */
+  void Execute(vtkWorkerThreadPoolFunction func, void *data);
+
+  //! Terminate the worker threads.
+  /*!
+   *  This is done automatically when the pool is destroyed.  If Execute()
+   *  is called again, then the worker threads will be restarted.
+   */
+  void Terminate();
+
+protected:
+  vtkWorkerThreadPool();
+  ~vtkWorkerThreadPool();
+
+  //! Spawn the worker threads.
+  void Start();
+
+  //! The main loop for each of the worker threads.
+  static VTK_THREAD_RETURN_TYPE WorkerMain(void *arg);
+
+  int NumberOfThreads;
+  int PinThreads;
+
+  vtkMultiThreader *Threader;
+  vtkSimpleMutexLock *Lock;
+  vtkSimpleConditionVariable *WorkCondition;
+  vtkSimpleConditionVariable *DoneCondition;
+
+  vtkWorkerThreadPoolWorker *Workers;
+  int NumberOfWorkers;
+  int PinnedThreads;
+
+  vtkWorkerThreadPoolFunction Function;
+  void *Data;
+  unsigned long Generation;
+  int Remaining;
+  bool Terminating;
+
+private:
+  vtkWorkerThreadPool(const vtkWorkerThreadPool&);
+  void operator=(const vtkWorkerThreadPool&);
+};
+
+#endif /* vtkWorkerThreadPool_h */
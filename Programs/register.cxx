@@ -18,7 +18,6 @@ Module:    register.cxx
 #include <vtkSmartPointer.h>
 
 #include <vtkImageReslice.h>
-#include <vtkImageResize.h>
 #include <vtkImageBSplineCoefficients.h>
 #include <vtkImageBSplineInterpolator.h>
 #include <vtkImageSincInterpolator.h>
@@ -37,6 +36,7 @@ Module:    register.cxx
 #include <vtkMath.h>
 #include <vtkCommand.h>
 #include <vtkMultiThreader.h>
+#include <vtkMutexLock.h>
 
 #include <vtkMINCImageReader.h>
 #include <vtkMINCImageWriter.h>
@@ -67,6 +67,9 @@ Module:    register.cxx
 #include "vtkITKXFMReader.h"
 #include "vtkITKXFMWriter.h"
 #include "vtkImageRegistration.h"
+#include "vtkImageRegistrationTarget.h"
+#include "vtkImageRegistrationPortfolio.h"
+#include "vtkWorkerThreadPool.h"
 #include "vtkLabelInterpolator.h"
 
 // optional readers
@@ -85,6 +88,9 @@ Module:    register.cxx
 
 #include <vector>
 #include <string>
+#include <map>
+
+#include <ctype.h>
 
 // A macro to assist VTK 5 backwards compatibility
 #if VTK_MAJOR_VERSION >= 6
@@ -102,6 +108,7 @@ Module:    register.cxx
 
 #if VTK_MAJOR_VERSION > 7 || (VTK_MAJOR_VERSION == 7 && VTK_MINOR_VERSION >= 0)
 #define USE_SMP_THREADED_IMAGE_ALGORITHM
+#include <vtkSMPTools.h>
 #endif
 
 // parallel processing
@@ -246,13 +253,15 @@ vtkDICOMReader *ReadDICOMImage(
     if (sorter->GetNumberOfSeries() == 0)
       {
       fprintf(stderr, "Folder contains no DICOM files: %s\n", directoryName);
-      exit(1);
+      reader->Delete();
+      return NULL;
       }
     else if (sorter->GetNumberOfSeries() > 1)
       {
       fprintf(stderr, "Folder contains more than one DICOM series: %s\n",
               directoryName);
-      exit(1);
+      reader->Delete();
+      return NULL;
       }
     reader->SetFileNames(sorter->GetFileNamesForSeries(0));
     }
@@ -274,7 +283,8 @@ vtkDICOMReader *ReadDICOMImage(
   reader->UpdateInformation();
   if (reader->GetErrorCode())
     {
-    exit(1);
+    reader->Delete();
+    return NULL;
     }
 
   if (!singleFile)
@@ -313,7 +323,8 @@ vtkDICOMReader *ReadDICOMImage(
   reader->Update();
   if (reader->GetErrorCode())
     {
-    exit(1);
+    reader->Delete();
+    return NULL;
     }
 
   vtkImageData *image = reader->GetOutput();
@@ -442,7 +453,8 @@ vtkDICOMImageReader *ReadDICOMImage(
   reader->Update();
   if (reader->GetErrorCode())
     {
-    exit(1);
+    reader->Delete();
+    return NULL;
     }
 
   vtkSmartPointer<vtkImageData> image = reader->GetOutput();
@@ -531,7 +543,8 @@ vtkMINCImageReader *ReadMINCImage(
   reader->Update();
   if (reader->GetErrorCode())
     {
-    exit(1);
+    reader->Delete();
+    return NULL;
     }
 
   vtkSmartPointer<vtkImageData> image = reader->GetOutput();
@@ -610,7 +623,8 @@ vtkNIFTIReader *ReadNIFTIImage(
   reader->Update();
   if (reader->GetErrorCode())
     {
-    exit(1);
+    reader->Delete();
+    return NULL;
     }
 
   vtkSmartPointer<vtkImageData> image = reader->GetOutput();
@@ -723,7 +737,7 @@ vtkImageReader2 *ReadImage(
     reader = ReadNIFTIImage(image, matrix, filename, coordSystem);
 #else
     fprintf(stderr, "NIFTI files are not supported.\n");
-    exit(1);
+    return NULL;
 #endif
     }
   else
@@ -731,6 +745,12 @@ vtkImageReader2 *ReadImage(
     reader = ReadDICOMImage(image, matrix, filename, coordSystem);
     }
 
+  if (!reader)
+    {
+    fprintf(stderr, "Unable to read image %s\n", filename);
+    return NULL;
+    }
+
   // compute the range of values present (between 1st and 99th percentile)
   double fill[2];
   ComputeRange(image, vrange, fill);
@@ -958,12 +978,14 @@ void WriteImage(
 // Write a csv file that can be used to plot the convergence of the
 // registration.  The first column is the function evaluation count,
 // the second column is the cost, the fourth is the metric value,
-// and the remainder of the columns are the parameters.
+// and the remainder of the columns are the parameters.  If the profile
+// was collected, then the profile of each evaluation follows.
 void WriteReport(vtkImageRegistration *reg, const char *fname)
 {
   vtkDoubleArray *costArray = reg->GetCostValues();
   vtkDoubleArray *metricArray = reg->GetMetricValues();
   vtkDoubleArray *paramArray = reg->GetParameterValues();
+  vtkDoubleArray *profileArray = reg->GetProfileValues();
 
   FILE *f = fopen(fname, "w");
   if (!f)
@@ -992,15 +1014,28 @@ void WriteReport(vtkImageRegistration *reg, const char *fname)
     pnames = p;
     }
 
+  // the profile has the same number of tuples as the costs
+  int n = static_cast<int>(costArray->GetNumberOfTuples());
+  bool profile = (reg->GetCollectProfile() &&
+                  profileArray->GetNumberOfComponents() == 7 &&
+                  profileArray->GetNumberOfTuples() == n);
+  static const char *profileNames[] = {
+    "transform", "resample", "pieces", "reduce", "optimizer",
+    "voxels", "utilization"
+  };
+
   // print the header
   fprintf(f, "\"%s\",\"%s\",\"%s\"", "feval", "cost", "metric");
   for (int k = 0; k < dof; k++)
     {
     fprintf(f, ",\"%s\"", pnames[k]);
     }
+  for (int k = 0; profile && k < 7; k++)
+    {
+    fprintf(f, ",\"%s\"", profileNames[k]);
+    }
   fprintf(f, "\n");
 
-  int n = static_cast<int>(costArray->GetNumberOfTuples());
   int j = 0;
   for (int i = 0; i < n; i++)
     {
@@ -1028,6 +1063,15 @@ void WriteReport(vtkImageRegistration *reg, const char *fname)
       {
       fprintf(f, ",%g", params[k]);
       }
+    if (profile)
+      {
+      double values[7];
+      profileArray->GetTuple(j, values);
+      for (int k = 0; k < 7; k++)
+        {
+        fprintf(f, ",%g", values[k]);
+        }
+      }
     fprintf(f, "\n");
     }
 
@@ -1059,13 +1103,17 @@ void SetViewFromMatrix(
   istyle->SetImageOrientation(viewRight, viewUp);
 }
 
-// a class to look for errors when reading transforms.
+// a class to look for errors when reading or writing transforms.
 class ErrorObserver : public vtkCommand
 {
 public:
   static ErrorObserver *New() { return new ErrorObserver; }
   vtkTypeMacro(ErrorObserver, vtkCommand);
   virtual void Execute(vtkObject *o, unsigned long eventId, void *callData);
+  bool GetError() { return this->Error; }
+protected:
+  ErrorObserver() : Error(false) {}
+  bool Error;
 };
 
 void ErrorObserver::Execute(
@@ -1075,10 +1123,11 @@ void ErrorObserver::Execute(
     {
     fprintf(stderr, "%s\n", static_cast<char *>(callData));
     }
-  exit(1);
+  this->Error = true;
 }
 
-void ReadMatrix(vtkMatrix4x4 *matrix, const char *xfminput)
+// Read a transform, or return false if it cannot be read
+bool ReadMatrix(vtkMatrix4x4 *matrix, const char *xfminput)
 {
   vtkSmartPointer<ErrorObserver> observer =
     vtkSmartPointer<ErrorObserver>::New();
@@ -1094,14 +1143,14 @@ void ReadMatrix(vtkMatrix4x4 *matrix, const char *xfminput)
     reader->Update();
     vtkLinearTransform *transform =
       vtkLinearTransform::SafeDownCast(reader->GetTransform());
-    if (transform)
+    if (transform && !observer->GetError())
       {
       matrix->DeepCopy(transform->GetMatrix());
       }
     else
       {
       fprintf(stderr, "Unable to read input transform %s\n", xfminput);
-      exit(1);
+      return false;
       }
     }
   else if (t == ITKTransform) // .tfm
@@ -1114,14 +1163,14 @@ void ReadMatrix(vtkMatrix4x4 *matrix, const char *xfminput)
     reader->Update();
     vtkLinearTransform *transform =
       vtkLinearTransform::SafeDownCast(reader->GetTransform());
-    if (transform)
+    if (transform && !observer->GetError())
       {
       matrix->DeepCopy(transform->GetMatrix());
       }
     else
       {
       fprintf(stderr, "Unable to read input transform %s\n", xfminput);
-      exit(1);
+      return false;
       }
     }
   else
@@ -1152,10 +1201,12 @@ void ReadMatrix(vtkMatrix4x4 *matrix, const char *xfminput)
     if (i < 16)
       {
       fprintf(stderr, "Unable to read input transform %s\n", xfminput);
-      exit(1);
+      return false;
       }
     matrix->DeepCopy(elements);
     }
+
+  return true;
 }
 
 void WriteMatrix(
@@ -1178,6 +1229,10 @@ void WriteMatrix(
     writer->SetTransform(transform);
     writer->AddObserver(vtkCommand::ErrorEvent, observer);
     writer->Update();
+    if (observer->GetError())
+      {
+      exit(1);
+      }
     }
   else if (t == ITKTransform) // .tfm
     {
@@ -1189,6 +1244,10 @@ void WriteMatrix(
     writer->SetTransformCenter(center);
     writer->AddObserver(vtkCommand::ErrorEvent, observer);
     writer->Write();
+    if (observer->GetError())
+      {
+      exit(1);
+      }
     }
   else
     {
@@ -1398,6 +1457,13 @@ struct register_options
   int parallel;        // -P --parallel
   int coords;          // -C --coords
   int maxeval[4];      // -N --maxeval
+  double sampling[4];  // --sampling
+  int strategy;        // --sampling-strategy
+  double timeLimit;    // --time-limit
+  int portfolio;       // --portfolio
+  int numa;            // --numa
+  int initializer;     // --initializer
+  double search;       // --search
   int display;         // -d --display
   int translucent;     // -t --translucent
   int silent;          // -s --silent
@@ -1409,6 +1475,8 @@ struct register_options
   const char *output;  // -o (output image)
   const char *screenshot; // -j (output screenshot)
   const char *report;  // -r (report csv file)
+  const char *jobs;    // --jobs (manifest file)
+  const char *summary; // --summary (summary csv file)
   const char *source;
   const char *target;
   std::vector<TransformArg> transforms;
@@ -1427,6 +1495,16 @@ void register_initialize_options(register_options *options)
   options->maxeval[1] = 5000;
   options->maxeval[2] = 5000;
   options->maxeval[3] = 5000;
+  options->sampling[0] = 1.0;
+  options->sampling[1] = 1.0;
+  options->sampling[2] = 1.0;
+  options->sampling[3] = 1.0;
+  options->timeLimit = 0.0;
+  options->portfolio = 0;
+  options->numa = 0;
+  options->strategy = vtkImageRegistration::StratifiedSampling;
+  options->initializer = -1;
+  options->search = 0.0;
   options->display = 0;
   options->translucent = 0;
   options->silent = 0;
@@ -1436,6 +1514,8 @@ void register_initialize_options(register_options *options)
   options->source_to_target = 0;
   options->screenshot = NULL;
   options->report = NULL;
+  options->jobs = NULL;
+  options->summary = NULL;
   options->output = NULL;
   options->outxfm = NULL;
   options->source = NULL;
@@ -1598,9 +1678,13 @@ void register_show_help(FILE *fp, const char *command)
     " -O --optimizer        (default: Powell)\n"
     "                 PW        Powell\n"
     "                 NM        Amoeba\n"
+    "                 LB        LBFGS\n"
     "\n"
     "    The Powell optimizer generally converges much faster than Amoeba,\n"
-    "    where the latter is the Nelder-Mead downhill simplex method.\n"
+    "    where the latter is the Nelder-Mead downhill simplex method.  The\n"
+    "    LBFGS optimizer is a quasi-Newton method that estimates gradients\n"
+    "    by finite differences, and evaluates the gradient probes in\n"
+    "    parallel.  It often needs less time than Powell for Affine.\n"
     "\n"
     " -P --parallel         (default: MultiThread)\n"
     "                 MT        MultiThread\n"
@@ -1631,6 +1715,91 @@ void register_show_help(FILE *fp, const char *command)
     "\n"
     "    Set the maximum number of metric evaluations per stage.  Set this\n"
     "    to zero if you want to use the initial transform as-is.\n"
+    "\n"
+    " --sampling     (default: 1x1x1x1)\n"
+    "\n"
+    "    Set the fraction of source voxels to use per stage.  For example,\n"
+    "    0.05x0.1x1x1 will use 5%% of the voxels for the first stage, 10%%\n"
+    "    for the second stage, and all voxels for the final stages.  The\n"
+    "    samples are chosen at the start of each stage.\n"
+    "\n"
+    " --time-limit   (default: none)\n"
+    "\n"
+    "    Set a time limit for the registration, in seconds.  Before each\n"
+    "    stage, the time for the stage is estimated from the previous stage,\n"
+    "    and if needed the sampling fraction is reduced so that the stage\n"
+    "    will finish in time.  Stages that cannot finish in time are skipped,\n"
+    "    and if time runs out during a stage, the best transform found so\n"
+    "    far is the result.\n"
+    "\n"
+    " --portfolio\n"
+    "\n"
+    "    Race the metrics MI, NMI and CR, each with the Powell and Amoeba\n"
+    "    optimizers, instead of using the -M and -O options.  They run\n"
+    "    concurrently and share the available threads.  At the end of each\n"
+    "    stage they are compared with normalized mutual information on a\n"
+    "    common set of voxels, and the worse half are cancelled.  The best\n"
+    "    at the final stage provides the result.\n"
+    "\n"
+    " --numa\n"
+    "\n"
+    "    Pin the threads to processors, and copy the images for each stage\n"
+    "    so that each thread's share of the image is in the memory of the\n"
+    "    processor socket that the thread runs on.  The target image is\n"
+    "    then interpolated directly by the metric, instead of being\n"
+    "    resampled first, so that there is no resampled image to place.\n"
+    "    This speeds up large registrations on machines with more than one\n"
+    "    socket, at the cost of memory for a second copy of each stage's\n"
+    "    images.  It is not used with --jobs or --portfolio, where the\n"
+    "    registrations share the processors, or with -P TP, whose threads\n"
+    "    cannot be pinned.\n"
+    "\n"
+    " --sampling-strategy   (default: Stratified)\n"
+    "                 Regular\n"
+    "                 Stratified\n"
+    "                 Gradient\n"
+    "\n"
+    "    Regular sampling uses evenly-spaced voxels, Stratified sampling\n"
+    "    uses randomly chosen voxels with an even distribution, and Gradient\n"
+    "    sampling is like Stratified but favors voxels with a high gradient.\n"
+    "\n"
+    " --initializer      (default: Centered, or None if -i or a transform\n"
+    "                     is given)\n"
+    "                 C         Centered\n"
+    "                 M         Moments\n"
+    "                 PC        PhaseCorrelation\n"
+    "\n"
+    "    The initial transform for the first stage.  Centered overlays the\n"
+    "    image centers, Moments aligns the centroids and the principal axes\n"
+    "    of the intensity, and PhaseCorrelation finds the translation by\n"
+    "    FFT.  PhaseCorrelation is best for same-modality follow-up scans.\n"
+    "\n"
+    " --search <angle>  (default: off)\n"
+    "\n"
+    "    Search a coarse grid of rotations, with the given angle in degrees\n"
+    "    between them, and of translations before starting the first stage.\n"
+    "    Use this when the images might differ by a large rotation, for\n"
+    "    example prone vs. supine.  A step of 90 degrees tries all of the\n"
+    "    24 axis-aligned orientations.\n"
+    "\n"
+    " --jobs <manifest>\n"
+    "\n"
+    "    Run all of the registrations that are listed in a manifest, which\n"
+    "    is either a csv file with a header row, or a json file that holds\n"
+    "    an array of objects.  The columns (or keys) are \"source\" and\n"
+    "    \"target\" for the images, and optionally \"initial\" for an initial\n"
+    "    transform, \"transform\" and \"report\" for the outputs, and\n"
+    "    \"name\" for the job.  The other options apply to every job.  Each\n"
+    "    file is only read once, and the jobs run concurrently with the\n"
+    "    available threads divided between them.\n"
+    "\n"
+    " --summary <file>\n"
+    "\n"
+    "    For --jobs, write a csv file with the status, time in seconds,\n"
+    "    number of evaluations, and final cost for each job.  The status\n"
+    "    is \"done\", \"missing\" if an input file does not exist, or\n"
+    "    \"failed\" if an input could not be read.  If no file is given,\n"
+    "    the summary is printed.\n"
 #ifdef VTK_HAS_SLAB_SPACING
     "\n"
     " --mip             (default: off)\n"
@@ -1663,7 +1832,10 @@ void register_show_help(FILE *fp, const char *command)
     " -r --report <file>\n"
     "\n"
     "    Write a report in csv format that shows the convergence.  This is\n"
-    "    for testing the metrics.\n"
+    "    for testing the metrics.  For each evaluation, the report also\n"
+    "    gives the seconds spent building the transform, resampling, in\n"
+    "    the metric pieces and reduction, and in the optimizer, as well as\n"
+    "    the number of voxels and the thread utilization of the metric.\n"
     "\n"
     " -o <file>\n"
     "\n"
@@ -1715,12 +1887,21 @@ int register_read_options(
   static const char *optimizer_args[] = {
     "PW", "Powell",
     "NM", "Amoeba",
+    "LB", "LBFGS",
     0 };
   static const char *parallel_args[] = {
     "MT", "MultiThread",
     "TP", "ThreadPool",
     "Off",
     0 };
+  static const char *initializer_args[] = {
+    "C", "Centered",
+    "M", "Moments",
+    "PC", "PhaseCorrelation",
+    0 };
+  static const char *strategy_args[] = {
+    "Regular", "Stratified", "Gradient",
+    0 };
   static const char *coords_args[] = {
     "DICOM", "LPS",
     "NIFTI", "MINC", "RAS",
@@ -1898,6 +2079,11 @@ int register_read_options(
           {
           options->optimizer = vtkImageRegistration::Powell;
           }
+        else if (strcmp(arg, "LBFGS") == 0 ||
+                 strcmp(arg, "LB") == 0)
+          {
+          options->optimizer = vtkImageRegistration::LBFGS;
+          }
         }
       else if (strcmp(arg, "-P") == 0 ||
                strcmp(arg, "--parallel") == 0)
@@ -1945,6 +2131,99 @@ int register_read_options(
           if (*arg == 'x') { arg++; }
           }
         }
+      else if (strcmp(arg, "--sampling") == 0)
+        {
+        arg = check_next_arg(argc, argv, &argi, 0);
+        for (int i = 0; i < 4; i++)
+          {
+          if (i > 0 && *arg == '\0')
+            {
+            // if fewer than four values, repeat the last value
+            options->sampling[i] = options->sampling[i-1];
+            continue;
+            }
+          options->sampling[i] = strtod(arg, const_cast<char **>(&arg));
+          if (*arg == 'x') { arg++; }
+          if (options->sampling[i] <= 0.0 || options->sampling[i] > 1.0)
+            {
+            fprintf(stderr, "Sampling fractions must be between 0 and 1\n");
+            exit(1);
+            }
+          }
+        }
+      else if (strcmp(arg, "--portfolio") == 0)
+        {
+        options->portfolio = 1;
+        }
+      else if (strcmp(arg, "--numa") == 0)
+        {
+        options->numa = 1;
+        }
+      else if (strcmp(arg, "--time-limit") == 0)
+        {
+        arg = check_next_arg(argc, argv, &argi, 0);
+        options->timeLimit = strtod(arg, const_cast<char **>(&arg));
+        if (options->timeLimit <= 0.0)
+          {
+          fprintf(stderr, "The time limit must be greater than zero\n");
+          exit(1);
+          }
+        }
+      else if (strcmp(arg, "--sampling-strategy") == 0)
+        {
+        arg = check_next_arg(argc, argv, &argi, strategy_args);
+        if (strcmp(arg, "Regular") == 0)
+          {
+          options->strategy = vtkImageRegistration::RegularSampling;
+          }
+        else if (strcmp(arg, "Stratified") == 0)
+          {
+          options->strategy = vtkImageRegistration::StratifiedSampling;
+          }
+        else if (strcmp(arg, "Gradient") == 0)
+          {
+          options->strategy = vtkImageRegistration::GradientSampling;
+          }
+        }
+      else if (strcmp(arg, "--initializer") == 0)
+        {
+        arg = check_next_arg(argc, argv, &argi, initializer_args);
+        if (strcmp(arg, "C") == 0 ||
+            strcmp(arg, "Centered") == 0)
+          {
+          options->initializer = vtkImageRegistration::Centered;
+          }
+        else if (strcmp(arg, "M") == 0 ||
+                 strcmp(arg, "Moments") == 0)
+          {
+          options->initializer = vtkImageRegistration::Moments;
+          }
+        else if (strcmp(arg, "PC") == 0 ||
+                 strcmp(arg, "PhaseCorrelation") == 0)
+          {
+          options->initializer = vtkImageRegistration::PhaseCorrelation;
+          }
+        }
+      else if (strcmp(arg, "--search") == 0)
+        {
+        arg = check_next_arg(argc, argv, &argi, 0);
+        options->search = strtod(arg, NULL);
+        if (options->search <= 0.0 || options->search > 180.0)
+          {
+          fprintf(stderr, "The search angle must be between 0 and 180\n");
+          exit(1);
+          }
+        }
+      else if (strcmp(arg, "--jobs") == 0)
+        {
+        arg = check_next_arg(argc, argv, &argi, 0);
+        options->jobs = arg;
+        }
+      else if (strcmp(arg, "--summary") == 0)
+        {
+        arg = check_next_arg(argc, argv, &argi, 0);
+        options->summary = arg;
+        }
       else if (strcmp(arg, "-d") == 0 ||
                strcmp(arg, "--display") == 0)
         {
@@ -2034,128 +2313,1062 @@ int register_read_options(
   return 1;
 }
 
-int main(int argc, char *argv[])
+// Set up a registration according to the options, and return the number
+// of pyramid levels, each level blurs the images to half the resolution
+// of the next level, and the final level is full resolution
+int register_configure(
+  vtkImageRegistration *registration, const register_options *options)
 {
-  register_options options;
-  register_initialize_options(&options);
-  register_read_options(argc, argv, &options);
+  double transformTolerance = 0.1; // tolerance on transformation result
+  int numberOfBins = 64; // for Mattes' mutual information
+  double initialBlurFactor = 8.0;
 
-  // -------------------------------------------------------
-  // the files
-  std::vector<TransformArg> *xfminputs = &options.transforms;
-  const char *xfmfile = options.outxfm;
-  const char *imagefile = options.output;
-  const char *sourcefile = options.source;
-  const char *targetfile = options.target;
-  bool display = (options.display != 0 ||
-                  options.screenshot != 0);
+  int numberOfLevels = 0;
+  int maxEvaluations = 0;
+  while (numberOfLevels < 4 && options->maxeval[numberOfLevels] > 0)
+    {
+    if (options->maxeval[numberOfLevels] > maxEvaluations)
+      {
+      maxEvaluations = options->maxeval[numberOfLevels];
+      }
+    numberOfLevels++;
+    }
 
-  if (!sourcefile || !targetfile)
+  registration->SetTransformDimensionality(options->dimensionality);
+  registration->SetTransformType(options->transform);
+  registration->SetMetricType(options->metric);
+  registration->SetInterpolatorType(options->interpolator);
+  registration->SetOptimizerType(options->optimizer);
+  registration->SetJointHistogramSize(numberOfBins,numberOfBins);
+  registration->SetCostTolerance(1e-4);
+  registration->SetTransformTolerance(transformTolerance);
+  registration->SetSamplingStrategy(options->strategy);
+  registration->SetMaximumNumberOfIterations(maxEvaluations);
+  registration->SetTimeBudget(options->timeLimit);
+  registration->SetNumberOfLevels(numberOfLevels);
+  for (int level = 0; level < numberOfLevels; level++)
     {
-    register_show_usage(stderr, argv[0]);
-    return 1;
+    registration->SetLevelShrinkFactor(
+      level, ldexp(initialBlurFactor, -level));
+    registration->SetLevelMaximumNumberOfEvaluations(
+      level, options->maxeval[level]);
+    registration->SetLevelSamplingFraction(level, options->sampling[level]);
     }
 
-  // -------------------------------------------------------
-  // parameters for registration
+  return numberOfLevels;
+}
 
-  int interpolatorType = options.interpolator;
-  double transformTolerance = 0.1; // tolerance on transformation result
-  int numberOfBins = 64; // for Mattes' mutual information
-  double initialBlurFactor = 8.0;
+// Set the initializer that is used at the coarsest pyramid level
+void register_set_initializer(
+  vtkImageRegistration *registration, const register_options *options)
+{
+  if (options->search > 0)
+    {
+    registration->SetInitializerTypeToGridSearch();
+    registration->SetInitializerAngleStep(options->search);
+    }
+  else if (options->initializer >= 0)
+    {
+    registration->SetInitializerType(options->initializer);
+    }
+}
 
-  // -------------------------------------------------------
-  // parameters for parallel processing
-  if (options.parallel == ThreadPool)
+// -------------------------------------------------------
+// batch mode, for the jobs that are listed in a manifest
+
+// A job that was read from the manifest, and its results
+struct register_job
+{
+  std::string name;
+  std::string source;
+  std::string target;
+  std::string initial;
+  std::string transform;
+  std::string report;
+  int coords;
+  std::string status;
+  double seconds;
+  int evaluations;
+  double cost;
+};
+
+void register_initialize_job(register_job *job)
+{
+  job->coords = NativeCoords;
+  job->status = "pending";
+  job->seconds = 0.0;
+  job->evaluations = 0;
+  job->cost = 0.0;
+}
+
+// Set the field of a job that matches a manifest column (or json key),
+// or return false if the column is not recognized
+bool register_set_job_field(
+  register_job *job, const std::string& key, const std::string& value)
+{
+  if (key == "name")
     {
-#ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
-    vtkThreadedImageAlgorithm::SetGlobalDefaultEnableSMP(true);
-#else
-    cerr << "Warning: ThreadPool not available, ";
-    cerr << "no backend was configured at build time.\n";
-#endif
+    job->name = value;
     }
-  else if (options.parallel == MultiThread)
+  else if (key == "source")
     {
-#ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
-    vtkThreadedImageAlgorithm::SetGlobalDefaultEnableSMP(false);
-#endif
+    job->source = value;
+    }
+  else if (key == "target")
+    {
+    job->target = value;
+    }
+  else if (key == "initial")
+    {
+    job->initial = value;
+    }
+  else if (key == "transform")
+    {
+    job->transform = value;
+    }
+  else if (key == "report")
+    {
+    job->report = value;
     }
   else
     {
-#ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
-    vtkThreadedImageAlgorithm::SetGlobalDefaultEnableSMP(false);
-#endif
-    vtkMultiThreader::SetGlobalMaximumNumberOfThreads(1);
-    vtkMultiThreader::SetGlobalDefaultNumberOfThreads(1);
+    return false;
     }
 
-  // -------------------------------------------------------
-  // load and concatenate the initial matrix transforms
-  vtkSmartPointer<vtkMatrix4x4> initialMatrix =
-    vtkSmartPointer<vtkMatrix4x4>::New();
-  vtkSmartPointer<vtkMatrix4x4> tempMatrix =
-    vtkSmartPointer<vtkMatrix4x4>::New();
-  for (size_t ti = 0; ti < xfminputs->size(); ti++)
-    {
-    TransformArg trans = xfminputs->at(ti);
-    if (!options.silent)
+  return true;
+}
+
+// Split a line of a csv file into fields, where fields can be quoted,
+// and where whitespace around each field is ignored
+void register_split_csv(
+  const std::string& line, std::vector<std::string> *fields)
+{
+  fields->clear();
+  std::string field;
+  size_t n = line.size();
+  size_t i = 0;
+  while (i <= n)
+    {
+    while (i < n && isspace(static_cast<unsigned char>(line[i]))) { i++; }
+    field.clear();
+    if (i < n && line[i] == '\"')
       {
-      cout << "Reading initial transform: " << trans.filename << endl;
-      if (trans.invert)
+      // a quoted field, where a doubled quote is a literal quote
+      for (i++; i < n; i++)
         {
-        cout << "Using inverse of transform." << endl;
+        if (line[i] == '\"')
+          {
+          if (i + 1 < n && line[i + 1] == '\"')
+            {
+            i++;
+            }
+          else
+            {
+            i++;
+            break;
+            }
+          }
+        field += line[i];
         }
+      while (i < n && line[i] != ',') { i++; }
       }
+    else
+      {
+      size_t j = i;
+      while (i < n && line[i] != ',') { i++; }
+      size_t k = i;
+      while (k > j && isspace(static_cast<unsigned char>(line[k - 1]))) { k--; }
+      field = line.substr(j, k - j);
+      }
+    fields->push_back(field);
+    i++;
+    }
+}
 
-    ReadMatrix(tempMatrix, trans.filename);
-    if (trans.invert)
+bool register_read_csv(const char *filename, std::vector<register_job> *jobs)
+{
+  ifstream infile(filename);
+  if (!infile.good())
+    {
+    fprintf(stderr, "Unable to open manifest %s\n", filename);
+    return false;
+    }
+
+  std::vector<std::string> header;
+  std::vector<std::string> fields;
+  std::string line;
+  register_job job;
+  while (std::getline(infile, line))
+    {
+    // skip blank lines and comments
+    size_t i = 0;
+    while (i < line.size() && isspace(static_cast<unsigned char>(line[i]))) { i++; }
+    if (i == line.size() || line[i] == '#')
       {
-      tempMatrix->Invert();
+      continue;
       }
 
-    vtkMatrix4x4::Multiply4x4(tempMatrix, initialMatrix, initialMatrix);
+    register_split_csv(line, &fields);
+    if (header.empty())
+      {
+      header = fields;
+      for (size_t k = 0; k < header.size(); k++)
+        {
+        if (!register_set_job_field(&job, header[k], ""))
+          {
+          fprintf(stderr, "Unrecognized column \"%s\" in manifest %s\n",
+                  header[k].c_str(), filename);
+          return false;
+          }
+        }
+      continue;
+      }
+
+    register_initialize_job(&job);
+    for (size_t k = 0; k < fields.size() && k < header.size(); k++)
+      {
+      register_set_job_field(&job, header[k], fields[k]);
+      }
+    jobs->push_back(job);
     }
 
-  // -------------------------------------------------------
-  // load the images
+  return true;
+}
 
-  if (options.coords == NativeCoords)
+// Read a json string, and advance the pointer past the closing quote
+bool register_json_string(const char **cp, std::string *s)
+{
+  const char *p = *cp;
+  if (*p != '\"')
     {
-    int ic = CoordSystem(sourcefile);
-    int oc = CoordSystem(targetfile);
+    return false;
+    }
 
-    if (ic == DICOMCoords || oc == DICOMCoords)
+  s->clear();
+  for (p++; *p != '\"'; p++)
+    {
+    if (*p == '\0')
       {
-      options.coords = DICOMCoords;
+      return false;
+      }
+    else if (*p == '\\')
+      {
+      // unicode escapes are not supported
+      p++;
+      switch (*p)
+        {
+        case '\"': case '\\': case '/': *s += *p; break;
+        case 'b': *s += '\b'; break;
+        case 'f': *s += '\f'; break;
+        case 'n': *s += '\n'; break;
+        case 'r': *s += '\r'; break;
+        case 't': *s += '\t'; break;
+        default: return false;
+        }
       }
     else
       {
-      options.coords = NIFTICoords;
+      *s += *p;
       }
     }
 
-  if (!options.silent)
+  *cp = p + 1;
+  return true;
+}
+
+void register_json_skip(const char **cp)
+{
+  while (isspace(static_cast<unsigned char>(**cp))) { ++*cp; }
+}
+
+// Read a json manifest, which must be an array of objects with values
+// that are strings
+bool register_read_json(
+  const char *filename, std::vector<register_job> *jobs)
+{
+  ifstream infile(filename);
+  if (!infile.good())
     {
-    cout << "Reading source image: " << sourcefile << endl;
+    fprintf(stderr, "Unable to open manifest %s\n", filename);
+    return false;
     }
 
-  double sourceRange[2] = { 0.0, 1.0 };
-  vtkSmartPointer<vtkImageData> sourceImage =
-    vtkSmartPointer<vtkImageData>::New();
-  vtkSmartPointer<vtkMatrix4x4> sourceMatrix =
-    vtkSmartPointer<vtkMatrix4x4>::New();
-  vtkSmartPointer<vtkImageReader2> sourceReader =
-    ReadImage(sourceImage, sourceMatrix, sourceRange,
-              sourcefile, options.coords, options.interpolator);
-  sourceReader->Delete();
+  std::string text;
+  std::getline(infile, text, '\0');
 
-  if (!options.silent)
+  const char *cp = text.c_str();
+  register_json_skip(&cp);
+  bool ok = (*cp == '[');
+  if (ok)
     {
-    cout << "Reading target image: " << targetfile << endl;
+    cp++;
+    register_json_skip(&cp);
     }
 
-  double targetRange[2] = { 0.0, 1.0 };
+  while (ok && *cp != ']')
+    {
+    register_job job;
+    register_initialize_job(&job);
+
+    ok = (*cp == '{');
+    if (ok)
+      {
+      cp++;
+      register_json_skip(&cp);
+      }
+    while (ok && *cp != '}')
+      {
+      std::string key;
+      std::string value;
+      ok = register_json_string(&cp, &key);
+      if (ok)
+        {
+        register_json_skip(&cp);
+        ok = (*cp == ':');
+        }
+      if (ok)
+        {
+        cp++;
+        register_json_skip(&cp);
+        ok = register_json_string(&cp, &value);
+        }
+      if (ok && !register_set_job_field(&job, key, value))
+        {
+        fprintf(stderr, "Unrecognized key \"%s\" in manifest %s\n",
+                key.c_str(), filename);
+        return false;
+        }
+      register_json_skip(&cp);
+      if (ok && *cp == ',')
+        {
+        cp++;
+        register_json_skip(&cp);
+        ok = (*cp == '\"');
+        }
+      }
+
+    if (ok)
+      {
+      jobs->push_back(job);
+      cp++;
+      register_json_skip(&cp);
+      if (*cp == ',')
+        {
+        cp++;
+        register_json_skip(&cp);
+        ok = (*cp == '{');
+        }
+      }
+    }
+
+  if (ok)
+    {
+    cp++;
+    register_json_skip(&cp);
+    ok = (*cp == '\0');
+    }
+
+  if (!ok)
+    {
+    fprintf(stderr, "Syntax error in manifest %s at character %d\n",
+            filename, static_cast<int>(cp - text.c_str()));
+    }
+
+  return ok;
+}
+
+// An image that has been read for the jobs, together with the targets
+// that have been prepared from it (for each source voxel spacing), the
+// lock ensures that the image is read and each target is built only once,
+// and if the image could not be read then it is marked as failed
+struct register_image
+{
+  register_image() : uses(0), failed(false), lock(0) {
+    range[0] = 0.0; range[1] = 1.0; }
+
+  vtkSmartPointer<vtkImageData> image;
+  vtkSmartPointer<vtkMatrix4x4> matrix;
+  double range[2];
+  int uses;
+  bool failed;
+  std::map<double, vtkSmartPointer<vtkImageRegistrationTarget> > prepared;
+  vtkSimpleMutexLock *lock;
+};
+
+// The shared state for running the jobs, everything except the jobs
+// themselves must only be accessed while holding the lock, except that
+// the reading of each image and the building of its prepared targets is
+// done while holding only the lock for that image
+struct register_batch
+{
+  const register_options *options;
+  std::vector<register_job> *jobs;
+  std::map<std::string, register_image> images;
+  vtkSimpleMutexLock *lock;
+  size_t next;
+  int threadsPerJob;
+};
+
+std::string register_image_key(const std::string& filename, int coords)
+{
+  return filename + (coords == DICOMCoords ? "|LPS" : "|RAS");
+}
+
+// Get an image, and read it if this is the first job to use it, jobs
+// that use other images are not blocked while the image is being read,
+// and the caller must check whether the image failed to read
+register_image *register_acquire_image(
+  register_batch *batch, const std::string& filename, int coords)
+{
+  batch->lock->Lock();
+  register_image *entry =
+    &batch->images[register_image_key(filename, coords)];
+  batch->lock->Unlock();
+
+  entry->lock->Lock();
+  if (!entry->image && !entry->failed)
+    {
+    entry->image = vtkSmartPointer<vtkImageData>::New();
+    entry->matrix = vtkSmartPointer<vtkMatrix4x4>::New();
+    vtkImageReader2 *reader = ReadImage(
+      entry->image, entry->matrix, entry->range, filename.c_str(),
+      coords, batch->options->interpolator);
+    if (reader)
+      {
+      reader->Delete();
+      }
+    else
+      {
+      entry->image = NULL;
+      entry->matrix = NULL;
+      entry->failed = true;
+      }
+    }
+  entry->lock->Unlock();
+
+  return entry;
+}
+
+// Get the target prepared for the given source spacing, and build it if
+// this is the first job to use it
+vtkImageRegistrationTarget *register_acquire_prepared(
+  register_image *entry, double spacing, vtkImageRegistration *registration)
+{
+  entry->lock->Lock();
+  vtkSmartPointer<vtkImageRegistrationTarget>& prepared =
+    entry->prepared[spacing];
+  if (!prepared)
+    {
+    prepared = vtkSmartPointer<vtkImageRegistrationTarget>::New();
+    prepared->CopySettings(registration);
+    prepared->SetReferenceSpacing(spacing);
+    prepared->SetTargetImage(entry->image);
+    prepared->Build();
+    }
+  vtkImageRegistrationTarget *result = prepared;
+  entry->lock->Unlock();
+
+  return result;
+}
+
+// Release an image, and free it if no remaining jobs will use it
+void register_release_image(register_image *entry)
+{
+  if (--entry->uses == 0)
+    {
+    entry->image = NULL;
+    entry->matrix = NULL;
+    entry->prepared.clear();
+    }
+}
+
+void register_run_job(register_batch *batch, register_job *job)
+{
+  const register_options *options = batch->options;
+  double startTime = vtkTimerLog::GetUniversalTime();
+
+  vtkSmartPointer<vtkImageRegistration> registration =
+    vtkSmartPointer<vtkImageRegistration>::New();
+  registration->GetThreadPool()->SetNumberOfThreads(batch->threadsPerJob);
+  int numberOfLevels = register_configure(registration, options);
+  if (!job->report.empty())
+    {
+    registration->CollectValuesOn();
+    registration->CollectProfileOn();
+    }
+
+  vtkSmartPointer<vtkMatrix4x4> initialMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  vtkSmartPointer<vtkMatrix4x4> sourceMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  vtkSmartPointer<vtkMatrix4x4> targetMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  vtkSmartPointer<vtkImageData> sourceImage =
+    vtkSmartPointer<vtkImageData>::New();
+
+  // get the inputs, the registration only receives shallow copies of
+  // the shared images, so that the shared data objects never become
+  // part of a pipeline
+  bool failed = false;
+  if (!job->initial.empty())
+    {
+    failed = !ReadMatrix(initialMatrix, job->initial.c_str());
+    }
+  register_image *source = NULL;
+  register_image *target = NULL;
+  if (!failed)
+    {
+    source = register_acquire_image(batch, job->source, job->coords);
+    failed = source->failed;
+    }
+  if (!failed)
+    {
+    target = register_acquire_image(batch, job->target, job->coords);
+    failed = target->failed;
+    }
+
+  if (failed)
+    {
+    // a bad input only fails this job, the other jobs still run, and
+    // the images that it would have used are released as usual
+    job->seconds = vtkTimerLog::GetUniversalTime() - startTime;
+    job->status = "failed";
+
+    batch->lock->Lock();
+    register_release_image(
+      &batch->images[register_image_key(job->source, job->coords)]);
+    register_release_image(
+      &batch->images[register_image_key(job->target, job->coords)]);
+    if (!options->silent)
+      {
+      cout << "Job " << job->name << " failed" << endl;
+      }
+    batch->lock->Unlock();
+    return;
+    }
+
+  batch->lock->Lock();
+  sourceMatrix->DeepCopy(source->matrix);
+  targetMatrix->DeepCopy(target->matrix);
+  sourceImage->ShallowCopy(source->image);
+  registration->SetSourceImage(sourceImage);
+  registration->SetSourceImageRange(source->range);
+  registration->SetTargetImageRange(target->range);
+  batch->lock->Unlock();
+
+  // the target pyramid depends on the source spacing, so the prepared
+  // target is shared by all jobs whose sources have the same spacing
+  double spacing[3];
+  sourceImage->GetSpacing(spacing);
+  double minSpacing = VTK_DOUBLE_MAX;
+  for (int j = 0; j < 3; j++)
+    {
+    minSpacing = (fabs(spacing[j]) < minSpacing ?
+                  fabs(spacing[j]) : minSpacing);
+    }
+  vtkImageRegistrationTarget *prepared =
+    register_acquire_prepared(target, minSpacing, registration);
+
+  batch->lock->Lock();
+  registration->SetPreparedTarget(prepared);
+  batch->lock->Unlock();
+
+  // apply the initial transform in the same way as for a single job
+  vtkSmartPointer<vtkMatrix4x4> originalSourceMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  originalSourceMatrix->DeepCopy(sourceMatrix);
+  vtkSmartPointer<vtkMatrix4x4> originalTargetMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  originalTargetMatrix->DeepCopy(targetMatrix);
+
+  vtkSmartPointer<vtkMatrix4x4> matrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  matrix->DeepCopy(initialMatrix);
+  matrix->Invert();
+  vtkMatrix4x4::Multiply4x4(matrix, targetMatrix, targetMatrix);
+  matrix->DeepCopy(targetMatrix);
+  matrix->Invert();
+  vtkMatrix4x4::Multiply4x4(matrix, sourceMatrix, matrix);
+
+  if (job->initial.empty())
+    {
+    registration->SetInitializerTypeToCentered();
+    }
+  else
+    {
+    registration->SetInitializerTypeToNone();
+    }
+
+  if (numberOfLevels > 0)
+    {
+    register_set_initializer(registration, options);
+    registration->InitializePyramid(matrix);
+    while (registration->IteratePyramid()) { }
+    }
+  else
+    {
+    registration->Initialize(matrix);
+    }
+
+  // the center is used by the ITK transform writer
+  double bounds[6];
+  double center[4];
+  vtkImageData *centerImage = sourceImage;
+  vtkMatrix4x4 *centerMatrix = originalSourceMatrix;
+  if (options->source_to_target)
+    {
+    centerImage = registration->GetTargetImage();
+    centerMatrix = originalTargetMatrix;
+    }
+  centerImage->GetBounds(bounds);
+  center[0] = 0.5*(bounds[0] + bounds[1]);
+  center[1] = 0.5*(bounds[2] + bounds[3]);
+  center[2] = 0.5*(bounds[4] + bounds[5]);
+  center[3] = 1.0;
+  centerMatrix->MultiplyPoint(center, center);
+
+  if (!job->transform.empty())
+    {
+    vtkMatrix4x4 *rmatrix = registration->GetTransform()->GetMatrix();
+    vtkSmartPointer<vtkMatrix4x4> wmatrix =
+      vtkSmartPointer<vtkMatrix4x4>::New();
+    wmatrix->DeepCopy(originalSourceMatrix);
+    wmatrix->Invert();
+    vtkMatrix4x4::Multiply4x4(rmatrix, wmatrix, wmatrix);
+    vtkMatrix4x4::Multiply4x4(originalTargetMatrix, wmatrix, wmatrix);
+
+    WriteMatrix(wmatrix, job->transform.c_str(), center);
+    }
+
+  if (!job->report.empty())
+    {
+    WriteReport(registration, job->report.c_str());
+    }
+
+  job->evaluations = 0;
+  for (int level = 0; level < numberOfLevels; level++)
+    {
+    job->evaluations += registration->GetLevelNumberOfEvaluations(level);
+    }
+  job->cost = registration->GetCostValue();
+  job->seconds = vtkTimerLog::GetUniversalTime() - startTime;
+  job->status = "done";
+
+  // release the images while holding the lock, since they are shared
+  batch->lock->Lock();
+  registration = NULL;
+  sourceImage = NULL;
+  register_release_image(source);
+  register_release_image(target);
+  if (!options->silent)
+    {
+    cout << "Job " << job->name << " took " << job->seconds << "s and "
+         << job->evaluations << " evaluations" << endl;
+    }
+  batch->lock->Unlock();
+}
+
+VTK_THREAD_RETURN_TYPE register_job_thread(void *arg)
+{
+  vtkMultiThreader::ThreadInfo *info =
+    static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  register_batch *batch = static_cast<register_batch *>(info->UserData);
+
+  for (;;)
+    {
+    batch->lock->Lock();
+    size_t i = batch->next++;
+    batch->lock->Unlock();
+
+    if (i >= batch->jobs->size())
+      {
+      break;
+      }
+
+    register_job *job = &(*batch->jobs)[i];
+    if (job->status == "pending")
+      {
+      register_run_job(batch, job);
+      }
+    }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+// Write the summary of the jobs as csv
+void register_write_summary(
+  FILE *f, const std::vector<register_job>& jobs)
+{
+  fprintf(f, "\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\"\n",
+          "job", "source", "target", "status", "seconds", "evaluations",
+          "cost");
+  for (size_t i = 0; i < jobs.size(); i++)
+    {
+    const register_job& job = jobs[i];
+    fprintf(f, "\"%s\",\"%s\",\"%s\",\"%s\",%g,%i,%g\n",
+            job.name.c_str(), job.source.c_str(), job.target.c_str(),
+            job.status.c_str(), job.seconds, job.evaluations, job.cost);
+    }
+}
+
+// Run all of the jobs in the manifest given by the --jobs option
+int register_run_jobs(const register_options *options)
+{
+  std::vector<register_job> jobs;
+  size_t l = strlen(options->jobs);
+  bool ok = false;
+  if (l > 5 && strcmp(options->jobs + l - 5, ".json") == 0)
+    {
+    ok = register_read_json(options->jobs, &jobs);
+    }
+  else
+    {
+    ok = register_read_csv(options->jobs, &jobs);
+    }
+  if (!ok)
+    {
+    return 1;
+    }
+
+  register_batch batch;
+  batch.options = options;
+  batch.jobs = &jobs;
+  batch.next = 0;
+
+  // check the files before starting, and count how many jobs use each
+  // image so that it can be freed after its last job
+  int runnable = 0;
+  for (size_t i = 0; i < jobs.size(); i++)
+    {
+    register_job *job = &jobs[i];
+    if (job->name.empty())
+      {
+      char name[32];
+      sprintf(name, "%d", static_cast<int>(i + 1));
+      job->name = name;
+      }
+
+    if (job->source.empty() || job->target.empty() ||
+        !vtksys::SystemTools::FileExists(job->source.c_str()) ||
+        !vtksys::SystemTools::FileExists(job->target.c_str()) ||
+        (!job->initial.empty() &&
+         !vtksys::SystemTools::FileExists(job->initial.c_str())))
+      {
+      fprintf(stderr, "Job %s: missing input file\n", job->name.c_str());
+      job->status = "missing";
+      continue;
+      }
+
+    job->coords = options->coords;
+    if (job->coords == NativeCoords)
+      {
+      int ic = CoordSystem(job->source.c_str());
+      int oc = CoordSystem(job->target.c_str());
+      job->coords = ((ic == DICOMCoords || oc == DICOMCoords) ?
+                     DICOMCoords : NIFTICoords);
+      }
+
+    batch.images[register_image_key(job->source, job->coords)].uses++;
+    batch.images[register_image_key(job->target, job->coords)].uses++;
+    runnable++;
+    }
+
+  // divide the thread budget between the jobs that run concurrently,
+  // this also limits the threads used by each VTK filter
+  int budget = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  int concurrent = (runnable < budget ? runnable : budget);
+  concurrent = (concurrent > 1 ? concurrent : 1);
+  batch.threadsPerJob = budget/concurrent;
+  vtkMultiThreader::SetGlobalDefaultNumberOfThreads(batch.threadsPerJob);
+#ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
+  if (options->parallel == ThreadPool)
+    {
+    vtkSMPTools::Initialize(budget);
+    }
+#endif
+
+  if (!options->silent)
+    {
+    cout << "Running " << runnable << " jobs, " << concurrent
+         << " at a time with " << batch.threadsPerJob
+         << " threads each" << endl;
+    }
+
+  double startTime = vtkTimerLog::GetUniversalTime();
+
+  batch.lock = vtkSimpleMutexLock::New();
+  std::map<std::string, register_image>::iterator iter;
+  for (iter = batch.images.begin(); iter != batch.images.end(); ++iter)
+    {
+    iter->second.lock = vtkSimpleMutexLock::New();
+    }
+  vtkSmartPointer<vtkMultiThreader> threader =
+    vtkSmartPointer<vtkMultiThreader>::New();
+  threader->SetNumberOfThreads(concurrent);
+  threader->SetSingleMethod(register_job_thread, &batch);
+  threader->SingleMethodExecute();
+  for (iter = batch.images.begin(); iter != batch.images.end(); ++iter)
+    {
+    iter->second.lock->Delete();
+    }
+  batch.lock->Delete();
+
+  if (!options->silent)
+    {
+    cout << "jobs took " << (vtkTimerLog::GetUniversalTime() - startTime)
+         << "s" << endl;
+    }
+
+  if (options->summary)
+    {
+    FILE *f = fopen(options->summary, "w");
+    if (!f)
+      {
+      fprintf(stderr, "Unable to open output file %s\n", options->summary);
+      return 1;
+      }
+    register_write_summary(f, jobs);
+    fclose(f);
+    }
+  else
+    {
+    register_write_summary(stdout, jobs);
+    }
+
+  int done = 0;
+  for (size_t i = 0; i < jobs.size(); i++)
+    {
+    done += (jobs[i].status == "done");
+    }
+
+  return (done == static_cast<int>(jobs.size()) ? 0 : 1);
+}
+
+// Race several configurations with a vtkImageRegistrationPortfolio, as
+// requested by the --portfolio option, and return the winner
+vtkSmartPointer<vtkImageRegistration> register_run_portfolio(
+  const register_options *options, vtkImageData *sourceImage,
+  vtkImageData *targetImage, double sourceRange[2],
+  double targetRange[2], vtkMatrix4x4 *matrix, bool initialized)
+{
+  static const int metrics[3] = {
+    vtkImageRegistration::MutualInformation,
+    vtkImageRegistration::NormalizedMutualInformation,
+    vtkImageRegistration::CorrelationRatio };
+  static const char *metricNames[3] = { "MI", "NMI", "CR" };
+  static const int optimizers[2] = {
+    vtkImageRegistration::Powell,
+    vtkImageRegistration::Amoeba };
+  static const char *optimizerNames[2] = { "Powell", "Amoeba" };
+
+  vtkSmartPointer<vtkImageRegistrationPortfolio> portfolio =
+    vtkSmartPointer<vtkImageRegistrationPortfolio>::New();
+  portfolio->SetSourceImage(sourceImage);
+  portfolio->SetTargetImage(targetImage);
+
+  std::vector<std::string> names;
+  for (int m = 0; m < 3; m++)
+    {
+    for (int o = 0; o < 2; o++)
+      {
+      vtkSmartPointer<vtkImageRegistration> registration =
+        vtkSmartPointer<vtkImageRegistration>::New();
+      register_configure(registration, options);
+      registration->SetMetricType(metrics[m]);
+      registration->SetOptimizerType(optimizers[o]);
+      registration->SetSourceImageRange(sourceRange);
+      registration->SetTargetImageRange(targetRange);
+      if (initialized)
+        {
+        registration->SetInitializerTypeToNone();
+        }
+      else
+        {
+        registration->SetInitializerTypeToCentered();
+        }
+      register_set_initializer(registration, options);
+      if (options->report)
+        {
+        registration->CollectValuesOn();
+        registration->CollectProfileOn();
+        }
+      portfolio->AddRegistration(registration);
+      names.push_back(std::string(metricNames[m]) + "/" + optimizerNames[o]);
+      }
+    }
+
+  double startTime = vtkTimerLog::GetUniversalTime();
+  portfolio->Execute(matrix);
+  double elapsed = vtkTimerLog::GetUniversalTime() - startTime;
+
+  if (!options->silent)
+    {
+    vtkDoubleArray *trace = portfolio->GetTraceValues();
+    for (vtkIdType k = 0; k < trace->GetNumberOfTuples(); k++)
+      {
+      double tuple[8];
+      trace->GetTuple(k, tuple);
+      int i = static_cast<int>(tuple[0]);
+      cout << names[i] << " level " << static_cast<int>(tuple[1])
+           << " scored " << tuple[2] << " (cost " << tuple[3]
+           << ") in " << tuple[4] << "s and "
+           << static_cast<int>(tuple[5]) << " evaluations with "
+           << static_cast<int>(tuple[6]) << " threads"
+           << (tuple[7] != 0 ? "" : ", cancelled") << endl;
+      }
+    if (portfolio->GetBestIndex() >= 0)
+      {
+      cout << "portfolio took " << elapsed << "s, best was "
+           << names[portfolio->GetBestIndex()] << endl;
+      }
+    }
+
+  return portfolio->GetBestRegistration();
+}
+
+int main(int argc, char *argv[])
+{
+  register_options options;
+  register_initialize_options(&options);
+  register_read_options(argc, argv, &options);
+
+  // -------------------------------------------------------
+  // the files
+  std::vector<TransformArg> *xfminputs = &options.transforms;
+  const char *xfmfile = options.outxfm;
+  const char *imagefile = options.output;
+  const char *sourcefile = options.source;
+  const char *targetfile = options.target;
+  bool display = (options.display != 0 ||
+                  options.screenshot != 0);
+
+  if (options.jobs)
+    {
+    if (sourcefile || targetfile || xfminputs->size() > 0 ||
+        xfmfile || imagefile || options.report || display)
+      {
+      fprintf(stderr, "The --jobs option cannot be used with input files, "
+              "or with -o, -r, -j, or -d\n");
+      return 1;
+      }
+    }
+  else if (!sourcefile || !targetfile)
+    {
+    register_show_usage(stderr, argv[0]);
+    return 1;
+    }
+
+  // -------------------------------------------------------
+  // parameters for registration
+
+  int interpolatorType = options.interpolator;
+
+  // -------------------------------------------------------
+  // parameters for parallel processing
+  if (options.parallel == ThreadPool)
+    {
+#ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
+    vtkThreadedImageAlgorithm::SetGlobalDefaultEnableSMP(true);
+#else
+    cerr << "Warning: ThreadPool not available, ";
+    cerr << "no backend was configured at build time.\n";
+#endif
+    }
+  else if (options.parallel == MultiThread)
+    {
+#ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
+    vtkThreadedImageAlgorithm::SetGlobalDefaultEnableSMP(false);
+#endif
+    }
+  else
+    {
+#ifdef USE_SMP_THREADED_IMAGE_ALGORITHM
+    vtkThreadedImageAlgorithm::SetGlobalDefaultEnableSMP(false);
+#endif
+    vtkMultiThreader::SetGlobalMaximumNumberOfThreads(1);
+    vtkMultiThreader::SetGlobalDefaultNumberOfThreads(1);
+    }
+
+  // -------------------------------------------------------
+  // run the jobs from a manifest, instead of a single registration
+  if (options.jobs)
+    {
+    return register_run_jobs(&options);
+    }
+
+  // -------------------------------------------------------
+  // load and concatenate the initial matrix transforms
+  vtkSmartPointer<vtkMatrix4x4> initialMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  vtkSmartPointer<vtkMatrix4x4> tempMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  for (size_t ti = 0; ti < xfminputs->size(); ti++)
+    {
+    TransformArg trans = xfminputs->at(ti);
+    if (!options.silent)
+      {
+      cout << "Reading initial transform: " << trans.filename << endl;
+      if (trans.invert)
+        {
+        cout << "Using inverse of transform." << endl;
+        }
+      }
+
+    if (!ReadMatrix(tempMatrix, trans.filename))
+      {
+      exit(1);
+      }
+    if (trans.invert)
+      {
+      tempMatrix->Invert();
+      }
+
+    vtkMatrix4x4::Multiply4x4(tempMatrix, initialMatrix, initialMatrix);
+    }
+
+  // -------------------------------------------------------
+  // load the images
+
+  if (options.coords == NativeCoords)
+    {
+    int ic = CoordSystem(sourcefile);
+    int oc = CoordSystem(targetfile);
+
+    if (ic == DICOMCoords || oc == DICOMCoords)
+      {
+      options.coords = DICOMCoords;
+      }
+    else
+      {
+      options.coords = NIFTICoords;
+      }
+    }
+
+  if (!options.silent)
+    {
+    cout << "Reading source image: " << sourcefile << endl;
+    }
+
+  double sourceRange[2] = { 0.0, 1.0 };
+  vtkSmartPointer<vtkImageData> sourceImage =
+    vtkSmartPointer<vtkImageData>::New();
+  vtkSmartPointer<vtkMatrix4x4> sourceMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  vtkSmartPointer<vtkImageReader2> sourceReader =
+    ReadImage(sourceImage, sourceMatrix, sourceRange,
+              sourcefile, options.coords, options.interpolator);
+  if (!sourceReader)
+    {
+    exit(1);
+    }
+  sourceReader->Delete();
+
+  if (!options.silent)
+    {
+    cout << "Reading target image: " << targetfile << endl;
+    }
+
+  double targetRange[2] = { 0.0, 1.0 };
   vtkSmartPointer<vtkImageData> targetImage =
     vtkSmartPointer<vtkImageData>::New();
   vtkSmartPointer<vtkMatrix4x4> targetMatrix =
@@ -2163,6 +3376,10 @@ int main(int argc, char *argv[])
   vtkSmartPointer<vtkImageReader2> targetReader =
     ReadImage(targetImage, targetMatrix, targetRange,
               targetfile, options.coords, options.interpolator);
+  if (!targetReader)
+    {
+    exit(1);
+    }
   targetReader->Delete();
 
   if (!options.silent)
@@ -2324,77 +3541,25 @@ int main(int argc, char *argv[])
   // -------------------------------------------------------
   // prepare for registration
 
-  // get information about the images
-  double targetSpacing[3], sourceSpacing[3];
-  targetImage->GetSpacing(targetSpacing);
-  sourceImage->GetSpacing(sourceSpacing);
-
-  for (int jj = 0; jj < 3; jj++)
-    {
-    targetSpacing[jj] = fabs(targetSpacing[jj]);
-    sourceSpacing[jj] = fabs(sourceSpacing[jj]);
-    }
-
-  double minSpacing = sourceSpacing[0];
-  if (minSpacing > sourceSpacing[1])
-    {
-    minSpacing = sourceSpacing[1];
-    }
-  if (minSpacing > sourceSpacing[2])
-    {
-    minSpacing = sourceSpacing[2];
-    }
-
-  // blur source image with Blackman-windowed sinc
-  vtkSmartPointer<vtkImageSincInterpolator> sourceBlurKernel =
-    vtkSmartPointer<vtkImageSincInterpolator>::New();
-  sourceBlurKernel->SetWindowFunctionToBlackman();
-  sourceBlurKernel->AntialiasingOn();
-
-  // reduce the source resolution
-  vtkSmartPointer<vtkImageResize> sourceBlur =
-    vtkSmartPointer<vtkImageResize>::New();
-  sourceBlur->SET_INPUT_DATA(sourceImage);
-  sourceBlur->SetResizeMethodToOutputSpacing();
-  sourceBlur->SetInterpolator(sourceBlurKernel);
-  sourceBlur->SetInterpolate(
-    interpolatorType != vtkImageRegistration::Nearest);
-
-  // blur target with Blackman-windowed sinc
-  vtkSmartPointer<vtkImageSincInterpolator> targetBlurKernel =
-    vtkSmartPointer<vtkImageSincInterpolator>::New();
-  targetBlurKernel->SetWindowFunctionToBlackman();
-  targetBlurKernel->AntialiasingOn();
-
-  // keep target at full resolution
-  vtkSmartPointer<vtkImageResize> targetBlur =
-    vtkSmartPointer<vtkImageResize>::New();
-  targetBlur->SET_INPUT_DATA(targetImage);
-  targetBlur->SetResizeMethodToOutputSpacing();
-  targetBlur->SetInterpolator(targetBlurKernel);
-  targetBlur->SetInterpolate(
-    interpolatorType != vtkImageRegistration::Nearest);
-
   // get the initial transformation
   matrix->DeepCopy(targetMatrix);
   matrix->Invert();
   vtkMatrix4x4::Multiply4x4(matrix, sourceMatrix, matrix);
 
-  // set up the registration
+  // set up the registration, the registration will generate the
+  // blurred, low-resolution images for each level of the pyramid
   vtkSmartPointer<vtkImageRegistration> registration =
     vtkSmartPointer<vtkImageRegistration>::New();
-  registration->SetTargetImageInputConnection(targetBlur->GetOutputPort());
-  registration->SetSourceImageInputConnection(sourceBlur->GetOutputPort());
+  registration->SetTargetImage(targetImage);
+  registration->SetSourceImage(sourceImage);
   registration->SetSourceImageRange(sourceRange);
   registration->SetTargetImageRange(targetRange);
-  registration->SetTransformDimensionality(options.dimensionality);
-  registration->SetTransformType(options.transform);
-  registration->SetMetricType(options.metric);
-  registration->SetInterpolatorType(interpolatorType);
-  registration->SetOptimizerType(options.optimizer);
-  registration->SetJointHistogramSize(numberOfBins,numberOfBins);
-  registration->SetCostTolerance(1e-4);
-  registration->SetTransformTolerance(transformTolerance);
+  int numberOfLevels = register_configure(registration, &options);
+  // the images can only be placed if the resampling is fused
+  bool numa = (options.numa != 0 && !options.portfolio &&
+               options.parallel == MultiThread);
+  registration->SetNUMAPlacement(numa);
+  registration->SetFusedEvaluation(numa);
   if (xfminputs->size() > 0)
     {
     registration->SetInitializerTypeToNone();
@@ -2410,6 +3575,7 @@ int main(int argc, char *argv[])
   if (options.report)
     {
     registration->CollectValuesOn();
+    registration->CollectProfileOn();
     }
 
   // -------------------------------------------------------
@@ -2423,146 +3589,119 @@ int main(int argc, char *argv[])
   // do the registration
 
   // the registration starts at low-resolution
-  double blurFactor = initialBlurFactor;
   int level = 0;
-  // will be set to "true" when registration is initialized
-  bool initialized = false;
+  bool running = false;
 
-  while (level < 4 && options.maxeval[level] > 0)
+  if (numberOfLevels > 0 && options.portfolio)
     {
-    registration->SetMaximumNumberOfEvaluations(options.maxeval[level]);
-    registration->SetMaximumNumberOfIterations(options.maxeval[level]);
-    registration->SetInterpolatorType(interpolatorType);
-    registration->SetTransformTolerance(transformTolerance*blurFactor);
-
-    if (blurFactor < 1.1)
+    // the winner has already finished, so the loop below only shows
+    // its result
+    registration = register_run_portfolio(
+      &options, sourceImage, targetImage, sourceRange, targetRange,
+      matrix, xfminputs->size() > 0);
+    if (!registration)
       {
-      // full resolution: no blurring or resampling
-      sourceBlur->SetInterpolator(0);
-      sourceBlur->InterpolateOff();
-      sourceBlur->SetOutputSpacing(sourceSpacing);
-#if VTK_MAJOR_VERSION >= 6
-      sourceBlur->UpdateWholeExtent();
-#else
-      sourceBlur->GetOutput()->SetUpdateExtentToWholeExtent();
-      sourceBlur->Update();
-#endif
-
-      targetBlur->SetInterpolator(0);
-      sourceBlur->InterpolateOff();
-      targetBlur->SetOutputSpacing(targetSpacing);
-#if VTK_MAJOR_VERSION >= 6
-      targetBlur->UpdateWholeExtent();
-#else
-      targetBlur->GetOutput()->SetUpdateExtentToWholeExtent();
-      targetBlur->Update();
-#endif
+      fprintf(stderr, "The portfolio registration failed\n");
+      return 1;
       }
-    else
+    level = numberOfLevels;
+    running = true;
+    }
+  else if (numberOfLevels > 0)
+    {
+    // the initializers are used at the coarsest level
+    register_set_initializer(registration, &options);
+    double initTime = timer->GetUniversalTime();
+    registration->InitializePyramid(matrix);
+    initTime = timer->GetUniversalTime() - initTime;
+    running = true;
+
+    vtkDoubleArray *costs = registration->GetInitializerCostValues();
+    if (costs->GetNumberOfTuples() > 0 && !options.silent)
       {
-      // reduced resolution: set the blurring
-      double spacing[3];
-      for (int j = 0; j < 3; j++)
+      double bestCost = VTK_DOUBLE_MAX;
+      for (vtkIdType k = 0; k < costs->GetNumberOfTuples(); k++)
         {
-        spacing[j] = blurFactor*minSpacing;
-        if (spacing[j] < sourceSpacing[j])
-          {
-          spacing[j] = sourceSpacing[j];
-          }
+        double cost = costs->GetValue(k);
+        bestCost = (cost < bestCost ? cost : bestCost);
         }
+      cout << "Initializer scored " << costs->GetNumberOfTuples()
+           << " candidates in " << initTime << "s, best cost "
+           << bestCost << endl;
+      }
+    }
 
-      sourceBlurKernel->SetBlurFactors(
-        spacing[0]/sourceSpacing[0],
-        spacing[1]/sourceSpacing[1],
-        spacing[2]/sourceSpacing[2]);
-
-      sourceBlur->SetOutputSpacing(spacing);
-#if VTK_MAJOR_VERSION >= 6
-      sourceBlur->UpdateWholeExtent();
-#else
-      sourceBlur->GetOutput()->SetUpdateExtentToWholeExtent();
-      sourceBlur->Update();
-#endif
-
-      targetBlurKernel->SetBlurFactors(
-        blurFactor*minSpacing/targetSpacing[0],
-        blurFactor*minSpacing/targetSpacing[1],
-        blurFactor*minSpacing/targetSpacing[2]);
+  while (running)
+    {
+    // will iterate until the final level converges or fails
+    running = (registration->IteratePyramid() != 0);
 
-#if VTK_MAJOR_VERSION >= 6
-      targetBlur->UpdateWholeExtent();
-#else
-      targetBlur->GetOutput()->SetUpdateExtentToWholeExtent();
-      targetBlur->Update();
-#endif
+    if (showTargetMoving)
+      {
+      targetMatrix->DeepCopy(registration->GetTransform()->GetMatrix());
+      targetMatrix->Invert();
+      vtkMatrix4x4::Multiply4x4(
+        originalSourceMatrix, targetMatrix, targetMatrix);
+      targetMatrix->Modified();
       }
-
-    if (initialized)
+    else
       {
-      // re-initialize with the matrix from the previous step
-      registration->SetInitializerTypeToNone();
-      matrix->DeepCopy(registration->GetTransform()->GetMatrix());
+      sourceMatrix->DeepCopy(registration->GetTransform()->GetMatrix());
+      vtkMatrix4x4::Multiply4x4(
+        originalTargetMatrix, sourceMatrix, sourceMatrix);
+      sourceMatrix->Modified();
       }
 
-    registration->Initialize(matrix);
-
-    initialized = true;
-
-    while (registration->Iterate())
+    if (display)
       {
-      // registration->UpdateRegistration();
-      // will iterate until convergence or failure
-
-      if (showTargetMoving)
-        {
-        targetMatrix->DeepCopy(registration->GetTransform()->GetMatrix());
-        targetMatrix->Invert();
-        vtkMatrix4x4::Multiply4x4(
-          originalSourceMatrix, targetMatrix, targetMatrix);
-        targetMatrix->Modified();
-        }
-      else
-        {
-        sourceMatrix->DeepCopy(registration->GetTransform()->GetMatrix());
-        vtkMatrix4x4::Multiply4x4(
-          originalTargetMatrix, sourceMatrix, sourceMatrix);
-        sourceMatrix->Modified();
-        }
-
-      if (display)
-        {
-        interactor->Render();
-        }
+      interactor->Render();
       }
 
-    double newTime = timer->GetUniversalTime();
-    double blurSpacing[3];
-    sourceBlur->GetOutputSpacing(blurSpacing);
-    double minBlurSpacing = VTK_DOUBLE_MAX;
-    for (int kk = 0; kk < 3; kk++)
+    // report on each level when it is complete
+    for (; level < registration->GetCurrentLevel(); level++)
       {
-      if (blurSpacing[kk] < minBlurSpacing)
+      double blurSpacing[3];
+      registration->GetLevelSourceImage(level)->GetSpacing(blurSpacing);
+      double minBlurSpacing = VTK_DOUBLE_MAX;
+      for (int kk = 0; kk < 3; kk++)
         {
-        minBlurSpacing = blurSpacing[kk];
+        if (fabs(blurSpacing[kk]) < minBlurSpacing)
+          {
+          minBlurSpacing = fabs(blurSpacing[kk]);
+          }
         }
-      }
 
-    if (!options.silent)
-      {
-      cout << minBlurSpacing << " mm took "
-           << (newTime - lastTime) << "s and "
-           << registration->GetNumberOfEvaluations() << " evaluations" << endl;
-      lastTime = newTime;
+      lastTime = timer->GetUniversalTime();
+      if (!options.silent)
+        {
+        double fraction = registration->GetLevelUsedSamplingFraction(level);
+        if (options.timeLimit > 0 && fraction == 0)
+          {
+          cout << minBlurSpacing << " mm skipped, out of time" << endl;
+          continue;
+          }
+        cout << minBlurSpacing << " mm took "
+             << registration->GetLevelElapsedTime(level) << "s and "
+             << registration->GetLevelNumberOfEvaluations(level)
+             << " evaluations";
+        if (options.timeLimit > 0)
+          {
+          cout << " (sampling " << fraction << " with "
+               << registration->GetLevelTimeBudget(level) << "s left)";
+          }
+        cout << endl;
+        }
       }
-
-    // prepare for next iteration
-    level++;
-    blurFactor /= 2.0;
     }
 
   if (!options.silent)
     {
     cout << "registration took " << (lastTime - startTime) << "s" << endl;
+    if (registration->GetStoppedByTimeBudget())
+      {
+      cout << "registration was stopped by the time limit of "
+           << options.timeLimit << "s" << endl;
+      }
     }
 
   // -------------------------------------------------------
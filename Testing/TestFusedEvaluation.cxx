@@ -0,0 +1,305 @@
+/*=========================================================================
+
+Program:   Atamai Image Registration and Segmentation
+Module:    TestFusedEvaluation.cxx
+
+   This software is distributed WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+=========================================================================*/
+// Test that each metric gives the same cost whether the target image is
+// resampled with vtkImageReslice or the resampling is fused with the
+// metric.  The costs are compared at several fixed transforms, including
+// one that moves part of the image out of bounds, with linear and cubic
+// interpolation, and with and without a stencil.  The images are double,
+// so that vtkImageReslice does not round the resampled values, and the
+// two paths should only differ by the order of the arithmetic.  The fused
+// cost is also compared with the cost at a step along a line search that
+// passes through the same transform.
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+#include <vtkImageCast.h>
+#include <vtkImageInterpolator.h>
+#include <vtkImageReslice.h>
+#include <vtkImageStencilData.h>
+#include <vtkROIStencilSource.h>
+#include <vtkTransform.h>
+#include <vtkMatrix4x4.h>
+#include <vtkVersion.h>
+
+#include <vtkImageSquaredDifference.h>
+#include <vtkImageCrossCorrelation.h>
+#include <vtkImageNeighborhoodCorrelation.h>
+#include <vtkImageCorrelationRatio.h>
+#include <vtkImageMutualInformation.h>
+
+#include "BenchmarkPhantom.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// A macro to assist VTK 5 backwards compatibility
+#if VTK_MAJOR_VERSION >= 6
+#define SET_INPUT_DATA SetInputData
+#define SET_STENCIL_DATA SetStencilData
+#else
+#define SET_INPUT_DATA SetInput
+#define SET_STENCIL_DATA SetStencil
+#endif
+
+namespace {
+
+const char *MetricNames[] = {
+  "SquaredDifference",
+  "CrossCorrelation",
+  "NormalizedCrossCorrelation",
+  "NeighborhoodCorrelation",
+  "CorrelationRatio",
+  "MutualInformation",
+  "NormalizedMutualInformation",
+  NULL
+};
+
+//----------------------------------------------------------------------------
+// Create the metric with the given index in MetricNames.
+vtkImageSimilarityMetric *NewMetric(int metricType)
+{
+  vtkImageSimilarityMetric *metric = NULL;
+  if (metricType == 0)
+    {
+    metric = vtkImageSquaredDifference::New();
+    }
+  else if (metricType == 1 || metricType == 2)
+    {
+    vtkImageCrossCorrelation *cc = vtkImageCrossCorrelation::New();
+    if (metricType == 2)
+      {
+      cc->SetMetricToNormalizedCrossCorrelation();
+      }
+    metric = cc;
+    }
+  else if (metricType == 3)
+    {
+    metric = vtkImageNeighborhoodCorrelation::New();
+    }
+  else if (metricType == 4)
+    {
+    metric = vtkImageCorrelationRatio::New();
+    }
+  else
+    {
+    vtkImageMutualInformation *mi = vtkImageMutualInformation::New();
+    mi->SetNumberOfBins(64, 64);
+    if (metricType == 6)
+      {
+      mi->SetMetricToNormalizedMutualInformation();
+      }
+    metric = mi;
+    }
+
+  double range[2] = { 0.0, 1000.0 };
+  metric->SetInputRange(0, range);
+  metric->SetInputRange(1, range);
+
+  return metric;
+}
+
+//----------------------------------------------------------------------------
+// Compute the cost with vtkImageReslice, in the same way as the
+// registration does when FusedEvaluation is off.
+double ResliceCost(
+  int metricType, vtkImageData *source, vtkImageData *target,
+  vtkImageStencilData *stencil, vtkAbstractImageInterpolator *interpolator,
+  vtkLinearTransform *transform)
+{
+  vtkSmartPointer<vtkImageReslice> reslice =
+    vtkSmartPointer<vtkImageReslice>::New();
+  reslice->SetInformationInput(source);
+  reslice->SET_INPUT_DATA(target);
+  reslice->SET_STENCIL_DATA(stencil);
+  reslice->SetResliceTransform(transform);
+  reslice->GenerateStencilOutputOn();
+  reslice->SetInterpolator(interpolator);
+
+  vtkImageSimilarityMetric *metric = NewMetric(metricType);
+  metric->SET_INPUT_DATA(source);
+  metric->SetInputConnection(1, reslice->GetOutputPort());
+  metric->SetInputConnection(2, reslice->GetStencilOutputPort());
+  metric->Update();
+  double cost = metric->GetCost();
+  metric->Delete();
+
+  return cost;
+}
+
+//----------------------------------------------------------------------------
+// Compute the cost with the resampling fused with the metric.
+double FusedCost(
+  int metricType, vtkImageData *source, vtkImageData *target,
+  vtkImageStencilData *stencil, vtkAbstractImageInterpolator *interpolator,
+  vtkLinearTransform *transform)
+{
+  vtkImageSimilarityMetric *metric = NewMetric(metricType);
+  metric->SET_INPUT_DATA(source);
+  metric->SET_INPUT_DATA(1, target);
+  metric->SetStencilData(stencil);
+  metric->SetInterpolator(interpolator);
+  metric->SetTransform(transform);
+  metric->Update();
+  double cost = metric->GetCost();
+  metric->Delete();
+
+  return cost;
+}
+
+//----------------------------------------------------------------------------
+// Compute the cost at a step along a line search through the transform,
+// where the line only changes the translation.
+double LineCost(
+  int metricType, vtkImageData *source, vtkImageData *target,
+  vtkImageStencilData *stencil, vtkAbstractImageInterpolator *interpolator,
+  vtkLinearTransform *transform)
+{
+  static const double translation[3] = { 0.5, -0.25, 0.75 };
+  double step = 0.5;
+
+  double matrix[16];
+  double delta[16];
+  vtkMatrix4x4::DeepCopy(matrix, transform->GetMatrix());
+  for (int k = 0; k < 16; k++)
+    {
+    delta[k] = 0.0;
+    }
+  for (int i = 0; i < 3; i++)
+    {
+    delta[4*i + 3] = translation[i];
+    matrix[4*i + 3] -= step*translation[i];
+    }
+
+  vtkImageSimilarityMetric *metric = NewMetric(metricType);
+  metric->SET_INPUT_DATA(source);
+  metric->SET_INPUT_DATA(1, target);
+  metric->SetStencilData(stencil);
+  metric->SetInterpolator(interpolator);
+  metric->Prepare();
+  metric->SetLine(matrix, delta);
+  double cost = metric->EvaluateLine(step);
+  metric->Delete();
+
+  return cost;
+}
+
+} // end anonymous namespace
+
+int main(int, char *[])
+{
+  int imageSize[3] = { 40, 36, 32 };
+  double spacing[3] = { 1.0, 1.0, 1.0 };
+
+  vtkSmartPointer<vtkTransform> motion =
+    vtkSmartPointer<vtkTransform>::New();
+  motion->PostMultiply();
+  motion->RotateWXYZ(6.0, 0.2, 0.3, 1.0);
+  motion->Translate(2.0, -1.5, 1.0);
+
+  // the phantoms are cast to double, so that resampling does not round
+  vtkSmartPointer<vtkImageData> images[2];
+  for (int i = 0; i < 2; i++)
+    {
+    vtkSmartPointer<vtkImageData> phantom =
+      vtkSmartPointer<vtkImageData>::New();
+    MakeBenchmarkPhantom(phantom, imageSize, spacing,
+                         (i == 0 ? NULL : motion->GetMatrix()));
+    vtkSmartPointer<vtkImageCast> cast =
+      vtkSmartPointer<vtkImageCast>::New();
+    cast->SET_INPUT_DATA(phantom);
+    cast->SetOutputScalarTypeToDouble();
+    cast->Update();
+    images[i] = vtkSmartPointer<vtkImageData>::New();
+    images[i]->DeepCopy(cast->GetOutput());
+    }
+  vtkImageData *source = images[0];
+  vtkImageData *target = images[1];
+
+  // an ellipsoidal stencil that covers the middle of the source
+  vtkSmartPointer<vtkROIStencilSource> roi =
+    vtkSmartPointer<vtkROIStencilSource>::New();
+  roi->SetShapeToEllipsoid();
+  roi->SetBounds(6.0, 33.0, 5.0, 30.0, 4.0, 27.0);
+  roi->SetInformationInput(source);
+  roi->Update();
+  vtkImageStencilData *stencils[2] = { NULL, roi->GetOutput() };
+
+  // the fixed transforms: identity, a small motion near the solution,
+  // and a large shift that moves a third of the image out of bounds
+  vtkSmartPointer<vtkTransform> transforms[3];
+  for (int i = 0; i < 3; i++)
+    {
+    transforms[i] = vtkSmartPointer<vtkTransform>::New();
+    transforms[i]->PostMultiply();
+    }
+  transforms[1]->RotateWXYZ(-4.0, 0.2, 0.3, 1.0);
+  transforms[1]->Translate(-1.75, 1.25, -0.5);
+  transforms[2]->RotateWXYZ(10.0, 1.0, 0.0, 0.0);
+  transforms[2]->Translate(13.3, 0.0, -2.7);
+
+  const char *interpolatorNames[2] = { "linear", "cubic" };
+
+  int failures = 0;
+  for (int metricType = 0; MetricNames[metricType] != NULL; metricType++)
+    {
+    for (int k = 0; k < 2; k++)
+      {
+      vtkSmartPointer<vtkImageInterpolator> interpolator =
+        vtkSmartPointer<vtkImageInterpolator>::New();
+      if (k == 0)
+        {
+        interpolator->SetInterpolationModeToLinear();
+        }
+      else
+        {
+        interpolator->SetInterpolationModeToCubic();
+        }
+
+      for (int s = 0; s < 2; s++)
+        {
+        for (int t = 0; t < 3; t++)
+          {
+          double resliceCost = ResliceCost(
+            metricType, source, target, stencils[s], interpolator,
+            transforms[t]);
+          double fusedCost = FusedCost(
+            metricType, source, target, stencils[s], interpolator,
+            transforms[t]);
+
+          double tol = 1e-9*(fabs(resliceCost) + 1.0);
+          if (!(fabs(fusedCost - resliceCost) <= tol))
+            {
+            fprintf(stderr, "%s, %s, %s stencil, transform %d: "
+                    "reslice cost %.15g, fused cost %.15g\n",
+                    MetricNames[metricType], interpolatorNames[k],
+                    (s ? "with" : "no"), t, resliceCost, fusedCost);
+            failures++;
+            }
+
+          double lineCost = LineCost(
+            metricType, source, target, stencils[s], interpolator,
+            transforms[t]);
+          tol = 1e-9*(fabs(fusedCost) + 1.0);
+          if (!(fabs(lineCost - fusedCost) <= tol))
+            {
+            fprintf(stderr, "%s, %s, %s stencil, transform %d: "
+                    "fused cost %.15g, line search cost %.15g\n",
+                    MetricNames[metricType], interpolatorNames[k],
+                    (s ? "with" : "no"), t, fusedCost, lineCost);
+            failures++;
+            }
+          }
+        }
+      }
+    }
+
+  return (failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
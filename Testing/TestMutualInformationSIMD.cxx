@@ -0,0 +1,200 @@
+/*=========================================================================
+
+Program:   Atamai Image Registration and Segmentation
+Module:    TestMutualInformationSIMD.cxx
+
+   This software is distributed WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+=========================================================================*/
+// Test that vtkImageMutualInformation computes exactly the same joint
+// histogram with UseSIMD on and off.  The images have values outside of
+// the input range, the float images also have NaN values, and the row
+// length is not a multiple of the vector width.  The histograms are done
+// with 64x64 bins, which use the per-lane sub-histograms, and with
+// 256x256 bins, which do not.
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+#include <vtkPointData.h>
+#include <vtkDataArray.h>
+#include <vtkMath.h>
+#include <vtkVersion.h>
+
+#include <vtkImageMutualInformation.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace {
+
+//----------------------------------------------------------------------------
+// Fill an image with pseudo-random values in [-200, 1200], which spills
+// past both ends of the [0, 1000] input range, as far as the scalar type
+// allows.  If "nanStep" is nonzero, then every nanStep'th value of a float
+// image is NaN.
+void MakeTestImage(
+  vtkImageData *image, int scalarType, unsigned int seed, int nanStep)
+{
+  image->SetDimensions(37, 29, 11);
+  image->SetSpacing(1.0, 1.0, 1.0);
+  image->SetOrigin(0.0, 0.0, 0.0);
+#if VTK_MAJOR_VERSION >= 6
+  image->AllocateScalars(scalarType, 1);
+#else
+  image->SetScalarType(scalarType);
+  image->SetNumberOfScalarComponents(1);
+  image->AllocateScalars();
+#endif
+
+  vtkDataArray *scalars = image->GetPointData()->GetScalars();
+  vtkIdType n = scalars->GetNumberOfTuples();
+  for (vtkIdType i = 0; i < n; i++)
+    {
+    seed = seed*1664525u + 1013904223u;
+    double v = -200.0 + 1400.0*(seed >> 8)/16777216.0;
+    if (scalarType != VTK_FLOAT)
+      {
+      // integer types are clamped to their own range
+      v = floor(v);
+      v = (v > image->GetScalarTypeMin() ? v : image->GetScalarTypeMin());
+      v = (v < image->GetScalarTypeMax() ? v : image->GetScalarTypeMax());
+      }
+    else if (nanStep > 0 && i % nanStep == 0)
+      {
+      v = vtkMath::Nan();
+      }
+    scalars->SetComponent(i, 0, v);
+    }
+}
+
+//----------------------------------------------------------------------------
+// Compute the joint histogram of the two images with UseSIMD set as given,
+// and return it as a copy.
+void ComputeHistogram(
+  vtkImageData *source, vtkImageData *target, int bins, int useSIMD,
+  vtkImageData *histogram)
+{
+  vtkSmartPointer<vtkImageMutualInformation> mi =
+    vtkSmartPointer<vtkImageMutualInformation>::New();
+  double range[2] = { 0.0, 1000.0 };
+  mi->SetInputRange(0, range);
+  mi->SetInputRange(1, range);
+  mi->SetNumberOfBins(bins, bins);
+  mi->SetOutputScalarTypeToUnsignedInt();
+  mi->SetUseSIMD(useSIMD);
+#if VTK_MAJOR_VERSION >= 6
+  mi->SetInputData(0, source);
+  mi->SetInputData(1, target);
+#else
+  mi->SetInput(0, source);
+  mi->SetInput(1, target);
+#endif
+  mi->Update();
+
+  histogram->DeepCopy(mi->GetOutput());
+}
+
+//----------------------------------------------------------------------------
+// Compare the histograms with and without SIMD, bin by bin, and return
+// the number of bins that differ.
+int CompareHistograms(
+  vtkImageData *source, vtkImageData *target, int bins, const char *name)
+{
+  vtkSmartPointer<vtkImageData> scalar =
+    vtkSmartPointer<vtkImageData>::New();
+  vtkSmartPointer<vtkImageData> simd =
+    vtkSmartPointer<vtkImageData>::New();
+  ComputeHistogram(source, target, bins, 0, scalar);
+  ComputeHistogram(source, target, bins, 1, simd);
+
+  vtkDataArray *a = scalar->GetPointData()->GetScalars();
+  vtkDataArray *b = simd->GetPointData()->GetScalars();
+  if (a == NULL || b == NULL ||
+      a->GetNumberOfTuples() != static_cast<vtkIdType>(bins)*bins ||
+      b->GetNumberOfTuples() != a->GetNumberOfTuples())
+    {
+    fprintf(stderr, "%s, %dx%d bins: wrong histogram size\n",
+            name, bins, bins);
+    return 1;
+    }
+
+  int failures = 0;
+  double total = 0.0;
+  vtkIdType n = a->GetNumberOfTuples();
+  for (vtkIdType i = 0; i < n; i++)
+    {
+    double x = a->GetComponent(i, 0);
+    double y = b->GetComponent(i, 0);
+    total += x;
+    if (x != y)
+      {
+      if (failures < 10)
+        {
+        fprintf(stderr, "%s, %dx%d bins: bin (%d, %d) is %.0f, "
+                "but %.0f with SIMD\n", name, bins, bins,
+                static_cast<int>(i % bins), static_cast<int>(i / bins),
+                x, y);
+        }
+      failures++;
+      }
+    }
+
+  // every voxel must be counted, including the clamped and NaN values
+  if (total != static_cast<double>(source->GetNumberOfPoints()))
+    {
+    fprintf(stderr, "%s, %dx%d bins: %.0f voxels counted, expected %d\n",
+            name, bins, bins, total,
+            static_cast<int>(source->GetNumberOfPoints()));
+    failures++;
+    }
+
+  return failures;
+}
+
+} // end anonymous namespace
+
+int main(int, char *[])
+{
+  // the scalar types that have SIMD kernels, plus int, which does not
+  static const int scalarTypes[] = {
+    VTK_FLOAT, VTK_SHORT, VTK_UNSIGNED_SHORT, VTK_UNSIGNED_CHAR, VTK_INT
+  };
+  static const char *typeNames[] = {
+    "float", "short", "unsigned short", "unsigned char", "int"
+  };
+  static const int binCounts[] = { 64, 256 };
+
+  int failures = 0;
+  for (int i = 0; i < 5; i++)
+    {
+    vtkSmartPointer<vtkImageData> source =
+      vtkSmartPointer<vtkImageData>::New();
+    MakeTestImage(source, scalarTypes[i], 12345u, 37);
+    vtkSmartPointer<vtkImageData> target =
+      vtkSmartPointer<vtkImageData>::New();
+    MakeTestImage(target, scalarTypes[i], 67890u, 53);
+
+    for (int j = 0; j < 2; j++)
+      {
+      failures += CompareHistograms(
+        source, target, binCounts[j], typeNames[i]);
+      }
+    }
+
+  // the float kernels must also match when paired with an integer type
+  vtkSmartPointer<vtkImageData> floatImage =
+    vtkSmartPointer<vtkImageData>::New();
+  MakeTestImage(floatImage, VTK_FLOAT, 24680u, 41);
+  vtkSmartPointer<vtkImageData> shortImage =
+    vtkSmartPointer<vtkImageData>::New();
+  MakeTestImage(shortImage, VTK_SHORT, 13579u, 0);
+  for (int j = 0; j < 2; j++)
+    {
+    failures += CompareHistograms(
+      floatImage, shortImage, binCounts[j], "float/short");
+    }
+
+  return (failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
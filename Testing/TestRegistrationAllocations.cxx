@@ -0,0 +1,260 @@
+/*=========================================================================
+
+Program:   Atamai Image Registration and Segmentation
+Module:    TestRegistrationAllocations.cxx
+
+   This software is distributed WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+=========================================================================*/
+// Test that the evaluation loop of vtkImageRegistration does not allocate
+// memory after the first iteration of a level, for each of the metrics.
+// A small phantom is registered to a moved copy of itself with fused
+// evaluation, with two threads so that the batches use the probes, and
+// there must be no heap allocations by any thread in the later iterations.
+// The allocations are counted by replacing the global operator new, and
+// also malloc(), calloc() and realloc() where the C library allows it, so
+// this does not rely on the registration counting its own allocations.
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+#include <vtkTransform.h>
+
+#include <vtkImageRegistration.h>
+#include <vtkWorkerThreadPool.h>
+
+#include "BenchmarkPhantom.h"
+
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+
+// The exception specifications of the replaceable operator new
+#if __cplusplus >= 201103L
+#define TEST_THROW_BAD_ALLOC
+#define TEST_NOTHROW noexcept
+#else
+#define TEST_THROW_BAD_ALLOC throw(std::bad_alloc)
+#define TEST_NOTHROW throw()
+#endif
+
+// With glibc, malloc() can also be replaced, since the real allocator
+// is available under another name
+#if defined(__GLIBC__)
+#define TEST_COUNT_MALLOC
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+#endif
+
+namespace {
+
+// The count of heap allocations by all threads, while counting is on
+volatile int CountingAllocations = 0;
+volatile long NumberOfHeapAllocations = 0;
+
+//----------------------------------------------------------------------------
+void CountAllocation()
+{
+  if (CountingAllocations)
+    {
+#if defined(__GNUC__)
+    __sync_fetch_and_add(&NumberOfHeapAllocations, 1);
+#else
+    NumberOfHeapAllocations++;
+#endif
+    }
+}
+
+//----------------------------------------------------------------------------
+// Allocate without counting, for use by operator new
+void *RawAllocate(size_t size)
+{
+  size = (size > 0 ? size : 1);
+#ifdef TEST_COUNT_MALLOC
+  return __libc_malloc(size);
+#else
+  return malloc(size);
+#endif
+}
+
+} // end anonymous namespace
+
+//----------------------------------------------------------------------------
+// The replacements for the global allocation functions
+void *operator new(size_t size) TEST_THROW_BAD_ALLOC
+{
+  CountAllocation();
+  void *ptr = RawAllocate(size);
+  if (ptr == NULL)
+    {
+    throw std::bad_alloc();
+    }
+  return ptr;
+}
+
+void *operator new[](size_t size) TEST_THROW_BAD_ALLOC
+{
+  CountAllocation();
+  void *ptr = RawAllocate(size);
+  if (ptr == NULL)
+    {
+    throw std::bad_alloc();
+    }
+  return ptr;
+}
+
+void *operator new(size_t size, const std::nothrow_t&) TEST_NOTHROW
+{
+  CountAllocation();
+  return RawAllocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t&) TEST_NOTHROW
+{
+  CountAllocation();
+  return RawAllocate(size);
+}
+
+void operator delete(void *ptr) TEST_NOTHROW
+{
+  free(ptr);
+}
+
+void operator delete[](void *ptr) TEST_NOTHROW
+{
+  free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t&) TEST_NOTHROW
+{
+  free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t&) TEST_NOTHROW
+{
+  free(ptr);
+}
+
+#ifdef TEST_COUNT_MALLOC
+extern "C" void *malloc(size_t size)
+{
+  CountAllocation();
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+  CountAllocation();
+  return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+  CountAllocation();
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+namespace {
+
+//----------------------------------------------------------------------------
+// Register the images with the given metric, and return the number of
+// iterations that allocated memory.
+int CheckAllocations(
+  vtkImageData *source, vtkImageData *target, int metricType,
+  const char *name)
+{
+  vtkSmartPointer<vtkImageRegistration> registration =
+    vtkSmartPointer<vtkImageRegistration>::New();
+
+  registration->GetThreadPool()->SetNumberOfThreads(2);
+  registration->SetSourceImage(source);
+  registration->SetTargetImage(target);
+  registration->SetMetricType(metricType);
+  registration->SetOptimizerTypeToPowell();
+  registration->SetInterpolatorTypeToLinear();
+  registration->SetTransformTypeToRigid();
+  registration->SetInitializerTypeToCentered();
+  registration->SetFusedEvaluation(true);
+  registration->SetCostTolerance(1e-6);
+  registration->SetTransformTolerance(0.001);
+  registration->SetMaximumNumberOfIterations(20);
+
+  registration->Initialize(NULL);
+  if (!registration->Iterate())
+    {
+    fprintf(stderr, "%s: converged after one iteration\n", name);
+    return 1;
+    }
+
+  // the registration also counts the times that its own buffers grow,
+  // which is reported to help find the cause of any failure
+  vtkTypeUInt64 count = registration->GetNumberOfAllocations();
+  int failures = 0;
+  int iteration = 1;
+  int more = 1;
+  while (more)
+    {
+    NumberOfHeapAllocations = 0;
+    CountingAllocations = 1;
+    more = registration->Iterate();
+    CountingAllocations = 0;
+    iteration++;
+    long heapCount = NumberOfHeapAllocations;
+    vtkTypeUInt64 newCount = registration->GetNumberOfAllocations();
+    if (heapCount != 0)
+      {
+      fprintf(stderr, "%s: %ld heap allocations in iteration %d "
+              "(%d counted by the registration)\n", name, heapCount,
+              iteration, static_cast<int>(newCount - count));
+      failures++;
+      }
+    count = newCount;
+    }
+
+  return failures;
+}
+
+} // end anonymous namespace
+
+int main(int, char *[])
+{
+  int imageSize[3] = { 32, 32, 32 };
+  double spacing[3] = { 1.0, 1.0, 1.0 };
+
+  vtkSmartPointer<vtkTransform> motion =
+    vtkSmartPointer<vtkTransform>::New();
+  motion->PostMultiply();
+  motion->RotateWXYZ(4.0, 0.2, 0.3, 1.0);
+  motion->Translate(1.5, -1.0, 0.5);
+
+  vtkSmartPointer<vtkImageData> source =
+    vtkSmartPointer<vtkImageData>::New();
+  MakeBenchmarkPhantom(source, imageSize, spacing, NULL);
+  vtkSmartPointer<vtkImageData> target =
+    vtkSmartPointer<vtkImageData>::New();
+  MakeBenchmarkPhantom(target, imageSize, spacing, motion->GetMatrix());
+
+  static const int metricTypes[] = {
+    vtkImageRegistration::SquaredDifference,
+    vtkImageRegistration::CrossCorrelation,
+    vtkImageRegistration::MutualInformation,
+    vtkImageRegistration::NormalizedMutualInformation
+  };
+  static const char *metricNames[] = {
+    "SquaredDifference",
+    "CrossCorrelation",
+    "MutualInformation",
+    "NormalizedMutualInformation"
+  };
+
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(metricTypes)/sizeof(int); i++)
+    {
+    failures += CheckAllocations(
+      source, target, metricTypes[i], metricNames[i]);
+    }
+
+  return (failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}